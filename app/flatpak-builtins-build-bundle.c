@@ -49,6 +49,8 @@ static gboolean opt_runtime = FALSE;
 static char **opt_gpg_file;
 static gboolean opt_oci = FALSE;
 static gboolean opt_oci_use_labels = FALSE;
+static char *opt_oci_compression;
+static int opt_oci_compression_level = -1;
 static char **opt_gpg_key_ids;
 static char *opt_gpg_homedir;
 static char *opt_from_commit;
@@ -64,6 +66,8 @@ static GOptionEntry options[] = {
   { "from-commit", 0, 0, G_OPTION_ARG_STRING, &opt_from_commit, N_("OSTree commit to create a delta bundle from"), N_("COMMIT") },
   { "oci", 0, 0, G_OPTION_ARG_NONE, &opt_oci, N_("Export oci image instead of flatpak bundle"), NULL },
   { "oci-use-labels", 0, 0, G_OPTION_ARG_NONE, &opt_oci_use_labels, N_("Use OCI labels instead of annotations"), NULL },
+  { "oci-compression", 0, 0, G_OPTION_ARG_STRING, &opt_oci_compression, N_("Compress the OCI layer with gzip (default) or zstd"), N_("TYPE") },
+  { "oci-compression-level", 0, 0, G_OPTION_ARG_INT, &opt_oci_compression_level, N_("Compression level for the OCI layer"), N_("LEVEL") },
   { NULL }
 };
 
@@ -454,6 +458,7 @@ generate_annotations (FlatpakOciDescriptor *layer_desc,
 static gboolean
 build_oci (OstreeRepo *repo, const char *commit_checksum, GFile *dir,
            const char *name, const char *ref,
+           FlatpakOciLayerCompression compression,
            GCancellable *cancellable, GError **error)
 {
   g_autoptr(GFile) root = NULL;
@@ -494,7 +499,9 @@ build_oci (OstreeRepo *repo, const char *commit_checksum, GFile *dir,
   if (registry == NULL)
     return FALSE;
 
-  layer_writer = flatpak_oci_registry_write_layer (registry, cancellable, error);
+  layer_writer = flatpak_oci_registry_write_layer (registry, compression,
+                                                   opt_oci_compression_level,
+                                                   cancellable, error);
   if (layer_writer == NULL)
     return FALSE;
 
@@ -619,6 +626,7 @@ flatpak_builtin_build_bundle (int argc, char **argv, GCancellable *cancellable,
   const char *branch;
   g_autofree char *full_branch = NULL;
   g_autofree char *commit_checksum = NULL;
+  FlatpakOciLayerCompression compression = FLATPAK_OCI_LAYER_COMPRESSION_GZIP;
 
   context = g_option_context_new (_("LOCATION FILENAME NAME [BRANCH] - Create a single file bundle from a local repository"));
   g_option_context_set_translation_domain (context, GETTEXT_PACKAGE);
@@ -632,6 +640,13 @@ flatpak_builtin_build_bundle (int argc, char **argv, GCancellable *cancellable,
   if (argc > 5)
     return usage_error (context, _("Too many arguments"), error);
 
+  if (opt_oci_compression == NULL || strcmp (opt_oci_compression, "gzip") == 0)
+    compression = FLATPAK_OCI_LAYER_COMPRESSION_GZIP;
+  else if (strcmp (opt_oci_compression, "zstd") == 0)
+    compression = FLATPAK_OCI_LAYER_COMPRESSION_ZSTD;
+  else
+    return usage_error (context, _("--oci-compression must be gzip or zstd"), error);
+
   location = argv[1];
   filename = argv[2];
   name = argv[3];
@@ -681,7 +696,7 @@ flatpak_builtin_build_bundle (int argc, char **argv, GCancellable *cancellable,
 
   if (opt_oci)
     {
-      if (!build_oci (repo, commit_checksum, file, name, full_branch, cancellable, error))
+      if (!build_oci (repo, commit_checksum, file, name, full_branch, compression, cancellable, error))
         return FALSE;
     }
   else
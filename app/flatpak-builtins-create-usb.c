@@ -743,6 +743,15 @@ flatpak_builtin_create_usb (int argc, char **argv, GCancellable *cancellable, GE
   if (!flatpak_dir_update_summary (dir, TRUE, cancellable, error))
     return FALSE;
 
+  /* Extra data that was downloaded into the installation is only in its
+   * cache, so put it into the commitmeta that gets copied along. */
+  GLNX_HASH_TABLE_FOREACH_V (all_refs, CommitAndSubpaths *, c_s)
+  {
+    if (c_s->commit != NULL &&
+        !flatpak_dir_embed_extra_data (dir, c_s->commit, cancellable, error))
+      return FALSE;
+  }
+
   /* Now use code copied from `ostree create-usb` to do the actual copying. We
    * can't just call out to `ostree` because (a) flatpak doesn't have a
    * dependency on the ostree command line tools and (b) we need to only pull
@@ -55,6 +55,7 @@ static gboolean opt_yes;
 static gboolean opt_reinstall;
 static gboolean opt_noninteractive;
 static gboolean opt_or_update;
+static int opt_parallel_pulls = 1;
 
 static GOptionEntry options[] = {
   { "arch", 0, 0, G_OPTION_ARG_STRING, &opt_arch, N_("Arch to install for"), N_("ARCH") },
@@ -73,6 +74,7 @@ static GOptionEntry options[] = {
   { "reinstall", 0, 0, G_OPTION_ARG_NONE, &opt_reinstall, N_("Uninstall first if already installed"), NULL },
   { "noninteractive", 0, 0, G_OPTION_ARG_NONE, &opt_noninteractive, N_("Produce minimal output and don't ask questions"), NULL },
   { "or-update", 0, 0, G_OPTION_ARG_NONE, &opt_or_update, N_("Update install if already installed"), NULL },
+  { "parallel-pulls", 0, 0, G_OPTION_ARG_INT, &opt_parallel_pulls, N_("Download up to N refs at the same time"), N_("N") },
   { NULL }
 };
 
@@ -161,6 +163,7 @@ install_bundle (FlatpakDir *dir,
   flatpak_transaction_set_no_pull (transaction, opt_no_pull);
   flatpak_transaction_set_no_deploy (transaction, opt_no_deploy);
   flatpak_transaction_set_disable_static_deltas (transaction, opt_no_static_deltas);
+  flatpak_transaction_set_max_parallel_pulls (transaction, MAX (opt_parallel_pulls, 1));
   flatpak_transaction_set_disable_dependencies (transaction, opt_no_deps);
   flatpak_transaction_set_disable_related (transaction, opt_no_related);
   flatpak_transaction_set_reinstall (transaction, opt_reinstall);
@@ -234,6 +237,7 @@ install_from (FlatpakDir *dir,
   flatpak_transaction_set_no_pull (transaction, opt_no_pull);
   flatpak_transaction_set_no_deploy (transaction, opt_no_deploy);
   flatpak_transaction_set_disable_static_deltas (transaction, opt_no_static_deltas);
+  flatpak_transaction_set_max_parallel_pulls (transaction, MAX (opt_parallel_pulls, 1));
   flatpak_transaction_set_disable_dependencies (transaction, opt_no_deps);
   flatpak_transaction_set_disable_related (transaction, opt_no_related);
   flatpak_transaction_set_reinstall (transaction, opt_reinstall);
@@ -455,6 +459,7 @@ flatpak_builtin_install (int argc, char **argv, GCancellable *cancellable, GErro
   flatpak_transaction_set_no_pull (transaction, opt_no_pull);
   flatpak_transaction_set_no_deploy (transaction, opt_no_deploy);
   flatpak_transaction_set_disable_static_deltas (transaction, opt_no_static_deltas);
+  flatpak_transaction_set_max_parallel_pulls (transaction, MAX (opt_parallel_pulls, 1));
   flatpak_transaction_set_disable_dependencies (transaction, opt_no_deps);
   flatpak_transaction_set_disable_related (transaction, opt_no_related);
   flatpak_transaction_set_reinstall (transaction, opt_reinstall);
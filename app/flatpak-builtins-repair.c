@@ -38,10 +38,12 @@
 
 static gboolean opt_dry_run;
 static gboolean opt_reinstall_all;
+static int opt_jobs = 1;
 
 static GOptionEntry options[] = {
   { "dry-run", 0, 0, G_OPTION_ARG_NONE, &opt_dry_run, N_("Don't make any changes"), NULL },
   { "reinstall-all", 0, 0, G_OPTION_ARG_NONE, &opt_reinstall_all, N_("Reinstall all refs"), NULL },
+  { "jobs", 0, 0, G_OPTION_ARG_INT, &opt_jobs, N_("Number of threads verifying objects, 0 for one per CPU (default: 1)"), N_("JOBS") },
   { NULL }
 };
 
@@ -51,6 +53,10 @@ typedef enum {
   FSCK_STATUS_HAS_INVALID_OBJECTS,
 } FsckStatus;
 
+/* Updated atomically, objects are verified from several threads with --jobs */
+static guint n_verified_objects;
+static gint64 n_verified_bytes;
+
 static FsckStatus
 fsck_one_object (OstreeRepo      *repo,
                  const char      *checksum,
@@ -58,6 +64,9 @@ fsck_one_object (OstreeRepo      *repo,
                  gboolean         allow_missing)
 {
   g_autoptr(GError) local_error = NULL;
+  guint64 size;
+
+  g_atomic_int_inc (&n_verified_objects);
 
   if (!ostree_repo_fsck_object (repo, objtype, checksum, NULL, &local_error))
     {
@@ -85,6 +94,16 @@ fsck_one_object (OstreeRepo      *repo,
         }
     }
 
+  /* Only the objects that were read in full count towards the throughput */
+  if (ostree_repo_query_object_storage_size (repo, objtype, checksum, &size, NULL, NULL))
+    {
+      /* There is no 64bit g_atomic_int_add() in our glib version */
+      G_LOCK_DEFINE_STATIC (n_verified_bytes);
+      G_LOCK (n_verified_bytes);
+      n_verified_bytes += size;
+      G_UNLOCK (n_verified_bytes);
+    }
+
   return FSCK_STATUS_OK;
 }
 
@@ -115,11 +134,14 @@ fsck_leaf_object (OstreeRepo      *repo,
 }
 
 
+/* If @dirtree_status_cache is set, the dirtree objects themselves
+ * were already verified by verify_objects_parallel() */
 static FsckStatus
 fsck_dirtree (OstreeRepo *repo,
               gboolean    partial,
               const char *checksum,
-              GHashTable *object_status_cache)
+              GHashTable *object_status_cache,
+              GHashTable *dirtree_status_cache)
 {
   OstreeRepoCommitIterResult iterres;
   g_autoptr(GError) local_error = NULL;
@@ -135,7 +157,11 @@ fsck_dirtree (OstreeRepo *repo,
     return GPOINTER_TO_INT (cached_status);
 
   /* First verify the dirtree itself */
-  status = fsck_one_object (repo, checksum, OSTREE_OBJECT_TYPE_DIR_TREE, partial);
+  if (dirtree_status_cache != NULL &&
+      g_hash_table_lookup_extended (dirtree_status_cache, key, NULL, &cached_status))
+    status = GPOINTER_TO_INT (cached_status);
+  else
+    status = fsck_one_object (repo, checksum, OSTREE_OBJECT_TYPE_DIR_TREE, partial);
 
   if (status == FSCK_STATUS_OK)
     {
@@ -186,7 +212,7 @@ fsck_dirtree (OstreeRepo *repo,
                   meta_status = fsck_leaf_object (repo, meta_checksum, OSTREE_OBJECT_TYPE_DIR_META, object_status_cache);
                   status = MAX (status, meta_status);
 
-                  dirtree_status = fsck_dirtree (repo, partial, dirtree_checksum, object_status_cache);
+                  dirtree_status = fsck_dirtree (repo, partial, dirtree_checksum, object_status_cache, dirtree_status_cache);
 
                   status = MAX (status, dirtree_status);
                 }
@@ -200,10 +226,200 @@ fsck_dirtree (OstreeRepo *repo,
   return status;
 }
 
+typedef struct
+{
+  OstreeRepo  *repo;
+  gboolean     partial;
+  GMutex       lock;
+  GCond        done_cond;
+  guint        n_pending;
+  GThreadPool *pool;
+  GHashTable  *object_status_cache;
+  GHashTable  *dirtree_status_cache;
+} ParallelFsck;
+
+/* Returns TRUE if the caller should verify the object, i.e. it was
+ * not seen before. The status is filled in when it is done. */
+static gboolean
+parallel_fsck_claim (ParallelFsck    *fsck,
+                     GHashTable      *cache,
+                     const char      *checksum,
+                     OstreeObjectType objtype)
+{
+  g_autoptr(GVariant) key = g_variant_ref_sink (ostree_object_name_serialize (checksum, objtype));
+  gboolean claimed = FALSE;
+
+  g_mutex_lock (&fsck->lock);
+  if (!g_hash_table_contains (cache, key) &&
+      (objtype != OSTREE_OBJECT_TYPE_DIR_TREE || !g_hash_table_contains (fsck->object_status_cache, key)))
+    {
+      g_hash_table_insert (cache, g_steal_pointer (&key), GINT_TO_POINTER (FSCK_STATUS_OK));
+      claimed = TRUE;
+    }
+  g_mutex_unlock (&fsck->lock);
+
+  return claimed;
+}
+
+static void
+parallel_fsck_set_status (ParallelFsck    *fsck,
+                          GHashTable      *cache,
+                          const char      *checksum,
+                          OstreeObjectType objtype,
+                          FsckStatus       status)
+{
+  GVariant *key = g_variant_ref_sink (ostree_object_name_serialize (checksum, objtype));
+
+  g_mutex_lock (&fsck->lock);
+  g_hash_table_replace (cache, key, GINT_TO_POINTER (status));
+  g_mutex_unlock (&fsck->lock);
+}
+
+static void
+parallel_fsck_leaf (ParallelFsck    *fsck,
+                    const char      *checksum,
+                    OstreeObjectType objtype)
+{
+  if (parallel_fsck_claim (fsck, fsck->object_status_cache, checksum, objtype))
+    parallel_fsck_set_status (fsck, fsck->object_status_cache, checksum, objtype,
+                              fsck_one_object (fsck->repo, checksum, objtype, FALSE));
+}
+
+static void
+parallel_fsck_push_dirtree (ParallelFsck *fsck,
+                            const char   *checksum)
+{
+  if (!parallel_fsck_claim (fsck, fsck->dirtree_status_cache, checksum, OSTREE_OBJECT_TYPE_DIR_TREE))
+    return;
+
+  g_mutex_lock (&fsck->lock);
+  fsck->n_pending++;
+  g_mutex_unlock (&fsck->lock);
+
+  g_thread_pool_push (fsck->pool, g_strdup (checksum), NULL);
+}
+
+/* Each work item is a claimed dirtree, which is verified before its
+ * children are, just like in fsck_dirtree(). Errors loading it are
+ * reported when fsck_dirtree() runs over it later. */
+static void
+parallel_fsck_dirtree (ParallelFsck *fsck,
+                       const char   *checksum)
+{
+  g_autoptr(GVariant) dirtree = NULL;
+  FsckStatus status;
+  ostree_cleanup_repo_commit_traverse_iter
+  OstreeRepoCommitTraverseIter iter = { 0, };
+
+  status = fsck_one_object (fsck->repo, checksum, OSTREE_OBJECT_TYPE_DIR_TREE, fsck->partial);
+  parallel_fsck_set_status (fsck, fsck->dirtree_status_cache, checksum, OSTREE_OBJECT_TYPE_DIR_TREE, status);
+  if (status != FSCK_STATUS_OK)
+    return;
+
+  if (!ostree_repo_load_variant (fsck->repo, OSTREE_OBJECT_TYPE_DIR_TREE, checksum, &dirtree, NULL) ||
+      !ostree_repo_commit_traverse_iter_init_dirtree (&iter, fsck->repo, dirtree, 0, NULL))
+    return;
+
+  while (TRUE)
+    {
+      OstreeRepoCommitIterResult iterres = ostree_repo_commit_traverse_iter_next (&iter, NULL, NULL);
+      char *name;
+
+      if (iterres == OSTREE_REPO_COMMIT_ITER_RESULT_FILE)
+        {
+          char *file_checksum;
+
+          ostree_repo_commit_traverse_iter_get_file (&iter, &name, &file_checksum);
+          parallel_fsck_leaf (fsck, file_checksum, OSTREE_OBJECT_TYPE_FILE);
+        }
+      else if (iterres == OSTREE_REPO_COMMIT_ITER_RESULT_DIR)
+        {
+          char *meta_checksum;
+          char *dirtree_checksum;
+
+          ostree_repo_commit_traverse_iter_get_dir (&iter, &name, &dirtree_checksum, &meta_checksum);
+          parallel_fsck_leaf (fsck, meta_checksum, OSTREE_OBJECT_TYPE_DIR_META);
+          parallel_fsck_push_dirtree (fsck, dirtree_checksum);
+        }
+      else
+        break;
+    }
+}
+
+static void
+parallel_fsck_dirtree_thread (gpointer data,
+                              gpointer user_data)
+{
+  g_autofree char *checksum = data;
+  ParallelFsck *fsck = user_data;
+
+  parallel_fsck_dirtree (fsck, checksum);
+
+  g_mutex_lock (&fsck->lock);
+  if (--fsck->n_pending == 0)
+    g_cond_signal (&fsck->done_cond);
+  g_mutex_unlock (&fsck->lock);
+}
+
+/* One pool is shared by all the commits that are verified */
+static ParallelFsck *
+parallel_fsck_new (OstreeRepo *repo,
+                   GHashTable *object_status_cache)
+{
+  ParallelFsck *fsck = g_new0 (ParallelFsck, 1);
+
+  fsck->repo = repo;
+  fsck->object_status_cache = object_status_cache;
+  fsck->dirtree_status_cache = g_hash_table_new_full (ostree_hash_object_name, g_variant_equal,
+                                                      (GDestroyNotify) g_variant_unref, NULL);
+  g_mutex_init (&fsck->lock);
+  g_cond_init (&fsck->done_cond);
+  fsck->pool = g_thread_pool_new (parallel_fsck_dirtree_thread, fsck,
+                                  opt_jobs, FALSE, NULL);
+
+  return fsck;
+}
+
+static void
+parallel_fsck_free (ParallelFsck *fsck)
+{
+  g_thread_pool_free (fsck->pool, FALSE, TRUE);
+  g_hash_table_unref (fsck->dirtree_status_cache);
+  g_cond_clear (&fsck->done_cond);
+  g_mutex_clear (&fsck->lock);
+  g_free (fsck);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (ParallelFsck, parallel_fsck_free)
+
+/* Verifies all the objects below the dirtree in parallel, filling in
+ * the caches. fsck_dirtree() then only has to combine the results, so
+ * the outcome is the same as when verifying serially. */
+static void
+verify_objects_parallel (ParallelFsck *fsck,
+                         gboolean      partial,
+                         const char   *dirtree_checksum)
+{
+  /* The pool is idle between commits */
+  fsck->partial = partial;
+
+  parallel_fsck_push_dirtree (fsck, dirtree_checksum);
+
+  /* Workers push new items while running, so we can only go on once
+     all the pushed items are done */
+  g_mutex_lock (&fsck->lock);
+  while (fsck->n_pending > 0)
+    g_cond_wait (&fsck->done_cond, &fsck->lock);
+  g_mutex_unlock (&fsck->lock);
+}
+
+/* If @parallel is set, the objects of the commit are verified in its
+ * thread pool */
 static FsckStatus
-fsck_commit (OstreeRepo *repo,
-             const char *checksum,
-             GHashTable *object_status_cache)
+fsck_commit (OstreeRepo   *repo,
+             const char   *checksum,
+             GHashTable   *object_status_cache,
+             ParallelFsck *parallel)
 {
   g_autoptr(GError) local_error = NULL;
   g_autoptr(GVariant) commit = NULL;
@@ -237,7 +453,11 @@ fsck_commit (OstreeRepo *repo,
   g_variant_get_child (commit, 6, "@ay", &dirtree_csum_bytes);
   dirtree_checksum = ostree_checksum_from_bytes (ostree_checksum_bytes_peek (dirtree_csum_bytes));
 
-  dirtree_status = fsck_dirtree (repo, partial, dirtree_checksum, object_status_cache);
+  if (parallel != NULL)
+    verify_objects_parallel (parallel, partial, dirtree_checksum);
+
+  dirtree_status = fsck_dirtree (repo, partial, dirtree_checksum, object_status_cache,
+                                 parallel ? parallel->dirtree_status_cache : NULL);
   status = MAX (status, dirtree_status);
 
   /* Its ok for partial commits to have missing objects */
@@ -291,11 +511,13 @@ flatpak_builtin_repair (int argc, char **argv, GCancellable *cancellable, GError
   g_autoptr(GHashTable) all_refs = NULL;
   g_autoptr(GHashTable) invalid_refs = NULL;
   g_autoptr(GHashTable) object_status_cache = NULL;
+  g_autoptr(ParallelFsck) parallel = NULL;
   g_auto(GStrv) app_refs = NULL;
   g_auto(GStrv) runtime_refs = NULL;
   g_autoptr(FlatpakTransaction) transaction = NULL;
   OstreeRepo *repo;
   g_autoptr(GFile) file = NULL;
+  gint64 verify_start, verify_time;
   int i;
 
   context = g_option_context_new (_("- Repair a flatpak installation"));
@@ -344,12 +566,20 @@ flatpak_builtin_repair (int argc, char **argv, GCancellable *cancellable, GError
   object_status_cache = g_hash_table_new_full (ostree_hash_object_name, g_variant_equal,
                                                (GDestroyNotify) g_variant_unref, NULL);
 
+  if (opt_jobs <= 0)
+    opt_jobs = g_get_num_processors ();
+
+  if (opt_jobs > 1)
+    parallel = parallel_fsck_new (repo, object_status_cache);
+
   invalid_refs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
 
   /* Validate that the commit for each ref is available */
   if (!ostree_repo_list_refs (repo, NULL, &all_refs, cancellable, error))
     return FALSE;
 
+  verify_start = g_get_monotonic_time ();
+
   GLNX_HASH_TABLE_FOREACH_KV (all_refs, const char *, refspec, const char *, checksum)
   {
     g_autofree char *remote = NULL;
@@ -381,7 +611,7 @@ flatpak_builtin_repair (int argc, char **argv, GCancellable *cancellable, GError
 
     g_print (_("Verifying %s…\n"), refspec);
 
-    status = fsck_commit (repo, checksum, object_status_cache);
+    status = fsck_commit (repo, checksum, object_status_cache, parallel);
     if (status != FSCK_STATUS_OK && !opt_dry_run)
       {
         switch (status)
@@ -402,6 +632,13 @@ flatpak_builtin_repair (int argc, char **argv, GCancellable *cancellable, GError
       }
   }
 
+  verify_time = MAX (g_get_monotonic_time () - verify_start, 1);
+  g_print (_("Verified %u objects (%.1f MB) in %.1f s, %.0f objects/s, %.1f MB/s\n"),
+           n_verified_objects, n_verified_bytes / 1000000.0,
+           (double) verify_time / G_USEC_PER_SEC,
+           n_verified_objects * (double) G_USEC_PER_SEC / verify_time,
+           n_verified_bytes * (double) G_USEC_PER_SEC / verify_time / 1000000.0);
+
   GLNX_HASH_TABLE_FOREACH_KV (all_refs, const char *, refspec, const char *, checksum)
   {
     g_autofree char *remote = NULL;
@@ -50,93 +50,30 @@ static Column all_columns[] = {
   { NULL }
 };
 
-static GPtrArray *
-get_remote_stores (GPtrArray *dirs, const char *arch, GCancellable *cancellable)
-{
-  GError *error = NULL;
-  GPtrArray *ret = g_ptr_array_new_with_free_func (g_object_unref);
-  guint i, j;
-
-  for (i = 0; i < dirs->len; ++i)
-    {
-      FlatpakDir *dir = g_ptr_array_index (dirs, i);
-      g_autofree char *install_path = NULL;
-      g_auto(GStrv) remotes = NULL;
-
-      flatpak_log_dir_access (dir);
-
-      install_path = g_file_get_path (flatpak_dir_get_path (dir));
-      remotes = flatpak_dir_list_enumerated_remotes (dir, cancellable, &error);
-      if (error)
-        {
-          g_warning ("%s", error->message);
-          g_clear_error (&error);
-          continue;
-        }
-      else if (remotes == NULL)
-        continue;
-
-      for (j = 0; remotes[j]; ++j)
-        {
-          g_autoptr(AsStore) store = as_store_new ();
-
-#if AS_CHECK_VERSION (0, 6, 1)
-          // We want to see multiple versions/branches of same app-id's, e.g. org.gnome.Platform
-          as_store_set_add_flags (store, as_store_get_add_flags (store) | AS_STORE_ADD_FLAG_USE_UNIQUE_ID);
-#endif
-
-          flatpak_dir_load_appstream_store (dir, remotes[j], arch, store, cancellable, &error);
-
-          if (error)
-            {
-              g_warning ("%s", error->message);
-              g_clear_error (&error);
-            }
-
-          g_object_set_data_full (G_OBJECT (store), "remote-name", g_strdup (remotes[j]), g_free);
-          g_ptr_array_add (ret, g_steal_pointer (&store));
-        }
-    }
-  return ret;
-}
-
-static void
-clear_app_arches (AsApp *app)
-{
-  GPtrArray *arches = as_app_get_architectures (app);
-
-  g_ptr_array_set_size (arches, 0);
-}
-
 typedef struct MatchResult
 {
-  AsApp     *app;
+  char      *id;
+  char      *name;
+  char      *comment;
+  char      *version;
+  char      *branch;
   GPtrArray *remotes;
   guint      score;
+  guint      seq;
 } MatchResult;
 
 static void
 match_result_free (MatchResult *result)
 {
-  g_object_unref (result->app);
+  g_free (result->id);
+  g_free (result->name);
+  g_free (result->comment);
+  g_free (result->version);
+  g_free (result->branch);
   g_ptr_array_unref (result->remotes);
   g_free (result);
 }
 
-static MatchResult *
-match_result_new (AsApp *app, guint score)
-{
-  MatchResult *result = g_new (MatchResult, 1);
-
-  result->app = g_object_ref (app);
-  result->remotes = g_ptr_array_new_with_free_func (g_free);
-  result->score = score;
-
-  clear_app_arches (result->app);
-
-  return result;
-}
-
 static void
 match_result_add_remote (MatchResult *self, const char *remote)
 {
@@ -151,85 +88,258 @@ match_result_add_remote (MatchResult *self, const char *remote)
   g_ptr_array_add (self->remotes, g_strdup (remote));
 }
 
-static int
-compare_by_score (MatchResult *a, MatchResult *b, gpointer user_data)
+typedef struct
+{
+  GHashTable *by_key; /* "id/branch" -> MatchResult */
+  GPtrArray  *heap;   /* Max-heap on score */
+  guint       seq;
+} Matches;
+
+/* Higher score comes first, and on equal scores the later match
+   does, like the previous sorted list did */
+static gboolean
+match_result_before (MatchResult *a, MatchResult *b)
 {
-  // Reverse order, higher score comes first
-  return (int) b->score - (int) a->score;
+  if (a->score != b->score)
+    return a->score > b->score;
+  return a->seq > b->seq;
 }
 
-#if !AS_CHECK_VERSION (0, 6, 1)
-/* Roughly copied directly from appstream-glib */
+static void
+matches_heap_push (GPtrArray *heap, MatchResult *result)
+{
+  guint i = heap->len;
 
-static const gchar *
-as_app_fix_unique_nullable (const gchar *tmp)
+  g_ptr_array_add (heap, result);
+  while (i > 0)
+    {
+      guint parent = (i - 1) / 2;
+
+      if (!match_result_before (heap->pdata[i], heap->pdata[parent]))
+        break;
+
+      heap->pdata[i] = heap->pdata[parent];
+      heap->pdata[parent] = result;
+      i = parent;
+    }
+}
+
+static MatchResult *
+matches_heap_pop (GPtrArray *heap)
 {
-  if (tmp == NULL || tmp[0] == '\0')
-    return "*";
-  return tmp;
+  MatchResult *top = heap->pdata[0];
+  MatchResult *last = heap->pdata[heap->len - 1];
+  guint i = 0;
+
+  g_ptr_array_set_size (heap, heap->len - 1);
+  if (heap->len == 0)
+    return top;
+
+  heap->pdata[0] = last;
+  while (TRUE)
+    {
+      guint left = 2 * i + 1, right = left + 1, best = i;
+
+      if (left < heap->len && match_result_before (heap->pdata[left], heap->pdata[best]))
+        best = left;
+      if (right < heap->len && match_result_before (heap->pdata[right], heap->pdata[best]))
+        best = right;
+      if (best == i)
+        break;
+
+      heap->pdata[i] = heap->pdata[best];
+      heap->pdata[best] = last;
+      i = best;
+    }
+
+  return top;
 }
 
-static char *
-as_app_get_unique_id (AsApp *app)
+static void
+matches_add (Matches    *matches,
+             const char *remote,
+             const char *id,
+             const char *name,
+             const char *comment,
+             const char *version,
+             const char *branch,
+             guint       score)
 {
-  const gchar *id_str = NULL;
-  const gchar *kind_str = NULL;
-  AsAppKind kind = as_app_get_kind (app);
-
-  if (kind != AS_APP_KIND_UNKNOWN)
-    kind_str = as_app_kind_to_string (kind);
-  id_str = as_app_get_id_no_prefix (app);
-  return g_strdup_printf ("%s/%s",
-                          as_app_fix_unique_nullable (kind_str),
-                          as_app_fix_unique_nullable (id_str));
+  g_autofree char *key = g_strconcat (id, "/", branch ? branch : "", NULL);
+  MatchResult *result;
+
+  // Avoid duplicate entries, but show multiple remotes
+  result = g_hash_table_lookup (matches->by_key, key);
+  if (result == NULL)
+    {
+      result = g_new0 (MatchResult, 1);
+      result->id = g_strdup (id);
+      result->name = g_strdup (name);
+      result->comment = g_strdup (comment);
+      result->version = g_strdup (version);
+      result->branch = g_strdup (branch);
+      result->remotes = g_ptr_array_new_with_free_func (g_free);
+      result->score = score;
+      result->seq = matches->seq++;
+
+      g_hash_table_insert (matches->by_key, g_steal_pointer (&key), result);
+      matches_heap_push (matches->heap, result);
+    }
+
+  match_result_add_remote (result, remote);
 }
 
 static gboolean
-as_app_equal (AsApp *app1, AsApp *app2)
+search_remote_index (FlatpakDir *dir,
+                     const char *remote,
+                     const char *arch,
+                     const char *search_text,
+                     Matches    *matches)
 {
-  if (app1 == app2)
-    return TRUE;
+  g_autofree char *subdir = NULL;
+  g_autoptr(GFile) index_file = NULL;
+  g_autoptr(GVariant) index = NULL;
+  g_autoptr(GArray) results = NULL;
+  g_autoptr(GError) local_error = NULL;
+  guint i;
+
+  if (arch == NULL)
+    arch = flatpak_get_arch ();
+
+  /* OCI remotes have no deployed appstream checkout to index */
+  if (flatpak_dir_get_remote_oci (dir, remote))
+    return FALSE;
+
+  subdir = g_build_filename ("appstream", remote, arch, "active", "search-index", NULL);
+  index_file = g_file_resolve_relative_path (flatpak_dir_get_path (dir), subdir);
 
-  g_autofree char *app1_id = as_app_get_unique_id (app1);
-  g_autofree char *app2_id = as_app_get_unique_id (app2);
-  return strcmp (app1_id, app2_id) == 0;
+  index = flatpak_search_index_load (index_file, &local_error);
+  if (index == NULL)
+    {
+      g_debug ("No search index for remote %s: %s", remote, local_error->message);
+      return FALSE;
+    }
+
+  results = flatpak_search_index_query (index, search_text, g_get_language_names ());
+  for (i = 0; i < results->len; i++)
+    {
+      FlatpakSearchIndexMatch *match = &g_array_index (results, FlatpakSearchIndexMatch, i);
+      const char *id, *name, *summary, *version, *branch;
+
+      flatpak_search_index_get_app (index, match->app, &id, &name, &summary, &version, &branch);
+      matches_add (matches, remote, id, name, summary,
+                   *version ? version : NULL, *branch ? branch : NULL,
+                   match->score);
+    }
+
+  return TRUE;
 }
+
+static void
+search_remote_store (FlatpakDir   *dir,
+                     const char   *remote,
+                     const char   *arch,
+                     const char   *search_text,
+                     Matches      *matches,
+                     GCancellable *cancellable)
+{
+  g_autoptr(AsStore) store = as_store_new ();
+  g_autoptr(GError) error = NULL;
+  GPtrArray *apps;
+  guint i;
+
+#if AS_CHECK_VERSION (0, 6, 1)
+  // We want to see multiple versions/branches of same app-id's, e.g. org.gnome.Platform
+  as_store_set_add_flags (store, as_store_get_add_flags (store) | AS_STORE_ADD_FLAG_USE_UNIQUE_ID);
+#endif
+
+  flatpak_dir_load_appstream_store (dir, remote, arch, store, cancellable, &error);
+  if (error)
+    g_warning ("%s", error->message);
+
+  apps = as_store_get_apps (store);
+  for (i = 0; i < apps->len; ++i)
+    {
+      AsApp *app = g_ptr_array_index (apps, i);
+      const char *app_id = as_app_get_id_filename (app);
+      const char *branch = NULL;
+      guint score = as_app_search_matches (app, search_text);
+
+      if (score == 0)
+        {
+          if (strcasestr (app_id, search_text) != NULL)
+            score = 50;
+          else
+            continue;
+        }
+
+#if AS_CHECK_VERSION (0, 6, 1)
+      branch = as_app_get_branch (app);
 #endif
 
-static int
-compare_apps (MatchResult *a, AsApp *b)
+      matches_add (matches, remote, app_id,
+                   as_app_get_localized_name (app),
+                   as_app_get_localized_comment (app),
+                   as_app_get_version (app),
+                   branch, score);
+    }
+}
+
+static void
+search_dirs (GPtrArray    *dirs,
+             const char   *arch,
+             const char   *search_text,
+             Matches      *matches,
+             GCancellable *cancellable)
 {
-  /* For now we want to ignore arch when comparing applications
-   * It may be valuable to show runtime arches in the future though.
-   * This is a naughty hack but for our purposes totally fine.
-   */
-  clear_app_arches (b);
+  GError *error = NULL;
+  guint i, j;
+
+  for (i = 0; i < dirs->len; ++i)
+    {
+      FlatpakDir *dir = g_ptr_array_index (dirs, i);
+      g_auto(GStrv) remotes = NULL;
+
+      flatpak_log_dir_access (dir);
 
-  return !as_app_equal (a->app, b);
+      remotes = flatpak_dir_list_enumerated_remotes (dir, cancellable, &error);
+      if (error)
+        {
+          g_warning ("%s", error->message);
+          g_clear_error (&error);
+          continue;
+        }
+      else if (remotes == NULL)
+        continue;
+
+      for (j = 0; remotes[j]; ++j)
+        {
+          // Fall back to parsing the appstream for remotes that have
+          // not been updated since the search index was introduced
+          if (!search_remote_index (dir, remotes[j], arch, search_text, matches))
+            search_remote_store (dir, remotes[j], arch, search_text, matches, cancellable);
+        }
+    }
 }
 
 static void
 print_app (Column *columns, MatchResult *res, FlatpakTablePrinter *printer)
 {
-  const char *version = as_app_get_version (res->app);
-  const char *id = as_app_get_id_filename (res->app);
-  const char *name = as_app_get_localized_name (res->app);
-  const char *comment = as_app_get_localized_comment (res->app);
   guint i;
 
   for (i = 0; columns[i].name; i++)
     {
       if (strcmp (columns[i].name, "name") == 0)
-        flatpak_table_printer_add_column (printer, name);
+        flatpak_table_printer_add_column (printer, res->name);
       if (strcmp (columns[i].name, "description") == 0)
-        flatpak_table_printer_add_column (printer, comment);
+        flatpak_table_printer_add_column (printer, res->comment);
       else if (strcmp (columns[i].name, "application") == 0)
-        flatpak_table_printer_add_column (printer, id);
+        flatpak_table_printer_add_column (printer, res->id);
       else if (strcmp (columns[i].name, "version") == 0)
-        flatpak_table_printer_add_column (printer, version);
+        flatpak_table_printer_add_column (printer, res->version);
 #if AS_CHECK_VERSION (0, 6, 1)
       else if (strcmp (columns[i].name, "branch") == 0)
-        flatpak_table_printer_add_column (printer, as_app_get_branch (res->app));
+        flatpak_table_printer_add_column (printer, res->branch);
 #endif
       else if (strcmp (columns[i].name, "remotes") == 0)
         {
@@ -243,20 +353,20 @@ print_app (Column *columns, MatchResult *res, FlatpakTablePrinter *printer)
 }
 
 static void
-print_matches (Column *columns, GSList *matches)
+print_matches (Column *columns, GPtrArray *heap)
 {
   FlatpakTablePrinter *printer = NULL;
   int rows, cols;
-  GSList *s;
 
   printer = flatpak_table_printer_new ();
 
   flatpak_table_printer_set_columns (printer, columns, opt_cols != NULL);
 
-  for (s = matches; s; s = s->next)
+  while (heap->len > 0)
     {
-      MatchResult *res = s->data;
+      MatchResult *res = matches_heap_pop (heap);
       print_app (columns, res, printer);
+      match_result_free (res);
     }
 
   flatpak_get_window_size (&rows, &cols);
@@ -272,6 +382,9 @@ flatpak_builtin_search (int argc, char **argv, GCancellable *cancellable, GError
   g_autoptr(GPtrArray) dirs = NULL;
   g_autofree char *col_help = NULL;
   g_autofree Column *columns = NULL;
+  g_autoptr(GHashTable) by_key = NULL;
+  g_autoptr(GPtrArray) heap = NULL;
+  Matches matches = { NULL, };
   g_autoptr(GOptionContext) context = g_option_context_new (_("TEXT - Search remote apps/runtimes for text"));
   g_option_context_set_translation_domain (context, GETTEXT_PACKAGE);
   col_help = column_help (all_columns);
@@ -293,57 +406,20 @@ flatpak_builtin_search (int argc, char **argv, GCancellable *cancellable, GError
     return FALSE;
 
   const char *search_text = argv[1];
-  GSList *matches = NULL;
-  guint j;
 
-  // We want a store for each remote so we keep the remote information
-  // as AsApp doesn't currently contain that information
-  g_autoptr(GPtrArray) remote_stores = get_remote_stores (dirs, opt_arch, cancellable);
-  for (j = 0; j < remote_stores->len; ++j)
-    {
-      AsStore *store = g_ptr_array_index (remote_stores, j);
-      GPtrArray *apps = as_store_get_apps (store);
-      guint i;
+  /* The results are freed as print_matches() pops them off the heap */
+  by_key = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  heap = g_ptr_array_new ();
+  matches.by_key = by_key;
+  matches.heap = heap;
 
-      for (i = 0; i < apps->len; ++i)
-        {
-          AsApp *app = g_ptr_array_index (apps, i);
-          guint score = as_app_search_matches (app, search_text);
-          if (score == 0)
-            {
-              const char *app_id = as_app_get_id_filename (app);
-              if (strcasestr (app_id, search_text) != NULL)
-                score = 50;
-              else
-                continue;
-            }
-
-          // Avoid duplicate entries, but show multiple remotes
-          GSList *list_entry = g_slist_find_custom (matches, app,
-                                                    (GCompareFunc) compare_apps);
-          MatchResult *result = NULL;
-          if (list_entry != NULL)
-            result = list_entry->data;
-          else
-            {
-              result = match_result_new (app, score);
-              matches = g_slist_insert_sorted_with_data (matches, result,
-                                                         (GCompareDataFunc) compare_by_score, NULL);
-            }
-          match_result_add_remote (result,
-                                   g_object_get_data (G_OBJECT (store), "remote-name"));
-        }
-    }
+  search_dirs (dirs, opt_arch, search_text, &matches, cancellable);
 
-  if (matches != NULL)
-    {
-      print_matches (columns, matches);
-      g_slist_free_full (matches, (GDestroyNotify) match_result_free);
-    }
+  if (heap->len > 0)
+    print_matches (columns, heap);
   else
-    {
-      g_print ("%s\n", _("No matches found"));
-    }
+    g_print ("%s\n", _("No matches found"));
+
   return TRUE;
 }
 
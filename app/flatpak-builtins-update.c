@@ -50,6 +50,7 @@ static gboolean opt_app;
 static gboolean opt_appstream;
 static gboolean opt_yes;
 static gboolean opt_noninteractive;
+static int opt_parallel_pulls = 1;
 
 static GOptionEntry options[] = {
   { "arch", 0, 0, G_OPTION_ARG_STRING, &opt_arch, N_("Arch to update for"), N_("ARCH") },
@@ -66,6 +67,7 @@ static GOptionEntry options[] = {
   { "subpath", 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &opt_subpaths, N_("Only update this subpath"), N_("PATH") },
   { "assumeyes", 'y', 0, G_OPTION_ARG_NONE, &opt_yes, N_("Automatically answer yes for all questions"), NULL },
   { "noninteractive", 0, 0, G_OPTION_ARG_NONE, &opt_noninteractive, N_("Produce minimal output and don't ask questions"), NULL },
+  { "parallel-pulls", 0, 0, G_OPTION_ARG_INT, &opt_parallel_pulls, N_("Download up to N refs at the same time"), N_("N") },
   { NULL }
 };
 
@@ -138,6 +140,7 @@ flatpak_builtin_update (int           argc,
       flatpak_transaction_set_no_pull (transaction, opt_no_pull);
       flatpak_transaction_set_no_deploy (transaction, opt_no_deploy);
       flatpak_transaction_set_disable_static_deltas (transaction, opt_no_static_deltas);
+      flatpak_transaction_set_max_parallel_pulls (transaction, MAX (opt_parallel_pulls, 1));
       flatpak_transaction_set_disable_dependencies (transaction, opt_no_deps);
       flatpak_transaction_set_disable_related (transaction, opt_no_related);
 
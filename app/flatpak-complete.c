@@ -178,6 +178,7 @@ flatpak_complete_partial_ref (FlatpakCompletion *completion,
   g_auto(GStrv) refs = NULL;
   int element;
   const char *cur_parts[4] = { NULL };
+  FindMatchingRefsFlags flags = FIND_MATCHING_REFS_FLAGS_NONE;
   g_autoptr(GError) error = NULL;
   int i;
 
@@ -192,26 +193,30 @@ flatpak_complete_partial_ref (FlatpakCompletion *completion,
   cur_parts[2] = arch ? arch : "";
   cur_parts[3] = branch ? branch : "";
 
+  /* While completing the id only look up the ids starting with it */
+  if (element == 1 && id != NULL && *id != 0)
+    flags = FIND_MATCHING_REFS_FLAGS_PREFIX;
+
   if (remote)
     {
       refs = flatpak_dir_find_remote_refs (dir, completion->argv[1],
-                                           (element > 1) ? id : NULL,
+                                           (element > 1 || flags != 0) ? id : NULL,
                                            (element > 3) ? branch : NULL,
                                            NULL, /* default branch */
                                            (element > 2) ? arch : only_arch,
                                            NULL, /* default arch */
                                            matched_kinds,
-                                           FIND_MATCHING_REFS_FLAGS_NONE,
+                                           flags,
                                            NULL, &error);
     }
   else
     {
       refs = flatpak_dir_find_installed_refs (dir,
-                                              (element > 1) ? id : NULL,
+                                              (element > 1 || flags != 0) ? id : NULL,
                                               (element > 3) ? branch : NULL,
                                               (element > 2) ? arch : only_arch,
                                               matched_kinds,
-                                              FIND_MATCHING_REFS_FLAGS_NONE,
+                                              flags,
                                               &error);
     }
   if (refs == NULL)
@@ -48,6 +48,7 @@ typedef enum {
   FLATPAK_RUN_FLAG_DO_NOT_REAP        = (1 << 18),
   FLATPAK_RUN_FLAG_NO_PROC            = (1 << 19),
   FLATPAK_RUN_FLAG_PARENT_EXPOSE_PIDS = (1 << 20),
+  FLATPAK_RUN_FLAG_TRACE_LAUNCH       = (1 << 21),
 } FlatpakRunFlags;
 
 typedef struct FlatpakDir          FlatpakDir;
@@ -55,5 +56,8 @@ typedef struct FlatpakDeploy       FlatpakDeploy;
 typedef struct FlatpakOciRegistry  FlatpakOciRegistry;
 typedef struct _FlatpakOciManifest FlatpakOciManifest;
 typedef struct _FlatpakOciImage    FlatpakOciImage;
+typedef struct FlatpakSummaryIndex FlatpakSummaryIndex;
+typedef struct FlatpakRefIndex FlatpakRefIndex;
+typedef struct FlatpakFilter FlatpakFilter;
 
 #endif /* __FLATPAK_COMMON_TYPES_H__ */
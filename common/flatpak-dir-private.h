@@ -117,9 +117,12 @@ typedef struct
   GError   *summary_fetch_error;
   GVariant *metadata;
   GError   *metadata_fetch_error;
-  GRegex   *allow_refs;
-  GRegex   *deny_refs;
-  int       refcount;
+  FlatpakFilter *allow_refs;
+  FlatpakFilter *deny_refs;
+  GMutex    lock; /* Protects the lazily created fields below */
+  FlatpakSummaryIndex *index; /* Lazily created, see flatpak_remote_state_get_index() */
+  FlatpakRefIndex *ref_index; /* Lazily created, see flatpak_dir_get_remote_ref_index() */
+  gint      refcount;
 } FlatpakRemoteState;
 
 FlatpakRemoteState *flatpak_remote_state_ref (FlatpakRemoteState *remote_state);
@@ -172,6 +175,35 @@ gboolean                  flatpak_collection_ref_equal (gconstpointer ref1,
 
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (FlatpakCollectionRef, flatpak_collection_ref_free)
 
+typedef struct
+{
+  const char  *refspec;       /* As in the refs table, may have a remote prefix */
+  const char  *ref;           /* Without the remote prefix */
+  const char  *id;
+  const char  *arch;
+  const char  *branch;
+  const char  *collection_id; /* (nullable) */
+  FlatpakKinds kind;
+} FlatpakRefIndexEntry;
+
+typedef enum {
+  FLATPAK_REF_INDEX_MATCH_EXACT,
+  FLATPAK_REF_INDEX_MATCH_PREFIX,
+  FLATPAK_REF_INDEX_MATCH_FUZZY,
+} FlatpakRefIndexMatch;
+
+FlatpakRefIndex *flatpak_ref_index_new (GHashTable *refs);
+FlatpakRefIndex *flatpak_ref_index_ref (FlatpakRefIndex *index);
+void             flatpak_ref_index_unref (FlatpakRefIndex *index);
+gboolean         flatpak_ref_index_has_refs (FlatpakRefIndex *index,
+                                             GHashTable      *refs);
+GPtrArray *      flatpak_ref_index_lookup (FlatpakRefIndex     *index,
+                                           FlatpakKinds         kinds,
+                                           const char          *id,
+                                           FlatpakRefIndexMatch match);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (FlatpakRefIndex, flatpak_ref_index_unref)
+
 typedef enum {
   FLATPAK_HELPER_DEPLOY_FLAGS_NONE = 0,
   FLATPAK_HELPER_DEPLOY_FLAGS_UPDATE = 1 << 0,
@@ -324,6 +356,7 @@ typedef enum {
   FIND_MATCHING_REFS_FLAGS_NONE = 0,
   FIND_MATCHING_REFS_FLAGS_KEEP_REMOTE = (1 << 0),
   FIND_MATCHING_REFS_FLAGS_FUZZY = (1 << 1),
+  FIND_MATCHING_REFS_FLAGS_PREFIX = (1 << 2),
 } FindMatchingRefsFlags;
 
 GQuark       flatpak_dir_error_quark (void);
@@ -405,6 +438,8 @@ FlatpakDir  *flatpak_dir_get_system_by_id (const char   *id,
                                            GError      **error);
 FlatpakDir *flatpak_dir_get_by_path (GFile *path);
 gboolean    flatpak_dir_is_user (FlatpakDir *self);
+gboolean    flatpak_dir_use_system_helper (FlatpakDir *self,
+                                           const char *installing_from_remote);
 void        flatpak_dir_set_no_system_helper (FlatpakDir *self,
                                               gboolean    no_system_helper);
 void        flatpak_dir_set_no_interaction (FlatpakDir *self,
@@ -568,11 +603,23 @@ gboolean    flatpak_dir_pull (FlatpakDir                           *self,
                               OstreeAsyncProgress                  *progress,
                               GCancellable                         *cancellable,
                               GError                              **error);
+gboolean    flatpak_dir_pull_for_deploy (FlatpakDir          *self,
+                                         FlatpakRemoteState  *state,
+                                         const char          *ref,
+                                         const char          *commit,
+                                         const char         **subpaths,
+                                         const char          *token,
+                                         gboolean             no_static_deltas,
+                                         gboolean             allow_downgrade,
+                                         OstreeAsyncProgress *progress,
+                                         GCancellable        *cancellable,
+                                         GError             **error);
 gboolean    flatpak_dir_pull_untrusted_local (FlatpakDir          *self,
                                               const char          *src_path,
                                               const char          *remote_name,
                                               const char          *ref,
                                               const char         **subpaths,
+                                              gboolean             src_is_private,
                                               OstreeAsyncProgress *progress,
                                               GCancellable        *cancellable,
                                               GError             **error);
@@ -746,6 +793,10 @@ gboolean    flatpak_dir_update_exports (FlatpakDir   *self,
 gboolean    flatpak_dir_prune (FlatpakDir   *self,
                                GCancellable *cancellable,
                                GError      **error);
+gboolean    flatpak_dir_embed_extra_data (FlatpakDir   *self,
+                                         const char   *checksum,
+                                         GCancellable *cancellable,
+                                         GError      **error);
 gboolean    flatpak_dir_run_triggers (FlatpakDir   *self,
                                       GCancellable *cancellable,
                                       GError      **error);
@@ -756,6 +807,9 @@ gboolean    flatpak_dir_update_summary (FlatpakDir   *self,
 gboolean    flatpak_dir_cleanup_removed (FlatpakDir   *self,
                                          GCancellable *cancellable,
                                          GError      **error);
+gboolean    flatpak_dir_gc_ld_caches (FlatpakDir   *self,
+                                      GCancellable *cancellable,
+                                      GError      **error);
 gboolean    flatpak_dir_cleanup_undeployed_refs (FlatpakDir   *self,
                                                  GCancellable *cancellable,
                                                  GError      **error);
@@ -29,6 +29,7 @@
 #include <sys/file.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/wait.h>
 #include <utime.h>
 
 #include <glib/gi18n-lib.h>
@@ -39,6 +40,8 @@
 
 #include <gio/gio.h>
 #include <gio/gunixsocketaddress.h>
+#include <gio/gunixinputstream.h>
+#include <gio/gunixoutputstream.h>
 #include "libglnx/libglnx.h"
 #include "flatpak-error.h"
 #include <ostree.h>
@@ -77,6 +80,12 @@
 #define SYSCONF_REMOTES_DIR "remotes.d"
 #define SYSCONF_REMOTES_FILE_EXT ".flatpakrepo"
 
+/* Stored in the deploy data, rewritten exports are only reused if they
+ * were made for the same flatpak binary by the same rewriting code. Bump
+ * the version when rewrite_export_dir() changes its output. */
+#define FLATPAK_EXPORT_REWRITE_VERSION "1"
+#define FLATPAK_EXPORT_REWRITE_KEY FLATPAK_EXPORT_REWRITE_VERSION ":" FLATPAK_BINDIR
+
 #ifdef USE_SYSTEM_HELPER
 /* This uses a weird Auto prefix to avoid conflicts with later added polkit types.
  */
@@ -137,8 +146,8 @@ static gboolean flatpak_dir_lookup_remote_filter (FlatpakDir *self,
                                                   const char *name,
                                                   gboolean    force_load,
                                                   char      **checksum_out,
-                                                  GRegex    **allow_regex,
-                                                  GRegex    **deny_regex,
+                                                  FlatpakFilter **allow_filter,
+                                                  FlatpakFilter **deny_filter,
                                                   GError **error);
 
 static void ensure_soup_session (FlatpakDir *self);
@@ -187,8 +196,8 @@ typedef struct {
   GTimeVal mtime;
   guint64 last_mtime_check;
   char *checksum;
-  GRegex *allow;
-  GRegex *deny;
+  FlatpakFilter *allow;
+  FlatpakFilter *deny;
 } RemoteFilter;
 
 struct FlatpakDir
@@ -211,12 +220,21 @@ struct FlatpakDir
   GHashTable      *remote_filters;
 
   /* Config cache, protected by config_cache lock */
-  GRegex          *masked;
+  FlatpakFilter   *masked;
+
+  /* Protected by deploy_index lock */
+  GHashTable      *deploy_index;
+  gboolean         deploy_index_loaded;
+  gboolean         deploy_index_rebuilt;
+
+  /* Protected by ref_index_cache lock */
+  GHashTable      *ref_index_cache;
 
   SoupSession     *soup_session;
 };
 
 G_LOCK_DEFINE_STATIC (config_cache);
+G_LOCK_DEFINE_STATIC (deploy_index);
 
 typedef struct
 {
@@ -280,6 +298,7 @@ flatpak_remote_state_new (void)
   FlatpakRemoteState *state = g_new0 (FlatpakRemoteState, 1);
 
   state->refcount = 1;
+  g_mutex_init (&state->lock);
   return state;
 }
 
@@ -287,7 +306,7 @@ FlatpakRemoteState *
 flatpak_remote_state_ref (FlatpakRemoteState *remote_state)
 {
   g_assert (remote_state->refcount > 0);
-  remote_state->refcount++;
+  g_atomic_int_inc (&remote_state->refcount);
   return remote_state;
 }
 
@@ -295,9 +314,8 @@ void
 flatpak_remote_state_unref (FlatpakRemoteState *remote_state)
 {
   g_assert (remote_state->refcount > 0);
-  remote_state->refcount--;
 
-  if (remote_state->refcount == 0)
+  if (g_atomic_int_dec_and_test (&remote_state->refcount))
     {
       g_free (remote_state->remote_name);
       g_free (remote_state->collection_id);
@@ -306,13 +324,34 @@ flatpak_remote_state_unref (FlatpakRemoteState *remote_state)
       g_clear_error (&remote_state->summary_fetch_error);
       g_clear_pointer (&remote_state->metadata, g_variant_unref);
       g_clear_error (&remote_state->metadata_fetch_error);
-      g_clear_pointer (&remote_state->allow_refs, g_regex_unref);
-      g_clear_pointer (&remote_state->deny_refs, g_regex_unref);
+      g_clear_pointer (&remote_state->allow_refs, flatpak_filter_unref);
+      g_clear_pointer (&remote_state->deny_refs, flatpak_filter_unref);
+      g_clear_pointer (&remote_state->index, flatpak_summary_index_free);
+      g_clear_pointer (&remote_state->ref_index, flatpak_ref_index_unref);
+      g_mutex_clear (&remote_state->lock);
 
       g_free (remote_state);
     }
 }
 
+/* The summary and metadata never change after the state is created, so
+ * the index is built from them on first use and then reused for all
+ * lookups in this state. The state may be shared with the pull threads
+ * of a transaction, hence the lock. */
+static FlatpakSummaryIndex *
+flatpak_remote_state_get_index (FlatpakRemoteState *self)
+{
+  FlatpakSummaryIndex *index;
+
+  g_mutex_lock (&self->lock);
+  if (self->index == NULL)
+    self->index = flatpak_summary_index_new (self->summary, self->metadata);
+  index = self->index;
+  g_mutex_unlock (&self->lock);
+
+  return index;
+}
+
 gboolean
 flatpak_remote_state_ensure_summary (FlatpakRemoteState *self,
                                      GError            **error)
@@ -375,7 +414,8 @@ flatpak_remote_state_lookup_ref (FlatpakRemoteState *self,
       if (!flatpak_remote_state_ensure_summary (self, error))
         return FALSE;
 
-      if (!flatpak_summary_lookup_ref (self->summary, self->collection_id, ref, out_checksum, out_variant))
+      if (!flatpak_summary_index_lookup_ref (flatpak_remote_state_get_index (self),
+                                             self->collection_id, ref, out_checksum, out_variant))
         {
           if (self->collection_id != NULL)
             return flatpak_fail_error (error, FLATPAK_ERROR_REF_NOT_FOUND,
@@ -410,7 +450,8 @@ flatpak_remote_state_match_subrefs (FlatpakRemoteState *self,
       return g_strdupv ((char **) empty);
     }
 
-  return flatpak_summary_match_subrefs (self->summary, self->collection_id, ref);
+  return flatpak_summary_index_match_subrefs (flatpak_remote_state_get_index (self),
+                                              self->collection_id, ref);
 }
 
 
@@ -450,66 +491,28 @@ flatpak_remote_state_lookup_cache (FlatpakRemoteState *self,
                                    GVariant          **maybe_commit,
                                    GError            **error)
 {
-  g_autoptr(GVariant) cache_v = NULL;
-  g_autoptr(GVariant) cache = NULL;
-  g_autoptr(GVariant) commits = NULL;
-  g_autoptr(GVariant) res = NULL;
-  g_autoptr(GVariant) refdata = NULL;
-  int pos;
+  FlatpakSummaryIndex *index;
 
   if (!flatpak_remote_state_ensure_metadata (self, error))
     return FALSE;
 
-  cache_v = g_variant_lookup_value (self->metadata, "xa.cache", NULL);
-  if (cache_v == NULL)
+  index = flatpak_remote_state_get_index (self);
+
+  if (!flatpak_summary_index_has_cache (index))
     {
       g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
                    _("No flatpak cache in remote '%s' summary"), self->remote_name);
       return FALSE;
     }
 
-  commits = g_variant_lookup_value (self->metadata, "xa.commits", NULL);
-
-  cache = g_variant_get_child_value (cache_v, 0);
-
-  if (!flatpak_variant_bsearch_str (cache, ref, &pos))
+  if (!flatpak_summary_index_lookup_cache (index, ref, download_size, installed_size,
+                                           metadata, maybe_commit))
     {
       return flatpak_fail_error (error, FLATPAK_ERROR_REF_NOT_FOUND,
                                  _("No entry for %s in remote '%s' summary flatpak cache "),
                                  ref, self->remote_name);
     }
 
-  refdata = g_variant_get_child_value (cache, pos);
-  res = g_variant_get_child_value (refdata, 1);
-
-  if (installed_size)
-    {
-      guint64 v;
-      g_variant_get_child (res, 0, "t", &v);
-      *installed_size = GUINT64_FROM_BE (v);
-    }
-
-  if (download_size)
-    {
-      guint64 v;
-      g_variant_get_child (res, 1, "t", &v);
-      *download_size = GUINT64_FROM_BE (v);
-    }
-
-  if (metadata)
-    g_variant_get_child (res, 2, "&s", metadata);
-
-
-  refdata = g_variant_get_child_value (cache, pos);
-
-  if (maybe_commit)
-    {
-      if (commits)
-        *maybe_commit = g_variant_get_child_value (commits, pos);
-      else
-        *maybe_commit = NULL;
-    }
-
   return TRUE;
 }
 
@@ -518,18 +521,14 @@ flatpak_remote_state_lookup_sparse_cache (FlatpakRemoteState *self,
                                           const char         *ref,
                                           GError            **error)
 {
-  g_autoptr(GVariant) cache = NULL;
-  int pos;
+  GVariant *sparse_cache;
 
   if (!flatpak_remote_state_ensure_metadata (self, error))
     return FALSE;
 
-  cache = g_variant_lookup_value (self->metadata, "xa.sparse-cache", NULL);
-  if (cache != NULL && flatpak_variant_bsearch_str (cache, ref, &pos))
-    {
-      g_autoptr(GVariant) refdata = g_variant_get_child_value (cache, pos);
-      return g_variant_get_child_value (refdata, 1);
-    }
+  sparse_cache = flatpak_summary_index_lookup_sparse_cache (flatpak_remote_state_get_index (self), ref);
+  if (sparse_cache != NULL)
+    return sparse_cache;
 
   g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
                _("No entry for %s in remote summary flatpak sparse cache "), ref);
@@ -1302,7 +1301,7 @@ flatpak_dir_revokefs_fuse_unmount (OstreeRepo **repo,
   return FALSE;
 }
 
-static gboolean
+gboolean
 flatpak_dir_use_system_helper (FlatpakDir *self,
                                const char *installing_from_remote)
 {
@@ -1765,7 +1764,9 @@ flatpak_dir_finalize (GObject *object)
   g_clear_object (&self->soup_session);
   g_clear_pointer (&self->summary_cache, g_hash_table_unref);
   g_clear_pointer (&self->remote_filters, g_hash_table_unref);
-  g_clear_pointer (&self->masked, g_regex_unref);
+  g_clear_pointer (&self->masked, flatpak_filter_unref);
+  g_clear_pointer (&self->deploy_index, g_hash_table_unref);
+  g_clear_pointer (&self->ref_index_cache, g_hash_table_unref);
 
   G_OBJECT_CLASS (flatpak_dir_parent_class)->finalize (object);
 }
@@ -2656,6 +2657,9 @@ flatpak_dir_new_deploy_data (FlatpakDir         *self,
     g_variant_builder_add (&metadata_builder, "{s@v}", "previous-ids",
                            g_variant_new_variant (g_variant_new_strv (previous_ids, -1)));
 
+  g_variant_builder_add (&metadata_builder, "{s@v}", "export-rewrite",
+                         g_variant_new_variant (g_variant_new_string (FLATPAK_EXPORT_REWRITE_KEY)));
+
   add_appdata_to_deploy_data (&metadata_builder, deploy_dir, id);
 
   return g_variant_ref_sink (g_variant_new ("(ss^ast@a{sv})",
@@ -2709,6 +2713,309 @@ upgrade_deploy_data (GVariant *deploy_data, GFile *deploy_dir, const char *ref)
                                             g_variant_builder_end (&metadata_builder)));
 }
 
+/* The deploy index is a copy of the deploy data of all active deploys, in
+ * one file, so that listing installed refs doesn't have to load each of
+ * them. It is updated whenever the active deploy changes, and rebuilt
+ * from all deploys if it is missing. Each entry has the inode and mtime
+ * of the active symlink it was created for, so an entry that is out of
+ * date (for instance because an older version changed the deploy) is
+ * never used. */
+#define FLATPAK_DEPLOY_INDEX_NAME ".deploy-index"
+#define FLATPAK_DEPLOY_INDEX_LOCK_NAME ".deploy-index.lock"
+#define FLATPAK_DEPLOY_INDEX_VERSION 2
+#define FLATPAK_DEPLOY_INDEX_ENTRY_FORMAT "(ttt" FLATPAK_DEPLOY_DATA_GVARIANT_STRING ")"
+#define FLATPAK_DEPLOY_INDEX_FORMAT "(ua{s" FLATPAK_DEPLOY_INDEX_ENTRY_FORMAT "})"
+
+static GVariant *
+load_deploy_index (FlatpakDir *self)
+{
+  g_autoptr(GFile) index_file = g_file_get_child (self->basedir, FLATPAK_DEPLOY_INDEX_NAME);
+  g_autoptr(GMappedFile) mfile = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GVariant) index = NULL;
+  guint32 version;
+
+  mfile = g_mapped_file_new (flatpak_file_get_path_cached (index_file), FALSE, NULL);
+  if (mfile == NULL)
+    return NULL;
+
+  bytes = g_mapped_file_get_bytes (mfile);
+  index = g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE (FLATPAK_DEPLOY_INDEX_FORMAT), bytes, FALSE));
+
+  g_variant_get_child (index, 0, "u", &version);
+  if (version != FLATPAK_DEPLOY_INDEX_VERSION)
+    return NULL;
+
+  return g_steal_pointer (&index);
+}
+
+/* Returns a table from ref to index entry, for constant time lookups */
+static GHashTable *
+deploy_index_to_hash (GVariant *index)
+{
+  g_autoptr(GVariant) entries = g_variant_get_child_value (index, 1);
+  GHashTable *hash = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                            g_free, (GDestroyNotify) g_variant_unref);
+  gsize i, n = g_variant_n_children (entries);
+
+  for (i = 0; i < n; i++)
+    {
+      g_autoptr(GVariant) entry = g_variant_get_child_value (entries, i);
+      char *ref;
+      GVariant *value;
+
+      g_variant_get (entry, "{s@" FLATPAK_DEPLOY_INDEX_ENTRY_FORMAT "}", &ref, &value);
+      g_hash_table_replace (hash, ref, value);
+    }
+
+  return hash;
+}
+
+static gboolean
+stat_active_link (FlatpakDir  *self,
+                  const char  *ref,
+                  struct stat *st_buf)
+{
+  g_autoptr(GFile) deploy_base = flatpak_dir_get_deploy_dir (self, ref);
+  g_autoptr(GFile) active_link = g_file_get_child (deploy_base, "active");
+
+  return lstat (flatpak_file_get_path_cached (active_link), st_buf) == 0;
+}
+
+/* Adds the entry for the current active deploy of @ref, if any */
+static void
+add_deploy_index_entry (FlatpakDir      *self,
+                        GVariantBuilder *builder,
+                        const char      *ref,
+                        GCancellable    *cancellable)
+{
+  g_autoptr(GFile) deploy_dir = NULL;
+  g_autoptr(GVariant) deploy_data = NULL;
+  struct stat st_buf;
+
+  deploy_dir = flatpak_dir_get_if_deployed (self, ref, NULL, cancellable);
+  if (deploy_dir == NULL || !stat_active_link (self, ref, &st_buf))
+    return;
+
+  /* Store it upgraded, so callers that need the current version can use it */
+  deploy_data = flatpak_load_deploy_data (deploy_dir, ref, FLATPAK_DEPLOY_VERSION_CURRENT, cancellable, NULL);
+  if (deploy_data == NULL)
+    return;
+
+  g_variant_builder_add (builder, "{s(ttt@" FLATPAK_DEPLOY_DATA_GVARIANT_STRING ")}",
+                         ref,
+                         (guint64) st_buf.st_ino,
+                         (guint64) st_buf.st_mtim.tv_sec,
+                         (guint64) st_buf.st_mtim.tv_nsec,
+                         deploy_data);
+}
+
+/* Must be called with the deploy index file lock held */
+static void
+write_deploy_index (FlatpakDir      *self,
+                    GVariantBuilder *builder,
+                    GCancellable    *cancellable)
+{
+  g_autoptr(GVariant) new_index = NULL;
+  g_autoptr(GFile) index_file = g_file_get_child (self->basedir, FLATPAK_DEPLOY_INDEX_NAME);
+  g_autoptr(GError) local_error = NULL;
+
+  new_index = g_variant_ref_sink (g_variant_new ("(u@a{s" FLATPAK_DEPLOY_INDEX_ENTRY_FORMAT "})",
+                                                 FLATPAK_DEPLOY_INDEX_VERSION,
+                                                 g_variant_builder_end (builder)));
+
+  if (!glnx_file_replace_contents_at (AT_FDCWD, flatpak_file_get_path_cached (index_file),
+                                      g_variant_get_data (new_index),
+                                      g_variant_get_size (new_index),
+                                      GLNX_FILE_REPLACE_NODATASYNC,
+                                      cancellable, &local_error))
+    {
+      g_debug ("Failed to update deploy index: %s", local_error->message);
+      return;
+    }
+
+  G_LOCK (deploy_index);
+  g_clear_pointer (&self->deploy_index, g_hash_table_unref);
+  self->deploy_index = deploy_index_to_hash (new_index);
+  self->deploy_index_loaded = TRUE;
+  G_UNLOCK (deploy_index);
+}
+
+/* Serializes the read-modify-write cycles of different processes */
+static gboolean
+lock_deploy_index (FlatpakDir   *self,
+                   GLnxLockFile *lockfile)
+{
+  g_autoptr(GFile) lock_file = g_file_get_child (self->basedir, FLATPAK_DEPLOY_INDEX_LOCK_NAME);
+  g_autoptr(GError) local_error = NULL;
+
+  if (!glnx_make_lock_file (AT_FDCWD, flatpak_file_get_path_cached (lock_file),
+                            LOCK_EX, lockfile, &local_error))
+    {
+      g_debug ("Failed to lock deploy index: %s", local_error->message);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Adds entries for all the refs that are deployed */
+static void
+add_all_deploy_index_entries (FlatpakDir      *self,
+                              GVariantBuilder *builder,
+                              GCancellable    *cancellable)
+{
+  const char *kinds[] = { "app", "runtime" };
+  gsize i;
+
+  for (i = 0; i < G_N_ELEMENTS (kinds); i++)
+    {
+      g_auto(GStrv) refs = NULL;
+      gsize j;
+
+      if (!flatpak_dir_list_refs (self, kinds[i], &refs, cancellable, NULL))
+        continue;
+
+      for (j = 0; refs[j] != NULL; j++)
+        add_deploy_index_entry (self, builder, refs[j], cancellable);
+    }
+}
+
+static void
+rebuild_deploy_index (FlatpakDir   *self,
+                      GCancellable *cancellable)
+{
+  g_auto(GLnxLockFile) lock = { 0, };
+  g_autoptr(GVariant) index = NULL;
+  g_auto(GVariantBuilder) builder = FLATPAK_VARIANT_BUILDER_INITIALIZER;
+
+  if (!lock_deploy_index (self, &lock))
+    return;
+
+  /* Someone else may have written it while we waited for the lock */
+  index = load_deploy_index (self);
+  if (index != NULL)
+    {
+      G_LOCK (deploy_index);
+      g_clear_pointer (&self->deploy_index, g_hash_table_unref);
+      self->deploy_index = deploy_index_to_hash (index);
+      G_UNLOCK (deploy_index);
+      return;
+    }
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{s" FLATPAK_DEPLOY_INDEX_ENTRY_FORMAT "}"));
+  add_all_deploy_index_entries (self, &builder, cancellable);
+  write_deploy_index (self, &builder, cancellable);
+
+  g_debug ("Rebuilt deploy index of %s", flatpak_file_get_path_cached (self->basedir));
+}
+
+static GVariant *
+lookup_deploy_index (FlatpakDir *self,
+                     const char *ref,
+                     int         required_version)
+{
+  g_autoptr(GVariant) entry = NULL;
+  g_autoptr(GVariant) deploy_data = NULL;
+  guint64 ino, mtime_sec, mtime_nsec;
+  gboolean rebuild = FALSE;
+  struct stat st_buf;
+
+  G_LOCK (deploy_index);
+  if (!self->deploy_index_loaded)
+    {
+      g_autoptr(GVariant) index = load_deploy_index (self);
+
+      if (index != NULL)
+        self->deploy_index = deploy_index_to_hash (index);
+      self->deploy_index_loaded = TRUE;
+    }
+
+  /* Build a missing index once, if we are allowed to write it */
+  if (self->deploy_index == NULL && !self->deploy_index_rebuilt &&
+      access (flatpak_file_get_path_cached (self->basedir), W_OK) == 0)
+    {
+      self->deploy_index_rebuilt = TRUE;
+      rebuild = TRUE;
+    }
+  G_UNLOCK (deploy_index);
+
+  if (rebuild)
+    rebuild_deploy_index (self, NULL);
+
+  G_LOCK (deploy_index);
+  if (self->deploy_index != NULL)
+    {
+      entry = g_hash_table_lookup (self->deploy_index, ref);
+      if (entry != NULL)
+        g_variant_ref (entry);
+    }
+  G_UNLOCK (deploy_index);
+
+  if (entry == NULL)
+    return NULL;
+
+  g_variant_get (entry, "(ttt@" FLATPAK_DEPLOY_DATA_GVARIANT_STRING ")",
+                 &ino, &mtime_sec, &mtime_nsec, &deploy_data);
+
+  if (!stat_active_link (self, ref, &st_buf) ||
+      (guint64) st_buf.st_ino != ino ||
+      (guint64) st_buf.st_mtim.tv_sec != mtime_sec ||
+      (guint64) st_buf.st_mtim.tv_nsec != mtime_nsec)
+    return NULL;
+
+  if (flatpak_deploy_data_get_version (deploy_data) < required_version)
+    return NULL;
+
+  return g_steal_pointer (&deploy_data);
+}
+
+/* Updates the entry for @ref to match its current active deploy, or
+ * removes it if there is none. The index is only an optimization, so
+ * failures to write it (e.g. for a non-writable installation) are not
+ * reported. */
+static void
+update_deploy_index (FlatpakDir   *self,
+                     const char   *ref,
+                     GCancellable *cancellable)
+{
+  g_auto(GLnxLockFile) lock = { 0, };
+  g_autoptr(GVariant) old_index = NULL;
+  g_auto(GVariantBuilder) builder = FLATPAK_VARIANT_BUILDER_INITIALIZER;
+
+  if (!lock_deploy_index (self, &lock))
+    return;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{s" FLATPAK_DEPLOY_INDEX_ENTRY_FORMAT "}"));
+
+  old_index = load_deploy_index (self);
+  if (old_index != NULL)
+    {
+      g_autoptr(GVariant) entries = g_variant_get_child_value (old_index, 1);
+      gsize i, n = g_variant_n_children (entries);
+
+      for (i = 0; i < n; i++)
+        {
+          g_autoptr(GVariant) entry = g_variant_get_child_value (entries, i);
+          const char *entry_ref;
+
+          g_variant_get_child (entry, 0, "&s", &entry_ref);
+          if (strcmp (entry_ref, ref) != 0)
+            g_variant_builder_add_value (&builder, entry);
+        }
+
+      add_deploy_index_entry (self, &builder, ref, cancellable);
+    }
+  else
+    {
+      /* A partial index would only be used for this ref, so index all
+       * of them */
+      add_all_deploy_index_entries (self, &builder, cancellable);
+    }
+
+  write_deploy_index (self, &builder, cancellable);
+}
+
 GVariant *
 flatpak_dir_get_deploy_data (FlatpakDir   *self,
                              const char   *ref,
@@ -2717,6 +3024,11 @@ flatpak_dir_get_deploy_data (FlatpakDir   *self,
                              GError      **error)
 {
   g_autoptr(GFile) deploy_dir = NULL;
+  GVariant *deploy_data;
+
+  deploy_data = lookup_deploy_index (self, ref, required_version);
+  if (deploy_data != NULL)
+    return deploy_data;
 
   deploy_dir = flatpak_dir_get_if_deployed (self, ref, NULL, cancellable);
   if (deploy_dir == NULL)
@@ -2809,7 +3121,7 @@ flatpak_dir_recreate_repo (FlatpakDir   *self,
 
   G_LOCK (config_cache);
 
-  g_clear_pointer (&self->masked, g_regex_unref);
+  g_clear_pointer (&self->masked, flatpak_filter_unref);
 
   G_UNLOCK (config_cache);
 
@@ -3209,7 +3521,7 @@ _flatpak_dir_reload_config (FlatpakDir   *self,
   /* Clear cached stuff from repo config */
   G_LOCK (config_cache);
 
-  g_clear_pointer (&self->masked, g_regex_unref);
+  g_clear_pointer (&self->masked, flatpak_filter_unref);
 
   G_UNLOCK (config_cache);
   return TRUE;
@@ -3366,9 +3678,10 @@ flatpak_dir_deploy_appstream (FlatpakDir   *self,
   gboolean do_compress = FALSE;
   gboolean do_uncompress = TRUE;
   g_autofree char *filter_checksum = NULL;
-  g_autoptr(GRegex) allow_refs = NULL;
-  g_autoptr(GRegex) deny_refs = NULL;
+  g_autoptr(FlatpakFilter) allow_refs = NULL;
+  g_autoptr(FlatpakFilter) deny_refs = NULL;
   g_autofree char *collection_id = NULL;
+  g_autoptr(FlatpakXml) appstream = NULL;
 
   /* Keep a shared repo lock to avoid prunes removing objects we're relying on
    * while we do the checkout. This could happen if the ref changes after we
@@ -3508,7 +3821,6 @@ flatpak_dir_deploy_appstream (FlatpakDir   *self,
       in = g_file_read (appstream_xml, NULL, NULL);
       if (in)
         {
-          g_autoptr(FlatpakXml) appstream = NULL;
           g_autoptr(GBytes) content = NULL;
 
           appstream = flatpak_xml_parse (G_INPUT_STREAM (in), FALSE, cancellable, error);
@@ -3556,6 +3868,31 @@ flatpak_dir_deploy_appstream (FlatpakDir   *self,
         }
     }
 
+  /* Pre-compute the search index so flatpak search doesn't have to parse
+     the whole appstream. This is only an optimization, so ignore errors. */
+  {
+    g_autoptr(GFile) appstream_xml = g_file_get_child (checkout_dir, "appstream.xml");
+    g_autoptr(GFile) search_index_file = g_file_get_child (checkout_dir, "search-index");
+    g_autoptr(GVariant) search_index = NULL;
+    g_autoptr(GError) local_error = NULL;
+
+    if (appstream == NULL)
+      {
+        g_autoptr(GFileInputStream) in = g_file_read (appstream_xml, NULL, NULL);
+        if (in)
+          appstream = flatpak_xml_parse (G_INPUT_STREAM (in), FALSE, cancellable, &local_error);
+      }
+
+    if (appstream != NULL)
+      {
+        search_index = flatpak_appstream_xml_build_search_index (appstream);
+        if (!flatpak_variant_save (search_index_file, search_index, cancellable, &local_error))
+          g_debug ("Failed to save search index for remote %s: %s", remote, local_error->message);
+      }
+    else if (local_error != NULL)
+      g_debug ("Failed to parse appstream for remote %s: %s", remote, local_error->message);
+  }
+
   glnx_gen_temp_name (tmpname);
   active_tmp_link = g_file_get_child (arch_dir, tmpname);
 
@@ -4892,23 +5229,6 @@ ensure_soup_session (FlatpakDir *self)
     }
 }
 
-typedef struct
-{
-  OstreeAsyncProgress *progress;
-  guint64              previous_dl;
-} ExtraDataProgress;
-
-static void
-extra_data_progress_report (guint64  downloaded_bytes,
-                            gpointer user_data)
-{
-  ExtraDataProgress *extra_progress = user_data;
-
-  if (extra_progress->progress)
-    ostree_async_progress_set_uint64 (extra_progress->progress, "transferred-extra-data-bytes",
-                                      extra_progress->previous_dl + downloaded_bytes);
-}
-
 static gboolean
 flatpak_dir_setup_extra_data (FlatpakDir                           *self,
                               OstreeRepo                           *repo,
@@ -4999,70 +5319,440 @@ reset_async_progress_extra_data (OstreeAsyncProgress *progress)
     ostree_async_progress_set_uint (progress, "downloading-extra-data", 0);
 }
 
+/* Downloaded extra data is kept in the repo as tmp/cache/extra-data/$sha256,
+ * and interrupted downloads as $sha256.partial, which are resumed. */
+#define EXTRA_DATA_CACHE_DIR "tmp/cache/extra-data"
+#define EXTRA_DATA_DOWNLOAD_ATTEMPTS 3
+
 static gboolean
-flatpak_dir_pull_extra_data (FlatpakDir          *self,
-                             OstreeRepo          *repo,
-                             const char          *repository,
-                             const char          *ref,
-                             const char          *rev,
-                             FlatpakPullFlags     flatpak_flags,
-                             OstreeAsyncProgress *progress,
-                             GCancellable        *cancellable,
-                             GError             **error)
+checksum_fd_range (int           fd,
+                   guint64       start,
+                   guint64       end,
+                   GChecksum    *checksum,
+                   GCancellable *cancellable,
+                   GError      **error)
 {
-  g_autoptr(GVariant) extra_data_sources = NULL;
-  g_autoptr(GVariant) detached_metadata = NULL;
-  g_auto(GVariantDict) new_metadata_dict = FLATPAK_VARIANT_DICT_INITIALIZER;
-  g_autoptr(GVariantBuilder) extra_data_builder = NULL;
-  g_autoptr(GVariant) new_detached_metadata = NULL;
-  g_autoptr(GVariant) extra_data = NULL;
-  g_autoptr(GFile) base_dir = NULL;
-  int i;
-  gsize n_extra_data;
-  ExtraDataProgress extra_data_progress = { NULL };
-
-  extra_data_sources = flatpak_repo_get_extra_data_sources (repo, rev, cancellable, NULL);
-  if (extra_data_sources == NULL)
-    return TRUE;
+  g_autofree char *buf = g_malloc (64 * 1024);
 
-  n_extra_data = g_variant_n_children (extra_data_sources);
-  if (n_extra_data == 0)
-    return TRUE;
+  while (start < end)
+    {
+      ssize_t n;
 
-  if ((flatpak_flags & FLATPAK_PULL_FLAGS_DOWNLOAD_EXTRA_DATA) == 0)
-    return flatpak_fail_error (error, FLATPAK_ERROR_UNTRUSTED, _("Extra data not supported for non-gpg-verified local system installs"));
+      if (g_cancellable_set_error_if_cancelled (cancellable, error))
+        return FALSE;
 
-  extra_data_builder = g_variant_builder_new (G_VARIANT_TYPE ("a(ayay)"));
+      n = pread (fd, buf, MIN (64 * 1024, end - start), start);
+      if (n < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          return glnx_throw_errno_prefix (error, "pread");
+        }
+      if (n == 0)
+        break;
 
-  /* Other fields were already set in flatpak_dir_setup_extra_data() */
-  if (progress)
-    {
-      ostree_async_progress_set (progress,
-                                 "start-time-extra-data", "t", g_get_monotonic_time (),
-                                 "downloading-extra-data", "u", 1,
-                                 NULL);
+      g_checksum_update (checksum, (guchar *) buf, n);
+      start += n;
     }
 
-  extra_data_progress.progress = progress;
+  return TRUE;
+}
 
-  base_dir = flatpak_get_user_base_dir_location ();
+static GMappedFile *
+map_extra_data_file (int         dfd,
+                     const char *name,
+                     GError    **error)
+{
+  glnx_autofd int fd = -1;
 
-  for (i = 0; i < n_extra_data; i++)
-    {
-      const char *extra_data_uri = NULL;
-      g_autofree char *extra_data_sha256 = NULL;
-      const char *extra_data_name = NULL;
-      guint64 download_size;
-      guint64 installed_size;
-      g_autofree char *sha256 = NULL;
-      const guchar *sha256_bytes;
-      g_autoptr(GBytes) bytes = NULL;
-      g_autoptr(GFile) extra_local_file = NULL;
+  if (!glnx_openat_rdonly (dfd, name, FALSE, &fd, error))
+    return NULL;
 
-      flatpak_repo_parse_extra_data_sources (extra_data_sources, i,
-                                             &extra_data_name,
-                                             &download_size,
-                                             &installed_size,
+  return g_mapped_file_new_from_fd (fd, FALSE, error);
+}
+
+typedef struct
+{
+  OstreeAsyncProgress *progress;
+  GPtrArray           *downloads; /* (element-type ExtraDataDownload) */
+  guint                n_running;
+} ExtraDataProgress;
+
+/* An extra-data file that is fetched into the cache. All the missing
+ * files of a commit are downloaded at the same time, the session
+ * limits how many requests go to the same host. Entries of the commit
+ * with the same checksum share one download. */
+typedef struct
+{
+  ExtraDataProgress *extra_progress;
+  SoupSession       *soup_session;
+  GPtrArray         *names; /* (element-type utf8) The entries using this file */
+  char              *uri;
+  char              *sha256;
+  char              *partial_name;
+  guint64            download_size;
+  GChecksum         *checksum;
+  GOutputStream     *out;
+  GCancellable      *cancellable;
+  int                cache_dfd;
+  int                fd; /* The locked .partial file, -1 if the file was already in the cache */
+  guint64            offset; /* What is on disk, and hashed */
+  guint64            transferred;
+  int                attempt;
+  GError            *error;
+} ExtraDataDownload;
+
+static void
+extra_data_download_free (ExtraDataDownload *download)
+{
+  g_ptr_array_unref (download->names);
+  g_free (download->uri);
+  g_free (download->sha256);
+  g_free (download->partial_name);
+  g_checksum_free (download->checksum);
+  g_clear_object (&download->out);
+  g_clear_object (&download->cancellable);
+  glnx_close_fd (&download->cache_dfd);
+  glnx_close_fd (&download->fd);
+  g_clear_error (&download->error);
+  g_free (download);
+}
+
+static void
+extra_data_progress_report (guint64  downloaded_bytes,
+                            gpointer user_data)
+{
+  ExtraDataDownload *download = user_data;
+  ExtraDataProgress *extra_progress = download->extra_progress;
+  guint64 transferred = 0;
+  guint i;
+
+  download->transferred = download->offset + downloaded_bytes;
+
+  if (extra_progress->progress == NULL)
+    return;
+
+  for (i = 0; i < extra_progress->downloads->len; i++)
+    {
+      ExtraDataDownload *other = g_ptr_array_index (extra_progress->downloads, i);
+      transferred += other->transferred;
+    }
+
+  ostree_async_progress_set_uint64 (extra_progress->progress, "transferred-extra-data-bytes", transferred);
+}
+
+static void extra_data_download_start (ExtraDataDownload *download);
+
+static void
+extra_data_download_cb (GObject      *source,
+                        GAsyncResult *result,
+                        gpointer      user_data)
+{
+  ExtraDataDownload *download = user_data;
+  ExtraDataProgress *extra_progress = download->extra_progress;
+  g_autoptr(GError) download_error = NULL;
+  struct stat st_buf;
+  guint64 new_offset;
+  gboolean res;
+
+  res = flatpak_download_http_uri_finish (SOUP_SESSION (source), result, &download_error);
+
+  /* Hash whatever made it to disk, also on errors, so that the next
+   * attempt can continue from there. */
+  if (!glnx_fstat (download->fd, &st_buf, &download->error))
+    goto out;
+  new_offset = st_buf.st_size;
+  if (!checksum_fd_range (download->fd, download->offset, new_offset, download->checksum,
+                          download->cancellable, &download->error))
+    goto out;
+
+  if (!res &&
+      !g_cancellable_is_cancelled (download->cancellable) &&
+      !g_error_matches (download_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND) &&
+      new_offset != download->offset &&
+      download->attempt + 1 < EXTRA_DATA_DOWNLOAD_ATTEMPTS)
+    {
+      g_debug ("Download of %s interrupted at %" G_GUINT64_FORMAT " bytes, retrying: %s",
+               download->uri, new_offset, download_error->message);
+      download->offset = new_offset;
+      download->attempt++;
+      extra_data_download_start (download);
+      return;
+    }
+
+  download->offset = new_offset;
+  download->transferred = new_offset;
+  if (!res)
+    download->error = g_steal_pointer (&download_error);
+
+out:
+  extra_progress->n_running--;
+  if (extra_progress->progress)
+    ostree_async_progress_set_uint64 (extra_progress->progress, "outstanding-extra-data",
+                                      extra_progress->n_running);
+}
+
+static void
+extra_data_download_start (ExtraDataDownload *download)
+{
+  download->transferred = download->offset;
+  flatpak_download_http_uri_async (download->soup_session, download->uri, 0,
+                                   download->out, download->offset,
+                                   extra_data_progress_report, download,
+                                   download->cancellable,
+                                   extra_data_download_cb, download);
+}
+
+static ExtraDataDownload *
+find_extra_data_download (GPtrArray  *downloads,
+                          const char *sha256)
+{
+  guint i;
+
+  for (i = 0; i < downloads->len; i++)
+    {
+      ExtraDataDownload *download = g_ptr_array_index (downloads, i);
+
+      if (strcmp (download->sha256, sha256) == 0)
+        return download;
+    }
+
+  return NULL;
+}
+
+/* Sets up the download of an extra-data file into the cache, resuming
+ * a partial download if there is one. The .partial file is locked for
+ * as long as the download exists, so other processes fetching the same
+ * file wait for this one instead of writing to it at the same time. */
+static ExtraDataDownload *
+flatpak_dir_prepare_extra_data_download (FlatpakDir        *self,
+                                         OstreeRepo        *repo,
+                                         const char        *name,
+                                         const char        *uri,
+                                         GFile             *local_file,
+                                         const char        *expected_sha256,
+                                         guint64            download_size,
+                                         ExtraDataProgress *extra_progress,
+                                         GCancellable      *cancellable,
+                                         GError           **error)
+{
+  ExtraDataDownload *download = g_new0 (ExtraDataDownload, 1);
+  struct stat st_buf;
+
+  download->extra_progress = extra_progress;
+  download->names = g_ptr_array_new ();
+  g_ptr_array_add (download->names, (char *) name);
+  download->uri = g_strdup (uri);
+  download->sha256 = g_strdup (expected_sha256);
+  download->partial_name = g_strconcat (expected_sha256, ".partial", NULL);
+  download->download_size = download_size;
+  download->checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  download->cancellable = cancellable ? g_object_ref (cancellable) : NULL;
+  download->cache_dfd = -1;
+  download->fd = -1;
+
+  /* Added right away so that the progress sees it, and it is freed on errors */
+  g_ptr_array_add (extra_progress->downloads, download);
+
+  if (!glnx_shutil_mkdir_p_at (ostree_repo_get_dfd (repo), EXTRA_DATA_CACHE_DIR, 0755, cancellable, error) ||
+      !glnx_opendirat (ostree_repo_get_dfd (repo), EXTRA_DATA_CACHE_DIR, TRUE, &download->cache_dfd, error))
+    return NULL;
+
+  while (TRUE)
+    {
+      struct stat partial_st_buf;
+
+      /* Only verified files are renamed to the final name */
+      if (fstatat (download->cache_dfd, expected_sha256, &st_buf, AT_SYMLINK_NOFOLLOW) == 0 &&
+          S_ISREG (st_buf.st_mode) && (guint64) st_buf.st_size == download_size)
+        {
+          g_debug ("Using already downloaded extra-data %s", expected_sha256);
+          glnx_close_fd (&download->fd);
+          download->offset = download_size;
+          download->transferred = download_size;
+          return download;
+        }
+
+      glnx_close_fd (&download->fd);
+      download->fd = openat (download->cache_dfd, download->partial_name,
+                             O_RDWR | O_CREAT | O_CLOEXEC | O_NOFOLLOW, 0644);
+      if (download->fd == -1)
+        return glnx_null_throw_errno_prefix (error, "openat(%s)", download->partial_name);
+
+      if (TEMP_FAILURE_RETRY (flock (download->fd, LOCK_EX | LOCK_NB)) != 0)
+        {
+          if (errno != EWOULDBLOCK)
+            return glnx_null_throw_errno_prefix (error, "flock(%s)", download->partial_name);
+
+          g_debug ("Waiting for another download of extra-data %s", expected_sha256);
+          if (TEMP_FAILURE_RETRY (flock (download->fd, LOCK_EX)) != 0)
+            return glnx_null_throw_errno_prefix (error, "flock(%s)", download->partial_name);
+        }
+
+      /* While we waited the other download may have finished, or failed
+       * and removed the file, so make sure we locked what is there now */
+      if (!glnx_fstat (download->fd, &st_buf, error))
+        return NULL;
+
+      if (fstatat (download->cache_dfd, download->partial_name, &partial_st_buf, AT_SYMLINK_NOFOLLOW) == 0 &&
+          partial_st_buf.st_dev == st_buf.st_dev && partial_st_buf.st_ino == st_buf.st_ino)
+        break;
+    }
+
+  if (local_file != NULL)
+    {
+      glnx_autofd int local_fd = -1;
+
+      g_debug ("Loading extra-data from local file %s", flatpak_file_get_path_cached (local_file));
+      if (!glnx_openat_rdonly (AT_FDCWD, flatpak_file_get_path_cached (local_file), TRUE, &local_fd, error))
+        {
+          g_prefix_error (error, _("Failed to load local extra-data %s: "),
+                          flatpak_file_get_path_cached (local_file));
+          return NULL;
+        }
+
+      if (ftruncate (download->fd, 0) != 0 ||
+          glnx_regfile_copy_bytes (local_fd, download->fd, (off_t) -1) < 0)
+        return glnx_null_throw_errno_prefix (error, _("Failed to load local extra-data %s"),
+                                             flatpak_file_get_path_cached (local_file));
+
+      if (!glnx_fstat (download->fd, &st_buf, error))
+        return NULL;
+    }
+
+  download->offset = st_buf.st_size;
+  if (download->offset > download_size)
+    {
+      if (ftruncate (download->fd, 0) != 0)
+        return glnx_null_throw_errno_prefix (error, "ftruncate");
+      download->offset = 0;
+    }
+
+  if (!checksum_fd_range (download->fd, 0, download->offset, download->checksum, cancellable, error))
+    return NULL;
+
+  if (lseek (download->fd, download->offset, SEEK_SET) < 0)
+    return glnx_null_throw_errno_prefix (error, "lseek");
+
+  download->out = g_unix_output_stream_new (download->fd, FALSE);
+  download->transferred = download->offset;
+
+  if (download->offset < download_size)
+    {
+      ensure_soup_session (self);
+      download->soup_session = self->soup_session;
+    }
+
+  return download;
+}
+
+/* Verifies a finished download and moves it to its final name */
+static GMappedFile *
+extra_data_download_finish (ExtraDataDownload *download,
+                            GError           **error)
+{
+  if (download->error != NULL)
+    {
+      g_propagate_error (error, g_steal_pointer (&download->error));
+      return NULL;
+    }
+
+  if (download->fd != -1)
+    {
+      if (download->offset != download->download_size)
+        {
+          (void) unlinkat (download->cache_dfd, download->partial_name, 0);
+          flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Wrong size for extra data %s"), download->uri);
+          return NULL;
+        }
+
+      if (strcmp (g_checksum_get_string (download->checksum), download->sha256) != 0)
+        {
+          (void) unlinkat (download->cache_dfd, download->partial_name, 0);
+          flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Invalid checksum for extra data %s"), download->uri);
+          return NULL;
+        }
+
+      if (!glnx_renameat (download->cache_dfd, download->partial_name,
+                          download->cache_dfd, download->sha256, error))
+        return NULL;
+    }
+
+  return map_extra_data_file (download->cache_dfd, download->sha256, error);
+}
+
+static gboolean
+flatpak_dir_pull_extra_data (FlatpakDir          *self,
+                             OstreeRepo          *repo,
+                             const char          *repository,
+                             const char          *ref,
+                             const char          *rev,
+                             FlatpakPullFlags     flatpak_flags,
+                             OstreeAsyncProgress *progress,
+                             GCancellable        *cancellable,
+                             GError             **error)
+{
+  g_autoptr(GVariant) extra_data_sources = NULL;
+  g_autoptr(GVariant) detached_metadata = NULL;
+  g_auto(GVariantDict) new_metadata_dict = FLATPAK_VARIANT_DICT_INITIALIZER;
+  g_autoptr(GVariantBuilder) extra_data_builder = NULL;
+  g_autoptr(GVariant) new_detached_metadata = NULL;
+  g_autoptr(GVariant) extra_data = NULL;
+  g_autoptr(GFile) base_dir = NULL;
+  guint i;
+  gsize n_extra_data;
+  g_autoptr(GPtrArray) downloads = NULL;
+  g_autoptr(GMainContext) context = NULL;
+  ExtraDataProgress extra_data_progress = { NULL };
+  gboolean embed_extra_data;
+
+  extra_data_sources = flatpak_repo_get_extra_data_sources (repo, rev, cancellable, NULL);
+  if (extra_data_sources == NULL)
+    return TRUE;
+
+  n_extra_data = g_variant_n_children (extra_data_sources);
+  if (n_extra_data == 0)
+    return TRUE;
+
+  if ((flatpak_flags & FLATPAK_PULL_FLAGS_DOWNLOAD_EXTRA_DATA) == 0)
+    return flatpak_fail_error (error, FLATPAK_ERROR_UNTRUSTED, _("Extra data not supported for non-gpg-verified local system installs"));
+
+  /* When pulling into another repo (such as the child repo for the system
+   * helper) the data has to be in the commitmeta */
+  embed_extra_data = (flatpak_flags & FLATPAK_PULL_FLAGS_SIDELOAD_EXTRA_DATA) != 0 || repo != self->repo;
+
+  extra_data_builder = g_variant_builder_new (G_VARIANT_TYPE ("a(ayay)"));
+
+  /* Other fields were already set in flatpak_dir_setup_extra_data() */
+  if (progress)
+    {
+      ostree_async_progress_set (progress,
+                                 "start-time-extra-data", "t", g_get_monotonic_time (),
+                                 "downloading-extra-data", "u", 1,
+                                 NULL);
+    }
+
+  downloads = g_ptr_array_new_with_free_func ((GDestroyNotify) extra_data_download_free);
+  extra_data_progress.progress = progress;
+  extra_data_progress.downloads = downloads;
+
+  base_dir = flatpak_get_user_base_dir_location ();
+
+  for (i = 0; i < n_extra_data; i++)
+    {
+      const char *extra_data_uri = NULL;
+      g_autofree char *extra_data_sha256 = NULL;
+      const char *extra_data_name = NULL;
+      guint64 download_size;
+      guint64 installed_size;
+      const guchar *sha256_bytes;
+      g_autoptr(GFile) extra_local_file = NULL;
+      ExtraDataDownload *download;
+
+      flatpak_repo_parse_extra_data_sources (extra_data_sources, i,
+                                             &extra_data_name,
+                                             &download_size,
+                                             &installed_size,
                                              &sha256_bytes,
                                              &extra_data_uri);
 
@@ -5082,66 +5772,90 @@ flatpak_dir_pull_extra_data (FlatpakDir          *self,
           return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Unsupported extra data uri %s"), extra_data_uri);
         }
 
-      /* TODO: Download to disk to support resumed downloads on error */
-
-      extra_local_file = flatpak_build_file (base_dir, "extra-data", extra_data_sha256, extra_data_name, NULL);
-      if (g_file_query_exists (extra_local_file, cancellable))
+      /* The same file may be listed under several names, they all use
+       * the same download, and the same .partial file */
+      download = find_extra_data_download (downloads, extra_data_sha256);
+      if (download != NULL)
         {
-          g_debug ("Loading extra-data from local file %s", flatpak_file_get_path_cached (extra_local_file));
-          gsize extra_local_size;
-          g_autofree char *extra_local_contents = NULL;
-          g_autoptr(GError) my_error = NULL;
-
-          if (!g_file_load_contents (extra_local_file, cancellable, &extra_local_contents, &extra_local_size, NULL, &my_error))
-            return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Failed to load local extra-data %s: %s"),
-                                       flatpak_file_get_path_cached (extra_local_file), my_error->message);
-          if (extra_local_size != download_size)
-            return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Wrong size for extra-data %s"), flatpak_file_get_path_cached (extra_local_file));
+          if (download->download_size != download_size)
+            {
+              reset_async_progress_extra_data (progress);
+              return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Wrong size for extra data %s"), extra_data_uri);
+            }
 
-          bytes = g_bytes_new (extra_local_contents, extra_local_size);
-        }
-      else
-        {
-          ensure_soup_session (self);
-          bytes = flatpak_load_http_uri (self->soup_session, extra_data_uri, 0,
-                                         extra_data_progress_report, &extra_data_progress,
-                                         cancellable, error);
+          g_ptr_array_add (download->names, (char *) extra_data_name);
+          continue;
         }
 
-      if (bytes == NULL)
+      extra_local_file = flatpak_build_file (base_dir, "extra-data", extra_data_sha256, extra_data_name, NULL);
+      if (!g_file_query_exists (extra_local_file, cancellable))
+        g_clear_object (&extra_local_file);
+
+      if (flatpak_dir_prepare_extra_data_download (self, repo, extra_data_name, extra_data_uri,
+                                                   extra_local_file, extra_data_sha256, download_size,
+                                                   &extra_data_progress, cancellable, error) == NULL)
         {
           reset_async_progress_extra_data (progress);
           g_prefix_error (error, _("While downloading %s: "), extra_data_uri);
           return FALSE;
         }
+    }
+
+  /* Fetch everything that is missing at once */
+  for (i = 0; i < downloads->len; i++)
+    {
+      ExtraDataDownload *download = g_ptr_array_index (downloads, i);
 
-      if (g_bytes_get_size (bytes) != download_size)
+      if (download->offset < download->download_size)
         {
-          reset_async_progress_extra_data (progress);
-          return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Wrong size for extra data %s"), extra_data_uri);
+          extra_data_progress.n_running++;
+          extra_data_download_start (download);
         }
+    }
+
+  if (progress)
+    ostree_async_progress_set_uint64 (progress, "outstanding-extra-data", extra_data_progress.n_running);
 
-      extra_data_progress.previous_dl += download_size;
-      if (progress)
-        ostree_async_progress_set_uint64 (progress, "outstanding-extra-data", n_extra_data - i - 1);
+  context = g_main_context_ref_thread_default ();
+  while (extra_data_progress.n_running > 0)
+    g_main_context_iteration (context, TRUE);
 
-      sha256 = g_compute_checksum_for_bytes (G_CHECKSUM_SHA256, bytes);
-      if (strcmp (sha256, extra_data_sha256) != 0)
+  for (i = 0; i < downloads->len; i++)
+    {
+      ExtraDataDownload *download = g_ptr_array_index (downloads, i);
+      g_autoptr(GMappedFile) mfile = NULL;
+
+      mfile = extra_data_download_finish (download, error);
+      if (mfile == NULL)
         {
           reset_async_progress_extra_data (progress);
-          return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Invalid checksum for extra data %s"), extra_data_uri);
+          g_prefix_error (error, _("While downloading %s: "), download->uri);
+          return FALSE;
         }
 
-      g_variant_builder_add (extra_data_builder,
-                             "(^ay@ay)",
-                             extra_data_name,
-                             g_variant_new_from_bytes (G_VARIANT_TYPE ("ay"), bytes, TRUE));
+      /* The data was verified while downloading. Unless it needs to travel
+       * along with the commit, extract_extra_data() picks it up from the
+       * cache, so we don't have to put it all in the commitmeta. */
+      if (embed_extra_data)
+        {
+          g_autoptr(GBytes) bytes = g_mapped_file_get_bytes (mfile);
+          guint j;
+
+          for (j = 0; j < download->names->len; j++)
+            g_variant_builder_add (extra_data_builder,
+                                   "(^ay@ay)",
+                                   (const char *) g_ptr_array_index (download->names, j),
+                                   g_variant_new_from_bytes (G_VARIANT_TYPE ("ay"), bytes, TRUE));
+        }
     }
 
-  extra_data = g_variant_ref_sink (g_variant_builder_end (extra_data_builder));
-
   reset_async_progress_extra_data (progress);
 
+  if (!embed_extra_data)
+    return TRUE;
+
+  extra_data = g_variant_ref_sink (g_variant_builder_end (extra_data_builder));
+
   if (!ostree_repo_read_commit_detached_metadata (repo, rev, &detached_metadata,
                                                   cancellable, error))
     return FALSE;
@@ -5656,6 +6370,39 @@ out:
   return ret;
 }
 
+/* Pulls @commit of @ref into the repo of @self without deploying it, so
+ * that it can later be deployed with no_pull. Neither the FlatpakDir nor
+ * its OstreeRepo can be shared between threads, so to pull from several
+ * threads at the same time each of them needs its own flatpak_dir_clone().
+ * This is not supported for installations that go via the system helper. */
+gboolean
+flatpak_dir_pull_for_deploy (FlatpakDir          *self,
+                             FlatpakRemoteState  *state,
+                             const char          *ref,
+                             const char          *commit,
+                             const char         **subpaths,
+                             const char          *token,
+                             gboolean             no_static_deltas,
+                             gboolean             allow_downgrade,
+                             OstreeAsyncProgress *progress,
+                             GCancellable        *cancellable,
+                             GError             **error)
+{
+  FlatpakPullFlags flatpak_flags;
+
+  g_return_val_if_fail (!flatpak_dir_use_system_helper (self, NULL), FALSE);
+
+  flatpak_flags = FLATPAK_PULL_FLAGS_DOWNLOAD_EXTRA_DATA;
+  if (no_static_deltas)
+    flatpak_flags |= FLATPAK_PULL_FLAGS_NO_STATIC_DELTAS;
+  if (allow_downgrade)
+    flatpak_flags |= FLATPAK_PULL_FLAGS_ALLOW_DOWNGRADE;
+
+  return flatpak_dir_pull (self, state, ref, commit, NULL, subpaths, token, NULL,
+                           flatpak_flags, OSTREE_REPO_PULL_FLAGS_NONE,
+                           progress, cancellable, error);
+}
+
 static gboolean
 repo_pull_local_untrusted (FlatpakDir          *self,
                            OstreeRepo          *repo,
@@ -5747,6 +6494,7 @@ flatpak_dir_pull_untrusted_local (FlatpakDir          *self,
                                   const char          *remote_name,
                                   const char          *ref,
                                   const char         **subpaths,
+                                  gboolean             src_is_private,
                                   OstreeAsyncProgress *progress,
                                   GCancellable        *cancellable,
                                   GError             **error)
@@ -5948,6 +6696,24 @@ flatpak_dir_pull_untrusted_local (FlatpakDir          *self,
 
   /* Past this we must use goto out, so we abort the transaction on error */
 
+  /* If nobody else can write to src_path anymore, we can verify the objects
+   * there and link or reflink them into our transaction, rather than have
+   * the untrusted pull below write each one again */
+  if (src_is_private && subdirs_arg == NULL &&
+      ostree_repo_get_mode (self->repo) == OSTREE_REPO_MODE_BARE_USER_ONLY &&
+      ostree_repo_get_mode (src_repo) == OSTREE_REPO_MODE_BARE_USER_ONLY)
+    {
+      guint64 linked_size, copied_size;
+
+      if (!flatpak_repo_import_verified_objects (self->repo, src_repo, checksum,
+                                                 &linked_size, &copied_size,
+                                                 cancellable, error))
+        goto out;
+
+      g_debug ("Imported %s from %s: %" G_GUINT64_FORMAT " bytes linked, %" G_GUINT64_FORMAT " bytes copied",
+               ref, src_path, linked_size, copied_size);
+    }
+
   if (!repo_pull_local_untrusted (self, self->repo, remote_name, url,
                                   subdirs_arg ? (const char **) subdirs_arg->pdata : NULL,
                                   ref, checksum, progress,
@@ -6407,28 +7173,367 @@ flatpak_dir_set_active (FlatpakDir   *self,
         }
     }
 
+  update_deploy_index (self, ref, cancellable);
+
   ret = TRUE;
 out:
   return ret;
 }
 
-gboolean
-flatpak_dir_run_triggers (FlatpakDir   *self,
-                          GCancellable *cancellable,
-                          GError      **error)
+/* Triggers list the directories they read, the files they generate and
+ * the host files and programs they rely on with lines like
+ *   # flatpak-trigger-input: exports/share/applications
+ *   # flatpak-trigger-output: exports/share/applications/mimeinfo.cache
+ *   # flatpak-trigger-host: update-desktop-database
+ * where inputs and outputs are relative to the installation, and host
+ * entries are either absolute paths or programs looked up in PATH.
+ * A trigger is skipped if the state of all of these and the trigger
+ * itself is the same as the last time it ran successfully. Triggers
+ * without inputs always run, one at a time, as nothing is known about
+ * what they touch. */
+#define TRIGGER_INPUT_PREFIX "# flatpak-trigger-input: "
+#define TRIGGER_OUTPUT_PREFIX "# flatpak-trigger-output: "
+#define TRIGGER_HOST_PREFIX "# flatpak-trigger-host: "
+#define TRIGGER_STATE_FILE ".trigger-state"
+
+typedef struct
 {
-  gboolean ret = FALSE;
-  g_autoptr(GFileEnumerator) dir_enum = NULL;
-  g_autoptr(GFileInfo) child_info = NULL;
-  g_autoptr(GFile) triggersdir = NULL;
-  GError *temp_error = NULL;
-  const char *triggerspath;
+  char         *name;
+  char         *path;
+  GPtrArray    *inputs;
+  GPtrArray    *outputs;
+  GPtrArray    *host;
+  char         *inputs_checksum;
+  FlatpakBwrap *bwrap;
+  GPid          pid;
+} Trigger;
 
-  if (flatpak_dir_use_system_helper (self, NULL))
-    {
-      const char *installation = flatpak_dir_get_id (self);
+static void
+trigger_free (Trigger *trigger)
+{
+  g_free (trigger->name);
+  g_free (trigger->path);
+  g_ptr_array_unref (trigger->inputs);
+  g_ptr_array_unref (trigger->outputs);
+  g_ptr_array_unref (trigger->host);
+  g_free (trigger->inputs_checksum);
+  g_clear_pointer (&trigger->bwrap, flatpak_bwrap_free);
+  g_free (trigger);
+}
 
-      if (!flatpak_dir_system_helper_call_run_triggers (self,
+static Trigger *
+trigger_new (const char *name,
+             const char *path)
+{
+  Trigger *trigger = g_new0 (Trigger, 1);
+  g_autofree char *contents = NULL;
+  g_auto(GStrv) lines = NULL;
+  int i;
+
+  trigger->name = g_strdup (name);
+  trigger->path = g_strdup (path);
+  trigger->inputs = g_ptr_array_new_with_free_func (g_free);
+  trigger->outputs = g_ptr_array_new_with_free_func (g_free);
+  trigger->host = g_ptr_array_new_with_free_func (g_free);
+
+  if (!g_file_get_contents (path, &contents, NULL, NULL))
+    return trigger;
+
+  lines = g_strsplit (contents, "\n", -1);
+  for (i = 0; lines[i] != NULL; i++)
+    {
+      if (g_str_has_prefix (lines[i], TRIGGER_INPUT_PREFIX))
+        g_ptr_array_add (trigger->inputs, g_strdup (lines[i] + strlen (TRIGGER_INPUT_PREFIX)));
+      else if (g_str_has_prefix (lines[i], TRIGGER_OUTPUT_PREFIX))
+        g_ptr_array_add (trigger->outputs, g_strdup (lines[i] + strlen (TRIGGER_OUTPUT_PREFIX)));
+      else if (g_str_has_prefix (lines[i], TRIGGER_HOST_PREFIX))
+        g_ptr_array_add (trigger->host, g_strdup (lines[i] + strlen (TRIGGER_HOST_PREFIX)));
+    }
+
+  return trigger;
+}
+
+static int
+compare_strings (gconstpointer a,
+                 gconstpointer b)
+{
+  return strcmp (*(const char **) a, *(const char **) b);
+}
+
+static void
+checksum_stat (GChecksum   *checksum,
+               const char  *prefix,
+               const char  *name,
+               int          res,
+               struct stat *stbuf)
+{
+  g_autofree char *line = NULL;
+
+  if (res != 0)
+    line = g_strdup_printf ("%s %s missing\n", prefix, name);
+  else
+    line = g_strdup_printf ("%s %s %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GINT64_FORMAT " %" G_GINT64_FORMAT ".%ld\n",
+                            prefix, name,
+                            (guint64) stbuf->st_dev, (guint64) stbuf->st_ino,
+                            (gint64) stbuf->st_size,
+                            (gint64) stbuf->st_mtim.tv_sec, (long) stbuf->st_mtim.tv_nsec);
+  g_checksum_update (checksum, (guchar *) line, -1);
+}
+
+/* The exported files are symlinks into the deploys, while the regular
+ * files are generated by the triggers themselves, so only the former
+ * are considered. The symlinks go via the active link, so the target
+ * is stat()ed to notice updates. */
+static void
+checksum_trigger_input (GChecksum  *checksum,
+                        int         dfd,
+                        const char *path)
+{
+  g_auto(GLnxDirFdIterator) iter = { 0 };
+  g_autoptr(GPtrArray) names = g_ptr_array_new_with_free_func (g_free);
+  struct dirent *dent;
+  guint i;
+
+  if (!glnx_dirfd_iterator_init_at (dfd, path, FALSE, &iter, NULL))
+    {
+      g_checksum_update (checksum, (guchar *) "missing\n", -1);
+      return;
+    }
+
+  while (glnx_dirfd_iterator_next_dent (&iter, &dent, NULL, NULL) && dent != NULL)
+    g_ptr_array_add (names, g_strdup (dent->d_name));
+
+  g_ptr_array_sort (names, compare_strings);
+
+  for (i = 0; i < names->len; i++)
+    {
+      const char *name = g_ptr_array_index (names, i);
+      struct stat stbuf;
+
+      if (fstatat (iter.fd, name, &stbuf, AT_SYMLINK_NOFOLLOW) != 0)
+        continue;
+
+      if (S_ISDIR (stbuf.st_mode))
+        {
+          g_autofree char *line = g_strdup_printf ("d %s\n", name);
+
+          g_checksum_update (checksum, (guchar *) line, -1);
+          checksum_trigger_input (checksum, iter.fd, name);
+          g_checksum_update (checksum, (guchar *) "\n", -1);
+        }
+      else if (S_ISLNK (stbuf.st_mode))
+        {
+          g_autofree char *target = glnx_readlinkat_malloc (iter.fd, name, NULL, NULL);
+          g_autofree char *line = g_strdup_printf ("%s %s", name, target ? target : "");
+          int res = fstatat (iter.fd, name, &stbuf, 0);
+
+          checksum_stat (checksum, "l", line, res, &stbuf);
+        }
+    }
+}
+
+/* Covers everything that decides what a trigger generates: the trigger
+ * itself, its inputs and the host programs and files it uses. Returns
+ * NULL for triggers that don't declare their inputs. */
+static char *
+calculate_trigger_inputs_checksum (int      basedir_dfd,
+                                   Trigger *trigger)
+{
+  g_autoptr(GChecksum) checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  struct stat stbuf;
+  guint i;
+
+  if (trigger->inputs->len == 0 ||
+      stat (trigger->path, &stbuf) != 0)
+    return NULL;
+
+  /* Changes to the trigger itself should also cause a rerun */
+  checksum_stat (checksum, "t", trigger->name, 0, &stbuf);
+
+  for (i = 0; i < trigger->inputs->len; i++)
+    {
+      const char *input = g_ptr_array_index (trigger->inputs, i);
+
+      g_checksum_update (checksum, (guchar *) input, -1);
+      g_checksum_update (checksum, (guchar *) "\n", -1);
+      checksum_trigger_input (checksum, basedir_dfd, input);
+    }
+
+  /* The triggers only do anything if the tools they run are installed,
+     so installing or updating one of them needs a rerun */
+  for (i = 0; i < trigger->host->len; i++)
+    {
+      const char *host = g_ptr_array_index (trigger->host, i);
+      g_autofree char *host_path = NULL;
+      int res = -1;
+
+      if (g_path_is_absolute (host))
+        host_path = g_strdup (host);
+      else
+        host_path = g_find_program_in_path (host);
+
+      if (host_path != NULL)
+        res = stat (host_path, &stbuf);
+
+      checksum_stat (checksum, "h", host_path ? host_path : host, res, &stbuf);
+    }
+
+  return g_strdup (g_checksum_get_string (checksum));
+}
+
+/* The generated files can be removed or replaced behind our back, so
+ * their state from right after the last successful run is kept too. */
+static char *
+calculate_trigger_outputs_checksum (int      basedir_dfd,
+                                    Trigger *trigger)
+{
+  g_autoptr(GChecksum) checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  guint i;
+
+  for (i = 0; i < trigger->outputs->len; i++)
+    {
+      const char *output = g_ptr_array_index (trigger->outputs, i);
+      struct stat stbuf;
+      int res;
+
+      res = fstatat (basedir_dfd, output, &stbuf, AT_SYMLINK_NOFOLLOW);
+      checksum_stat (checksum, "o", output, res, &stbuf);
+    }
+
+  return g_strdup (g_checksum_get_string (checksum));
+}
+
+static gboolean
+trigger_is_unchanged (int       basedir_dfd,
+                      Trigger  *trigger,
+                      GKeyFile *state)
+{
+  g_autofree char *last_inputs = NULL;
+  g_autofree char *last_outputs = NULL;
+  g_autofree char *outputs_checksum = NULL;
+
+  if (trigger->inputs_checksum == NULL)
+    return FALSE;
+
+  last_inputs = g_key_file_get_string (state, trigger->name, "inputs", NULL);
+  if (g_strcmp0 (trigger->inputs_checksum, last_inputs) != 0)
+    return FALSE;
+
+  last_outputs = g_key_file_get_string (state, trigger->name, "outputs", NULL);
+  outputs_checksum = calculate_trigger_outputs_checksum (basedir_dfd, trigger);
+
+  return g_strcmp0 (outputs_checksum, last_outputs) == 0;
+}
+
+static void
+spawn_trigger (Trigger    *trigger,
+               const char *basedir)
+{
+  g_autofree char *commandline = NULL;
+  g_autoptr(GError) trigger_error = NULL;
+
+  g_debug ("running trigger %s", trigger->name);
+
+  trigger->bwrap = flatpak_bwrap_new (NULL);
+
+#ifndef DISABLE_SANDBOXED_TRIGGERS
+  flatpak_bwrap_add_arg (trigger->bwrap, flatpak_get_bwrap ());
+  flatpak_bwrap_add_args (trigger->bwrap,
+                          "--unshare-ipc",
+                          "--unshare-net",
+                          "--unshare-pid",
+                          "--ro-bind", "/", "/",
+                          "--proc", "/proc",
+                          "--dev", "/dev",
+                          "--bind", basedir, basedir,
+                          NULL);
+#endif
+  flatpak_bwrap_add_args (trigger->bwrap,
+                          trigger->path,
+                          basedir,
+                          NULL);
+  flatpak_bwrap_finish (trigger->bwrap);
+
+  commandline = flatpak_quote_argv ((const char **) trigger->bwrap->argv->pdata, -1);
+  g_debug ("Running '%s'", commandline);
+
+  /* We use LEAVE_DESCRIPTORS_OPEN to work around dead-lock, see flatpak_close_fds_workaround */
+  if (!g_spawn_async ("/",
+                      (char **) trigger->bwrap->argv->pdata,
+                      NULL,
+                      G_SPAWN_SEARCH_PATH | G_SPAWN_LEAVE_DESCRIPTORS_OPEN | G_SPAWN_DO_NOT_REAP_CHILD,
+                      flatpak_bwrap_child_setup_cb, trigger->bwrap->fds,
+                      &trigger->pid, &trigger_error))
+    g_warning ("Error running trigger %s: %s", trigger->name, trigger_error->message);
+}
+
+/* Waits for the trigger and records the state it left behind. Returns
+ * whether the saved state needs to be written out. */
+static gboolean
+finish_trigger (Trigger  *trigger,
+                int       basedir_dfd,
+                GKeyFile *state)
+{
+  g_autoptr(GError) trigger_error = NULL;
+  g_autofree char *outputs_checksum = NULL;
+  int status;
+  pid_t r;
+
+  if (trigger->pid == 0)
+    return FALSE;
+
+  do
+    r = waitpid (trigger->pid, &status, 0);
+  while (G_UNLIKELY (r == -1 && errno == EINTR));
+
+  g_spawn_close_pid (trigger->pid);
+  trigger->pid = 0;
+
+  if (r == -1)
+    glnx_throw_errno_prefix (&trigger_error, "waitpid");
+  else
+    g_spawn_check_exit_status (status, &trigger_error);
+
+  if (trigger_error != NULL)
+    {
+      g_debug ("Trigger %s failed: %s", trigger->name, trigger_error->message);
+      return g_key_file_remove_group (state, trigger->name, NULL);
+    }
+
+  if (trigger->inputs_checksum == NULL)
+    return FALSE;
+
+  outputs_checksum = calculate_trigger_outputs_checksum (basedir_dfd, trigger);
+  g_key_file_set_string (state, trigger->name, "inputs", trigger->inputs_checksum);
+  g_key_file_set_string (state, trigger->name, "outputs", outputs_checksum);
+
+  return TRUE;
+}
+
+gboolean
+flatpak_dir_run_triggers (FlatpakDir   *self,
+                          GCancellable *cancellable,
+                          GError      **error)
+{
+  g_autoptr(GFileEnumerator) dir_enum = NULL;
+  g_autoptr(GFileInfo) child_info = NULL;
+  g_autoptr(GFile) triggersdir = NULL;
+  g_autoptr(GPtrArray) triggers = NULL;
+  g_autoptr(GKeyFile) state = g_key_file_new ();
+  g_autofree char *state_path = NULL;
+  g_autofree char *basedir_orig = NULL;
+  g_autofree char *basedir = NULL;
+  glnx_autofd int basedir_dfd = -1;
+  gboolean state_changed = FALSE;
+  GError *temp_error = NULL;
+  const char *triggerspath;
+  guint i;
+
+  if (flatpak_dir_use_system_helper (self, NULL))
+    {
+      const char *installation = flatpak_dir_get_id (self);
+
+      if (!flatpak_dir_system_helper_call_run_triggers (self,
                                                         FLATPAK_HELPER_RUN_TRIGGERS_FLAGS_NONE,
                                                         installation ? installation : "",
                                                         cancellable,
@@ -6446,16 +7551,31 @@ flatpak_dir_run_triggers (FlatpakDir   *self,
 
   triggersdir = g_file_new_for_path (triggerspath);
 
+  /* We need to canonicalize the basedir, because if has a symlink
+     somewhere the bind mount will be on the target of that, not
+     at that exact path. */
+  basedir_orig = g_file_get_path (self->basedir);
+  basedir = realpath (basedir_orig, NULL);
+  if (basedir == NULL)
+    return glnx_throw_errno_prefix (error, "realpath %s", basedir_orig);
+
+  if (!glnx_opendirat (AT_FDCWD, basedir, TRUE, &basedir_dfd, error))
+    return FALSE;
+
+  state_path = g_build_filename (basedir, TRIGGER_STATE_FILE, NULL);
+  g_key_file_load_from_file (state, state_path, G_KEY_FILE_NONE, NULL);
+
   dir_enum = g_file_enumerate_children (triggersdir, "standard::type,standard::name",
                                         0, cancellable, error);
   if (!dir_enum)
-    goto out;
+    return FALSE;
+
+  triggers = g_ptr_array_new_with_free_func ((GDestroyNotify) trigger_free);
 
   while ((child_info = g_file_enumerator_next_file (dir_enum, cancellable, &temp_error)) != NULL)
     {
       g_autoptr(GFile) child = NULL;
       const char *name;
-      GError *trigger_error = NULL;
 
       name = g_file_info_get_name (child_info);
 
@@ -6464,53 +7584,18 @@ flatpak_dir_run_triggers (FlatpakDir   *self,
       if (g_file_info_get_file_type (child_info) == G_FILE_TYPE_REGULAR &&
           g_str_has_suffix (name, ".trigger"))
         {
-          g_autoptr(GPtrArray) argv_array = NULL;
-          /* We need to canonicalize the basedir, because if has a symlink
-             somewhere the bind mount will be on the target of that, not
-             at that exact path. */
-          g_autofree char *basedir_orig = g_file_get_path (self->basedir);
-          g_autofree char *basedir = realpath (basedir_orig, NULL);
-          g_autoptr(FlatpakBwrap) bwrap = NULL;
-          g_autofree char *commandline = NULL;
-
-          g_debug ("running trigger %s", name);
+          g_autofree char *path = g_file_get_path (child);
+          Trigger *trigger = trigger_new (name, path);
 
-          bwrap = flatpak_bwrap_new (NULL);
+          trigger->inputs_checksum = calculate_trigger_inputs_checksum (basedir_dfd, trigger);
 
-          argv_array = g_ptr_array_new_with_free_func (g_free);
-#ifndef DISABLE_SANDBOXED_TRIGGERS
-          flatpak_bwrap_add_arg (bwrap, flatpak_get_bwrap ());
-          flatpak_bwrap_add_args (bwrap,
-                                  "--unshare-ipc",
-                                  "--unshare-net",
-                                  "--unshare-pid",
-                                  "--ro-bind", "/", "/",
-                                  "--proc", "/proc",
-                                  "--dev", "/dev",
-                                  "--bind", basedir, basedir,
-                                  NULL);
-#endif
-          flatpak_bwrap_add_args (bwrap,
-                                  flatpak_file_get_path_cached (child),
-                                  basedir,
-                                  NULL);
-          flatpak_bwrap_finish (bwrap);
-
-          commandline = flatpak_quote_argv ((const char **) bwrap->argv->pdata, -1);
-          g_debug ("Running '%s'", commandline);
-
-          /* We use LEAVE_DESCRIPTORS_OPEN to work around dead-lock, see flatpak_close_fds_workaround */
-          if (!g_spawn_sync ("/",
-                             (char **) bwrap->argv->pdata,
-                             NULL,
-                             G_SPAWN_SEARCH_PATH | G_SPAWN_LEAVE_DESCRIPTORS_OPEN,
-                             flatpak_bwrap_child_setup_cb, bwrap->fds,
-                             NULL, NULL,
-                             NULL, &trigger_error))
+          if (trigger_is_unchanged (basedir_dfd, trigger, state))
             {
-              g_warning ("Error running trigger %s: %s", name, trigger_error->message);
-              g_clear_error (&trigger_error);
+              g_debug ("skipping trigger %s, its inputs and outputs are unchanged", name);
+              trigger_free (trigger);
             }
+          else
+            g_ptr_array_add (triggers, trigger);
         }
 
       g_clear_object (&child_info);
@@ -6519,12 +7604,49 @@ flatpak_dir_run_triggers (FlatpakDir   *self,
   if (temp_error != NULL)
     {
       g_propagate_error (error, temp_error);
-      goto out;
+      return FALSE;
     }
 
-  ret = TRUE;
-out:
-  return ret;
+  /* The triggers that declare their inputs write to separate
+     directories, so they are all started at once and then waited for */
+  for (i = 0; i < triggers->len; i++)
+    {
+      Trigger *trigger = g_ptr_array_index (triggers, i);
+
+      if (trigger->inputs_checksum != NULL)
+        spawn_trigger (trigger, basedir);
+    }
+
+  for (i = 0; i < triggers->len; i++)
+    {
+      Trigger *trigger = g_ptr_array_index (triggers, i);
+
+      if (trigger->inputs_checksum != NULL)
+        state_changed |= finish_trigger (trigger, basedir_dfd, state);
+    }
+
+  /* Nothing is known about what the others touch, so they run one at
+     a time once the rest are done */
+  for (i = 0; i < triggers->len; i++)
+    {
+      Trigger *trigger = g_ptr_array_index (triggers, i);
+
+      if (trigger->inputs_checksum != NULL)
+        continue;
+
+      spawn_trigger (trigger, basedir);
+      state_changed |= finish_trigger (trigger, basedir_dfd, state);
+    }
+
+  if (state_changed)
+    {
+      g_autoptr(GError) local_error = NULL;
+
+      if (!g_key_file_save_to_file (state, state_path, &local_error))
+        g_debug ("Failed to save trigger state: %s", local_error->message);
+    }
+
+  return TRUE;
 }
 
 static gboolean
@@ -7028,6 +8150,228 @@ out:
   return ret;
 }
 
+/* When deploying a new commit of an app, the files in the export dir
+ * that are the same as in the active deploy don't have to be rewritten
+ * again, the already rewritten ones can be copied instead. */
+typedef struct
+{
+  int         old_export_dfd;
+  GHashTable *unchanged; /* Relative paths of unchanged files and dirs, "" is the whole tree */
+} ExportReuse;
+
+static void
+export_reuse_free (ExportReuse *reuse)
+{
+  glnx_close_fd (&reuse->old_export_dfd);
+  g_hash_table_unref (reuse->unchanged);
+  g_free (reuse);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (ExportReuse, export_reuse_free)
+
+static const char *
+repo_file_get_checksum (GFile *file)
+{
+  OstreeRepoFile *repo_file = OSTREE_REPO_FILE (file);
+
+  if (!ostree_repo_file_ensure_resolved (repo_file, NULL))
+    return NULL;
+
+  if (g_file_query_file_type (file, G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS, NULL) == G_FILE_TYPE_DIRECTORY)
+    return ostree_repo_file_tree_get_contents_checksum (repo_file);
+
+  return ostree_repo_file_get_checksum (repo_file);
+}
+
+static void
+collect_unchanged_exports (GFile      *new_dir,
+                           GFile      *old_dir,
+                           const char *path,
+                           GHashTable *unchanged)
+{
+  g_autoptr(GFileEnumerator) dir_enum = NULL;
+  g_autoptr(GFileInfo) child_info = NULL;
+  const char *new_checksum = repo_file_get_checksum (new_dir);
+  const char *old_checksum = repo_file_get_checksum (old_dir);
+
+  if (new_checksum == NULL || old_checksum == NULL)
+    return;
+
+  if (strcmp (new_checksum, old_checksum) == 0)
+    {
+      g_hash_table_add (unchanged, g_strdup (path));
+      return;
+    }
+
+  dir_enum = g_file_enumerate_children (new_dir, G_FILE_ATTRIBUTE_STANDARD_NAME "," G_FILE_ATTRIBUTE_STANDARD_TYPE,
+                                        G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS, NULL, NULL);
+  if (dir_enum == NULL)
+    return;
+
+  while ((child_info = g_file_enumerator_next_file (dir_enum, NULL, NULL)))
+    {
+      const char *name = g_file_info_get_name (child_info);
+      g_autoptr(GFile) new_child = g_file_get_child (new_dir, name);
+      g_autoptr(GFile) old_child = g_file_get_child (old_dir, name);
+      g_autofree char *child_path = g_build_filename (path, name, NULL);
+      GFileType old_type = g_file_query_file_type (old_child, G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS, NULL);
+
+      if (g_file_info_get_file_type (child_info) == G_FILE_TYPE_DIRECTORY)
+        {
+          if (old_type == G_FILE_TYPE_DIRECTORY)
+            collect_unchanged_exports (new_child, old_child, child_path, unchanged);
+        }
+      else if (g_file_info_get_file_type (child_info) == G_FILE_TYPE_REGULAR &&
+               old_type == G_FILE_TYPE_REGULAR)
+        {
+          const char *new_file_checksum = repo_file_get_checksum (new_child);
+          const char *old_file_checksum = repo_file_get_checksum (old_child);
+
+          if (new_file_checksum != NULL && g_strcmp0 (new_file_checksum, old_file_checksum) == 0)
+            g_hash_table_add (unchanged, g_steal_pointer (&child_path));
+        }
+
+      g_clear_object (&child_info);
+    }
+}
+
+static gboolean
+strv_equal0 (const char * const *a,
+             const char * const *b)
+{
+  gsize i;
+
+  if (a == NULL || b == NULL)
+    return (a == NULL || *a == NULL) && (b == NULL || *b == NULL);
+
+  for (i = 0; a[i] != NULL && b[i] != NULL; i++)
+    if (strcmp (a[i], b[i]) != 0)
+      return FALSE;
+
+  return a[i] == NULL && b[i] == NULL;
+}
+
+/* The rewritten exports depend on the export files of the commit, the
+ * metadata and the previous ids, so the active deploy's rewritten
+ * files can only be reused if the latter two are unchanged */
+static ExportReuse *
+flatpak_dir_get_export_reuse (FlatpakDir         *self,
+                              const char         *ref,
+                              GFile              *new_root,
+                              const char         *metadata_contents,
+                              const char * const *previous_ids,
+                              GCancellable       *cancellable)
+{
+  g_autoptr(GFile) old_deploy_dir = NULL;
+  g_autoptr(GVariant) old_deploy_data = NULL;
+  g_autoptr(GVariant) old_metadata = NULL;
+  const char *old_rewrite_key;
+  g_autoptr(GFile) old_metadata_file = NULL;
+  g_autofree char *old_metadata_contents = NULL;
+  g_autoptr(GFile) old_root = NULL;
+  g_autoptr(GFile) old_export = NULL;
+  g_autoptr(GFile) new_export = NULL;
+  g_autoptr(GFile) old_deploy_export = NULL;
+  g_autoptr(ExportReuse) reuse = NULL;
+
+  old_deploy_dir = flatpak_dir_get_if_deployed (self, ref, NULL, cancellable);
+  if (old_deploy_dir == NULL)
+    return NULL;
+
+  old_deploy_data = flatpak_load_deploy_data (old_deploy_dir, ref, FLATPAK_DEPLOY_VERSION_ANY, cancellable, NULL);
+  if (old_deploy_data == NULL ||
+      !strv_equal0 (flatpak_deploy_data_get_previous_ids (old_deploy_data, NULL), previous_ids))
+    return NULL;
+
+  /* The files may have been rewritten for another flatpak binary, or
+     by a version that rewrote them differently */
+  old_metadata = g_variant_get_child_value (old_deploy_data, 4);
+  if (!g_variant_lookup (old_metadata, "export-rewrite", "&s", &old_rewrite_key) ||
+      strcmp (old_rewrite_key, FLATPAK_EXPORT_REWRITE_KEY) != 0)
+    return NULL;
+
+  old_metadata_file = g_file_get_child (old_deploy_dir, "metadata");
+  if (!g_file_load_contents (old_metadata_file, cancellable, &old_metadata_contents, NULL, NULL, NULL) ||
+      g_strcmp0 (old_metadata_contents, metadata_contents) != 0)
+    return NULL;
+
+  if (!ostree_repo_read_commit (self->repo, flatpak_deploy_data_get_commit (old_deploy_data),
+                                &old_root, NULL, cancellable, NULL))
+    return NULL;
+
+  old_export = g_file_get_child (old_root, "export");
+  new_export = g_file_get_child (new_root, "export");
+  if (!g_file_query_exists (old_export, cancellable) ||
+      !g_file_query_exists (new_export, cancellable))
+    return NULL;
+
+  reuse = g_new0 (ExportReuse, 1);
+  reuse->old_export_dfd = -1;
+  reuse->unchanged = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+  old_deploy_export = g_file_get_child (old_deploy_dir, "export");
+  if (!glnx_opendirat (AT_FDCWD, flatpak_file_get_path_cached (old_deploy_export), TRUE,
+                       &reuse->old_export_dfd, NULL))
+    return NULL;
+
+  collect_unchanged_exports (new_export, old_export, "", reuse->unchanged);
+
+  return g_steal_pointer (&reuse);
+}
+
+static gboolean
+export_reuse_is_unchanged (ExportReuse *reuse,
+                           const char  *path)
+{
+  g_autofree char *parent = g_strdup (path);
+  char *slash;
+
+  while (!g_hash_table_contains (reuse->unchanged, parent))
+    {
+      if (*parent == 0)
+        return FALSE;
+
+      slash = strrchr (parent, '/');
+      if (slash != NULL)
+        *slash = 0;
+      else
+        *parent = 0;
+    }
+
+  return TRUE;
+}
+
+/* Replaces the file with the rewritten version from the active deploy,
+ * if the source is unchanged */
+static gboolean
+reuse_exported_file (ExportReuse  *reuse,
+                     const char   *path,
+                     int           dfd,
+                     const char   *name,
+                     gboolean     *out_reused,
+                     GCancellable *cancellable,
+                     GError      **error)
+{
+  struct stat stbuf;
+
+  *out_reused = FALSE;
+
+  if (reuse == NULL || !export_reuse_is_unchanged (reuse, path))
+    return TRUE;
+
+  if (fstatat (reuse->old_export_dfd, path, &stbuf, AT_SYMLINK_NOFOLLOW) != 0 ||
+      !S_ISREG (stbuf.st_mode))
+    return TRUE;
+
+  if (!glnx_file_copy_at (reuse->old_export_dfd, path, &stbuf, dfd, name,
+                          GLNX_FILE_COPY_OVERWRITE | GLNX_FILE_COPY_NOXATTRS,
+                          cancellable, error))
+    return FALSE;
+
+  *out_reused = TRUE;
+  return TRUE;
+}
+
 static gboolean
 rewrite_export_dir (const char         *app,
                     const char         *branch,
@@ -7035,6 +8379,7 @@ rewrite_export_dir (const char         *app,
                     GKeyFile           *metadata,
                     const char * const *previous_ids,
                     FlatpakContext     *context,
+                    ExportReuse        *reuse,
                     int                 source_parent_fd,
                     const char         *source_name,
                     const char         *source_path,
@@ -7091,7 +8436,7 @@ rewrite_export_dir (const char         *app,
         {
           g_autofree char *path = g_build_filename (source_path, dent->d_name, NULL);
 
-          if (!rewrite_export_dir (app, branch, arch, metadata, previous_ids, context,
+          if (!rewrite_export_dir (app, branch, arch, metadata, previous_ids, context, reuse,
                                    source_iter.fd, dent->d_name,
                                    path, cancellable, error))
             goto out;
@@ -7100,6 +8445,8 @@ rewrite_export_dir (const char         *app,
         {
           g_autofree gchar *name_without_extension = NULL;
           g_autofree gchar *new_name = NULL;
+          g_autofree gchar *path = NULL;
+          gboolean reused;
           int i;
 
           for (i = 0; allowed_extensions[i] != NULL; i++)
@@ -7131,6 +8478,12 @@ rewrite_export_dir (const char         *app,
                 }
             }
 
+          path = g_build_filename (source_path, dent->d_name, NULL);
+          if (!reuse_exported_file (reuse, path, source_iter.fd, dent->d_name, &reused, cancellable, error))
+            goto out;
+          if (reused)
+            continue;
+
           if (g_str_has_suffix (dent->d_name, ".desktop") ||
               g_str_has_suffix (dent->d_name, ".service"))
             {
@@ -7189,6 +8542,7 @@ flatpak_rewrite_export_dir (const char         *app,
                             const char         *arch,
                             GKeyFile           *metadata,
                             const char * const *previous_ids,
+                            ExportReuse        *reuse,
                             GFile              *source,
                             GCancellable       *cancellable,
                             GError            **error)
@@ -7215,7 +8569,7 @@ flatpak_rewrite_export_dir (const char         *app,
     return FALSE;
 
   /* The fds are closed by this call */
-  if (!rewrite_export_dir (app, branch, arch, metadata, previous_ids, context,
+  if (!rewrite_export_dir (app, branch, arch, metadata, previous_ids, context, reuse,
                            parentfd, name, source_path,
                            cancellable, error))
     goto out;
@@ -7227,6 +8581,16 @@ out:
 }
 
 
+static gboolean
+symlink_has_target (int         dfd,
+                    const char *name,
+                    const char *target)
+{
+  g_autofree char *existing = glnx_readlinkat_malloc (dfd, name, NULL, NULL);
+
+  return existing != NULL && strcmp (existing, target) == 0;
+}
+
 static gboolean
 export_dir (int           source_parent_fd,
             const char   *source_name,
@@ -7301,6 +8665,9 @@ export_dir (int           source_parent_fd,
 
           target = g_build_filename (source_symlink_prefix, dent->d_name, NULL);
 
+          if (symlink_has_target (destination_dfd, dent->d_name, target))
+            continue;
+
           for (int count = 0; count < 100; count++)
             {
               glnx_gen_temp_name (symlink_name);
@@ -7370,11 +8737,14 @@ flatpak_export_dir (GFile        *source,
   return TRUE;
 }
 
-gboolean
-flatpak_dir_update_exports (FlatpakDir   *self,
-                            const char   *changed_app,
-                            GCancellable *cancellable,
-                            GError      **error)
+/* Only the links of @changed_app can go stale when its exports are
+ * unchanged, so the scan for dangling links can then be skipped */
+static gboolean
+flatpak_dir_update_exports_full (FlatpakDir   *self,
+                                 const char   *changed_app,
+                                 gboolean      remove_dangling,
+                                 GCancellable *cancellable,
+                                 GError      **error)
 {
   gboolean ret = FALSE;
   g_autoptr(GFile) exports = NULL;
@@ -7410,7 +8780,8 @@ flatpak_dir_update_exports (FlatpakDir   *self,
         }
     }
 
-  if (!flatpak_remove_dangling_symlinks (exports, cancellable, error))
+  if (remove_dangling &&
+      !flatpak_remove_dangling_symlinks (exports, cancellable, error))
     goto out;
 
   ret = TRUE;
@@ -7419,6 +8790,248 @@ out:
   return ret;
 }
 
+gboolean
+flatpak_dir_update_exports (FlatpakDir   *self,
+                            const char   *changed_app,
+                            GCancellable *cancellable,
+                            GError      **error)
+{
+  return flatpak_dir_update_exports_full (self, changed_app, TRUE, cancellable, error);
+}
+
+/* Opens a downloaded extra data file from the cache, verifying it on the
+ * way since the only signed thing is the commit. */
+static gboolean
+open_cached_extra_data (int           cache_dfd,
+                        const char   *sha256,
+                        guint64       download_size,
+                        int          *out_fd,
+                        GCancellable *cancellable,
+                        GError      **error)
+{
+  g_autoptr(GChecksum) checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  glnx_autofd int fd = -1;
+  struct stat st_buf;
+
+  if (!glnx_openat_rdonly (cache_dfd, sha256, FALSE, &fd, error))
+    return FALSE;
+
+  if (!glnx_fstat (fd, &st_buf, error))
+    return FALSE;
+
+  if ((guint64) st_buf.st_size != download_size)
+    return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Wrong size for extra data"));
+
+  if (!checksum_fd_range (fd, 0, download_size, checksum, cancellable, error))
+    return FALSE;
+
+  if (strcmp (g_checksum_get_string (checksum), sha256) != 0)
+    return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Invalid checksum for extra data"));
+
+  *out_fd = glnx_steal_fd (&fd);
+  return TRUE;
+}
+
+/* Copies a downloaded extra data file from the cache into the extra dir.
+ * The cache is kept for redeploying the commit, so this must not be a
+ * hardlink that apply_extra could modify. */
+static gboolean
+extract_cached_extra_data (int           cache_dfd,
+                           const char   *sha256,
+                           guint64       download_size,
+                           int           dest_dfd,
+                           const char   *dest_name,
+                           GCancellable *cancellable,
+                           GError      **error)
+{
+  glnx_autofd int fd = -1;
+  g_autoptr(GOutputStream) out = NULL;
+  g_autoptr(GInputStream) in = NULL;
+  g_auto(GLnxTmpfile) tmpf = { 0, };
+
+  if (!open_cached_extra_data (cache_dfd, sha256, download_size, &fd, cancellable, error))
+    return FALSE;
+
+  if (!glnx_open_tmpfile_linkable_at (dest_dfd, ".", O_WRONLY | O_CLOEXEC, &tmpf, error))
+    return FALSE;
+
+  in = g_unix_input_stream_new (glnx_steal_fd (&fd), TRUE);
+  out = g_unix_output_stream_new (tmpf.fd, FALSE);
+  if (g_output_stream_splice (out, in, G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE,
+                              cancellable, error) < 0)
+    return FALSE;
+
+  if (fchmod (tmpf.fd, 0644) != 0)
+    return glnx_throw_errno_prefix (error, "fchmod");
+
+  return glnx_link_tmpfile_at (&tmpf, GLNX_LINK_TMPFILE_REPLACE,
+                               dest_dfd, dest_name, error);
+}
+
+/* Downloaded extra data is kept in the cache for as long as a commit
+ * that uses it is in the repo. This drops the rest, including leftover
+ * partial downloads. */
+static void
+flatpak_dir_prune_extra_data_cache (FlatpakDir   *self,
+                                    GCancellable *cancellable)
+{
+  g_auto(GLnxDirFdIterator) iter = { 0, };
+  g_autoptr(GHashTable) commits = NULL;
+  g_autoptr(GHashTable) used = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  g_autoptr(GError) local_error = NULL;
+  GHashTableIter hash_iter;
+  gpointer key;
+
+  if (!glnx_dirfd_iterator_init_at (ostree_repo_get_dfd (self->repo), EXTRA_DATA_CACHE_DIR,
+                                    FALSE, &iter, &local_error))
+    return;
+
+  if (!ostree_repo_list_commit_objects_starting_with (self->repo, "", &commits,
+                                                      cancellable, &local_error))
+    {
+      g_debug ("Not pruning extra data: %s", local_error->message);
+      return;
+    }
+
+  g_hash_table_iter_init (&hash_iter, commits);
+  while (g_hash_table_iter_next (&hash_iter, &key, NULL))
+    {
+      const char *checksum;
+      g_autoptr(GVariant) extra_data_sources = NULL;
+      gsize i, n_extra_data_sources;
+
+      ostree_object_name_deserialize (key, &checksum, NULL);
+      extra_data_sources = flatpak_repo_get_extra_data_sources (self->repo, checksum, cancellable, NULL);
+      if (extra_data_sources == NULL)
+        continue;
+
+      n_extra_data_sources = g_variant_n_children (extra_data_sources);
+      for (i = 0; i < n_extra_data_sources; i++)
+        {
+          const guchar *sha256_bytes;
+
+          flatpak_repo_parse_extra_data_sources (extra_data_sources, i,
+                                                 NULL, NULL, NULL, &sha256_bytes, NULL);
+          if (sha256_bytes != NULL)
+            g_hash_table_add (used, ostree_checksum_from_bytes (sha256_bytes));
+        }
+    }
+
+  while (TRUE)
+    {
+      struct dirent *dent;
+      g_autofree char *sha256 = NULL;
+
+      if (!glnx_dirfd_iterator_next_dent (&iter, &dent, cancellable, NULL) || dent == NULL)
+        break;
+
+      if (g_str_has_suffix (dent->d_name, ".partial"))
+        sha256 = g_strndup (dent->d_name, strlen (dent->d_name) - strlen (".partial"));
+      else
+        sha256 = g_strdup (dent->d_name);
+
+      if (g_hash_table_contains (used, sha256))
+        continue;
+
+      /* Leave partial files that are being downloaded to alone */
+      if (g_str_has_suffix (dent->d_name, ".partial"))
+        {
+          glnx_autofd int fd = openat (iter.fd, dent->d_name, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+
+          if (fd == -1 || flock (fd, LOCK_EX | LOCK_NB) != 0)
+            continue;
+        }
+
+      g_debug ("Pruning unused extra data %s", dent->d_name);
+      (void) unlinkat (iter.fd, dent->d_name, 0);
+    }
+}
+
+/* Puts the extra data of @checksum from the cache into its commitmeta,
+ * where it needs to be to copy the commit to another repo, e.g. in
+ * create-usb. Does nothing if it is already there. */
+gboolean
+flatpak_dir_embed_extra_data (FlatpakDir   *self,
+                              const char   *checksum,
+                              GCancellable *cancellable,
+                              GError      **error)
+{
+  g_autoptr(GVariant) extra_data_sources = NULL;
+  g_autoptr(GVariant) detached_metadata = NULL;
+  g_autoptr(GVariant) extra_data = NULL;
+  g_autoptr(GVariant) new_detached_metadata = NULL;
+  g_auto(GVariantDict) new_metadata_dict = FLATPAK_VARIANT_DICT_INITIALIZER;
+  g_auto(GVariantBuilder) extra_data_builder = FLATPAK_VARIANT_BUILDER_INITIALIZER;
+  glnx_autofd int cache_dfd = -1;
+  gsize i, n_extra_data_sources;
+
+  extra_data_sources = flatpak_repo_get_extra_data_sources (self->repo, checksum, cancellable, NULL);
+  if (extra_data_sources == NULL)
+    return TRUE;
+
+  n_extra_data_sources = g_variant_n_children (extra_data_sources);
+  if (n_extra_data_sources == 0)
+    return TRUE;
+
+  if (!ostree_repo_read_commit_detached_metadata (self->repo, checksum, &detached_metadata,
+                                                  cancellable, error))
+    return FALSE;
+
+  if (detached_metadata != NULL)
+    extra_data = g_variant_lookup_value (detached_metadata, "xa.extra-data",
+                                         G_VARIANT_TYPE ("a(ayay)"));
+  if (extra_data != NULL)
+    return TRUE;
+
+  if (!glnx_opendirat (ostree_repo_get_dfd (self->repo), EXTRA_DATA_CACHE_DIR, TRUE, &cache_dfd, error))
+    return FALSE;
+
+  g_variant_builder_init (&extra_data_builder, G_VARIANT_TYPE ("a(ayay)"));
+  for (i = 0; i < n_extra_data_sources; i++)
+    {
+      g_autofree char *extra_data_sha256 = NULL;
+      const guchar *extra_data_sha256_bytes;
+      const char *extra_data_name = NULL;
+      guint64 download_size;
+      glnx_autofd int fd = -1;
+      g_autoptr(GMappedFile) mfile = NULL;
+      g_autoptr(GBytes) bytes = NULL;
+
+      flatpak_repo_parse_extra_data_sources (extra_data_sources, i,
+                                             &extra_data_name,
+                                             &download_size,
+                                             NULL,
+                                             &extra_data_sha256_bytes,
+                                             NULL);
+      if (extra_data_sha256_bytes == NULL)
+        return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Invalid checksum for extra data"));
+
+      extra_data_sha256 = ostree_checksum_from_bytes (extra_data_sha256_bytes);
+
+      if (!open_cached_extra_data (cache_dfd, extra_data_sha256, download_size, &fd, cancellable, error))
+        {
+          g_prefix_error (error, _("While reading extra data file '%s': "), extra_data_name);
+          return FALSE;
+        }
+
+      mfile = g_mapped_file_new_from_fd (fd, FALSE, error);
+      if (mfile == NULL)
+        return FALSE;
+
+      bytes = g_mapped_file_get_bytes (mfile);
+      g_variant_builder_add (&extra_data_builder, "(^ay@ay)", extra_data_name,
+                             g_variant_new_from_bytes (G_VARIANT_TYPE ("ay"), bytes, TRUE));
+    }
+
+  g_variant_dict_init (&new_metadata_dict, detached_metadata);
+  g_variant_dict_insert_value (&new_metadata_dict, "xa.extra-data",
+                               g_variant_builder_end (&extra_data_builder));
+  new_detached_metadata = g_variant_ref_sink (g_variant_dict_end (&new_metadata_dict));
+
+  return ostree_repo_write_commit_detached_metadata (self->repo, checksum, new_detached_metadata,
+                                                     cancellable, error);
+}
+
 static gboolean
 extract_extra_data (FlatpakDir   *self,
                     const char   *checksum,
@@ -7433,6 +9046,9 @@ extract_extra_data (FlatpakDir   *self,
   g_autoptr(GError) local_error = NULL;
   gsize i, n_extra_data = 0;
   gsize n_extra_data_sources;
+  glnx_autofd int cache_dfd = -1;
+  glnx_autofd int extradir_dfd = -1;
+  struct stat st_buf;
 
   extra_data_sources = flatpak_repo_get_extra_data_sources (self->repo, checksum,
                                                             cancellable, &local_error);
@@ -7462,17 +9078,23 @@ extract_extra_data (FlatpakDir   *self,
       return FALSE;
     }
 
-  if (detached_metadata == NULL)
-    return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Extra data missing in detached metadata"));
-
-  extra_data = g_variant_lookup_value (detached_metadata, "xa.extra-data",
-                                       G_VARIANT_TYPE ("a(ayay)"));
-  if (extra_data == NULL)
-    return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Extra data missing in detached metadata"));
+  /* Extra data downloaded directly into this repo is in the cache, and
+   * only extra data pulled from elsewhere is in the commitmeta. */
+  if (detached_metadata != NULL)
+    extra_data = g_variant_lookup_value (detached_metadata, "xa.extra-data",
+                                         G_VARIANT_TYPE ("a(ayay)"));
+  if (extra_data != NULL)
+    n_extra_data = g_variant_n_children (extra_data);
 
-  n_extra_data = g_variant_n_children (extra_data);
-  if (n_extra_data < n_extra_data_sources)
-    return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Extra data missing in detached metadata"));
+  if (!glnx_opendirat (ostree_repo_get_dfd (self->repo), EXTRA_DATA_CACHE_DIR, TRUE, &cache_dfd, &local_error))
+    {
+      if (!g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        {
+          g_propagate_error (error, g_steal_pointer (&local_error));
+          return FALSE;
+        }
+      g_clear_error (&local_error);
+    }
 
   if (!flatpak_mkdir_p (extradir, cancellable, error))
     {
@@ -7480,6 +9102,9 @@ extract_extra_data (FlatpakDir   *self,
       return FALSE;
     }
 
+  if (!glnx_opendirat (AT_FDCWD, flatpak_file_get_path_cached (extradir), TRUE, &extradir_dfd, error))
+    return FALSE;
+
   for (i = 0; i < n_extra_data_sources; i++)
     {
       g_autofree char *extra_data_sha256 = NULL;
@@ -7501,6 +9126,19 @@ extract_extra_data (FlatpakDir   *self,
 
       extra_data_sha256 = ostree_checksum_from_bytes (extra_data_sha256_bytes);
 
+      if (cache_dfd != -1 &&
+          fstatat (cache_dfd, extra_data_sha256, &st_buf, AT_SYMLINK_NOFOLLOW) == 0)
+        {
+          if (!extract_cached_extra_data (cache_dfd, extra_data_sha256, download_size,
+                                          extradir_dfd, extra_data_source_name,
+                                          cancellable, error))
+            {
+              g_prefix_error (error, _("While writing extra data file '%s': "), extra_data_source_name);
+              return FALSE;
+            }
+          continue;
+        }
+
       /* We need to verify the data in the commitmeta again, because the only signed
          thing is the commit, which has the source info. We could have accidentally
          picked up some other commitmeta stuff from the remote, or via the untrusted
@@ -7900,15 +9538,77 @@ flatpak_dir_update_deploy_ref (FlatpakDir *self,
   return TRUE;
 }
 
-gboolean
-flatpak_dir_deploy (FlatpakDir          *self,
-                    const char          *origin,
-                    const char          *ref,
-                    const char          *checksum_or_latest,
-                    const char * const * subpaths,
-                    const char * const * previous_ids,
-                    GCancellable        *cancellable,
-                    GError             **error)
+static void
+ensure_ld_cache_for_ref (FlatpakDir   *self,
+                         const char   *ref,
+                         GCancellable *cancellable)
+{
+  g_autoptr(FlatpakDeploy) deploy = NULL;
+  g_autoptr(GError) local_error = NULL;
+
+  deploy = flatpak_dir_load_deployed (self, ref, NULL, cancellable, &local_error);
+  if (deploy == NULL ||
+      !flatpak_run_ensure_ld_cache (deploy, ref, cancellable, &local_error))
+    g_debug ("Not pre-generating ld.so.cache for %s: %s", ref, local_error->message);
+}
+
+/* Generate the ld.so.caches in the calling user's store for everything
+ * whose cache was invalidated by deploying @ref, so that the next launch
+ * doesn't have to run ldconfig. This is best effort, anything missing is
+ * still generated on demand. It is never done in the system helper, the
+ * client does it once the helper has deployed. */
+static void
+flatpak_dir_pregenerate_ld_caches (FlatpakDir   *self,
+                                   const char   *ref,
+                                   GCancellable *cancellable)
+{
+  g_auto(GStrv) app_refs = NULL;
+  const char *runtime;
+  guint i;
+
+  if (self->no_system_helper)
+    return;
+
+  ensure_ld_cache_for_ref (self, ref, cancellable);
+
+  if (!g_str_has_prefix (ref, "runtime/"))
+    return;
+
+  /* Every app using this runtime needs a new cache too */
+  runtime = ref + strlen ("runtime/");
+  if (!flatpak_dir_list_refs (self, "app", &app_refs, cancellable, NULL))
+    return;
+
+  for (i = 0; app_refs[i] != NULL; i++)
+    {
+      g_autoptr(FlatpakDeploy) app_deploy = NULL;
+      g_autoptr(GKeyFile) metakey = NULL;
+      g_autofree char *app_runtime = NULL;
+
+      app_deploy = flatpak_dir_load_deployed (self, app_refs[i], NULL, cancellable, NULL);
+      if (app_deploy == NULL)
+        continue;
+
+      metakey = flatpak_deploy_get_metadata (app_deploy);
+      app_runtime = g_key_file_get_string (metakey, FLATPAK_METADATA_GROUP_APPLICATION,
+                                           FLATPAK_METADATA_KEY_RUNTIME, NULL);
+      if (g_strcmp0 (app_runtime, runtime) == 0)
+        ensure_ld_cache_for_ref (self, app_refs[i], cancellable);
+    }
+}
+
+/* If @out_exports_unchanged is set, it is set to TRUE if the rewritten
+ * exports are the same as the ones of the previously active deploy */
+static gboolean
+flatpak_dir_deploy_internal (FlatpakDir          *self,
+                             const char          *origin,
+                             const char          *ref,
+                             const char          *checksum_or_latest,
+                             const char * const * subpaths,
+                             const char * const * previous_ids,
+                             gboolean            *out_exports_unchanged,
+                             GCancellable        *cancellable,
+                             GError             **error)
 {
   g_autofree char *resolved_ref = NULL;
   g_autoptr(GFile) root = NULL;
@@ -8012,7 +9712,10 @@ flatpak_dir_deploy (FlatpakDir          *self,
       return FALSE;
     }
 
-  if (!flatpak_repo_collect_sizes (self->repo, root, &installed_size, NULL, cancellable, error))
+  /* The size cache is for repos that are exported from, don't load and
+     rewrite it in an installation, which may be done as root */
+  if (!flatpak_repo_collect_sizes_with_cache (self->repo, root, NULL, &installed_size, NULL,
+                                              cancellable, error))
     return FALSE;
 
   options.mode = OSTREE_REPO_CHECKOUT_MODE_USER;
@@ -8279,11 +9982,18 @@ flatpak_dir_deploy (FlatpakDir          *self,
       g_autofree char *bin_data = NULL;
       int r;
 
+      g_autoptr(ExportReuse) export_reuse = NULL;
+
       if (!flatpak_mkdir_p (bindir, cancellable, error))
         return FALSE;
 
+      export_reuse = flatpak_dir_get_export_reuse (self, ref, root, metadata_contents,
+                                                   previous_ids, cancellable);
+      if (export_reuse != NULL && out_exports_unchanged != NULL)
+        *out_exports_unchanged = g_hash_table_contains (export_reuse->unchanged, "");
+
       if (!flatpak_rewrite_export_dir (ref_parts[1], ref_parts[3], ref_parts[2],
-                                       keyfile, previous_ids, export,
+                                       keyfile, previous_ids, export_reuse, export,
                                        cancellable,
                                        error))
         return FALSE;
@@ -8340,9 +10050,26 @@ flatpak_dir_deploy (FlatpakDir          *self,
   if (!flatpak_dir_update_deploy_ref (self, ref, checksum, error))
     return FALSE;
 
+  flatpak_dir_pregenerate_ld_caches (self, ref, cancellable);
+
   return TRUE;
 }
 
+gboolean
+flatpak_dir_deploy (FlatpakDir          *self,
+                    const char          *origin,
+                    const char          *ref,
+                    const char          *checksum_or_latest,
+                    const char * const * subpaths,
+                    const char * const * previous_ids,
+                    GCancellable        *cancellable,
+                    GError             **error)
+{
+  return flatpak_dir_deploy_internal (self, origin, ref, checksum_or_latest,
+                                      subpaths, previous_ids, NULL,
+                                      cancellable, error);
+}
+
 /* -origin remotes are deleted when the last ref referring to it is undeployed */
 void
 flatpak_dir_prune_origin_remote (FlatpakDir *self,
@@ -8504,6 +10231,7 @@ flatpak_dir_deploy_update (FlatpakDir   *self,
   const char *old_origin;
   g_autofree char *commit = NULL;
   g_auto(GStrv) previous_ids = NULL;
+  gboolean exports_unchanged = FALSE;
 
   if (!flatpak_dir_lock (self, &lock,
                          cancellable, error))
@@ -8526,13 +10254,14 @@ flatpak_dir_deploy_update (FlatpakDir   *self,
       previous_ids = flatpak_strv_merge (old_previous_ids, (char **) opt_previous_ids);
     }
 
-  if (!flatpak_dir_deploy (self,
-                           old_origin,
-                           ref,
-                           checksum_or_latest,
-                           opt_subpaths ? opt_subpaths : old_subpaths,
-                           (const char * const *) previous_ids,
-                           cancellable, error))
+  if (!flatpak_dir_deploy_internal (self,
+                                    old_origin,
+                                    ref,
+                                    checksum_or_latest,
+                                    opt_subpaths ? opt_subpaths : old_subpaths,
+                                    (const char * const *) previous_ids,
+                                    &exports_unchanged,
+                                    cancellable, error))
     return FALSE;
 
   if (old_active &&
@@ -8541,11 +10270,14 @@ flatpak_dir_deploy_update (FlatpakDir   *self,
                              cancellable, error))
     return FALSE;
 
+  /* The export symlinks point into the active deploy, so if the
+     exported files are the same this only puts back missing links */
   if (g_str_has_prefix (ref, "app/"))
     {
       g_auto(GStrv) ref_parts = g_strsplit (ref, "/", -1);
 
-      if (!flatpak_dir_update_exports (self, ref_parts[1], cancellable, error))
+      if (!flatpak_dir_update_exports_full (self, ref_parts[1], !exports_unchanged,
+                                            cancellable, error))
         return FALSE;
     }
 
@@ -9093,6 +10825,9 @@ flatpak_dir_install (FlatpakDir          *self,
       if (child_repo_path && !is_revokefs_pull)
         (void) glnx_shutil_rm_rf_at (AT_FDCWD, child_repo_path, NULL, NULL);
 
+      if (!no_deploy)
+        flatpak_dir_pregenerate_ld_caches (self, ref, cancellable);
+
       return TRUE;
     }
 
@@ -9783,6 +11518,9 @@ flatpak_dir_update (FlatpakDir                           *self,
       if (child_repo_path && !is_revokefs_pull)
         (void) glnx_shutil_rm_rf_at (AT_FDCWD, child_repo_path, NULL, NULL);
 
+      if (!no_deploy)
+        flatpak_dir_pregenerate_ld_caches (self, ref, cancellable);
+
       return TRUE;
     }
 
@@ -10456,11 +12194,137 @@ flatpak_dir_cleanup_removed (FlatpakDir   *self,
       goto out;
     }
 
+  flatpak_dir_gc_ld_caches (self, cancellable, NULL);
+
   ret = TRUE;
 out:
   return ret;
 }
 
+static gboolean
+add_deployed_commits (FlatpakDir   *self,
+                      GHashTable   *commits,
+                      GCancellable *cancellable,
+                      GError      **error)
+{
+  const char *kinds[] = { "app", "runtime" };
+  gsize k;
+  int i, j;
+
+  for (k = 0; k < G_N_ELEMENTS (kinds); k++)
+    {
+      g_auto(GStrv) refs = NULL;
+
+      if (!flatpak_dir_list_refs (self, kinds[k], &refs, cancellable, error))
+        return FALSE;
+
+      for (i = 0; refs[i] != NULL; i++)
+        {
+          g_auto(GStrv) deployed = NULL;
+
+          if (!flatpak_dir_list_deployed (self, refs[i], &deployed, cancellable, error))
+            return FALSE;
+
+          /* Deploy ids are the commit, possibly followed by the subpaths */
+          for (j = 0; deployed[j] != NULL; j++)
+            g_hash_table_add (commits, g_strndup (deployed[j], strcspn (deployed[j], "-")));
+        }
+    }
+
+  return TRUE;
+}
+
+static gboolean
+gc_ld_cache_dir (GFile        *ld_cache_dir,
+                 GHashTable   *live_commits,
+                 GCancellable *cancellable,
+                 GError      **error)
+{
+  g_auto(GLnxDirFdIterator) iter = { 0 };
+  struct dirent *dent;
+
+  if (!glnx_dirfd_iterator_init_at (AT_FDCWD, flatpak_file_get_path_cached (ld_cache_dir),
+                                    FALSE, &iter, error))
+    return FALSE;
+
+  while (TRUE)
+    {
+      g_autofree char *deps = NULL;
+      g_autofree char *checksum = NULL;
+      g_auto(GStrv) commits = NULL;
+      gboolean live = TRUE;
+      int i;
+
+      if (!glnx_dirfd_iterator_next_dent (&iter, &dent, cancellable, error))
+        return FALSE;
+
+      if (dent == NULL)
+        break;
+
+      if (!g_str_has_suffix (dent->d_name, ".deps"))
+        continue;
+
+      /* Each cache lists the commits it was generated from, and is
+         only useful as long as all of them are still deployed */
+      deps = glnx_file_get_contents_utf8_at (iter.fd, dent->d_name, NULL, cancellable, NULL);
+      if (deps != NULL)
+        {
+          commits = g_strsplit (deps, "\n", -1);
+          for (i = 0; live && commits[i] != NULL; i++)
+            {
+              if (*commits[i] != 0 && !g_hash_table_contains (live_commits, commits[i]))
+                live = FALSE;
+            }
+        }
+
+      if (live)
+        continue;
+
+      checksum = g_strndup (dent->d_name, strlen (dent->d_name) - strlen (".deps"));
+      g_debug ("Removing unused ld.so.cache %s", checksum);
+      (void) unlinkat (iter.fd, checksum, 0);
+      (void) unlinkat (iter.fd, dent->d_name, 0);
+    }
+
+  return TRUE;
+}
+
+/* Removes the ld.so.caches in the calling user's store that were
+ * generated for commits that are no longer deployed. As apps can use
+ * runtimes from other installations, this looks at the deploys of all of
+ * them. This runs when uninstalling and pruning, never when launching,
+ * and does nothing in the system helper, which has no store. */
+gboolean
+flatpak_dir_gc_ld_caches (FlatpakDir   *self,
+                          GCancellable *cancellable,
+                          GError      **error)
+{
+  g_autoptr(GHashTable) live_commits = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  g_autoptr(GPtrArray) dirs = NULL;
+  g_autoptr(GFile) ld_cache_dir = NULL;
+  guint i;
+
+  if (self->no_system_helper)
+    return TRUE;
+
+  ld_cache_dir = flatpak_get_user_ld_cache_dir ();
+  if (!g_file_query_exists (ld_cache_dir, cancellable))
+    return TRUE;
+
+  dirs = flatpak_dir_get_system_list (cancellable, error);
+  if (dirs == NULL)
+    return FALSE;
+  g_ptr_array_insert (dirs, 0, flatpak_dir_get_user ());
+
+  for (i = 0; i < dirs->len; i++)
+    {
+      if (!add_deployed_commits (g_ptr_array_index (dirs, i), live_commits, cancellable, error))
+        return FALSE;
+    }
+
+  return gc_ld_cache_dir (ld_cache_dir, live_commits, cancellable, error);
+}
+
 gboolean
 flatpak_dir_prune (FlatpakDir   *self,
                    GCancellable *cancellable,
@@ -10477,6 +12341,8 @@ flatpak_dir_prune (FlatpakDir   *self,
   if (error == NULL)
     error = &local_error;
 
+  flatpak_dir_gc_ld_caches (self, cancellable, NULL);
+
   if (flatpak_dir_use_system_helper (self, NULL))
     {
       const char *installation = flatpak_dir_get_id (self);
@@ -10522,6 +12388,8 @@ flatpak_dir_prune (FlatpakDir   *self,
   formatted_freed_size = g_format_size_full (pruned_object_size_total, 0);
   g_debug ("Pruned %d/%d objects, size %s", objects_total, objects_pruned, formatted_freed_size);
 
+  flatpak_dir_prune_extra_data_cache (self, cancellable);
+
   ret = TRUE;
 
 out:
@@ -10677,9 +12545,9 @@ remote_filter_free (RemoteFilter *remote_filter)
   g_free (remote_filter->checksum);
   g_object_unref (remote_filter->path);
   if (remote_filter->allow)
-    g_regex_unref (remote_filter->allow);
+    flatpak_filter_unref (remote_filter->allow);
   if (remote_filter->deny)
-    g_regex_unref (remote_filter->deny);
+    flatpak_filter_unref (remote_filter->deny);
 
   g_free (remote_filter);
 }
@@ -10692,8 +12560,8 @@ remote_filter_load (GFile *path, GError **error)
   char *data = NULL;
   gsize data_size;
   GTimeVal mtime;
-  g_autoptr(GRegex) allow_refs = NULL;
-  g_autoptr(GRegex) deny_refs = NULL;
+  g_autoptr(FlatpakFilter) allow_refs = NULL;
+  g_autoptr(FlatpakFilter) deny_refs = NULL;
 
   /* Save mtime before loading to avoid races */
   if (!get_mtime (path, &mtime, NULL, error))
@@ -10732,8 +12600,8 @@ flatpak_dir_lookup_remote_filter (FlatpakDir *self,
                                   const char *name,
                                   gboolean    force_load,
                                   char      **checksum_out,
-                                  GRegex    **allow_regex,
-                                  GRegex    **deny_regex,
+                                  FlatpakFilter **allow_filter,
+                                  FlatpakFilter **deny_filter,
                                   GError **error)
 {
   RemoteFilter *filter = NULL;
@@ -10743,8 +12611,8 @@ flatpak_dir_lookup_remote_filter (FlatpakDir *self,
 
   if (checksum_out)
     *checksum_out = NULL;
-  *allow_regex = NULL;
-  *deny_regex = NULL;
+  *allow_filter = NULL;
+  *deny_filter = NULL;
 
   filter_path = flatpak_dir_get_remote_filter (self, name);
 
@@ -10790,9 +12658,9 @@ flatpak_dir_lookup_remote_filter (FlatpakDir *self,
       if (checksum_out)
         *checksum_out = g_strdup (filter->checksum);
       if (filter->allow)
-        *allow_regex = g_regex_ref (filter->allow);
+        *allow_filter = flatpak_filter_ref (filter->allow);
       if (filter->deny)
-        *deny_regex = g_regex_ref (filter->deny);
+        *deny_filter = flatpak_filter_ref (filter->deny);
     }
 
   G_UNLOCK (filters);
@@ -10815,9 +12683,9 @@ flatpak_dir_lookup_remote_filter (FlatpakDir *self,
   if (checksum_out)
     *checksum_out = g_strdup (filter->checksum);
   if (filter->allow)
-    *allow_regex = g_regex_ref (filter->allow);
+    *allow_filter = flatpak_filter_ref (filter->allow);
   if (filter->deny)
-    *deny_regex = g_regex_ref (filter->deny);
+    *deny_filter = flatpak_filter_ref (filter->deny);
 
   G_LOCK (filters);
   g_hash_table_replace (self->remote_filters, g_strdup (name), filter);
@@ -10848,13 +12716,248 @@ cached_summary_new (GBytes     *bytes,
 {
   CachedSummary *summary = g_new0 (CachedSummary, 1);
 
-  summary->bytes = g_bytes_ref (bytes);
-  if (bytes_sig)
-    summary->bytes_sig = g_bytes_ref (bytes_sig);
-  summary->url = g_strdup (url);
-  summary->remote = g_strdup (remote);
-  summary->time = g_get_monotonic_time ();
-  return summary;
+  summary->bytes = g_bytes_ref (bytes);
+  if (bytes_sig)
+    summary->bytes_sig = g_bytes_ref (bytes_sig);
+  summary->url = g_strdup (url);
+  summary->remote = g_strdup (remote);
+  summary->time = g_get_monotonic_time ();
+  return summary;
+}
+
+/* Fetched (and thus verified) summaries of remotes with signed
+ * summaries are also shared between processes, using files in the user
+ * runtime dir. If the summary.sig on the server is still the same, the
+ * shared summary can be used without downloading and verifying the
+ * summary again. The file name is a hash of the repo, the remote name,
+ * url and config, and its keyring, so that any change to the remote
+ * uses a new entry. Each entry has the checksum of the summary, the
+ * summary and its signature. */
+#define SHARED_SUMMARY_CACHE_FORMAT "(s@ay@ay)"
+
+static char *
+flatpak_dir_get_shared_summary_cache_path (FlatpakDir *self,
+                                           const char *name,
+                                           const char *url)
+{
+  g_autoptr(GChecksum) checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  g_autoptr(GKeyFile) config = NULL;
+  g_autofree char *group = NULL;
+  g_autofree char *keyring = NULL;
+  g_autofree char *keyring_info = NULL;
+  g_auto(GStrv) keys = NULL;
+  const char *repo_path = flatpak_file_get_path_cached (ostree_repo_get_path (self->repo));
+  struct stat st_buf;
+  int i;
+
+  g_checksum_update (checksum, (guchar *) repo_path, -1);
+  g_checksum_update (checksum, (guchar *) "\n", 1);
+  g_checksum_update (checksum, (guchar *) name, -1);
+  g_checksum_update (checksum, (guchar *) "\n", 1);
+  g_checksum_update (checksum, (guchar *) url, -1);
+
+  config = ostree_repo_copy_config (self->repo);
+  group = g_strdup_printf ("remote \"%s\"", name);
+  keys = g_key_file_get_keys (config, group, NULL, NULL);
+  for (i = 0; keys != NULL && keys[i] != NULL; i++)
+    {
+      g_autofree char *value = g_key_file_get_value (config, group, keys[i], NULL);
+
+      g_checksum_update (checksum, (guchar *) "\n", 1);
+      g_checksum_update (checksum, (guchar *) keys[i], -1);
+      g_checksum_update (checksum, (guchar *) "=", 1);
+      if (value)
+        g_checksum_update (checksum, (guchar *) value, -1);
+    }
+
+  keyring = g_strdup_printf ("%s/%s.trustedkeys.gpg", repo_path, name);
+  if (stat (keyring, &st_buf) == 0)
+    {
+      keyring_info = g_strdup_printf ("\n%" G_GUINT64_FORMAT ".%ld:%" G_GUINT64_FORMAT,
+                                      (guint64) st_buf.st_mtim.tv_sec, (long) st_buf.st_mtim.tv_nsec,
+                                      (guint64) st_buf.st_size);
+      g_checksum_update (checksum, (guchar *) keyring_info, -1);
+    }
+
+  return g_build_filename (g_get_user_runtime_dir (), ".flatpak-summaries",
+                           g_checksum_get_string (checksum), NULL);
+}
+
+static gboolean
+flatpak_dir_can_share_summary (FlatpakDir *self,
+                               const char *name,
+                               const char *url)
+{
+  gboolean gpg_verify_summary = FALSE;
+
+  if (!g_str_has_prefix (url, "http:") && !g_str_has_prefix (url, "https:"))
+    return FALSE;
+
+  if (flatpak_dir_get_remote_oci (self, name))
+    return FALSE;
+
+  /* Without signatures there is no cheap way to tell if it changed */
+  if (!ostree_repo_remote_get_gpg_verify_summary (self->repo, name, &gpg_verify_summary, NULL))
+    return FALSE;
+
+  return gpg_verify_summary;
+}
+
+/* Looks for a shared summary matching the current summary.sig of the
+ * remote. On a miss, the summary.sig that was fetched is returned in
+ * @remote_sig_out so that the caller doesn't have to fetch it again. */
+static gboolean
+flatpak_dir_lookup_shared_summary (FlatpakDir   *self,
+                                   GBytes      **bytes_out,
+                                   GBytes      **bytes_sig_out,
+                                   GBytes      **remote_sig_out,
+                                   const char   *name,
+                                   const char   *url,
+                                   GCancellable *cancellable)
+{
+  g_autofree char *path = NULL;
+  g_autofree char *sig_url = NULL;
+  g_autoptr(GMappedFile) mfile = NULL;
+  g_autoptr(GBytes) file_bytes = NULL;
+  g_autoptr(GVariant) v = NULL;
+  g_autoptr(GVariant) summary_v = NULL;
+  g_autoptr(GVariant) summary_sig_v = NULL;
+  g_autoptr(GBytes) summary = NULL;
+  g_autoptr(GBytes) summary_sig = NULL;
+  g_autoptr(GBytes) remote_summary_sig = NULL;
+  g_autoptr(GError) local_error = NULL;
+  g_autofree char *summary_checksum = NULL;
+  const char *expected_checksum;
+  struct stat st_buf;
+  glnx_autofd int fd = -1;
+
+  if (!flatpak_dir_can_share_summary (self, name, url))
+    return FALSE;
+
+  path = flatpak_dir_get_shared_summary_cache_path (self, name, url);
+  fd = open (path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+  if (fd == -1)
+    return FALSE;
+
+  /* Only trust entries we wrote ourselves */
+  if (fstat (fd, &st_buf) != 0 || st_buf.st_uid != getuid () || (st_buf.st_mode & 0077) != 0)
+    return FALSE;
+
+  mfile = g_mapped_file_new_from_fd (fd, FALSE, NULL);
+  if (mfile == NULL)
+    return FALSE;
+
+  file_bytes = g_mapped_file_get_bytes (mfile);
+  v = g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE (SHARED_SUMMARY_CACHE_FORMAT), file_bytes, FALSE));
+  g_variant_get (v, "(&s@ay@ay)", &expected_checksum, &summary_v, &summary_sig_v);
+
+  summary = g_variant_get_data_as_bytes (summary_v);
+  summary_sig = g_variant_get_data_as_bytes (summary_sig_v);
+
+  summary_checksum = g_compute_checksum_for_bytes (G_CHECKSUM_SHA256, summary);
+  if (strcmp (summary_checksum, expected_checksum) != 0)
+    return FALSE;
+
+  ensure_soup_session (self);
+
+  sig_url = g_build_path ("/", url, "summary.sig", NULL);
+  remote_summary_sig = flatpak_load_http_uri (self->soup_session, sig_url, 0,
+                                              NULL, NULL, cancellable, &local_error);
+  if (remote_summary_sig == NULL)
+    {
+      g_debug ("Failed to fetch summary.sig for remote %s: %s", name, local_error->message);
+      return FALSE;
+    }
+
+  if (!g_bytes_equal (remote_summary_sig, summary_sig))
+    {
+      *remote_sig_out = g_steal_pointer (&remote_summary_sig);
+      return FALSE;
+    }
+
+  g_debug ("Using shared cached summary for remote %s", name);
+
+  *bytes_out = g_steal_pointer (&summary);
+  if (bytes_sig_out)
+    *bytes_sig_out = g_steal_pointer (&summary_sig);
+
+  return TRUE;
+}
+
+/* Fetches the summary that goes with the already fetched @summary_sig
+ * and verifies it, without fetching the signature again */
+static GBytes *
+flatpak_dir_fetch_summary_for_sig (FlatpakDir   *self,
+                                   GBytes       *summary_sig,
+                                   const char   *name,
+                                   const char   *url,
+                                   GCancellable *cancellable,
+                                   GError      **error)
+{
+  g_autofree char *summary_url = g_build_path ("/", url, "summary", NULL);
+  g_autoptr(GBytes) summary = NULL;
+  g_autoptr(OstreeGpgVerifyResult) gpg_result = NULL;
+
+  ensure_soup_session (self);
+
+  summary = flatpak_load_http_uri (self->soup_session, summary_url, 0,
+                                   NULL, NULL, cancellable, error);
+  if (summary == NULL)
+    return NULL;
+
+  gpg_result = ostree_repo_verify_summary (self->repo, name, summary, summary_sig,
+                                           cancellable, error);
+  if (gpg_result == NULL)
+    return NULL;
+
+  if (ostree_gpg_verify_result_count_valid (gpg_result) == 0)
+    {
+      flatpak_fail_error (error, FLATPAK_ERROR_UNTRUSTED, _("GPG signatures found for remote '%s', but none are in trusted keyring"), name);
+      return NULL;
+    }
+
+  g_debug ("Fetched summary for remote %s matching its summary.sig", name);
+
+  return g_steal_pointer (&summary);
+}
+
+static void
+flatpak_dir_save_shared_summary (FlatpakDir *self,
+                                 GBytes     *bytes,
+                                 GBytes     *bytes_sig,
+                                 const char *name,
+                                 const char *url)
+{
+  g_autofree char *path = NULL;
+  g_autofree char *dir = NULL;
+  g_autofree char *summary_checksum = NULL;
+  g_autoptr(GVariant) v = NULL;
+  g_autoptr(GError) local_error = NULL;
+
+  if (bytes_sig == NULL || !flatpak_dir_can_share_summary (self, name, url))
+    return;
+
+  path = flatpak_dir_get_shared_summary_cache_path (self, name, url);
+  dir = g_path_get_dirname (path);
+  summary_checksum = g_compute_checksum_for_bytes (G_CHECKSUM_SHA256, bytes);
+
+  v = g_variant_ref_sink (g_variant_new (SHARED_SUMMARY_CACHE_FORMAT,
+                                         summary_checksum,
+                                         g_variant_new_from_bytes (G_VARIANT_TYPE_BYTESTRING, bytes, TRUE),
+                                         g_variant_new_from_bytes (G_VARIANT_TYPE_BYTESTRING, bytes_sig, TRUE)));
+
+  if (g_mkdir_with_parents (dir, 0700) != 0)
+    {
+      g_debug ("Failed to create shared summary cache dir: %s", g_strerror (errno));
+      return;
+    }
+
+  if (!glnx_file_replace_contents_with_perms_at (AT_FDCWD, path,
+                                                 g_variant_get_data (v), g_variant_get_size (v),
+                                                 0600, (uid_t) -1, (gid_t) -1,
+                                                 GLNX_FILE_REPLACE_NODATASYNC,
+                                                 NULL, &local_error))
+    g_debug ("Failed to save shared summary cache: %s", local_error->message);
 }
 
 static gboolean
@@ -11032,6 +13135,7 @@ flatpak_dir_remote_fetch_summary (FlatpakDir   *self,
   g_autoptr(GError) local_error = NULL;
   g_autoptr(GBytes) summary = NULL;
   g_autoptr(GBytes) summary_sig = NULL;
+  g_autoptr(GBytes) remote_summary_sig = NULL;
 
   if (!ostree_repo_remote_get_url (self->repo, name_or_uri, &url, error))
     return FALSE;
@@ -11090,11 +13194,37 @@ flatpak_dir_remote_fetch_summary (FlatpakDir   *self,
           if (sig_mfile)
             summary_sig = g_mapped_file_get_bytes (sig_mfile);
         }
-      else if (!ostree_repo_remote_fetch_summary (self->repo, name_or_uri,
-                                                  &summary, &summary_sig,
-                                                  cancellable,
-                                                  error))
-        return FALSE;
+      else if (flatpak_dir_lookup_shared_summary (self, &summary, &summary_sig, &remote_summary_sig,
+                                                  name_or_uri, url, cancellable))
+        ;
+      else
+        {
+          /* The summary.sig was already fetched to check the shared
+           * summary, so only the summary itself is missing. If that
+           * fails, e.g. because the remote was updated in between, let
+           * ostree fetch both again. */
+          if (remote_summary_sig != NULL)
+            {
+              g_autoptr(GError) fetch_error = NULL;
+
+              summary = flatpak_dir_fetch_summary_for_sig (self, remote_summary_sig, name_or_uri, url,
+                                                           cancellable, &fetch_error);
+              if (summary != NULL)
+                summary_sig = g_steal_pointer (&remote_summary_sig);
+              else
+                g_debug ("Failed to fetch summary for remote %s: %s", name_or_uri, fetch_error->message);
+            }
+
+          if (summary == NULL &&
+              !ostree_repo_remote_fetch_summary (self->repo, name_or_uri,
+                                                 &summary, &summary_sig,
+                                                 cancellable,
+                                                 error))
+            return FALSE;
+
+          if (summary != NULL && !is_local)
+            flatpak_dir_save_shared_summary (self, summary, summary_sig, name_or_uri, url);
+        }
     }
 
   if (summary == NULL)
@@ -11470,9 +13600,471 @@ out:
   return TRUE;
 }
 
+/* The ref index splits each ref once, up front, and files it under
+ * kind -> id, so that resolving a (partial) ref does not have to
+ * decompose every ref in the table. The ids of each kind are also kept
+ * sorted, for prefix matches. An id only has a handful of arches and
+ * branches, so these are filtered from its entries, which are sorted
+ * by refspec and thus by arch and then branch. */
+struct FlatpakRefIndex
+{
+  gint        refcount;
+  GPtrArray  *entries;       /* (element-type FlatpakRefIndexEntry) */
+  GHashTable *ids[2];        /* id -> GPtrArray of entries, sorted by refspec */
+  GPtrArray  *sorted_ids[2]; /* (element-type utf8) */
+  GHashTable *entry_set;     /* entries, by refspec and collection id */
+  GHashTable *skipped;       /* FlatpakCollectionRef set of refs not in entries */
+};
+
+static const FlatpakKinds ref_index_kinds[2] = { FLATPAK_KINDS_APP, FLATPAK_KINDS_RUNTIME };
+
+static FlatpakRefIndexEntry *
+ref_index_entry_new (const char  *refspec,
+                     const char  *ref,
+                     char       **parts,
+                     const char  *collection_id)
+{
+  const char *strings[] = { refspec, ref, parts[1], parts[2], parts[3], collection_id };
+  gsize lens[G_N_ELEMENTS (strings)];
+  gsize total = sizeof (FlatpakRefIndexEntry);
+  FlatpakRefIndexEntry *entry;
+  const char **fields[G_N_ELEMENTS (strings)];
+  char *p;
+  gsize i;
+
+  /* Keep each entry in a single allocation */
+  for (i = 0; i < G_N_ELEMENTS (strings); i++)
+    {
+      lens[i] = strings[i] ? strlen (strings[i]) + 1 : 0;
+      total += lens[i];
+    }
+
+  entry = g_malloc0 (total);
+  fields[0] = &entry->refspec;
+  fields[1] = &entry->ref;
+  fields[2] = &entry->id;
+  fields[3] = &entry->arch;
+  fields[4] = &entry->branch;
+  fields[5] = &entry->collection_id;
+
+  p = (char *) (entry + 1);
+  for (i = 0; i < G_N_ELEMENTS (strings); i++)
+    {
+      if (strings[i] == NULL)
+        continue;
+      memcpy (p, strings[i], lens[i]);
+      *fields[i] = p;
+      p += lens[i];
+    }
+
+  return entry;
+}
+
+static guint
+ref_index_entry_hash (gconstpointer a)
+{
+  const FlatpakRefIndexEntry *entry = a;
+
+  if (entry->collection_id != NULL)
+    return g_str_hash (entry->collection_id) ^ g_str_hash (entry->refspec);
+  else
+    return g_str_hash (entry->refspec);
+}
+
+static gboolean
+ref_index_entry_equal (gconstpointer a,
+                       gconstpointer b)
+{
+  const FlatpakRefIndexEntry *entry_a = a, *entry_b = b;
+
+  return g_strcmp0 (entry_a->collection_id, entry_b->collection_id) == 0 &&
+         strcmp (entry_a->refspec, entry_b->refspec) == 0;
+}
+
+static int
+ref_index_entry_cmp (gconstpointer a,
+                     gconstpointer b)
+{
+  const FlatpakRefIndexEntry *entry_a = *(const FlatpakRefIndexEntry **) a;
+  const FlatpakRefIndexEntry *entry_b = *(const FlatpakRefIndexEntry **) b;
+
+  return strcmp (entry_a->refspec, entry_b->refspec);
+}
+
+/* @refs has FlatpakCollectionRef keys, like the tables returned by
+ * flatpak_dir_list_all_remote_refs(). Refs that are not decomposable
+ * are left out. */
+FlatpakRefIndex *
+flatpak_ref_index_new (GHashTable *refs)
+{
+  FlatpakRefIndex *index = g_new0 (FlatpakRefIndex, 1);
+  GHashTableIter hash_iter;
+  gpointer key;
+  guint k;
+
+  index->refcount = 1;
+  index->entries = g_ptr_array_new_with_free_func (g_free);
+  index->entry_set = g_hash_table_new (ref_index_entry_hash, ref_index_entry_equal);
+  index->skipped = g_hash_table_new_full (flatpak_collection_ref_hash, flatpak_collection_ref_equal,
+                                          (GDestroyNotify) flatpak_collection_ref_free, NULL);
+  for (k = 0; k < G_N_ELEMENTS (ref_index_kinds); k++)
+    index->ids[k] = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, (GDestroyNotify) g_ptr_array_unref);
+
+  g_hash_table_iter_init (&hash_iter, refs);
+  while (g_hash_table_iter_next (&hash_iter, &key, NULL))
+    {
+      FlatpakCollectionRef *coll_ref = key;
+      g_autofree char *ref = NULL;
+      g_auto(GStrv) parts = NULL;
+      FlatpakRefIndexEntry *entry;
+      GPtrArray *id_entries;
+
+      /* Unprefix any remote name if needed */
+      ostree_parse_refspec (coll_ref->ref_name, NULL, &ref, NULL);
+      if (ref != NULL && g_str_has_prefix (ref, "app/"))
+        k = 0;
+      else if (ref != NULL && g_str_has_prefix (ref, "runtime/"))
+        k = 1;
+      else
+        k = G_N_ELEMENTS (ref_index_kinds);
+
+      if (k < G_N_ELEMENTS (ref_index_kinds))
+        parts = flatpak_decompose_ref (ref, NULL);
+
+      if (parts == NULL)
+        {
+          g_hash_table_add (index->skipped,
+                            flatpak_collection_ref_new (coll_ref->collection_id, coll_ref->ref_name));
+          continue;
+        }
+
+      entry = ref_index_entry_new (coll_ref->ref_name, ref, parts, coll_ref->collection_id);
+      entry->kind = ref_index_kinds[k];
+      g_ptr_array_add (index->entries, entry);
+      g_hash_table_add (index->entry_set, entry);
+
+      id_entries = g_hash_table_lookup (index->ids[k], entry->id);
+      if (id_entries == NULL)
+        {
+          id_entries = g_ptr_array_new ();
+          g_hash_table_insert (index->ids[k], (char *) entry->id, id_entries);
+        }
+      g_ptr_array_add (id_entries, entry);
+    }
+
+  for (k = 0; k < G_N_ELEMENTS (ref_index_kinds); k++)
+    {
+      GHashTableIter ids_iter;
+      gpointer id, id_entries;
+
+      index->sorted_ids[k] = g_ptr_array_sized_new (g_hash_table_size (index->ids[k]));
+      g_hash_table_iter_init (&ids_iter, index->ids[k]);
+      while (g_hash_table_iter_next (&ids_iter, &id, &id_entries))
+        {
+          g_ptr_array_add (index->sorted_ids[k], id);
+          g_ptr_array_sort (id_entries, ref_index_entry_cmp);
+        }
+      g_ptr_array_sort (index->sorted_ids[k], flatpak_strcmp0_ptr);
+    }
+
+  return index;
+}
+
+FlatpakRefIndex *
+flatpak_ref_index_ref (FlatpakRefIndex *index)
+{
+  g_atomic_int_inc (&index->refcount);
+  return index;
+}
+
+void
+flatpak_ref_index_unref (FlatpakRefIndex *index)
+{
+  guint k;
+
+  if (!g_atomic_int_dec_and_test (&index->refcount))
+    return;
+
+  for (k = 0; k < G_N_ELEMENTS (ref_index_kinds); k++)
+    {
+      g_clear_pointer (&index->sorted_ids[k], g_ptr_array_unref);
+      g_clear_pointer (&index->ids[k], g_hash_table_unref);
+    }
+  g_hash_table_unref (index->entry_set);
+  g_hash_table_unref (index->skipped);
+  g_ptr_array_unref (index->entries);
+  g_free (index);
+}
+
+/* Whether the index was built from exactly the refs in @refs */
+gboolean
+flatpak_ref_index_has_refs (FlatpakRefIndex *index,
+                            GHashTable      *refs)
+{
+  GHashTableIter hash_iter;
+  gpointer key;
+
+  if (g_hash_table_size (refs) != index->entries->len + g_hash_table_size (index->skipped))
+    return FALSE;
+
+  g_hash_table_iter_init (&hash_iter, refs);
+  while (g_hash_table_iter_next (&hash_iter, &key, NULL))
+    {
+      FlatpakCollectionRef *coll_ref = key;
+      FlatpakRefIndexEntry lookup = { 0 };
+
+      lookup.refspec = coll_ref->ref_name;
+      lookup.collection_id = coll_ref->collection_id;
+
+      if (!g_hash_table_contains (index->entry_set, &lookup) &&
+          !g_hash_table_contains (index->skipped, coll_ref))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+ref_index_fuzzy_match (const char *name,
+                       const char *id)
+{
+  /* Subrefs are only ever matched exactly */
+  if (flatpak_id_has_subref_suffix (id))
+    return strcmp (name, id) == 0;
+
+  /* See if the given name looks similar to this ref name. The
+   * Levenshtein distance constant was chosen pretty arbitrarily. */
+  return strcasestr (id, name) != NULL ||
+         flatpak_levenshtein_distance (name, id) <= 2;
+}
+
+/* Returns the entries of the given kinds whose id matches @id, or all of
+ * them if @id is %NULL. The result is in a stable order (by kind, id
+ * and refspec) and does not own the entries. */
+GPtrArray *
+flatpak_ref_index_lookup (FlatpakRefIndex     *index,
+                          FlatpakKinds         kinds,
+                          const char          *id,
+                          FlatpakRefIndexMatch match)
+{
+  GPtrArray *res = g_ptr_array_new ();
+  guint k;
+
+  for (k = 0; k < G_N_ELEMENTS (ref_index_kinds); k++)
+    {
+      GPtrArray *sorted_ids = index->sorted_ids[k];
+      guint first = 0, i;
+
+      if ((kinds & ref_index_kinds[k]) == 0)
+        continue;
+
+      if (id != NULL && match == FLATPAK_REF_INDEX_MATCH_EXACT)
+        {
+          GPtrArray *id_entries = g_hash_table_lookup (index->ids[k], id);
+
+          for (i = 0; id_entries != NULL && i < id_entries->len; i++)
+            g_ptr_array_add (res, g_ptr_array_index (id_entries, i));
+          continue;
+        }
+
+      if (id != NULL && match == FLATPAK_REF_INDEX_MATCH_PREFIX)
+        {
+          guint last = sorted_ids->len;
+
+          /* Bisect to the first id >= @id, all matches follow it */
+          while (first < last)
+            {
+              guint mid = first + (last - first) / 2;
+
+              if (strcmp (g_ptr_array_index (sorted_ids, mid), id) < 0)
+                first = mid + 1;
+              else
+                last = mid;
+            }
+        }
+
+      for (i = first; i < sorted_ids->len; i++)
+        {
+          const char *candidate = g_ptr_array_index (sorted_ids, i);
+          GPtrArray *id_entries;
+          guint j;
+
+          if (id != NULL)
+            {
+              if (match == FLATPAK_REF_INDEX_MATCH_PREFIX && !g_str_has_prefix (candidate, id))
+                break;
+              if (match == FLATPAK_REF_INDEX_MATCH_FUZZY && !ref_index_fuzzy_match (id, candidate))
+                continue;
+            }
+
+          id_entries = g_hash_table_lookup (index->ids[k], candidate);
+          for (j = 0; j < id_entries->len; j++)
+            g_ptr_array_add (res, g_ptr_array_index (id_entries, j));
+        }
+    }
+
+  return res;
+}
+
+/* Ref indexes are cached per dir, so that they are reused across
+ * operations and not just within one FlatpakRemoteState. A remote's
+ * index is reused as long as the summary and the filters it was built
+ * from are the same. For local refs, the refs have to be listed anyway,
+ * so they are compared with the ones the index was built from. */
+typedef struct
+{
+  char            *summary_checksum;
+  char            *collection_id;
+  FlatpakFilter   *allow_refs;
+  FlatpakFilter   *deny_refs;
+  FlatpakRefIndex *index;
+} CachedRefIndex;
+
+G_LOCK_DEFINE_STATIC (ref_index_cache);
+
+static void
+cached_ref_index_free (CachedRefIndex *cached)
+{
+  g_free (cached->summary_checksum);
+  g_free (cached->collection_id);
+  g_clear_pointer (&cached->allow_refs, flatpak_filter_unref);
+  g_clear_pointer (&cached->deny_refs, flatpak_filter_unref);
+  flatpak_ref_index_unref (cached->index);
+  g_free (cached);
+}
+
+static void
+flatpak_dir_cache_ref_index (FlatpakDir         *self,
+                             const char         *key,
+                             FlatpakRemoteState *state,
+                             const char         *summary_checksum,
+                             FlatpakRefIndex    *index)
+{
+  CachedRefIndex *cached = g_new0 (CachedRefIndex, 1);
+
+  cached->summary_checksum = g_strdup (summary_checksum);
+  if (state != NULL)
+    {
+      cached->collection_id = g_strdup (state->collection_id);
+      if (state->allow_refs)
+        cached->allow_refs = flatpak_filter_ref (state->allow_refs);
+      if (state->deny_refs)
+        cached->deny_refs = flatpak_filter_ref (state->deny_refs);
+    }
+  cached->index = flatpak_ref_index_ref (index);
+
+  G_LOCK (ref_index_cache);
+  if (self->ref_index_cache == NULL)
+    self->ref_index_cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                                   (GDestroyNotify) cached_ref_index_free);
+  g_hash_table_replace (self->ref_index_cache, g_strdup (key), cached);
+  G_UNLOCK (ref_index_cache);
+}
+
+static FlatpakRefIndex *
+flatpak_dir_lookup_cached_ref_index (FlatpakDir         *self,
+                                     const char         *key,
+                                     FlatpakRemoteState *state,
+                                     const char         *summary_checksum)
+{
+  FlatpakRefIndex *index = NULL;
+  CachedRefIndex *cached = NULL;
+
+  G_LOCK (ref_index_cache);
+  if (self->ref_index_cache != NULL)
+    cached = g_hash_table_lookup (self->ref_index_cache, key);
+
+  /* The filters are only replaced when reloaded, and the cache keeps
+     the old ones alive, so comparing pointers is enough */
+  if (cached != NULL &&
+      g_strcmp0 (cached->summary_checksum, summary_checksum) == 0 &&
+      (state == NULL ||
+       (g_strcmp0 (cached->collection_id, state->collection_id) == 0 &&
+        cached->allow_refs == state->allow_refs &&
+        cached->deny_refs == state->deny_refs)))
+    index = flatpak_ref_index_ref (cached->index);
+  G_UNLOCK (ref_index_cache);
+
+  return index;
+}
+
+/* Returns a new reference to an index of @refs, reusing the one cached
+ * under @key if it has the same refs. */
+static FlatpakRefIndex *
+flatpak_dir_get_local_ref_index (FlatpakDir *self,
+                                 const char *key,
+                                 GHashTable *refs)
+{
+  FlatpakRefIndex *index;
+
+  index = flatpak_dir_lookup_cached_ref_index (self, key, NULL, NULL);
+  if (index != NULL)
+    {
+      if (flatpak_ref_index_has_refs (index, refs))
+        return index;
+      flatpak_ref_index_unref (index);
+    }
+
+  index = flatpak_ref_index_new (refs);
+  flatpak_dir_cache_ref_index (self, key, NULL, NULL, index);
+
+  return index;
+}
+
+static FlatpakRefIndex *
+flatpak_dir_get_remote_ref_index (FlatpakDir         *self,
+                                  FlatpakRemoteState *state,
+                                  GCancellable       *cancellable,
+                                  GError            **error)
+{
+  g_autoptr(FlatpakRefIndex) index = NULL;
+  g_autofree char *key = NULL;
+  g_autofree char *summary_checksum = NULL;
+  FlatpakRefIndex *res;
+
+  g_mutex_lock (&state->lock);
+  res = state->ref_index;
+  g_mutex_unlock (&state->lock);
+
+  if (res != NULL)
+    return res;
+
+  /* Without a summary the refs come from the ostree-metadata, which is
+     only indexed for this state */
+  key = g_strconcat ("remote:", state->remote_name, NULL);
+  if (state->summary != NULL)
+    {
+      summary_checksum = g_compute_checksum_for_data (G_CHECKSUM_SHA256,
+                                                      g_variant_get_data (state->summary),
+                                                      g_variant_get_size (state->summary));
+      index = flatpak_dir_lookup_cached_ref_index (self, key, state, summary_checksum);
+    }
+
+  if (index == NULL)
+    {
+      g_autoptr(GHashTable) remote_refs = NULL;
+
+      if (!flatpak_dir_list_all_remote_refs (self, state,
+                                             &remote_refs, cancellable, error))
+        return NULL;
+
+      index = flatpak_ref_index_new (remote_refs);
+      if (summary_checksum != NULL)
+        flatpak_dir_cache_ref_index (self, key, state, summary_checksum, index);
+    }
+
+  g_mutex_lock (&state->lock);
+  if (state->ref_index == NULL)
+    state->ref_index = g_steal_pointer (&index);
+  res = state->ref_index;
+  g_mutex_unlock (&state->lock);
+
+  return res;
+}
+
 /* Guarantees to return refs which are decomposable. */
 static GPtrArray *
-find_matching_refs (GHashTable           *refs,
+find_matching_refs (FlatpakRefIndex      *index,
                     const char           *opt_name,
                     const char           *opt_branch,
                     const char           *opt_default_branch,
@@ -11483,20 +14075,27 @@ find_matching_refs (GHashTable           *refs,
                     FindMatchingRefsFlags flags,
                     GError              **error)
 {
-  g_autoptr(GPtrArray) matched_refs = NULL;
+  g_autoptr(GPtrArray) candidates = NULL;
+  g_autoptr(GPtrArray) matched = NULL;
+  GPtrArray *matched_refs;
   const char **arches = flatpak_get_arches ();
   const char *opt_arches[] = {opt_arch, NULL};
-  GHashTableIter hash_iter;
-  gpointer key;
+  FlatpakRefIndexMatch match = FLATPAK_REF_INDEX_MATCH_EXACT;
   g_autoptr(GError) local_error = NULL;
   gboolean found_exact_name_match = FALSE;
   gboolean found_default_branch_match = FALSE;
   gboolean found_default_arch_match = FALSE;
+  guint i;
 
   if (opt_arch != NULL)
     arches = opt_arches;
 
-  if (opt_name && !(flags & FIND_MATCHING_REFS_FLAGS_FUZZY) &&
+  if (flags & FIND_MATCHING_REFS_FLAGS_FUZZY)
+    match = FLATPAK_REF_INDEX_MATCH_FUZZY;
+  else if (flags & FIND_MATCHING_REFS_FLAGS_PREFIX)
+    match = FLATPAK_REF_INDEX_MATCH_PREFIX;
+
+  if (opt_name && match == FLATPAK_REF_INDEX_MATCH_EXACT &&
       !flatpak_is_valid_name (opt_name, &local_error))
     {
       flatpak_fail_error (error, FLATPAK_ERROR_INVALID_REF, _("'%s' is not a valid name: %s"), opt_name, local_error->message);
@@ -11509,109 +14108,70 @@ find_matching_refs (GHashTable           *refs,
       return NULL;
     }
 
-  matched_refs = g_ptr_array_new_with_free_func (g_free);
+  candidates = flatpak_ref_index_lookup (index, kinds, opt_name, match);
+  matched = g_ptr_array_new ();
 
-  g_hash_table_iter_init (&hash_iter, refs);
-  while (g_hash_table_iter_next (&hash_iter, &key, NULL))
+  for (i = 0; i < candidates->len; i++)
     {
-      g_autofree char *ref = NULL;
-      g_auto(GStrv) parts = NULL;
-      gboolean is_app, is_runtime;
-      FlatpakCollectionRef *coll_ref = key;
-
-      /* Unprefix any remote name if needed */
-      ostree_parse_refspec (coll_ref->ref_name, NULL, &ref, NULL);
-      if (ref == NULL)
-        continue;
-
-      is_app = g_str_has_prefix (ref, "app/");
-      is_runtime = g_str_has_prefix (ref, "runtime/");
-
-      if ((!(kinds & FLATPAK_KINDS_APP) && is_app) ||
-          (!(kinds & FLATPAK_KINDS_RUNTIME) && is_runtime) ||
-          (!is_app && !is_runtime))
-        continue;
+      const FlatpakRefIndexEntry *entry = g_ptr_array_index (candidates, i);
 
-      parts = flatpak_decompose_ref (ref, NULL);
-      if (parts == NULL)
-        continue;
-
-      if ((flags & FIND_MATCHING_REFS_FLAGS_FUZZY) && !flatpak_id_has_subref_suffix (parts[1]))
-        {
-          /* See if the given name looks similar to this ref name. The
-           * Levenshtein distance constant was chosen pretty arbitrarily. */
-          if (opt_name != NULL && strcasestr (parts[1], opt_name) == NULL &&
-              flatpak_levenshtein_distance (opt_name, parts[1]) > 2)
-            continue;
-        }
-      else
-        {
-          if (opt_name != NULL && strcmp (opt_name, parts[1]) != 0)
-            continue;
-        }
-
-      if (!g_strv_contains (arches, parts[2]))
+      if (!g_strv_contains (arches, entry->arch))
         continue;
 
-      if (opt_branch != NULL && strcmp (opt_branch, parts[3]) != 0)
+      if (opt_branch != NULL && strcmp (opt_branch, entry->branch) != 0)
         continue;
 
-      if (opt_collection_id != NULL && strcmp (opt_collection_id, coll_ref->collection_id))
+      if (opt_collection_id != NULL && g_strcmp0 (opt_collection_id, entry->collection_id) != 0)
         continue;
 
-      if (opt_name != NULL && strcmp (opt_name, parts[1]) == 0)
+      /* A prefix is not a name, so it never hides the other matches */
+      if (opt_name != NULL && match != FLATPAK_REF_INDEX_MATCH_PREFIX &&
+          strcmp (opt_name, entry->id) == 0)
         found_exact_name_match = TRUE;
 
-      if (opt_default_arch != NULL && strcmp (opt_default_arch, parts[2]) == 0)
+      if (opt_default_arch != NULL && strcmp (opt_default_arch, entry->arch) == 0)
         found_default_arch_match = TRUE;
 
-      if (opt_default_branch != NULL && strcmp (opt_default_branch, parts[3]) == 0)
+      if (opt_default_branch != NULL && strcmp (opt_default_branch, entry->branch) == 0)
         found_default_branch_match = TRUE;
 
-      if (flags & FIND_MATCHING_REFS_FLAGS_KEEP_REMOTE)
-        g_ptr_array_add (matched_refs, g_strdup (coll_ref->ref_name));
-      else
-        g_ptr_array_add (matched_refs, g_steal_pointer (&ref));
+      g_ptr_array_add (matched, (gpointer) entry);
     }
 
-  /* Don't show fuzzy matches if we found at least one exact name match, and
-   * enforce the default arch/branch */
-  if (found_exact_name_match || found_default_arch_match || found_default_branch_match)
-    {
-      guint i;
+  matched_refs = g_ptr_array_new_with_free_func (g_free);
 
-      /* Walk through the array backwards so we can safely remove */
-      for (i = matched_refs->len; i > 0; i--)
-        {
-          const char *matched_refspec = g_ptr_array_index (matched_refs, i - 1);
-          g_auto(GStrv) matched_parts = NULL;
-          g_autofree char *matched_ref = NULL;
+  for (i = 0; i < matched->len; i++)
+    {
+      const FlatpakRefIndexEntry *entry = g_ptr_array_index (matched, i);
 
-          ostree_parse_refspec (matched_refspec, NULL, &matched_ref, NULL);
-          matched_parts = flatpak_decompose_ref (matched_ref, NULL);
+      /* Don't show fuzzy matches if we found at least one exact name match, and
+       * enforce the default arch/branch */
+      if (found_exact_name_match && strcmp (entry->id, opt_name) != 0)
+        continue;
+      else if (found_default_arch_match && strcmp (entry->arch, opt_default_arch) != 0)
+        continue;
+      else if (found_default_branch_match && strcmp (entry->branch, opt_default_branch) != 0)
+        continue;
 
-          if (found_exact_name_match && strcmp (matched_parts[1], opt_name) != 0)
-            g_ptr_array_remove_index (matched_refs, i - 1);
-          else if (found_default_arch_match && strcmp (matched_parts[2], opt_default_arch) != 0)
-            g_ptr_array_remove_index (matched_refs, i - 1);
-          else if (found_default_branch_match && strcmp (matched_parts[3], opt_default_branch) != 0)
-            g_ptr_array_remove_index (matched_refs, i - 1);
-        }
+      if (flags & FIND_MATCHING_REFS_FLAGS_KEEP_REMOTE)
+        g_ptr_array_add (matched_refs, g_strdup (entry->refspec));
+      else
+        g_ptr_array_add (matched_refs, g_strdup (entry->ref));
     }
 
-  return g_steal_pointer (&matched_refs);
+  return matched_refs;
 }
 
 
 static char *
-find_matching_ref (GHashTable  *refs,
-                   const char  *name,
-                   const char  *opt_branch,
-                   const char  *opt_default_branch,
-                   const char  *opt_arch,
-                   const char  *opt_collection_id,
-                   FlatpakKinds kinds,
-                   GError     **error)
+find_matching_ref (FlatpakRefIndex *index,
+                   const char      *name,
+                   const char      *opt_branch,
+                   const char      *opt_default_branch,
+                   const char      *opt_arch,
+                   const char      *opt_collection_id,
+                   FlatpakKinds     kinds,
+                   GError         **error)
 {
   const char **arches = flatpak_get_arches ();
   const char *opt_arches[] = {opt_arch, NULL};
@@ -11626,7 +14186,7 @@ find_matching_ref (GHashTable  *refs,
       g_autoptr(GPtrArray) matched_refs = NULL;
       int j;
 
-      matched_refs = find_matching_refs (refs,
+      matched_refs = find_matching_refs (index,
                                          name,
                                          opt_branch,
                                          opt_default_branch,
@@ -11700,20 +14260,20 @@ flatpak_dir_find_remote_refs (FlatpakDir           *self,
                               GError              **error)
 {
   g_autofree char *collection_id = NULL;
-  g_autoptr(GHashTable) remote_refs = NULL;
   g_autoptr(FlatpakRemoteState) state = NULL;
+  FlatpakRefIndex *index;
   GPtrArray *matched_refs;
 
   state = flatpak_dir_get_remote_state_optional (self, remote, FALSE, cancellable, error);
   if (state == NULL)
     return NULL;
 
-  if (!flatpak_dir_list_all_remote_refs (self, state,
-                                         &remote_refs, cancellable, error))
+  index = flatpak_dir_get_remote_ref_index (self, state, cancellable, error);
+  if (index == NULL)
     return NULL;
 
   collection_id = flatpak_dir_get_remote_collection_id (self, remote);
-  matched_refs = find_matching_refs (remote_refs,
+  matched_refs = find_matching_refs (index,
                                      name,
                                      opt_branch,
                                      opt_default_branch,
@@ -11731,18 +14291,18 @@ flatpak_dir_find_remote_refs (FlatpakDir           *self,
 }
 
 static char *
-find_ref_for_refs_set (GHashTable   *refs,
-                       const char   *name,
-                       const char   *opt_branch,
-                       const char   *opt_default_branch,
-                       const char   *opt_arch,
-                       const char   *collection_id,
-                       FlatpakKinds  kinds,
-                       FlatpakKinds *out_kind,
-                       GError      **error)
+find_ref_for_refs_set (FlatpakRefIndex *index,
+                       const char      *name,
+                       const char      *opt_branch,
+                       const char      *opt_default_branch,
+                       const char      *opt_arch,
+                       const char      *collection_id,
+                       FlatpakKinds     kinds,
+                       FlatpakKinds    *out_kind,
+                       GError         **error)
 {
   g_autoptr(GError) my_error = NULL;
-  g_autofree gchar *ref = find_matching_ref (refs,
+  g_autofree gchar *ref = find_matching_ref (index,
                                              name,
                                              opt_branch,
                                              opt_default_branch,
@@ -11797,20 +14357,20 @@ flatpak_dir_find_remote_ref (FlatpakDir   *self,
 {
   g_autofree char *collection_id = NULL;
   g_autofree char *remote_ref = NULL;
-  g_autoptr(GHashTable) remote_refs = NULL;
   g_autoptr(FlatpakRemoteState) state = NULL;
   g_autoptr(GError) my_error = NULL;
+  FlatpakRefIndex *index;
 
   state = flatpak_dir_get_remote_state_optional (self, remote, FALSE, cancellable, error);
   if (state == NULL)
     return NULL;
 
-  if (!flatpak_dir_list_all_remote_refs (self, state,
-                                         &remote_refs, cancellable, error))
+  index = flatpak_dir_get_remote_ref_index (self, state, cancellable, error);
+  if (index == NULL)
     return NULL;
 
   collection_id = flatpak_dir_get_remote_collection_id (self, remote);
-  remote_ref = find_ref_for_refs_set (remote_refs, name, opt_branch,
+  remote_ref = find_ref_for_refs_set (index, name, opt_branch,
                                       opt_default_branch, opt_arch, collection_id,
                                       kinds, out_kind, &my_error);
   if (!remote_ref)
@@ -11882,8 +14442,10 @@ flatpak_dir_find_local_refs (FlatpakDir           *self,
 {
   g_autofree char *collection_id = NULL;
   g_autoptr(GHashTable) local_refs = NULL;
+  g_autoptr(FlatpakRefIndex) index = NULL;
   g_autoptr(GError) my_error = NULL;
   g_autofree char *refspec_prefix = g_strconcat (remote, ":.", NULL);
+  g_autofree char *index_key = NULL;
   GPtrArray *matched_refs;
 
   if (!flatpak_dir_ensure_repo (self, NULL, error))
@@ -11894,7 +14456,9 @@ flatpak_dir_find_local_refs (FlatpakDir           *self,
                                               &local_refs, cancellable, error))
     return NULL;
 
-  matched_refs = find_matching_refs (local_refs,
+  index_key = g_strconcat ("local:", remote, NULL);
+  index = flatpak_dir_get_local_ref_index (self, index_key, local_refs);
+  matched_refs = find_matching_refs (index,
                                      name,
                                      opt_branch,
                                      opt_default_branch,
@@ -11989,13 +14553,15 @@ flatpak_dir_find_installed_refs (FlatpakDir           *self,
                                  GError              **error)
 {
   g_autoptr(GHashTable) local_refs = NULL;
+  g_autoptr(FlatpakRefIndex) index = NULL;
   GPtrArray *matched_refs;
 
   local_refs = flatpak_dir_get_all_installed_refs (self, kinds, error);
   if (local_refs == NULL)
     return NULL;
 
-  matched_refs = find_matching_refs (local_refs,
+  index = flatpak_dir_get_local_ref_index (self, "installed", local_refs);
+  matched_refs = find_matching_refs (index,
                                      opt_name,
                                      opt_branch,
                                      NULL, /* default branch */
@@ -12023,13 +14589,15 @@ flatpak_dir_find_installed_ref (FlatpakDir   *self,
 {
   g_autofree char *local_ref = NULL;
   g_autoptr(GHashTable) local_refs = NULL;
+  g_autoptr(FlatpakRefIndex) index = NULL;
   g_autoptr(GError) my_error = NULL;
 
   local_refs = flatpak_dir_get_all_installed_refs (self, kinds, error);
   if (local_refs == NULL)
     return NULL;
 
-  local_ref = find_matching_ref (local_refs, opt_name, opt_branch, NULL,
+  index = flatpak_dir_get_local_ref_index (self, "installed", local_refs);
+  local_ref = find_matching_ref (index, opt_name, opt_branch, NULL,
                                  opt_arch, NULL, kinds, &my_error);
   if (local_ref == NULL)
     {
@@ -12117,6 +14685,7 @@ flatpak_dir_cleanup_undeployed_refs (FlatpakDir   *self,
                                      GError      **error)
 {
   g_autoptr(GHashTable) local_refspecs = NULL;
+  g_autoptr(FlatpakRefIndex) index = NULL;
   g_autoptr(GPtrArray)  local_flatpak_refspecs = NULL;
   g_autoptr(GPtrArray) undeployed_refs = NULL;
   gsize i = 0;
@@ -12125,7 +14694,8 @@ flatpak_dir_cleanup_undeployed_refs (FlatpakDir   *self,
                                               cancellable, error))
     return FALSE;
 
-  local_flatpak_refspecs = find_matching_refs (local_refspecs,
+  index = flatpak_dir_get_local_ref_index (self, "local", local_refspecs);
+  local_flatpak_refspecs = find_matching_refs (index,
                                                NULL, NULL, NULL, NULL, NULL, NULL,
                                                FLATPAK_KINDS_APP |
                                                FLATPAK_KINDS_RUNTIME,
@@ -14015,10 +16585,10 @@ add_related (FlatpakDir *self,
   g_ptr_array_add (related, rel);
 }
 
-static GRegex *
-flatpak_dir_get_mask_regexp (FlatpakDir *self)
+static FlatpakFilter *
+flatpak_dir_get_mask_filter (FlatpakDir *self)
 {
-  GRegex *res = NULL;
+  FlatpakFilter *res = NULL;
 
   G_LOCK (config_cache);
 
@@ -14030,34 +16600,21 @@ flatpak_dir_get_mask_regexp (FlatpakDir *self)
       if (masked)
         {
           g_auto(GStrv) patterns = g_strsplit (masked, ";", -1);
-          g_autoptr(GString) deny_regexp = g_string_new ("^(");
           int i;
 
+          self->masked = flatpak_filter_new ();
+
+          /* Invalid patterns are ignored */
           for (i = 0; patterns[i] != NULL; i++)
             {
-              const char *pattern = patterns[i];
-
-              if (*pattern != 0)
-                {
-                  g_autofree char *regexp = NULL;
-
-                  regexp = flatpak_filter_glob_to_regexp (pattern, NULL);
-                  if (regexp)
-                    {
-                      if (i != 0)
-                        g_string_append (deny_regexp, "|");
-                      g_string_append (deny_regexp, regexp);
-                    }
-                }
+              if (*patterns[i] != 0)
+                flatpak_filter_add_glob (self->masked, patterns[i], NULL);
             }
-
-          g_string_append (deny_regexp, ")$");
-          self->masked = g_regex_new (deny_regexp->str, G_REGEX_DOLLAR_ENDONLY|G_REGEX_RAW|G_REGEX_OPTIMIZE, G_REGEX_MATCH_ANCHORED, NULL);
         }
     }
 
   if (self->masked)
-    res = g_regex_ref (self->masked);
+    res = flatpak_filter_ref (self->masked);
 
   G_UNLOCK (config_cache);
 
@@ -14068,7 +16625,7 @@ gboolean
 flatpak_dir_ref_is_masked (FlatpakDir *self,
                            const char *ref)
 {
-  g_autoptr(GRegex) masked = flatpak_dir_get_mask_regexp (self);
+  g_autoptr(FlatpakFilter) masked = flatpak_dir_get_mask_filter (self);
 
   return !flatpak_filters_allow_ref (NULL, masked, ref);
 }
@@ -14086,7 +16643,7 @@ flatpak_dir_find_remote_related_for_metadata (FlatpakDir         *self,
   g_autoptr(GPtrArray) related = g_ptr_array_new_with_free_func ((GDestroyNotify) flatpak_related_free);
   g_autofree char *url = NULL;
   g_auto(GStrv) groups = NULL;
-  g_autoptr(GRegex) masked = NULL;
+  g_autoptr(FlatpakFilter) masked = NULL;
 
   parts = flatpak_decompose_ref (ref, error);
   if (parts == NULL)
@@ -14101,7 +16658,7 @@ flatpak_dir_find_remote_related_for_metadata (FlatpakDir         *self,
   if (*url == 0)
     return g_steal_pointer (&related);  /* Empty url, silently disables updates */
 
-  masked = flatpak_dir_get_mask_regexp (self);
+  masked = flatpak_dir_get_mask_filter (self);
 
   groups = g_key_file_get_groups (metakey, NULL);
   for (i = 0; groups[i] != NULL; i++)
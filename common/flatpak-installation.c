@@ -720,12 +720,114 @@ flatpak_installation_launch_full (FlatpakInstallation *self,
   return TRUE;
 }
 
+/* What listing installed refs looks up for all the refs of the listing
+ * at once, or once per origin or app, instead of once per ref */
+typedef struct
+{
+  GHashTable *remote_refs;    /* "remote:ref" -> commit, NULL if they couldn't be listed */
+  GHashTable *collection_ids; /* origin -> collection id, or NULL */
+  GHashTable *current_refs;   /* app name -> current ref, or NULL */
+} InstalledRefsBatch;
+
+static void
+installed_refs_batch_init (InstalledRefsBatch *batch,
+                           FlatpakDir         *dir,
+                           GCancellable       *cancellable)
+{
+  batch->remote_refs = NULL;
+  batch->collection_ids = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  batch->current_refs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+  if (flatpak_dir_ensure_repo (dir, cancellable, NULL) &&
+      !ostree_repo_list_refs (flatpak_dir_get_repo (dir), NULL, &batch->remote_refs, cancellable, NULL))
+    batch->remote_refs = NULL;
+}
+
+static void
+installed_refs_batch_clear (InstalledRefsBatch *batch)
+{
+  g_clear_pointer (&batch->remote_refs, g_hash_table_unref);
+  g_clear_pointer (&batch->collection_ids, g_hash_table_unref);
+  g_clear_pointer (&batch->current_refs, g_hash_table_unref);
+}
+
+G_DEFINE_AUTO_CLEANUP_CLEAR_FUNC (InstalledRefsBatch, installed_refs_batch_clear)
+
+static char *
+get_collection_id (FlatpakDir         *dir,
+                   InstalledRefsBatch *batch,
+                   const char         *origin)
+{
+  char *collection_id;
+
+  if (batch == NULL)
+    return flatpak_dir_get_remote_collection_id (dir, origin);
+
+  if (!g_hash_table_lookup_extended (batch->collection_ids, origin, NULL, (gpointer *) &collection_id))
+    {
+      collection_id = flatpak_dir_get_remote_collection_id (dir, origin);
+      g_hash_table_insert (batch->collection_ids, g_strdup (origin), collection_id);
+    }
+
+  return g_strdup (collection_id);
+}
+
+static char *
+get_current_ref (FlatpakDir         *dir,
+                 InstalledRefsBatch *batch,
+                 const char         *name,
+                 GCancellable       *cancellable)
+{
+  char *current;
+
+  if (batch == NULL)
+    return flatpak_dir_current_ref (dir, name, cancellable);
+
+  if (!g_hash_table_lookup_extended (batch->current_refs, name, NULL, (gpointer *) &current))
+    {
+      current = flatpak_dir_current_ref (dir, name, cancellable);
+      g_hash_table_insert (batch->current_refs, g_strdup (name), current);
+    }
+
+  return g_strdup (current);
+}
+
+/* The latest commit of @full_ref in @origin is normally the one of the
+ * origin's remote ref, which the batch has. If it is the deployed
+ * commit, so is its alt-id, and the commit doesn't have to be loaded. */
+static char *
+get_latest_commit (FlatpakDir         *dir,
+                   InstalledRefsBatch *batch,
+                   const char         *origin,
+                   const char         *full_ref,
+                   const char         *commit,
+                   const char         *alt_id,
+                   char              **out_latest_alt_id)
+{
+  g_autofree char *refspec = NULL;
+  const char *latest_commit = NULL;
+
+  if (batch != NULL && batch->remote_refs != NULL)
+    {
+      refspec = g_strconcat (origin, ":", full_ref, NULL);
+      latest_commit = g_hash_table_lookup (batch->remote_refs, refspec);
+    }
+
+  if (latest_commit != NULL && g_strcmp0 (latest_commit, commit) == 0)
+    {
+      *out_latest_alt_id = g_strdup (alt_id);
+      return g_strdup (latest_commit);
+    }
+
+  return flatpak_dir_read_latest (dir, origin, full_ref, out_latest_alt_id, NULL, NULL);
+}
 
 static FlatpakInstalledRef *
-get_ref (FlatpakDir   *dir,
-         const char   *full_ref,
-         GCancellable *cancellable,
-         GError      **error)
+get_ref_batched (FlatpakDir         *dir,
+                 const char         *full_ref,
+                 InstalledRefsBatch *batch,
+                 GCancellable       *cancellable,
+                 GError            **error)
 {
   g_auto(GStrv) parts = NULL;
   const char *origin = NULL;
@@ -761,15 +863,14 @@ get_ref (FlatpakDir   *dir,
 
   if (strcmp (parts[0], "app") == 0)
     {
-      g_autofree char *current =
-        flatpak_dir_current_ref (dir, parts[1], cancellable);
+      g_autofree char *current = get_current_ref (dir, batch, parts[1], cancellable);
       if (current && strcmp (full_ref, current) == 0)
         is_current = TRUE;
     }
 
-  latest_commit = flatpak_dir_read_latest (dir, origin, full_ref, &latest_alt_id, NULL, NULL);
+  latest_commit = get_latest_commit (dir, batch, origin, full_ref, commit, alt_id, &latest_alt_id);
 
-  collection_id = flatpak_dir_get_remote_collection_id (dir, origin);
+  collection_id = get_collection_id (dir, batch, origin);
 
   return flatpak_installed_ref_new (full_ref,
                                     alt_id ? alt_id : commit,
@@ -788,6 +889,15 @@ get_ref (FlatpakDir   *dir,
                                     flatpak_deploy_data_get_appdata_content_rating (deploy_data));
 }
 
+static FlatpakInstalledRef *
+get_ref (FlatpakDir   *dir,
+         const char   *full_ref,
+         GCancellable *cancellable,
+         GError      **error)
+{
+  return get_ref_batched (dir, full_ref, NULL, cancellable, error);
+}
+
 /**
  * flatpak_installation_get_installed_ref:
  * @self: a #FlatpakInstallation
@@ -903,6 +1013,7 @@ flatpak_installation_list_installed_refs (FlatpakInstallation *self,
   g_auto(GStrv) raw_refs_app = NULL;
   g_auto(GStrv) raw_refs_runtime = NULL;
   g_autoptr(GPtrArray) refs = g_ptr_array_new_with_free_func (g_object_unref);
+  g_auto(InstalledRefsBatch) batch = { NULL };
   int i;
 
   if (!flatpak_dir_list_refs (dir,
@@ -911,10 +1022,12 @@ flatpak_installation_list_installed_refs (FlatpakInstallation *self,
                               cancellable, error))
     return NULL;
 
+  installed_refs_batch_init (&batch, dir, cancellable);
+
   for (i = 0; raw_refs_app[i] != NULL; i++)
     {
       g_autoptr(GError) local_error = NULL;
-      FlatpakInstalledRef *ref = get_ref (dir, raw_refs_app[i], cancellable, &local_error);
+      FlatpakInstalledRef *ref = get_ref_batched (dir, raw_refs_app[i], &batch, cancellable, &local_error);
       if (ref != NULL)
         g_ptr_array_add (refs, ref);
       else
@@ -930,7 +1043,7 @@ flatpak_installation_list_installed_refs (FlatpakInstallation *self,
   for (i = 0; raw_refs_runtime[i] != NULL; i++)
     {
       g_autoptr(GError) local_error = NULL;
-      FlatpakInstalledRef *ref = get_ref (dir, raw_refs_runtime[i], cancellable, &local_error);
+      FlatpakInstalledRef *ref = get_ref_batched (dir, raw_refs_runtime[i], &batch, cancellable, &local_error);
       if (ref != NULL)
         g_ptr_array_add (refs, ref);
       else
@@ -961,6 +1074,7 @@ flatpak_installation_list_installed_refs_by_kind (FlatpakInstallation *self,
   g_autoptr(FlatpakDir) dir = flatpak_installation_get_dir_maybe_no_repo (self);
   g_auto(GStrv) raw_refs = NULL;
   g_autoptr(GPtrArray) refs = g_ptr_array_new_with_free_func (g_object_unref);
+  g_auto(InstalledRefsBatch) batch = { NULL };
   int i;
 
   if (!flatpak_dir_list_refs (dir,
@@ -969,10 +1083,12 @@ flatpak_installation_list_installed_refs_by_kind (FlatpakInstallation *self,
                               cancellable, error))
     return NULL;
 
+  installed_refs_batch_init (&batch, dir, cancellable);
+
   for (i = 0; raw_refs[i] != NULL; i++)
     {
       g_autoptr(GError) local_error = NULL;
-      FlatpakInstalledRef *ref = get_ref (dir, raw_refs[i], cancellable, &local_error);
+      FlatpakInstalledRef *ref = get_ref_batched (dir, raw_refs[i], &batch, cancellable, &local_error);
       if (ref != NULL)
         g_ptr_array_add (refs, ref);
       else
@@ -1002,6 +1118,134 @@ _ostree_collection_ref_free0 (OstreeCollectionRef *ref)
   ostree_collection_ref_free (ref);
 }
 
+static gboolean
+local_remote_ref_exists (FlatpakDir *dir,
+                         const char *remote_name,
+                         const char *ref)
+{
+  g_autofree char *refspec = g_strconcat (remote_name, ":", ref, NULL);
+  g_autofree char *checksum = NULL;
+
+  return ostree_repo_resolve_rev (flatpak_dir_get_repo (dir), refspec, TRUE, &checksum, NULL) &&
+         checksum != NULL;
+}
+
+/* Fetching a remote state is mostly waiting for the network, but
+ * there is no point in opening dozens of connections at once */
+#define FLATPAK_REMOTE_STATE_FETCH_MAX_THREADS 4
+
+typedef struct
+{
+  FlatpakDir         *dir;
+  char               *remote_name;
+  GCancellable       *cancellable;
+  FlatpakRemoteState *state;
+} RemoteStateFetch;
+
+static void
+remote_state_fetch_free (RemoteStateFetch *fetch)
+{
+  g_free (fetch->remote_name);
+  g_clear_pointer (&fetch->state, flatpak_remote_state_unref);
+  g_free (fetch);
+}
+
+static void
+remote_state_fetch_thread (gpointer data,
+                           gpointer user_data)
+{
+  RemoteStateFetch *fetch = data;
+  g_autoptr(GMainContextPopDefault) context = flatpak_main_context_new_default ();
+  g_autoptr(GError) local_error = NULL;
+  gint64 start = g_get_monotonic_time ();
+
+  /* We ignore errors here. we don't want one remote to fail us */
+  fetch->state = flatpak_dir_get_remote_state_optional (fetch->dir, fetch->remote_name, FALSE,
+                                                        fetch->cancellable, &local_error);
+  if (fetch->state == NULL)
+    g_debug ("Update: Failed to read remote %s: %s", fetch->remote_name, local_error->message);
+  else
+    g_debug ("Update: Fetched state of remote %s in %" G_GINT64_FORMAT " ms",
+             fetch->remote_name, (g_get_monotonic_time () - start) / 1000);
+}
+
+/* Fetches the state of all the enabled, non-collection remotes that
+ * some installed ref comes from, a few at a time. Remotes that fail
+ * are left out of the returned hashtable. */
+static GHashTable *
+fetch_remote_states_for_installed (FlatpakDir   *dir,
+                                   GPtrArray    *remotes,
+                                   GPtrArray    *installed,
+                                   GCancellable *cancellable)
+{
+  g_autoptr(GHashTable) origins = g_hash_table_new (g_str_hash, g_str_equal);
+  g_autoptr(GPtrArray) fetches = g_ptr_array_new_with_free_func ((GDestroyNotify) remote_state_fetch_free);
+  GHashTable *states = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                              (GDestroyNotify) flatpak_remote_state_unref);
+  GThreadPool *pool;
+  gint64 start = g_get_monotonic_time ();
+  guint i;
+
+  for (i = 0; i < installed->len; i++)
+    {
+      FlatpakInstalledRef *installed_ref = g_ptr_array_index (installed, i);
+      const char *origin = flatpak_installed_ref_get_origin (installed_ref);
+
+      if (origin != NULL)
+        g_hash_table_add (origins, (char *) origin);
+    }
+
+  for (i = 0; i < remotes->len; i++)
+    {
+      FlatpakRemote *remote = g_ptr_array_index (remotes, i);
+      const char *remote_name = flatpak_remote_get_name (remote);
+      g_autofree char *collection_id = NULL;
+      RemoteStateFetch *fetch;
+
+      if (flatpak_remote_get_disabled (remote) ||
+          !g_hash_table_contains (origins, remote_name))
+        continue;
+
+      /* Remotes with collection IDs are handled with ostree_repo_find_remotes_async() */
+      collection_id = flatpak_remote_get_collection_id (remote);
+      if (collection_id != NULL)
+        continue;
+
+      fetch = g_new0 (RemoteStateFetch, 1);
+      fetch->dir = dir;
+      fetch->remote_name = g_strdup (remote_name);
+      fetch->cancellable = cancellable;
+      g_ptr_array_add (fetches, fetch);
+    }
+
+  if (fetches->len == 0)
+    return states;
+
+  /* Make sure the repo is opened before it is used from several threads */
+  if (!flatpak_dir_ensure_repo (dir, cancellable, NULL))
+    return states;
+
+  pool = g_thread_pool_new (remote_state_fetch_thread, NULL,
+                            MIN (fetches->len, FLATPAK_REMOTE_STATE_FETCH_MAX_THREADS),
+                            FALSE, NULL);
+  for (i = 0; i < fetches->len; i++)
+    g_thread_pool_push (pool, g_ptr_array_index (fetches, i), NULL);
+  g_thread_pool_free (pool, FALSE, TRUE);
+
+  for (i = 0; i < fetches->len; i++)
+    {
+      RemoteStateFetch *fetch = g_ptr_array_index (fetches, i);
+
+      if (fetch->state != NULL)
+        g_hash_table_insert (states, g_strdup (fetch->remote_name), g_steal_pointer (&fetch->state));
+    }
+
+  g_debug ("Update: Fetched %u of %u remote states in %" G_GINT64_FORMAT " ms",
+           g_hash_table_size (states), fetches->len, (g_get_monotonic_time () - start) / 1000);
+
+  return states;
+}
+
 /**
  * flatpak_installation_list_installed_refs_for_update:
  * @self: a #FlatpakInstallation
@@ -1029,7 +1273,7 @@ flatpak_installation_list_installed_refs_for_update (FlatpakInstallation *self,
   g_autoptr(GPtrArray) updates = NULL; /* (element-type FlatpakInstalledRef) */
   g_autoptr(GPtrArray) installed = NULL; /* (element-type FlatpakInstalledRef) */
   g_autoptr(GPtrArray) remotes = NULL; /* (element-type FlatpakRemote) */
-  g_autoptr(GHashTable) remote_commits = NULL; /* (element-type utf8 utf8) */
+  g_autoptr(GHashTable) remote_states = NULL; /* (element-type utf8 FlatpakRemoteState) */
   int i, j;
   g_autoptr(FlatpakDir) dir = NULL;
   g_auto(OstreeRepoFinderResultv) results = NULL;
@@ -1037,52 +1281,6 @@ flatpak_installation_list_installed_refs_for_update (FlatpakInstallation *self,
   g_autoptr(GPtrArray) collection_refs = NULL; /* (element-type OstreeCollectionRef) */
   g_autoptr(GString) refs_str = NULL;
 
-  remote_commits = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
-
-  remotes = flatpak_installation_list_remotes (self, cancellable, error);
-  if (remotes == NULL)
-    return NULL;
-
-  for (i = 0; i < remotes->len; i++)
-    {
-      FlatpakRemote *remote = g_ptr_array_index (remotes, i);
-      g_autoptr(GPtrArray) refs = NULL;
-      g_autoptr(GError) local_error = NULL;
-      g_autofree char *collection_id = NULL;
-      const char *remote_name = flatpak_remote_get_name (remote);
-
-      if (flatpak_remote_get_disabled (remote))
-        continue;
-
-      /* Remotes with collection IDs will be handled separately below */
-      collection_id = flatpak_remote_get_collection_id (remote);
-      if (collection_id != NULL)
-        continue;
-
-      /* We ignore errors here. we don't want one remote to fail us */
-      refs = flatpak_installation_list_remote_refs_sync (self,
-                                                         remote_name,
-                                                         cancellable, &local_error);
-      if (refs != NULL)
-        {
-          for (j = 0; j < refs->len; j++)
-            {
-              FlatpakRemoteRef *remote_ref = g_ptr_array_index (refs, j);
-              g_autofree char *full_ref = flatpak_ref_format_ref (FLATPAK_REF (remote_ref));
-              g_autofree char *key = g_strdup_printf ("%s:%s", remote_name, full_ref);
-
-              g_hash_table_insert (remote_commits, g_steal_pointer (&key),
-                                   g_strdup (flatpak_ref_get_commit (FLATPAK_REF (remote_ref))));
-            }
-        }
-      else
-        {
-          g_debug ("Update: Failed to read remote %s: %s",
-                   flatpak_remote_get_name (remote),
-                   local_error->message);
-        }
-    }
-
   installed = flatpak_installation_list_installed_refs (self, cancellable, error);
   if (installed == NULL)
     return NULL;
@@ -1093,19 +1291,35 @@ flatpak_installation_list_installed_refs_for_update (FlatpakInstallation *self,
   if (dir == NULL)
     return NULL;
 
+  remotes = flatpak_installation_list_remotes (self, cancellable, error);
+  if (remotes == NULL)
+    return NULL;
+
+  remote_states = fetch_remote_states_for_installed (dir, remotes, installed, cancellable);
+
   for (i = 0; i < installed->len; i++)
     {
       g_autoptr(FlatpakRemoteState) state = NULL;
       FlatpakInstalledRef *installed_ref = g_ptr_array_index (installed, i);
       const char *remote_name = flatpak_installed_ref_get_origin (installed_ref);
       g_autofree char *full_ref = flatpak_ref_format_ref (FLATPAK_REF (installed_ref));
-      g_autofree char *key = g_strdup_printf ("%s:%s", remote_name, full_ref);
-      const char *remote_commit = g_hash_table_lookup (remote_commits, key);
+      g_autofree char *remote_commit = NULL;
       const char *local_commit = flatpak_installed_ref_get_latest_commit (installed_ref);
+      FlatpakRemoteState *fetched_state = g_hash_table_lookup (remote_states, remote_name);
 
       if (flatpak_dir_ref_is_masked (dir, full_ref))
         continue;
 
+      if (fetched_state != NULL)
+        {
+          if (!flatpak_remote_state_lookup_ref (fetched_state, full_ref, &remote_commit, NULL, NULL))
+            g_clear_pointer (&remote_commit, g_free);
+          /* For noenumerate remotes, only refs that are available locally are considered */
+          else if (flatpak_dir_get_remote_noenumerate (dir, remote_name) &&
+                   !local_remote_ref_exists (dir, remote_name, full_ref))
+            g_clear_pointer (&remote_commit, g_free);
+        }
+
       /* Note: local_commit may be NULL here */
       if (remote_commit != NULL &&
           g_strcmp0 (remote_commit, local_commit) != 0)
@@ -1123,7 +1337,10 @@ flatpak_installation_list_installed_refs_for_update (FlatpakInstallation *self,
        * This makes sure that the ref (maybe an app or runtime) remains in usable
        * state and fixes itself through an update.
        */
-      state = flatpak_dir_get_remote_state_optional (dir, remote_name, FALSE, cancellable, error);
+      if (fetched_state != NULL)
+        state = flatpak_remote_state_ref (fetched_state);
+      else
+        state = flatpak_dir_get_remote_state_optional (dir, remote_name, FALSE, cancellable, error);
       if (state == NULL)
         continue;
 
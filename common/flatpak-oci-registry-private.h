@@ -51,6 +51,11 @@ typedef enum {
 
 FLATPAK_EXTERN GQuark  flatpak_oci_error_quark (void);
 
+typedef enum {
+  FLATPAK_OCI_LAYER_COMPRESSION_GZIP,
+  FLATPAK_OCI_LAYER_COMPRESSION_ZSTD,
+} FlatpakOciLayerCompression;
+
 typedef struct FlatpakOciLayerWriter FlatpakOciLayerWriter;
 
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (FlatpakOciLayerWriter, g_object_unref)
@@ -111,11 +116,14 @@ FlatpakOciImage *      flatpak_oci_registry_load_image_config (FlatpakOciRegistr
                                                                gsize              *out_size,
                                                                GCancellable       *cancellable,
                                                                GError            **error);
-FlatpakOciLayerWriter *flatpak_oci_registry_write_layer (FlatpakOciRegistry *self,
-                                                         GCancellable       *cancellable,
-                                                         GError            **error);
+FlatpakOciLayerWriter *flatpak_oci_registry_write_layer (FlatpakOciRegistry        *self,
+                                                         FlatpakOciLayerCompression compression,
+                                                         int                        level,
+                                                         GCancellable              *cancellable,
+                                                         GError                   **error);
 
 struct archive *flatpak_oci_layer_writer_get_archive (FlatpakOciLayerWriter *self);
+gboolean        flatpak_oci_layer_is_zstd (FlatpakOciDescriptor *desc);
 gboolean        flatpak_oci_layer_writer_close (FlatpakOciLayerWriter *self,
                                                 char                 **uncompressed_digest_out,
                                                 FlatpakOciDescriptor **res_out,
@@ -127,6 +135,22 @@ gboolean flatpak_archive_read_open_fd_with_checksum (struct archive *a,
                                                      GChecksum      *checksum,
                                                      GError        **error);
 
+typedef struct FlatpakOciLayerFetcher FlatpakOciLayerFetcher;
+
+FlatpakOciLayerFetcher *flatpak_oci_layer_fetcher_new (FlatpakOciRegistry    *registry,
+                                                       const char            *repository,
+                                                       FlatpakOciDescriptor **layers,
+                                                       int                    max_parallel,
+                                                       GCancellable          *cancellable);
+void                    flatpak_oci_layer_fetcher_free (FlatpakOciLayerFetcher *self);
+int                     flatpak_oci_layer_fetcher_wait (FlatpakOciLayerFetcher *self,
+                                                        int                     layer_nr,
+                                                        FlatpakLoadUriProgress  progress_cb,
+                                                        gpointer                user_data,
+                                                        GError                **error);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (FlatpakOciLayerFetcher, flatpak_oci_layer_fetcher_free)
+
 GBytes *flatpak_oci_sign_data (GBytes       *data,
                                const gchar **okey_ids,
                                const char   *homedir,
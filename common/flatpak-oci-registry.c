@@ -28,6 +28,10 @@
 
 #include <gpgme.h>
 #include <libsoup/soup.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
 #include "flatpak-oci-registry-private.h"
 #include "flatpak-utils-private.h"
 
@@ -679,6 +683,85 @@ checksum_fd (int fd, GCancellable *cancellable, GError **error)
   return g_strdup (g_checksum_get_string (checksum));
 }
 
+/* An output stream that hashes what is written through it, and
+ * optionally tells someone how many bytes went through, so that the
+ * progress of downloads on other threads can be tracked. */
+typedef void (*FlatpakOciBlobWrittenFunc) (gsize    bytes_written,
+                                           gpointer user_data);
+
+typedef struct
+{
+  GFilterOutputStream       parent;
+
+  GChecksum                *checksum;
+  FlatpakOciBlobWrittenFunc written_func;
+  gpointer                  written_data;
+} FlatpakOciBlobOutputStream;
+
+typedef struct
+{
+  GFilterOutputStreamClass parent_class;
+} FlatpakOciBlobOutputStreamClass;
+
+GType flatpak_oci_blob_output_stream_get_type (void);
+
+G_DEFINE_TYPE (FlatpakOciBlobOutputStream, flatpak_oci_blob_output_stream, G_TYPE_FILTER_OUTPUT_STREAM)
+
+static gssize
+flatpak_oci_blob_output_stream_write (GOutputStream *stream,
+                                      const void    *buffer,
+                                      gsize          count,
+                                      GCancellable  *cancellable,
+                                      GError       **error)
+{
+  FlatpakOciBlobOutputStream *self = (FlatpakOciBlobOutputStream *) stream;
+  GOutputStream *base = g_filter_output_stream_get_base_stream (G_FILTER_OUTPUT_STREAM (stream));
+  gssize res;
+
+  res = g_output_stream_write (base, buffer, count, cancellable, error);
+  if (res <= 0)
+    return res;
+
+  if (self->checksum)
+    g_checksum_update (self->checksum, buffer, res);
+
+  if (self->written_func)
+    self->written_func (res, self->written_data);
+
+  return res;
+}
+
+static void
+flatpak_oci_blob_output_stream_class_init (FlatpakOciBlobOutputStreamClass *klass)
+{
+  GOutputStreamClass *stream_class = G_OUTPUT_STREAM_CLASS (klass);
+
+  stream_class->write_fn = flatpak_oci_blob_output_stream_write;
+}
+
+static void
+flatpak_oci_blob_output_stream_init (FlatpakOciBlobOutputStream *self)
+{
+}
+
+static GOutputStream *
+flatpak_oci_blob_output_stream_new (GOutputStream            *base,
+                                    GChecksum                *checksum,
+                                    FlatpakOciBlobWrittenFunc written_func,
+                                    gpointer                  written_data)
+{
+  FlatpakOciBlobOutputStream *self;
+
+  self = g_object_new (flatpak_oci_blob_output_stream_get_type (),
+                       "base-stream", base,
+                       NULL);
+  self->checksum = checksum;
+  self->written_func = written_func;
+  self->written_data = written_data;
+
+  return G_OUTPUT_STREAM (self);
+}
+
 int
 flatpak_oci_registry_download_blob (FlatpakOciRegistry    *self,
                                     const char            *repository,
@@ -709,9 +792,10 @@ flatpak_oci_registry_download_blob (FlatpakOciRegistry    *self,
     {
       g_autoptr(SoupURI) uri = NULL;
       g_autofree char *uri_s = NULL;
-      g_autofree char *checksum = NULL;
+      g_autoptr(GChecksum) checksum = g_checksum_new (G_CHECKSUM_SHA256);
       g_autofree char *tmpfile_name = g_strdup_printf ("oci-layer-XXXXXX");
       g_autoptr(GOutputStream) out_stream = NULL;
+      g_autoptr(GOutputStream) checksum_stream = NULL;
 
       /* remote case, download and verify */
 
@@ -735,24 +819,23 @@ flatpak_oci_registry_download_blob (FlatpakOciRegistry    *self,
       if (fd == -1)
         return -1;
 
+      /* Hash while downloading rather than re-reading the blob afterwards */
+      checksum_stream = flatpak_oci_blob_output_stream_new (out_stream, checksum, NULL, NULL);
+
       if (!flatpak_download_http_uri (self->soup_session, uri_s,
                                       FLATPAK_HTTP_FLAGS_ACCEPT_OCI,
-                                      out_stream,
+                                      checksum_stream, 0,
                                       progress_cb, user_data,
                                       cancellable, error))
         return -1;
 
-      if (!g_output_stream_close (out_stream, cancellable, error))
+      if (!g_output_stream_close (checksum_stream, cancellable, error))
         return -1;
 
-      checksum = checksum_fd (fd, cancellable, error);
-      if (checksum == NULL)
-        return -1;
-
-      if (strcmp (checksum, digest + strlen ("sha256:")) != 0)
+      if (strcmp (g_checksum_get_string (checksum), digest + strlen ("sha256:")) != 0)
         {
           g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
-                       "Checksum digest did not match (%s != %s)", digest, checksum);
+                       "Checksum digest did not match (%s != %s)", digest, g_checksum_get_string (checksum));
           return -1;
         }
 
@@ -834,7 +917,7 @@ flatpak_oci_registry_mirror_blob (FlatpakOciRegistry    *self,
 
       uri_s = soup_uri_to_string (uri, FALSE);
       if (!flatpak_download_http_uri (source_registry->soup_session, uri_s,
-                                      FLATPAK_HTTP_FLAGS_ACCEPT_OCI, out_stream,
+                                      FLATPAK_HTTP_FLAGS_ACCEPT_OCI, out_stream, 0,
                                       progress_cb, user_data,
                                       cancellable, error))
         return FALSE;
@@ -978,6 +1061,41 @@ flatpak_oci_registry_load_image_config (FlatpakOciRegistry *self,
   return flatpak_oci_image_from_json (bytes, error);
 }
 
+/* Layers are compressed pigz-style: the tar stream is cut into fixed
+ * size blocks that are deflated independently on a thread pool (each
+ * primed with the tail of the previous block as dictionary) and byte
+ * aligned with a sync flush, so the raw deflate outputs can simply be
+ * concatenated between one gzip header and trailer. The output only
+ * depends on the block size, not on the number of threads. */
+#define FLATPAK_OCI_LAYER_BLOCK_SIZE (128 * 1024)
+#define FLATPAK_OCI_LAYER_DICT_SIZE (32 * 1024)
+
+typedef struct
+{
+  guchar     *input;
+  gsize       input_len;
+  guchar     *dict;
+  gsize       dict_len;
+  gboolean    last;
+
+  /* Set by the compress thread */
+  GByteArray *output;
+  guint32     crc;
+  char       *error;
+  gboolean    done;
+} FlatpakOciCompressJob;
+
+static void
+flatpak_oci_compress_job_free (FlatpakOciCompressJob *job)
+{
+  g_free (job->input);
+  g_free (job->dict);
+  if (job->output)
+    g_byte_array_unref (job->output);
+  g_free (job->error);
+  g_free (job);
+}
+
 struct FlatpakOciLayerWriter
 {
   GObject             parent;
@@ -987,10 +1105,28 @@ struct FlatpakOciLayerWriter
   GChecksum          *uncompressed_checksum;
   GChecksum          *compressed_checksum;
   struct archive     *archive;
-  GZlibCompressor    *compressor;
   guint64             uncompressed_size;
   guint64             compressed_size;
   GLnxTmpfile         tmpf;
+  FlatpakOciLayerCompression compression;
+  int                 level;
+
+#ifdef HAVE_ZSTD
+  ZSTD_CCtx          *zstd;
+  guchar             *zstd_out;
+#endif
+
+  GThreadPool        *compress_pool;
+  guint               max_pending;
+  GMutex              compress_lock;
+  GCond               compress_cond;
+  GQueue              compress_jobs; /* FlatpakOciCompressJob, in stream order */
+  guchar             *block;
+  gsize               block_len;
+  guchar             *dict;
+  gsize               dict_len;
+  guint32             crc;
+  gboolean            header_written;
 };
 
 typedef struct
@@ -1023,7 +1159,25 @@ flatpak_oci_layer_writer_reset (FlatpakOciLayerWriter *self)
       self->archive = NULL;
     }
 
-  g_clear_object (&self->compressor);
+  if (self->compress_pool)
+    {
+      g_thread_pool_free (self->compress_pool, FALSE, TRUE);
+      self->compress_pool = NULL;
+    }
+
+  g_queue_foreach (&self->compress_jobs, (GFunc) flatpak_oci_compress_job_free, NULL);
+  g_queue_clear (&self->compress_jobs);
+  g_clear_pointer (&self->block, g_free);
+  self->block_len = 0;
+  g_clear_pointer (&self->dict, g_free);
+  self->dict_len = 0;
+  self->crc = crc32 (0, NULL, 0);
+  self->header_written = FALSE;
+
+#ifdef HAVE_ZSTD
+  g_clear_pointer (&self->zstd, ZSTD_freeCCtx);
+  g_clear_pointer (&self->zstd_out, g_free);
+#endif
 }
 
 
@@ -1040,6 +1194,9 @@ flatpak_oci_layer_writer_finalize (GObject *object)
 
   g_clear_object (&self->registry);
 
+  g_mutex_clear (&self->compress_lock);
+  g_cond_clear (&self->compress_cond);
+
   G_OBJECT_CLASS (flatpak_oci_layer_writer_parent_class)->finalize (object);
 }
 
@@ -1056,6 +1213,9 @@ flatpak_oci_layer_writer_init (FlatpakOciLayerWriter *self)
 {
   self->uncompressed_checksum = g_checksum_new (G_CHECKSUM_SHA256);
   self->compressed_checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  g_mutex_init (&self->compress_lock);
+  g_cond_init (&self->compress_cond);
+  g_queue_init (&self->compress_jobs);
 }
 
 static int
@@ -1065,64 +1225,267 @@ flatpak_oci_layer_writer_open_cb (struct archive *archive,
   return ARCHIVE_OK;
 }
 
+static void
+flatpak_oci_compress_job_run (gpointer data,
+                              gpointer user_data)
+{
+  FlatpakOciCompressJob *job = data;
+  FlatpakOciLayerWriter *self = user_data;
+  z_stream stream = { NULL };
+  gsize out_len = 0;
+  int res;
+
+  job->crc = crc32 (0, job->input, job->input_len);
+
+  res = deflateInit2 (&stream, self->level, Z_DEFLATED,
+                      -MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+  if (res != Z_OK)
+    {
+      job->error = g_strdup_printf ("Failed to initialize compression: %s", zError (res));
+      goto out;
+    }
+
+  if (job->dict_len > 0)
+    {
+      res = deflateSetDictionary (&stream, job->dict, job->dict_len);
+      if (res != Z_OK)
+        {
+          job->error = g_strdup_printf ("Failed to set compression dictionary: %s", zError (res));
+          deflateEnd (&stream);
+          goto out;
+        }
+    }
+
+  job->output = g_byte_array_new ();
+  g_byte_array_set_size (job->output, deflateBound (&stream, job->input_len) + 16);
+
+  stream.next_in = job->input;
+  stream.avail_in = job->input_len;
+
+  while (TRUE)
+    {
+      stream.next_out = job->output->data + out_len;
+      stream.avail_out = job->output->len - out_len;
+
+      res = deflate (&stream, job->last ? Z_FINISH : Z_SYNC_FLUSH);
+      if (res == Z_STREAM_ERROR)
+        {
+          job->error = g_strdup_printf ("Compression failed: %s", zError (res));
+          break;
+        }
+
+      out_len = job->output->len - stream.avail_out;
+      if (stream.avail_out != 0 && (!job->last || res == Z_STREAM_END))
+        break;
+
+      g_byte_array_set_size (job->output, job->output->len + 64 * 1024);
+    }
+
+  g_byte_array_set_size (job->output, out_len);
+  deflateEnd (&stream);
+
+out:
+  g_mutex_lock (&self->compress_lock);
+  job->done = TRUE;
+  g_cond_broadcast (&self->compress_cond);
+  g_mutex_unlock (&self->compress_lock);
+}
+
+static gboolean
+flatpak_oci_layer_writer_write_out (FlatpakOciLayerWriter *self,
+                                    const guchar          *to_write,
+                                    gsize                  to_write_len)
+{
+  g_checksum_update (self->compressed_checksum, to_write, to_write_len);
+  self->compressed_size += to_write_len;
+
+  while (to_write_len > 0)
+    {
+      ssize_t res = write (self->tmpf.fd, to_write, to_write_len);
+      if (res <= 0)
+        {
+          if (errno == EINTR)
+            continue;
+          archive_set_error (self->archive, errno, "Write error");
+          return FALSE;
+        }
+
+      to_write_len -= res;
+      to_write += res;
+    }
+
+  return TRUE;
+}
+
+/* Writes out all finished blocks at the head of the queue, waiting
+ * until no more than @max_pending blocks are left in flight. */
+static gboolean
+flatpak_oci_layer_writer_drain (FlatpakOciLayerWriter *self,
+                                guint                  max_pending)
+{
+  g_mutex_lock (&self->compress_lock);
+  while (TRUE)
+    {
+      FlatpakOciCompressJob *job = g_queue_peek_head (&self->compress_jobs);
+      gboolean ok;
+
+      if (job == NULL)
+        break;
+
+      if (!job->done)
+        {
+          if (self->compress_jobs.length <= max_pending)
+            break;
+          g_cond_wait (&self->compress_cond, &self->compress_lock);
+          continue;
+        }
+
+      g_queue_pop_head (&self->compress_jobs);
+      g_mutex_unlock (&self->compress_lock);
+
+      if (job->error)
+        {
+          archive_set_error (self->archive, EIO, "%s", job->error);
+          ok = FALSE;
+        }
+      else
+        {
+          self->crc = crc32_combine (self->crc, job->crc, job->input_len);
+          ok = flatpak_oci_layer_writer_write_out (self, job->output->data, job->output->len);
+        }
+
+      flatpak_oci_compress_job_free (job);
+      if (!ok)
+        return FALSE;
+
+      g_mutex_lock (&self->compress_lock);
+    }
+  g_mutex_unlock (&self->compress_lock);
+
+  return TRUE;
+}
+
+static gboolean
+flatpak_oci_layer_writer_submit_block (FlatpakOciLayerWriter *self,
+                                       gboolean               last)
+{
+  FlatpakOciCompressJob *job = g_new0 (FlatpakOciCompressJob, 1);
+
+  job->input = g_steal_pointer (&self->block);
+  job->input_len = self->block_len;
+  job->dict = g_steal_pointer (&self->dict);
+  job->dict_len = self->dict_len;
+  job->last = last;
+  self->block_len = 0;
+
+  /* The tail of this block primes the dictionary of the next one */
+  self->dict_len = MIN (job->input_len, FLATPAK_OCI_LAYER_DICT_SIZE);
+  if (self->dict_len > 0)
+    self->dict = g_memdup (job->input + job->input_len - self->dict_len, self->dict_len);
+
+  g_mutex_lock (&self->compress_lock);
+  g_queue_push_tail (&self->compress_jobs, job);
+  g_mutex_unlock (&self->compress_lock);
+
+  g_thread_pool_push (self->compress_pool, job, NULL);
+
+  return flatpak_oci_layer_writer_drain (self, self->max_pending);
+}
+
+#ifdef HAVE_ZSTD
+/* zstd does its own block splitting on worker threads, and its output
+ * does not depend on the number of workers. */
+static gssize
+flatpak_oci_layer_writer_compress_zstd (FlatpakOciLayerWriter *self,
+                                        const void            *buffer,
+                                        size_t                 length,
+                                        gboolean               at_end)
+{
+  ZSTD_inBuffer in = { buffer, length, 0 };
+  gboolean finished;
+
+  g_checksum_update (self->uncompressed_checksum, buffer, length);
+  self->uncompressed_size += length;
+
+  do
+    {
+      ZSTD_outBuffer out = { self->zstd_out, ZSTD_CStreamOutSize (), 0 };
+      size_t remaining;
+
+      remaining = ZSTD_compressStream2 (self->zstd, &out, &in,
+                                        at_end ? ZSTD_e_end : ZSTD_e_continue);
+      if (ZSTD_isError (remaining))
+        {
+          archive_set_error (self->archive, EIO, "%s", ZSTD_getErrorName (remaining));
+          return -1;
+        }
+
+      if (!flatpak_oci_layer_writer_write_out (self, out.dst, out.pos))
+        return -1;
+
+      finished = at_end ? remaining == 0 : in.pos == in.size;
+    }
+  while (!finished);
+
+  return length;
+}
+#endif
+
 static gssize
 flatpak_oci_layer_writer_compress (FlatpakOciLayerWriter *self,
                                    const void            *buffer,
                                    size_t                 length,
                                    gboolean               at_end)
 {
-  guchar compressed_buffer[8192];
-  GConverterResult res;
-  gsize total_bytes_read, bytes_read, bytes_written, to_write_len;
-  guchar *to_write;
-  g_autoptr(GError) local_error = NULL;
-  GConverterFlags flags = 0;
-  bytes_read = 0;
+  const guchar *data = buffer;
+  gsize total_bytes_read = 0;
 
-  total_bytes_read = 0;
+#ifdef HAVE_ZSTD
+  if (self->compression == FLATPAK_OCI_LAYER_COMPRESSION_ZSTD)
+    return flatpak_oci_layer_writer_compress_zstd (self, buffer, length, at_end);
+#endif
 
-  if (at_end)
-    flags |= G_CONVERTER_INPUT_AT_END;
+  if (!self->header_written)
+    {
+      /* Same header as GZlibCompressor: no mtime, unix OS */
+      static const guchar gzip_header[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3 };
 
-  do
+      if (!flatpak_oci_layer_writer_write_out (self, gzip_header, sizeof (gzip_header)))
+        return -1;
+      self->header_written = TRUE;
+    }
+
+  while (total_bytes_read < length)
     {
-      res = g_converter_convert (G_CONVERTER (self->compressor),
-                                 buffer, length,
-                                 compressed_buffer, sizeof (compressed_buffer),
-                                 flags, &bytes_read, &bytes_written,
-                                 &local_error);
-      if (res == G_CONVERTER_ERROR)
-        {
-          archive_set_error (self->archive, EIO, "%s", local_error->message);
-          return -1;
-        }
+      gsize n = MIN (length - total_bytes_read, FLATPAK_OCI_LAYER_BLOCK_SIZE - self->block_len);
 
-      g_checksum_update (self->uncompressed_checksum, buffer, bytes_read);
-      g_checksum_update (self->compressed_checksum, compressed_buffer, bytes_written);
-      self->uncompressed_size += bytes_read;
-      self->compressed_size += bytes_written;
+      if (self->block == NULL)
+        self->block = g_malloc (FLATPAK_OCI_LAYER_BLOCK_SIZE);
 
-      to_write_len = bytes_written;
-      to_write = compressed_buffer;
-      while (to_write_len > 0)
-        {
-          ssize_t res = write (self->tmpf.fd, to_write, to_write_len);
-          if (res <= 0)
-            {
-              if (errno == EINTR)
-                continue;
-              archive_set_error (self->archive, errno, "Write error");
-              return -1;
-            }
+      memcpy (self->block + self->block_len, data + total_bytes_read, n);
+      g_checksum_update (self->uncompressed_checksum, data + total_bytes_read, n);
+      self->uncompressed_size += n;
+      self->block_len += n;
+      total_bytes_read += n;
 
-          to_write_len -= res;
-          to_write += res;
-        }
+      if (self->block_len == FLATPAK_OCI_LAYER_BLOCK_SIZE &&
+          !flatpak_oci_layer_writer_submit_block (self, FALSE))
+        return -1;
+    }
+
+  if (at_end)
+    {
+      guint32 gzip_trailer[2];
 
-      total_bytes_read += bytes_read;
+      if (!flatpak_oci_layer_writer_submit_block (self, TRUE) ||
+          !flatpak_oci_layer_writer_drain (self, 0))
+        return -1;
+
+      gzip_trailer[0] = GUINT32_TO_LE (self->crc);
+      gzip_trailer[1] = GUINT32_TO_LE ((guint32) self->uncompressed_size);
+      if (!flatpak_oci_layer_writer_write_out (self, (const guchar *) gzip_trailer, sizeof (gzip_trailer)))
+        return -1;
     }
-  while ((length > 0 && bytes_read == 0) || /* Repeat if we consumed nothing */
-         (at_end && res != G_CONVERTER_FINISHED)); /* Or until finished if at_end */
 
   return total_bytes_read;
 }
@@ -1154,9 +1517,11 @@ flatpak_oci_layer_writer_close_cb (struct archive *archive,
 }
 
 FlatpakOciLayerWriter *
-flatpak_oci_registry_write_layer (FlatpakOciRegistry *self,
-                                  GCancellable       *cancellable,
-                                  GError            **error)
+flatpak_oci_registry_write_layer (FlatpakOciRegistry        *self,
+                                  FlatpakOciLayerCompression compression,
+                                  int                        level,
+                                  GCancellable              *cancellable,
+                                  GError                   **error)
 {
   g_autoptr(FlatpakOciLayerWriter) oci_layer_writer = NULL;
   g_autoptr(FlatpakAutoArchiveWrite) a = NULL;
@@ -1171,6 +1536,41 @@ flatpak_oci_registry_write_layer (FlatpakOciRegistry *self,
       return NULL;
     }
 
+  /* A negative level picks the default for the compression type */
+  switch (compression)
+    {
+    case FLATPAK_OCI_LAYER_COMPRESSION_GZIP:
+      if (level > 9)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                       "Invalid gzip compression level %d", level);
+          return NULL;
+        }
+      if (level < 0)
+        level = Z_DEFAULT_COMPRESSION;
+      break;
+
+    case FLATPAK_OCI_LAYER_COMPRESSION_ZSTD:
+#ifdef HAVE_ZSTD
+      if (level == 0 || level > ZSTD_maxCLevel ())
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                       "Invalid zstd compression level %d", level);
+          return NULL;
+        }
+      if (level < 0)
+        level = ZSTD_CLEVEL_DEFAULT;
+      break;
+#else
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                   "zstd compression not supported");
+      return NULL;
+#endif
+
+    default:
+      g_assert_not_reached ();
+    }
+
   oci_layer_writer = g_object_new (FLATPAK_TYPE_OCI_LAYER_WRITER, NULL);
   oci_layer_writer->registry = g_object_ref (self);
 
@@ -1210,7 +1610,46 @@ flatpak_oci_registry_write_layer (FlatpakOciRegistry *self,
   /* Transfer ownership of the tmpfile */
   oci_layer_writer->tmpf = tmpf;
   tmpf.initialized = 0;
-  oci_layer_writer->compressor = g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_GZIP, -1);
+  oci_layer_writer->compression = compression;
+  oci_layer_writer->level = level;
+
+#ifdef HAVE_ZSTD
+  if (compression == FLATPAK_OCI_LAYER_COMPRESSION_ZSTD)
+    {
+      size_t res;
+
+      oci_layer_writer->zstd = ZSTD_createCCtx ();
+      if (oci_layer_writer->zstd == NULL)
+        {
+          flatpak_fail (error, "Failed to create zstd compression context");
+          return NULL;
+        }
+
+      res = ZSTD_CCtx_setParameter (oci_layer_writer->zstd, ZSTD_c_compressionLevel, level);
+      if (!ZSTD_isError (res))
+        res = ZSTD_CCtx_setParameter (oci_layer_writer->zstd, ZSTD_c_checksumFlag, 1);
+      if (ZSTD_isError (res))
+        {
+          flatpak_fail (error, "Failed to set up zstd compression: %s", ZSTD_getErrorName (res));
+          return NULL;
+        }
+
+      /* libzstd built without thread support refuses workers, and then
+         compresses on the calling thread */
+      res = ZSTD_CCtx_setParameter (oci_layer_writer->zstd, ZSTD_c_nbWorkers, g_get_num_processors ());
+      if (ZSTD_isError (res))
+        g_debug ("Compressing zstd layer on a single thread: %s", ZSTD_getErrorName (res));
+
+      oci_layer_writer->zstd_out = g_malloc (ZSTD_CStreamOutSize ());
+      return g_steal_pointer (&oci_layer_writer);
+    }
+#endif
+
+  oci_layer_writer->max_pending = 2 * g_get_num_processors ();
+  oci_layer_writer->compress_pool = g_thread_pool_new (flatpak_oci_compress_job_run,
+                                                       oci_layer_writer,
+                                                       g_get_num_processors (),
+                                                       FALSE, NULL);
 
   return g_steal_pointer (&oci_layer_writer);
 }
@@ -1243,7 +1682,12 @@ flatpak_oci_layer_writer_close (FlatpakOciLayerWriter *self,
     {
       g_autofree char *digest = g_strdup_printf ("sha256:%s", g_checksum_get_string (self->compressed_checksum));
 
-      *res_out = flatpak_oci_descriptor_new (FLATPAK_OCI_MEDIA_TYPE_IMAGE_LAYER, digest, self->compressed_size);
+      const char *media_type = FLATPAK_OCI_MEDIA_TYPE_IMAGE_LAYER;
+
+      if (self->compression == FLATPAK_OCI_LAYER_COMPRESSION_ZSTD)
+        media_type = FLATPAK_OCI_MEDIA_TYPE_IMAGE_LAYER_ZSTD;
+
+      *res_out = flatpak_oci_descriptor_new (media_type, digest, self->compressed_size);
     }
 
   return TRUE;
@@ -1255,6 +1699,14 @@ flatpak_oci_layer_writer_get_archive (FlatpakOciLayerWriter *self)
   return self->archive;
 }
 
+gboolean
+flatpak_oci_layer_is_zstd (FlatpakOciDescriptor *desc)
+{
+  return desc->mediatype != NULL &&
+         (strcmp (desc->mediatype, FLATPAK_OCI_MEDIA_TYPE_IMAGE_LAYER_ZSTD) == 0 ||
+          strcmp (desc->mediatype, FLATPAK_OCI_MEDIA_TYPE_IMAGE_LAYER_NONDISTRIBUTABLE_ZSTD) == 0);
+}
+
 typedef struct
 {
   int        fd;
@@ -1336,6 +1788,298 @@ flatpak_archive_read_open_fd_with_checksum (struct archive *a,
   return TRUE;
 }
 
+/* A FlatpakOciLayerFetcher downloads the layers of an image in the
+ * background, a few at a time, into unlinked tmpfiles, and verifies
+ * their digests as they arrive. The layers are then handed out (in
+ * order) only once they are complete and verified, so importing a
+ * layer overlaps with the downloads of the layers after it, but nothing
+ * unverified is ever passed to libarchive. */
+
+typedef struct
+{
+  FlatpakOciLayerFetcher *fetcher;
+  char                   *digest;
+
+  /* Protected by fetcher->lock */
+  int                     fd;
+  gboolean                finished;
+  GError                 *error;
+} FlatpakOciFetchedLayer;
+
+struct FlatpakOciLayerFetcher
+{
+  FlatpakOciRegistry     *registry;
+  char                   *repository;
+  GCancellable           *cancellable;
+  GCancellable           *caller_cancellable;
+  gulong                  cancelled_id;
+  GThreadPool            *pool;
+
+  GMutex                  lock;
+  GCond                   cond;
+  guint64                 downloaded;
+
+  guint                   n_layers;
+  FlatpakOciFetchedLayer *layers;
+};
+
+static void
+fetched_layer_written (gsize    bytes_written,
+                       gpointer user_data)
+{
+  FlatpakOciFetchedLayer *layer = user_data;
+  FlatpakOciLayerFetcher *fetcher = layer->fetcher;
+
+  g_mutex_lock (&fetcher->lock);
+  fetcher->downloaded += bytes_written;
+  g_cond_broadcast (&fetcher->cond);
+  g_mutex_unlock (&fetcher->lock);
+}
+
+static int
+fetch_layer (FlatpakOciLayerFetcher *fetcher,
+             FlatpakOciFetchedLayer *layer,
+             GError                **error)
+{
+  FlatpakOciRegistry *registry = fetcher->registry;
+  g_autoptr(GChecksum) checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  g_autofree char *subpath = NULL;
+  g_autofree char *local_checksum = NULL;
+  const char *actual;
+  glnx_autofd int fd = -1;
+
+  if (!g_str_has_prefix (layer->digest, "sha256:"))
+    {
+      flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Unsupported layer digest %s"), layer->digest);
+      return -1;
+    }
+
+  subpath = get_digest_subpath (registry, fetcher->repository, FALSE, layer->digest, error);
+  if (subpath == NULL)
+    return -1;
+
+  if (registry->dfd != -1)
+    {
+      struct stat stbuf;
+
+      /* Local case, nothing to download, but still verify it */
+      fd = local_open_file (registry->dfd, subpath, &stbuf, fetcher->cancellable, error);
+      if (fd == -1)
+        return -1;
+
+      local_checksum = checksum_fd (fd, fetcher->cancellable, error);
+      if (local_checksum == NULL)
+        return -1;
+      actual = local_checksum;
+
+      fetched_layer_written (stbuf.st_size, layer);
+    }
+  else
+    {
+      g_autoptr(SoupURI) uri = NULL;
+      g_autofree char *uri_s = NULL;
+      g_autofree char *tmpfile_name = g_strdup_printf ("oci-layer-XXXXXX");
+      g_autoptr(GOutputStream) out_stream = NULL;
+      g_autoptr(GOutputStream) checksum_stream = NULL;
+
+      uri = soup_uri_new_with_base (registry->base_uri, subpath);
+      if (uri == NULL)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                       "Invalid relative url %s", subpath);
+          return -1;
+        }
+
+      uri_s = soup_uri_to_string (uri, FALSE);
+
+      if (!flatpak_open_in_tmpdir_at (registry->tmp_dfd, 0600, tmpfile_name,
+                                      &out_stream, fetcher->cancellable, error))
+        return -1;
+
+      fd = local_open_file (registry->tmp_dfd, tmpfile_name, NULL, fetcher->cancellable, error);
+      (void) unlinkat (registry->tmp_dfd, tmpfile_name, 0);
+
+      if (fd == -1)
+        return -1;
+
+      checksum_stream = flatpak_oci_blob_output_stream_new (out_stream, checksum,
+                                                            fetched_layer_written, layer);
+
+      if (!flatpak_download_http_uri (registry->soup_session, uri_s,
+                                      FLATPAK_HTTP_FLAGS_ACCEPT_OCI,
+                                      checksum_stream,
+                                      NULL, NULL,
+                                      fetcher->cancellable, error))
+        return -1;
+
+      if (!g_output_stream_close (checksum_stream, fetcher->cancellable, error))
+        return -1;
+
+      actual = g_checksum_get_string (checksum);
+    }
+
+  if (strcmp (layer->digest + strlen ("sha256:"), actual) != 0)
+    {
+      flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Wrong layer checksum, expected %s, was %s"), layer->digest, actual);
+      return -1;
+    }
+
+  if (lseek (fd, 0, SEEK_SET) == (off_t) -1)
+    {
+      glnx_set_error_from_errno (error);
+      return -1;
+    }
+
+  return glnx_steal_fd (&fd);
+}
+
+static void
+fetch_layer_thread (gpointer data,
+                    gpointer user_data)
+{
+  FlatpakOciFetchedLayer *layer = data;
+  FlatpakOciLayerFetcher *fetcher = user_data;
+  g_autoptr(GMainContextPopDefault) context = flatpak_main_context_new_default ();
+  g_autoptr(GError) local_error = NULL;
+  int fd;
+
+  fd = fetch_layer (fetcher, layer, &local_error);
+
+  g_mutex_lock (&fetcher->lock);
+  layer->finished = TRUE;
+  layer->fd = fd;
+  if (fd == -1)
+    layer->error = g_steal_pointer (&local_error);
+  g_cond_broadcast (&fetcher->cond);
+  g_mutex_unlock (&fetcher->lock);
+}
+
+static void
+cancel_layer_fetcher (GCancellable *caller_cancellable,
+                      GCancellable *cancellable)
+{
+  g_cancellable_cancel (cancellable);
+}
+
+FlatpakOciLayerFetcher *
+flatpak_oci_layer_fetcher_new (FlatpakOciRegistry    *registry,
+                               const char            *repository,
+                               FlatpakOciDescriptor **layers,
+                               int                    max_parallel,
+                               GCancellable          *cancellable)
+{
+  FlatpakOciLayerFetcher *self = g_new0 (FlatpakOciLayerFetcher, 1);
+  guint i;
+
+  g_assert (registry->valid);
+
+  self->registry = g_object_ref (registry);
+  self->repository = g_strdup (repository);
+  self->cancellable = g_cancellable_new ();
+  g_mutex_init (&self->lock);
+  g_cond_init (&self->cond);
+
+  if (cancellable)
+    {
+      self->caller_cancellable = g_object_ref (cancellable);
+      self->cancelled_id = g_cancellable_connect (cancellable, G_CALLBACK (cancel_layer_fetcher),
+                                                  self->cancellable, NULL);
+    }
+
+  while (layers[self->n_layers] != NULL)
+    self->n_layers++;
+
+  self->layers = g_new0 (FlatpakOciFetchedLayer, self->n_layers);
+  self->pool = g_thread_pool_new (fetch_layer_thread, self, MAX (max_parallel, 1), FALSE, NULL);
+
+  /* The pool is FIFO, so layers are fetched roughly in the order they are imported */
+  for (i = 0; i < self->n_layers; i++)
+    {
+      FlatpakOciFetchedLayer *layer = &self->layers[i];
+
+      layer->fetcher = self;
+      layer->digest = g_strdup (layers[i]->digest);
+      layer->fd = -1;
+
+      g_thread_pool_push (self->pool, layer, NULL);
+    }
+
+  return self;
+}
+
+void
+flatpak_oci_layer_fetcher_free (FlatpakOciLayerFetcher *self)
+{
+  guint i;
+
+  /* Stop any downloads that are still running, and drop the queued ones */
+  g_cancellable_cancel (self->cancellable);
+  g_thread_pool_free (self->pool, TRUE, TRUE);
+
+  if (self->cancelled_id)
+    g_cancellable_disconnect (self->caller_cancellable, self->cancelled_id);
+  g_clear_object (&self->caller_cancellable);
+
+  for (i = 0; i < self->n_layers; i++)
+    {
+      FlatpakOciFetchedLayer *layer = &self->layers[i];
+
+      glnx_close_fd (&layer->fd);
+      g_free (layer->digest);
+      g_clear_error (&layer->error);
+    }
+  g_free (self->layers);
+
+  g_mutex_clear (&self->lock);
+  g_cond_clear (&self->cond);
+  g_object_unref (self->cancellable);
+  g_free (self->repository);
+  g_object_unref (self->registry);
+  g_free (self);
+}
+
+/* Waits until layer number @layer_nr is downloaded and its digest is
+ * verified, reporting the total downloaded so far while waiting, and
+ * returns an fd for it positioned at the start. The caller owns the fd. */
+int
+flatpak_oci_layer_fetcher_wait (FlatpakOciLayerFetcher *self,
+                                int                     layer_nr,
+                                FlatpakLoadUriProgress  progress_cb,
+                                gpointer                user_data,
+                                GError                **error)
+{
+  FlatpakOciFetchedLayer *layer;
+  guint64 downloaded;
+  int fd = -1;
+
+  g_assert (layer_nr >= 0 && (guint) layer_nr < self->n_layers);
+
+  layer = &self->layers[layer_nr];
+
+  g_mutex_lock (&self->lock);
+  while (!layer->finished)
+    {
+      g_cond_wait_until (&self->cond, &self->lock,
+                         g_get_monotonic_time () + G_TIME_SPAN_SECOND);
+
+      if (progress_cb)
+        {
+          downloaded = self->downloaded;
+          g_mutex_unlock (&self->lock);
+          progress_cb (downloaded, user_data);
+          g_mutex_lock (&self->lock);
+        }
+    }
+
+  if (layer->error)
+    g_propagate_error (error, g_error_copy (layer->error));
+  else
+    fd = glnx_steal_fd (&layer->fd);
+  g_mutex_unlock (&self->lock);
+
+  return fd;
+}
+
 G_DEFINE_AUTO_CLEANUP_FREE_FUNC (gpgme_data_t, gpgme_data_release, NULL)
 G_DEFINE_AUTO_CLEANUP_FREE_FUNC (gpgme_ctx_t, gpgme_release, NULL)
 G_DEFINE_AUTO_CLEANUP_FREE_FUNC (gpgme_key_t, gpgme_key_unref, NULL)
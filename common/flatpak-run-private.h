@@ -141,6 +141,12 @@ gboolean flatpak_ensure_data_dir (GFile        *app_id_dir,
                                   GCancellable *cancellable,
                                   GError      **error);
 
+GFile *flatpak_get_user_ld_cache_dir (void);
+gboolean flatpak_run_ensure_ld_cache (FlatpakDeploy *deploy,
+                                      const char    *ref,
+                                      GCancellable  *cancellable,
+                                      GError       **error);
+
 gboolean flatpak_run_setup_base_argv (FlatpakBwrap   *bwrap,
                                       GFile          *runtime_files,
                                       GFile          *app_id_dir,
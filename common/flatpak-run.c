@@ -49,6 +49,10 @@
 #include <X11/Xauth.h>
 #endif
 
+#ifdef HAVE_LIBSYSTEMD
+#include <systemd/sd-journal.h>
+#endif
+
 #include <glib/gi18n-lib.h>
 
 #include <gio/gio.h>
@@ -64,6 +68,172 @@
 
 #define DEFAULT_SHELL "/bin/sh"
 
+/* Launch tracing records how long each phase of flatpak_run_app() takes,
+ * and is enabled with --trace-launch, or by setting FLATPAK_TRACE_LAUNCH
+ * to a comma separated list of "stderr" and "journal". */
+#define FLATPAK_LAUNCH_TRACE_MESSAGE_ID "0b0a5c4e4f3f4b4c9d2ab7e3a1f5c6d8"
+
+typedef struct
+{
+  const char *name;
+  gint64      usec;
+} LaunchTracePhase;
+
+typedef struct
+{
+  gboolean to_stderr;
+  gboolean to_journal;
+  gint64   start;
+  gint64   last;
+  GArray  *phases;
+} LaunchTrace;
+
+/* There is only one launch per process, so nested helpers find it here */
+static LaunchTrace *current_launch_trace;
+
+static LaunchTrace *
+launch_trace_new (FlatpakRunFlags flags)
+{
+  const char *env = g_getenv ("FLATPAK_TRACE_LAUNCH");
+  LaunchTrace *trace;
+  gboolean to_stderr = (flags & FLATPAK_RUN_FLAG_TRACE_LAUNCH) != 0;
+  gboolean to_journal = FALSE;
+
+  if (env != NULL && *env != 0)
+    {
+      g_auto(GStrv) targets = g_strsplit (env, ",", -1);
+      int i;
+
+      for (i = 0; targets[i] != NULL; i++)
+        {
+          if (strcmp (targets[i], "journal") == 0)
+            to_journal = TRUE;
+          else
+            to_stderr = TRUE;
+        }
+    }
+
+  if (!to_stderr && !to_journal)
+    return NULL;
+
+  trace = g_new0 (LaunchTrace, 1);
+  trace->to_stderr = to_stderr;
+  trace->to_journal = to_journal;
+  trace->start = trace->last = g_get_monotonic_time ();
+  trace->phases = g_array_new (FALSE, FALSE, sizeof (LaunchTracePhase));
+
+  current_launch_trace = trace;
+
+  return trace;
+}
+
+static void
+launch_trace_free (LaunchTrace *trace)
+{
+  if (current_launch_trace == trace)
+    current_launch_trace = NULL;
+
+  g_array_unref (trace->phases);
+  g_free (trace);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (LaunchTrace, launch_trace_free)
+
+/* Ends the phase @name, which started at the previous mark */
+static void
+launch_trace_mark (const char *name)
+{
+  LaunchTrace *trace = current_launch_trace;
+  LaunchTracePhase phase;
+  gint64 now;
+
+  if (trace == NULL)
+    return;
+
+  now = g_get_monotonic_time ();
+  phase.name = name;
+  phase.usec = now - trace->last;
+  g_array_append_val (trace->phases, phase);
+  trace->last = now;
+}
+
+static void
+launch_trace_emit (LaunchTrace *trace,
+                   const char  *app_ref)
+{
+  gint64 total;
+  guint i;
+
+  if (trace == NULL)
+    return;
+
+  total = g_get_monotonic_time () - trace->start;
+
+  if (trace->to_stderr)
+    {
+      g_autoptr(GString) json = g_string_new ("");
+
+      g_string_append_printf (json, "{\"ref\": \"%s\", \"total_us\": %" G_GINT64_FORMAT ", \"phases\": [",
+                              app_ref, total);
+      for (i = 0; i < trace->phases->len; i++)
+        {
+          LaunchTracePhase *phase = &g_array_index (trace->phases, LaunchTracePhase, i);
+
+          g_string_append_printf (json, "%s{\"name\": \"%s\", \"us\": %" G_GINT64_FORMAT "}",
+                                  i > 0 ? ", " : "", phase->name, phase->usec);
+        }
+      g_string_append (json, "]}\n");
+
+      g_printerr ("%s", json->str);
+    }
+
+#ifdef HAVE_LIBSYSTEMD
+  if (trace->to_journal)
+    {
+      g_autoptr(GPtrArray) fields = g_ptr_array_new_with_free_func (g_free);
+      g_autofree struct iovec *iov = NULL;
+
+      g_ptr_array_add (fields, g_strdup ("MESSAGE_ID=" FLATPAK_LAUNCH_TRACE_MESSAGE_ID));
+      g_ptr_array_add (fields, g_strdup ("PRIORITY=7"));
+      g_ptr_array_add (fields, g_strdup_printf ("MESSAGE=Launch of %s took %" G_GINT64_FORMAT " us", app_ref, total));
+      g_ptr_array_add (fields, g_strdup ("FLATPAK_VERSION=" PACKAGE_VERSION));
+      g_ptr_array_add (fields, g_strdup_printf ("REF=%s", app_ref));
+      g_ptr_array_add (fields, g_strdup_printf ("LAUNCH_TOTAL_USEC=%" G_GINT64_FORMAT, total));
+      for (i = 0; i < trace->phases->len; i++)
+        {
+          LaunchTracePhase *phase = &g_array_index (trace->phases, LaunchTracePhase, i);
+          g_autofree char *field = g_ascii_strup (phase->name, -1);
+
+          g_strdelimit (field, "-", '_');
+          g_ptr_array_add (fields, g_strdup_printf ("LAUNCH_%s_USEC=%" G_GINT64_FORMAT, field, phase->usec));
+        }
+
+      iov = g_new (struct iovec, fields->len);
+      for (i = 0; i < fields->len; i++)
+        {
+          iov[i].iov_base = g_ptr_array_index (fields, i);
+          iov[i].iov_len = strlen (g_ptr_array_index (fields, i));
+        }
+
+      sd_journal_sendv (iov, fields->len);
+    }
+#endif
+}
+
+/* Parts of the launch that don't depend on the rest of the setup run
+ * in threads, which are started early in flatpak_run_app() and only
+ * joined where the result is needed. Waiting for the dbus proxy to
+ * start up is similarly deferred until just before the exec. */
+typedef struct
+{
+  GThread *transient_unit;
+  GThread *document_portal;
+  GThread *dconf;
+  int      proxy_sync_fd;
+} LaunchTasks;
+
+static LaunchTasks *current_launch_tasks;
+
 static char *
 extract_unix_path_from_dbus_address (const char *address)
 {
@@ -802,13 +972,29 @@ add_bwrap_wrapper (FlatpakBwrap *bwrap,
   return TRUE;
 }
 
+/* Waits until the proxy is listening on the sockets */
+static gboolean
+sync_with_dbus_proxy (int      sync_fd,
+                      GError **error)
+{
+  char x;
+
+  if (read (sync_fd, &x, 1) != 1)
+    {
+      g_set_error_literal (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                           _("Failed to sync with dbus proxy"));
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
 static gboolean
 start_dbus_proxy (FlatpakBwrap *app_bwrap,
                   FlatpakBwrap *proxy_arg_bwrap,
                   const char   *app_info_path,
                   GError      **error)
 {
-  char x = 'x';
   const char *proxy;
   g_autofree char *commandline = NULL;
   g_autoptr(FlatpakBwrap) proxy_bwrap = NULL;
@@ -864,15 +1050,13 @@ start_dbus_proxy (FlatpakBwrap *app_bwrap,
                       NULL, error))
     return FALSE;
 
-  /* Sync with proxy, i.e. wait until its listening on the sockets */
-  if (read (sync_fds[0], &x, 1) != 1)
+  if (current_launch_tasks != NULL)
     {
-      g_set_error_literal (error, G_IO_ERROR, g_io_error_from_errno (errno),
-                           _("Failed to sync with dbus proxy"));
-      return FALSE;
+      current_launch_tasks->proxy_sync_fd = sync_fds[0];
+      return TRUE;
     }
 
-  return TRUE;
+  return sync_with_dbus_proxy (sync_fds[0], error);
 }
 
 static int
@@ -885,20 +1069,24 @@ flatpak_extension_compare_by_path (gconstpointer _a,
   return g_strcmp0 (a->directory, b->directory);
 }
 
-gboolean
-flatpak_run_add_extension_args (FlatpakBwrap *bwrap,
-                                GKeyFile     *metakey,
-                                const char   *full_ref,
-                                gboolean      use_ld_so_cache,
-                                char        **extensions_out,
-                                GCancellable *cancellable,
-                                GError      **error)
+/* The bwrap setup for the extensions of a ref is computed as a list of
+ * operations, a(sas), so that it can be stored in the launch plan:
+ *  ("args", [arg…]) adds the arguments as is
+ *  ("data", [name, path, contents]) adds --ro-bind-data for the contents
+ *  ("ld-path", [path]) adds the path to LD_LIBRARY_PATH
+ */
+static gboolean
+build_extension_ops (GKeyFile        *metakey,
+                     const char      *full_ref,
+                     gboolean         use_ld_so_cache,
+                     GVariantBuilder *ops,
+                     char           **extensions_out,
+                     GError         **error)
 {
   g_auto(GStrv) parts = NULL;
   g_autoptr(GString) used_extensions = g_string_new ("");
   gboolean is_app;
   GList *extensions, *path_sorted_extensions, *l;
-  g_autoptr(GString) ld_library_path = g_string_new ("");
   int count = 0;
   g_autoptr(GHashTable) mounted_tmpfs =
     g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
@@ -933,21 +1121,22 @@ flatpak_run_add_extension_args (FlatpakBwrap *bwrap,
 
           if (g_hash_table_lookup (mounted_tmpfs, parent) == NULL)
             {
-              flatpak_bwrap_add_args (bwrap,
-                                      "--tmpfs", parent,
-                                      NULL);
+              const char *args[] = { "--tmpfs", parent, NULL };
+              g_variant_builder_add (ops, "(s^as)", "args", args);
               g_hash_table_insert (mounted_tmpfs, g_steal_pointer (&parent), "mounted");
             }
         }
 
-      flatpak_bwrap_add_args (bwrap,
-                              "--ro-bind", ext->files_path, full_directory,
-                              NULL);
+      {
+        const char *args[] = { "--ro-bind", ext->files_path, full_directory, NULL };
+        g_variant_builder_add (ops, "(s^as)", "args", args);
+      }
 
       if (g_file_test (real_ref, G_FILE_TEST_EXISTS))
-        flatpak_bwrap_add_args (bwrap,
-                                "--lock-file", ref,
-                                NULL);
+        {
+          const char *args[] = { "--lock-file", ref, NULL };
+          g_variant_builder_add (ops, "(s^as)", "args", args);
+        }
     }
 
   g_list_free (path_sorted_extensions);
@@ -980,16 +1169,15 @@ flatpak_run_add_extension_args (FlatpakBwrap *bwrap,
               /* We prepend app or runtime and a counter in order to get the include order correct for the conf files */
               g_autofree char *ld_so_conf_file = g_strdup_printf ("%s-%03d-%s.conf", parts[0], ++count, ext->installed_id);
               g_autofree char *ld_so_conf_file_path = g_build_filename ("/run/flatpak/ld.so.conf.d", ld_so_conf_file, NULL);
+              const char *args[] = { "ld-so-conf", ld_so_conf_file_path, contents, NULL };
 
-              if (!flatpak_bwrap_add_args_data (bwrap, "ld-so-conf",
-                                                contents, -1, ld_so_conf_file_path, error))
-                return FALSE;
+              g_variant_builder_add (ops, "(s^as)", "data", args);
             }
           else
             {
-              if (ld_library_path->len != 0)
-                g_string_append (ld_library_path, ":");
-              g_string_append (ld_library_path, ld_path);
+              const char *args[] = { ld_path, NULL };
+
+              g_variant_builder_add (ops, "(s^as)", "ld-path", args);
             }
         }
 
@@ -1010,9 +1198,9 @@ flatpak_run_add_extension_args (FlatpakBwrap *bwrap,
                   if (g_hash_table_lookup (created_symlink, symlink_path) == NULL)
                     {
                       g_autofree char *symlink = g_build_filename (directory, ext->merge_dirs[i], dent->d_name, NULL);
-                      flatpak_bwrap_add_args (bwrap,
-                                              "--symlink", symlink, symlink_path,
-                                              NULL);
+                      const char *args[] = { "--symlink", symlink, symlink_path, NULL };
+
+                      g_variant_builder_add (ops, "(s^as)", "args", args);
                       g_hash_table_insert (created_symlink, g_steal_pointer (&symlink_path), "created");
                     }
                 }
@@ -1022,6 +1210,43 @@ flatpak_run_add_extension_args (FlatpakBwrap *bwrap,
 
   g_list_free_full (extensions, (GDestroyNotify) flatpak_extension_free);
 
+  if (extensions_out)
+    *extensions_out = g_string_free (g_steal_pointer (&used_extensions), FALSE);
+
+  return TRUE;
+}
+
+static gboolean
+apply_extension_ops (FlatpakBwrap *bwrap,
+                     GVariant     *ops,
+                     gboolean      is_app,
+                     GError      **error)
+{
+  g_autoptr(GString) ld_library_path = g_string_new ("");
+  gsize i, n = g_variant_n_children (ops);
+
+  for (i = 0; i < n; i++)
+    {
+      const char *op;
+      g_autofree const char **args = NULL;
+
+      g_variant_get_child (ops, i, "(&s^a&s)", &op, &args);
+
+      if (strcmp (op, "args") == 0)
+        flatpak_bwrap_append_argsv (bwrap, (char **) args, -1);
+      else if (strcmp (op, "data") == 0 && g_strv_length ((char **) args) == 3)
+        {
+          if (!flatpak_bwrap_add_args_data (bwrap, args[0], args[2], -1, args[1], error))
+            return FALSE;
+        }
+      else if (strcmp (op, "ld-path") == 0 && args[0] != NULL)
+        {
+          if (ld_library_path->len != 0)
+            g_string_append (ld_library_path, ":");
+          g_string_append (ld_library_path, args[0]);
+        }
+    }
+
   if (ld_library_path->len != 0)
     {
       const gchar *old_ld_path = g_environ_getenv (bwrap->envp, "LD_LIBRARY_PATH");
@@ -1043,12 +1268,30 @@ flatpak_run_add_extension_args (FlatpakBwrap *bwrap,
       flatpak_bwrap_set_env (bwrap, "LD_LIBRARY_PATH", ld_library_path->str, TRUE);
     }
 
-  if (extensions_out)
-    *extensions_out = g_string_free (g_steal_pointer (&used_extensions), FALSE);
-
   return TRUE;
 }
 
+gboolean
+flatpak_run_add_extension_args (FlatpakBwrap *bwrap,
+                                GKeyFile     *metakey,
+                                const char   *full_ref,
+                                gboolean      use_ld_so_cache,
+                                char        **extensions_out,
+                                GCancellable *cancellable,
+                                GError      **error)
+{
+  g_auto(GVariantBuilder) builder = FLATPAK_VARIANT_BUILDER_INITIALIZER;
+  g_autoptr(GVariant) ops = NULL;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(sas)"));
+  if (!build_extension_ops (metakey, full_ref, use_ld_so_cache, &builder, extensions_out, error))
+    return FALSE;
+
+  ops = g_variant_ref_sink (g_variant_builder_end (&builder));
+
+  return apply_extension_ops (bwrap, ops, g_str_has_prefix (full_ref, "app/"), error);
+}
+
 gboolean
 flatpak_run_add_environment_args (FlatpakBwrap    *bwrap,
                                   const char      *app_info_path,
@@ -1194,9 +1437,16 @@ flatpak_run_add_environment_args (FlatpakBwrap    *bwrap,
       flatpak_bwrap_unset_env (bwrap, "LD_LIBRARY_PATH");
     }
 
+  launch_trace_mark ("environment");
+
   /* Must run this before spawning the dbus proxy, to ensure it
      ends up in the app cgroup */
-  if (!flatpak_run_in_transient_unit (app_id, &my_error))
+  if (current_launch_tasks != NULL && current_launch_tasks->transient_unit != NULL)
+    my_error = g_thread_join (g_steal_pointer (&current_launch_tasks->transient_unit));
+  else
+    flatpak_run_in_transient_unit (app_id, &my_error);
+
+  if (my_error != NULL)
     {
       /* We still run along even if we don't get a cgroup, as nothing
          really depends on it. Its just nice to have */
@@ -1204,10 +1454,14 @@ flatpak_run_add_environment_args (FlatpakBwrap    *bwrap,
       g_clear_error (&my_error);
     }
 
+  launch_trace_mark ("transient-unit");
+
   if (!flatpak_bwrap_is_empty (proxy_arg_bwrap) &&
       !start_dbus_proxy (bwrap, proxy_arg_bwrap, app_info_path, error))
     return FALSE;
 
+  launch_trace_mark ("dbus-proxy");
+
   if (exports_out)
     *exports_out = g_steal_pointer (&exports);
 
@@ -1950,52 +2204,88 @@ get_dconf_data (const char  *app_id,
 #endif
 }
 
-static gboolean
-flatpak_run_add_dconf_args (FlatpakBwrap *bwrap,
-                            const char   *app_id,
-                            GKeyFile     *metakey,
-                            GError      **error)
+typedef struct
 {
-  g_auto(GStrv) paths = NULL;
-  g_autofree char *migrate_path = NULL;
-  g_autofree char *defaults = NULL;
-  g_autofree char *values = NULL;
-  g_autofree char *locks = NULL;
-  gsize defaults_size;
-  gsize values_size;
-  gsize locks_size;
+  char  *app_id;
+  char **paths;
+  char  *migrate_path;
+  char  *defaults;
+  gsize  defaults_size;
+  char  *values;
+  gsize  values_size;
+  char  *locks;
+  gsize  locks_size;
+} DconfData;
+
+static void
+dconf_data_free (DconfData *data)
+{
+  g_free (data->app_id);
+  g_strfreev (data->paths);
+  g_free (data->migrate_path);
+  g_free (data->defaults);
+  g_free (data->values);
+  g_free (data->locks);
+  g_free (data);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (DconfData, dconf_data_free)
+
+static DconfData *
+dconf_data_new (const char *app_id,
+                GKeyFile   *metakey)
+{
+  DconfData *data = g_new0 (DconfData, 1);
+
+  data->app_id = g_strdup (app_id);
 
   if (metakey)
     {
-      paths = g_key_file_get_string_list (metakey,
-                                          FLATPAK_METADATA_GROUP_DCONF,
-                                          FLATPAK_METADATA_KEY_DCONF_PATHS,
-                                          NULL, NULL);
-      migrate_path = g_key_file_get_string (metakey,
-                                            FLATPAK_METADATA_GROUP_DCONF,
-                                            FLATPAK_METADATA_KEY_DCONF_MIGRATE_PATH,
-                                            NULL);
+      data->paths = g_key_file_get_string_list (metakey,
+                                                FLATPAK_METADATA_GROUP_DCONF,
+                                                FLATPAK_METADATA_KEY_DCONF_PATHS,
+                                                NULL, NULL);
+      data->migrate_path = g_key_file_get_string (metakey,
+                                                  FLATPAK_METADATA_GROUP_DCONF,
+                                                  FLATPAK_METADATA_KEY_DCONF_MIGRATE_PATH,
+                                                  NULL);
     }
 
-  get_dconf_data (app_id,
-                  (const char **) paths,
-                  migrate_path,
-                  &defaults, &defaults_size,
-                  &values, &values_size,
-                  &locks, &locks_size);
+  return data;
+}
 
-  if (defaults_size != 0 &&
+static gpointer
+load_dconf_data_thread (gpointer user_data)
+{
+  DconfData *data = user_data;
+
+  get_dconf_data (data->app_id,
+                  (const char **) data->paths,
+                  data->migrate_path,
+                  &data->defaults, &data->defaults_size,
+                  &data->values, &data->values_size,
+                  &data->locks, &data->locks_size);
+
+  return data;
+}
+
+static gboolean
+flatpak_run_add_dconf_args (FlatpakBwrap *bwrap,
+                            DconfData    *data,
+                            GError      **error)
+{
+  if (data->defaults_size != 0 &&
       !flatpak_bwrap_add_args_data (bwrap,
                                     "dconf-defaults",
-                                    defaults, defaults_size,
+                                    data->defaults, data->defaults_size,
                                     "/etc/glib-2.0/settings/defaults",
                                     error))
     return FALSE;
 
-  if (locks_size != 0 &&
+  if (data->locks_size != 0 &&
       !flatpak_bwrap_add_args_data (bwrap,
                                     "dconf-locks",
-                                    locks, locks_size,
+                                    data->locks, data->locks_size,
                                     "/etc/glib-2.0/settings/locks",
                                     error))
     return FALSE;
@@ -2003,18 +2293,18 @@ flatpak_run_add_dconf_args (FlatpakBwrap *bwrap,
   /* We do a one-time conversion of existing dconf settings to a keyfile.
    * Only do that once the app stops requesting dconf access.
    */
-  if (migrate_path)
+  if (data->migrate_path)
     {
       g_autofree char *filename = NULL;
 
       filename = g_build_filename (g_get_home_dir (),
-                                   ".var/app", app_id,
+                                   ".var/app", data->app_id,
                                    "config/glib-2.0/settings/keyfile",
                                    NULL);
 
       g_debug ("writing D-Conf values to %s", filename);
 
-      if (values_size != 0 && !g_file_test (filename, G_FILE_TEST_EXISTS))
+      if (data->values_size != 0 && !g_file_test (filename, G_FILE_TEST_EXISTS))
         {
           g_autofree char *dir = g_path_get_dirname (filename);
 
@@ -2024,7 +2314,7 @@ flatpak_run_add_dconf_args (FlatpakBwrap *bwrap,
               return FALSE;
             }
 
-          if (!g_file_set_contents (filename, values, values_size, error))
+          if (!g_file_set_contents (filename, data->values, data->values_size, error))
             {
               g_warning ("failed writing %s", filename);
               return FALSE;
@@ -2351,13 +2641,12 @@ add_monitor_path_args (gboolean      use_session_helper,
     }
 }
 
-static void
-add_document_portal_args (FlatpakBwrap *bwrap,
-                          const char   *app_id,
-                          char        **out_mount_path)
+/* Returns the document portal mount point, or NULL */
+static gpointer
+get_document_portal_mount_path_thread (gpointer user_data)
 {
   g_autoptr(GDBusConnection) session_bus = NULL;
-  g_autofree char *doc_mount_path = NULL;
+  char *doc_mount_path = NULL;
 
   session_bus = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, NULL);
   if (session_bus)
@@ -2388,20 +2677,30 @@ add_document_portal_args (FlatpakBwrap *bwrap,
             }
           else
             {
-              g_autofree char *src_path = NULL;
-              g_autofree char *dst_path = NULL;
               g_variant_get (g_dbus_message_get_body (reply),
                              "(^ay)", &doc_mount_path);
-
-              src_path = g_strdup_printf ("%s/by-app/%s",
-                                          doc_mount_path, app_id);
-              dst_path = g_strdup_printf ("/run/user/%d/doc", getuid ());
-              flatpak_bwrap_add_args (bwrap, "--bind", src_path, dst_path, NULL);
             }
         }
     }
 
-  *out_mount_path = g_steal_pointer (&doc_mount_path);
+  return doc_mount_path;
+}
+
+static void
+add_document_portal_args (FlatpakBwrap *bwrap,
+                          const char   *app_id,
+                          const char   *doc_mount_path)
+{
+  g_autofree char *src_path = NULL;
+  g_autofree char *dst_path = NULL;
+
+  if (doc_mount_path == NULL)
+    return;
+
+  src_path = g_strdup_printf ("%s/by-app/%s",
+                              doc_mount_path, app_id);
+  dst_path = g_strdup_printf ("/run/user/%d/doc", getuid ());
+  flatpak_bwrap_add_args (bwrap, "--bind", src_path, dst_path, NULL);
 }
 
 #ifdef ENABLE_SECCOMP
@@ -3059,11 +3358,362 @@ add_ld_so_conf (FlatpakBwrap *bwrap,
                                       contents, -1, "/etc/ld.so.conf", error);
 }
 
+/* The commits that went into an ld.so.cache, one per line. This is what
+ * flatpak_dir_gc_ld_caches() uses to find out when it is no longer needed. */
+static char *
+calculate_ld_cache_deps (GVariant   *app_deploy_data,
+                         GVariant   *runtime_deploy_data,
+                         const char *app_extensions,
+                         const char *runtime_extensions)
+{
+  GString *deps = g_string_new ("");
+  const char *extensions[] = { app_extensions, runtime_extensions };
+  gsize i;
+  int j;
+
+  if (app_deploy_data)
+    g_string_append_printf (deps, "%s\n", flatpak_deploy_data_get_commit (app_deploy_data));
+  g_string_append_printf (deps, "%s\n", flatpak_deploy_data_get_commit (runtime_deploy_data));
+
+  for (i = 0; i < G_N_ELEMENTS (extensions); i++)
+    {
+      g_auto(GStrv) used_extensions = NULL;
+
+      if (extensions[i] == NULL)
+        continue;
+
+      used_extensions = g_strsplit (extensions[i], ";", -1);
+      for (j = 0; used_extensions[j] != NULL; j++)
+        {
+          const char *commit = strchr (used_extensions[j], '=');
+
+          /* Unmaintained extensions have no commit, and don't go away */
+          if (commit != NULL && strcmp (commit + 1, "local") != 0)
+            g_string_append_printf (deps, "%s\n", commit + 1);
+        }
+    }
+
+  return g_string_free (deps, FALSE);
+}
+
+/* Where the ld.so.caches of the user are kept. The caches are shared
+ * between apps and loaded into their sandboxes, so like the launch
+ * plans they live in the user installation, which is hidden from all
+ * sandboxes, rather than in the cache dir that apps may be able to
+ * write to. */
+GFile *
+flatpak_get_user_ld_cache_dir (void)
+{
+  g_autoptr(GFile) user_base_dir = flatpak_get_user_base_dir_location ();
+
+  return g_file_get_child (user_base_dir, "ld-so-cache");
+}
+
+static gboolean
+runtime_has_ldconfig (GFile *runtime_files)
+{
+  g_autoptr(GFile) bin_ldconfig = g_file_resolve_relative_path (runtime_files, "bin/ldconfig");
+
+  return g_file_query_exists (bin_ldconfig, NULL);
+}
+
+/* An empty /etc/ld.so.conf in the runtime means we generate our own */
+static gboolean
+runtime_needs_ld_so_conf (GFile *runtime_files)
+{
+  g_autoptr(GFile) runtime_ld_so_conf = g_file_resolve_relative_path (runtime_files, "etc/ld.so.conf");
+  struct stat s;
+
+  if (lstat (flatpak_file_get_path_cached (runtime_ld_so_conf), &s) == 0)
+    return S_ISREG (s.st_mode) && s.st_size == 0;
+
+  return TRUE;
+}
+
+/* The extension part of the sandbox setup only changes when the
+ * deployed commits, the set of installed extensions or the state the
+ * extension conditions depend on changes, so flatpak_run_app() keeps
+ * it in a per-app launch plan to avoid enumerating extensions in all
+ * installations on every launch. */
+#define FLATPAK_LAUNCH_PLAN_VERSION 1
+#define FLATPAK_LAUNCH_PLAN_FORMAT "(usmsa(sas)sa(sas))"
+
+static void
+checksum_add_mtime (GChecksum *checksum,
+                    GFile     *file)
+{
+  struct stat stbuf;
+  g_autofree char *str = NULL;
+
+  if (stat (flatpak_file_get_path_cached (file), &stbuf) != 0)
+    memset (&stbuf, 0, sizeof (stbuf));
+
+  str = g_strdup_printf ("%s:%" G_GINT64_FORMAT ".%ld;", flatpak_file_get_path_cached (file),
+                         (gint64) stbuf.st_mtim.tv_sec, (long) stbuf.st_mtim.tv_nsec);
+  g_checksum_update (checksum, (guchar *) str, -1);
+}
+
+/* Any deploy or undeploy touches .changed, and unmanaged extensions
+   live in the extension directory */
+static void
+checksum_add_base_dir (GChecksum *checksum,
+                       GFile     *base_dir)
+{
+  g_autoptr(GFile) changed = g_file_get_child (base_dir, ".changed");
+  g_autoptr(GFile) extension_dir = g_file_get_child (base_dir, "extension");
+
+  checksum_add_mtime (checksum, changed);
+  checksum_add_mtime (checksum, extension_dir);
+}
+
+static char *
+calculate_launch_plan_key (GFile      *app_files,
+                           const char *app_ref,
+                           GFile      *runtime_files,
+                           const char *runtime_ref,
+                           gboolean    use_ld_so_cache)
+{
+  g_autoptr(GChecksum) checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  g_autoptr(GFile) user_base_dir = flatpak_get_user_base_dir_location ();
+  g_autofree char *reasons = flatpak_extension_reasons_state ();
+  GPtrArray *system_base_dirs;
+  guint i;
+
+  /* The files paths contain the deployed commits */
+  if (app_files)
+    g_checksum_update (checksum, (guchar *) flatpak_file_get_path_cached (app_files), -1);
+  g_checksum_update (checksum, (guchar *) ";", 1);
+  g_checksum_update (checksum, (guchar *) app_ref, -1);
+  g_checksum_update (checksum, (guchar *) ";", 1);
+  g_checksum_update (checksum, (guchar *) flatpak_file_get_path_cached (runtime_files), -1);
+  g_checksum_update (checksum, (guchar *) ";", 1);
+  g_checksum_update (checksum, (guchar *) runtime_ref, -1);
+  g_checksum_update (checksum, (guchar *) (use_ld_so_cache ? ";ld;" : ";;"), -1);
+  g_checksum_update (checksum, (guchar *) reasons, -1);
+
+  /* The system locations were already loaded when looking up the
+     deploys, so this is only a couple of stats per installation */
+  checksum_add_base_dir (checksum, user_base_dir);
+  system_base_dirs = flatpak_get_system_base_dir_locations (NULL, NULL);
+  for (i = 0; system_base_dirs != NULL && i < system_base_dirs->len; i++)
+    checksum_add_base_dir (checksum, g_ptr_array_index (system_base_dirs, i));
+
+  return g_strdup (g_checksum_get_string (checksum));
+}
+
+/* The plans are replayed as bwrap arguments, so they live in the user
+ * installation, which is hidden from all sandboxes, rather than in
+ * the cache dir that apps may be able to write to. */
+static GFile *
+get_launch_plan_file (const char *app_ref)
+{
+  g_autoptr(GFile) user_base_dir = flatpak_get_user_base_dir_location ();
+  g_autoptr(GFile) plan_dir = g_file_get_child (user_base_dir, "launch-plans");
+  g_autofree char *name = g_strdup (app_ref);
+  char *p;
+
+  for (p = name; *p != 0; p++)
+    if (*p == '/')
+      *p = '_';
+
+  return g_file_get_child (plan_dir, name);
+}
+
+static GVariant *
+load_launch_plan (GFile      *plan_file,
+                  const char *key)
+{
+  glnx_autofd int fd = -1;
+  struct stat stbuf;
+  g_autoptr(GMappedFile) mfile = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GVariant) plan = NULL;
+  guint32 version;
+  const char *plan_key;
+
+  fd = open (flatpak_file_get_path_cached (plan_file), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd == -1)
+    return NULL;
+
+  /* Never trust a plan someone else could have written */
+  if (fstat (fd, &stbuf) != 0 ||
+      !S_ISREG (stbuf.st_mode) ||
+      stbuf.st_uid != getuid () ||
+      (stbuf.st_mode & 022) != 0)
+    {
+      g_debug ("Ignoring launch plan %s with unexpected owner or mode",
+               flatpak_file_get_path_cached (plan_file));
+      return NULL;
+    }
+
+  mfile = g_mapped_file_new_from_fd (fd, FALSE, NULL);
+  if (mfile == NULL)
+    return NULL;
+
+  bytes = g_mapped_file_get_bytes (mfile);
+  plan = g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE (FLATPAK_LAUNCH_PLAN_FORMAT), bytes, FALSE));
+  if (!g_variant_is_normal_form (plan))
+    return NULL;
+
+  g_variant_get (plan, "(u&s@ms@a(sas)&s@a(sas))", &version, &plan_key, NULL, NULL, NULL, NULL);
+  if (version != FLATPAK_LAUNCH_PLAN_VERSION || strcmp (plan_key, key) != 0)
+    return NULL;
+
+  return g_steal_pointer (&plan);
+}
+
+static void
+save_launch_plan (GFile    *plan_file,
+                  GVariant *plan)
+{
+  g_autoptr(GFile) plan_dir = g_file_get_parent (plan_file);
+  g_autoptr(GError) local_error = NULL;
+
+  if (!glnx_shutil_mkdir_p_at (AT_FDCWD, flatpak_file_get_path_cached (plan_dir), 0700, NULL, &local_error) ||
+      !glnx_file_replace_contents_with_perms_at (AT_FDCWD, flatpak_file_get_path_cached (plan_file),
+                                                 g_variant_get_data (plan), g_variant_get_size (plan),
+                                                 0600, (uid_t) -1, (gid_t) -1,
+                                                 GLNX_FILE_REPLACE_NODATASYNC,
+                                                 NULL, &local_error))
+    g_debug ("Failed to save launch plan: %s", local_error->message);
+}
+
+static GVariant *
+build_launch_plan (GKeyFile   *metakey,
+                   const char *app_ref,
+                   GKeyFile   *runtime_metakey,
+                   const char *runtime_ref,
+                   gboolean    use_ld_so_cache,
+                   const char *key,
+                   GError    **error)
+{
+  g_auto(GVariantBuilder) app_ops = FLATPAK_VARIANT_BUILDER_INITIALIZER;
+  g_auto(GVariantBuilder) runtime_ops = FLATPAK_VARIANT_BUILDER_INITIALIZER;
+  g_autofree char *app_extensions = NULL;
+  g_autofree char *runtime_extensions = NULL;
+
+  g_variant_builder_init (&app_ops, G_VARIANT_TYPE ("a(sas)"));
+  g_variant_builder_init (&runtime_ops, G_VARIANT_TYPE ("a(sas)"));
+
+  if (metakey != NULL &&
+      !build_extension_ops (metakey, app_ref, use_ld_so_cache, &app_ops, &app_extensions, error))
+    return NULL;
+
+  if (!build_extension_ops (runtime_metakey, runtime_ref, use_ld_so_cache, &runtime_ops, &runtime_extensions, error))
+    return NULL;
+
+  return g_variant_ref_sink (g_variant_new (FLATPAK_LAUNCH_PLAN_FORMAT,
+                                            FLATPAK_LAUNCH_PLAN_VERSION,
+                                            key,
+                                            app_extensions,
+                                            &app_ops,
+                                            runtime_extensions,
+                                            &runtime_ops));
+}
+
+/* This sets up the part of the sandbox that determines the ld.so.cache,
+ * i.e. the app, the runtime and their extensions */
+static gboolean
+add_app_and_runtime_args (FlatpakBwrap *bwrap,
+                          GFile        *app_files,
+                          GKeyFile     *metakey,
+                          const char   *app_ref,
+                          GFile        *runtime_files,
+                          GKeyFile     *runtime_metakey,
+                          const char   *runtime_ref,
+                          gboolean      use_ld_so_cache,
+                          gboolean      use_launch_plan,
+                          char        **app_extensions,
+                          char        **runtime_extensions,
+                          GCancellable *cancellable,
+                          GError      **error)
+{
+  flatpak_bwrap_add_args (bwrap,
+                          "--ro-bind", flatpak_file_get_path_cached (runtime_files), "/usr",
+                          "--lock-file", "/usr/.ref",
+                          NULL);
+
+  if (app_files != NULL)
+    flatpak_bwrap_add_args (bwrap,
+                            "--ro-bind", flatpak_file_get_path_cached (app_files), "/app",
+                            "--lock-file", "/app/.ref",
+                            NULL);
+  else
+    flatpak_bwrap_add_args (bwrap,
+                            "--dir", "/app",
+                            NULL);
+
+  if (use_launch_plan)
+    {
+      g_autoptr(GFile) plan_file = get_launch_plan_file (app_ref);
+      g_autofree char *key = calculate_launch_plan_key (app_files, app_ref, runtime_files, runtime_ref, use_ld_so_cache);
+      g_autoptr(GVariant) plan = load_launch_plan (plan_file, key);
+      g_autoptr(GVariant) app_ops = NULL;
+      g_autoptr(GVariant) runtime_ops = NULL;
+
+      if (plan == NULL)
+        {
+          plan = build_launch_plan (metakey, app_ref, runtime_metakey, runtime_ref, use_ld_so_cache, key, error);
+          if (plan == NULL)
+            return FALSE;
+          save_launch_plan (plan_file, plan);
+        }
+      else
+        g_debug ("Using cached launch plan for %s", app_ref);
+
+      g_variant_get (plan, "(u&sms@a(sas)s@a(sas))", NULL, NULL,
+                     app_extensions, &app_ops, runtime_extensions, &runtime_ops);
+
+      return
+        apply_extension_ops (bwrap, app_ops, TRUE, error) &&
+        apply_extension_ops (bwrap, runtime_ops, FALSE, error);
+    }
+
+  if (metakey != NULL &&
+      !flatpak_run_add_extension_args (bwrap, metakey, app_ref, use_ld_so_cache, app_extensions, cancellable, error))
+    return FALSE;
+
+  if (!flatpak_run_add_extension_args (bwrap, runtime_metakey, runtime_ref, use_ld_so_cache, runtime_extensions, cancellable, error))
+    return FALSE;
+
+  return TRUE;
+}
+
+static int
+open_ld_cache (GFile      *ld_cache_dir,
+               const char *checksum)
+{
+  g_autoptr(GFile) ld_so_cache = g_file_get_child (ld_cache_dir, checksum);
+  glnx_autofd int fd = -1;
+  struct stat stbuf;
+
+  fd = open (flatpak_file_get_path_cached (ld_so_cache), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd == -1)
+    return -1;
+
+  /* Never use a cache someone else could have written */
+  if (fstat (fd, &stbuf) != 0 ||
+      !S_ISREG (stbuf.st_mode) ||
+      stbuf.st_uid != getuid () ||
+      (stbuf.st_mode & 022) != 0)
+    {
+      g_debug ("Ignoring untrusted ld.so.cache %s", flatpak_file_get_path_cached (ld_so_cache));
+      return -1;
+    }
+
+  return glnx_steal_fd (&fd);
+}
+
+/* The caches in @ld_cache_dir are named by calculate_ld_cache_checksum(),
+ * so they can be shared by everything using the same app, runtime and
+ * extension commits. Each one has a .deps file next to it, listing
+ * these commits. */
 static int
 regenerate_ld_cache (GPtrArray    *base_argv_array,
                      GArray       *base_fd_array,
-                     GFile        *app_id_dir,
+                     GFile        *ld_cache_dir,
                      const char   *checksum,
+                     const char   *deps,
                      GFile        *runtime_files,
                      gboolean      generate_ld_so_conf,
                      GCancellable *cancellable,
@@ -3072,30 +3722,27 @@ regenerate_ld_cache (GPtrArray    *base_argv_array,
   g_autoptr(FlatpakBwrap) bwrap = NULL;
   g_autoptr(GArray) combined_fd_array = NULL;
   g_autoptr(GFile) ld_so_cache = NULL;
-  g_autofree char *sandbox_cache_path = NULL;
+  g_autofree char *deps_path = NULL;
+  g_autofree char *tmpdir_template = NULL;
+  g_auto(GLnxTmpDir) tmpdir = { 0, };
   g_auto(GStrv) minimal_envp = NULL;
   g_autofree char *commandline = NULL;
   int exit_status;
   glnx_autofd int ld_so_fd = -1;
-  g_autoptr(GFile) ld_so_dir = NULL;
-
-  if (app_id_dir)
-    ld_so_dir = g_file_get_child (app_id_dir, ".ld.so");
-  else
-    {
-      g_autoptr(GFile) base_dir = g_file_new_for_path (g_get_user_cache_dir ());
-      ld_so_dir = g_file_resolve_relative_path (base_dir, "flatpak/ld.so");
-    }
 
-  ld_so_cache = g_file_get_child (ld_so_dir, checksum);
-  ld_so_fd = open (flatpak_file_get_path_cached (ld_so_cache), O_RDONLY);
-  if (ld_so_fd >= 0)
-    return glnx_steal_fd (&ld_so_fd);
+  ld_so_cache = g_file_get_child (ld_cache_dir, checksum);
+  deps_path = g_strconcat (flatpak_file_get_path_cached (ld_so_cache), ".deps", NULL);
 
   g_debug ("Regenerating ld.so.cache %s", flatpak_file_get_path_cached (ld_so_cache));
 
-  if (!flatpak_mkdir_p (ld_so_dir, cancellable, error))
-    return FALSE;
+  if (!glnx_shutil_mkdir_p_at (AT_FDCWD, flatpak_file_get_path_cached (ld_cache_dir), 0700, cancellable, error))
+    return -1;
+
+  /* ldconfig only gets to write to a private directory, and the result
+     is moved into the shared store afterwards */
+  tmpdir_template = g_build_filename (flatpak_file_get_path_cached (ld_cache_dir), ".tmp-XXXXXX", NULL);
+  if (!glnx_mkdtempat (AT_FDCWD, tmpdir_template, 0755, &tmpdir, error))
+    return -1;
 
   minimal_envp = flatpak_run_get_minimal_env (FALSE, FALSE);
   bwrap = flatpak_bwrap_new (minimal_envp);
@@ -3114,22 +3761,27 @@ regenerate_ld_cache (GPtrArray    *base_argv_array,
                             "--symlink", "../usr/etc/ld.so.conf", "/etc/ld.so.conf",
                             NULL);
 
-  sandbox_cache_path = g_build_filename ("/run/ld-so-cache-dir", checksum, NULL);
-
   flatpak_bwrap_add_args (bwrap,
                           "--unshare-pid",
                           "--unshare-ipc",
                           "--unshare-net",
                           "--proc", "/proc",
                           "--dev", "/dev",
-                          "--bind", flatpak_file_get_path_cached (ld_so_dir), "/run/ld-so-cache-dir",
+                          "--bind", tmpdir.path, "/run/ld-so-cache-dir",
                           NULL);
 
+  /* We run as root when pre-generating for a system deploy done by root,
+     so drop all caps */
+  if (getuid () == 0)
+    flatpak_bwrap_add_args (bwrap,
+                            "--cap-drop", "ALL",
+                            NULL);
+
   if (!flatpak_bwrap_bundle_args (bwrap, 1, -1, FALSE, error))
     return -1;
 
   flatpak_bwrap_add_args (bwrap,
-                          "ldconfig", "-X", "-C", sandbox_cache_path, NULL);
+                          "ldconfig", "-X", "-C", "/run/ld-so-cache-dir/ld.so.cache", NULL);
 
   flatpak_bwrap_finish (bwrap);
 
@@ -3158,30 +3810,119 @@ regenerate_ld_cache (GPtrArray    *base_argv_array,
       return -1;
     }
 
-  ld_so_fd = open (flatpak_file_get_path_cached (ld_so_cache), O_RDONLY);
+  ld_so_fd = openat (tmpdir.fd, "ld.so.cache", O_RDONLY);
   if (ld_so_fd < 0)
     {
       flatpak_fail_error (error, FLATPAK_ERROR_SETUP_FAILED, _("Can't open generated ld.so.cache"));
       return -1;
     }
 
-  if (app_id_dir == NULL)
+  /* Someone else may be generating the same cache, but the result is the
+     same so it doesn't matter who wins. The deps go in first, so that there
+     is never a cache without them. */
+  if (!glnx_file_replace_contents_at (tmpdir.fd, "deps", (const guint8 *) deps, strlen (deps),
+                                      GLNX_FILE_REPLACE_NODATASYNC, cancellable, error))
+    return -1;
+
+  if (!glnx_renameat (tmpdir.fd, "deps", AT_FDCWD, deps_path, error))
+    return -1;
+
+  if (!glnx_renameat (tmpdir.fd, "ld.so.cache", AT_FDCWD, flatpak_file_get_path_cached (ld_so_cache), error))
+    return -1;
+
+  return glnx_steal_fd (&ld_so_fd);
+}
+
+/* Makes sure the user's store has the ld.so.cache that running @ref
+ * from @deploy would use, so that the first launch after deploying it
+ * doesn't have to run ldconfig. */
+gboolean
+flatpak_run_ensure_ld_cache (FlatpakDeploy *deploy,
+                             const char    *ref,
+                             GCancellable  *cancellable,
+                             GError       **error)
+{
+  g_autoptr(FlatpakBwrap) bwrap = NULL;
+  g_autoptr(FlatpakDeploy) runtime_deploy = NULL;
+  g_autoptr(GKeyFile) metakey = NULL;
+  g_autoptr(GKeyFile) runtime_metakey = NULL;
+  g_autoptr(GVariant) app_deploy_data = NULL;
+  g_autoptr(GVariant) runtime_deploy_data = NULL;
+  g_autoptr(GFile) app_files = NULL;
+  g_autoptr(GFile) runtime_files = NULL;
+  g_autoptr(GFile) ld_cache_dir = NULL;
+  g_autofree char *runtime_ref = NULL;
+  g_autofree char *app_extensions = NULL;
+  g_autofree char *runtime_extensions = NULL;
+  g_autofree char *checksum = NULL;
+  g_autofree char *deps = NULL;
+  glnx_autofd int ld_so_fd = -1;
+
+  if (g_str_has_prefix (ref, "app/"))
     {
-      /* For runs without an app id dir we always regenerate the ld.so.cache */
-      unlink (flatpak_file_get_path_cached (ld_so_cache));
+      g_autofree char *runtime = NULL;
+
+      metakey = flatpak_deploy_get_metadata (deploy);
+      runtime = g_key_file_get_string (metakey, FLATPAK_METADATA_GROUP_APPLICATION,
+                                       FLATPAK_METADATA_KEY_RUNTIME, error);
+      if (runtime == NULL)
+        return FALSE;
+
+      runtime_ref = g_build_filename ("runtime", runtime, NULL);
+      runtime_deploy = flatpak_find_deploy_for_ref (runtime_ref, NULL, cancellable, error);
+      if (runtime_deploy == NULL)
+        return FALSE;
+
+      app_deploy_data = flatpak_deploy_get_deploy_data (deploy, FLATPAK_DEPLOY_VERSION_ANY, cancellable, error);
+      if (app_deploy_data == NULL)
+        return FALSE;
+
+      app_files = flatpak_deploy_get_files (deploy);
     }
   else
     {
-      g_autoptr(GFile) active = g_file_get_child (ld_so_dir, "active");
+      runtime_ref = g_strdup (ref);
+      runtime_deploy = g_object_ref (deploy);
+    }
 
-      /* For app-dirs we keep one checksum alive, by pointing the active symlink to it */
+  runtime_deploy_data = flatpak_deploy_get_deploy_data (runtime_deploy, FLATPAK_DEPLOY_VERSION_ANY, cancellable, error);
+  if (runtime_deploy_data == NULL)
+    return FALSE;
 
-      if (!flatpak_switch_symlink_and_remove (flatpak_file_get_path_cached (active),
-                                              checksum, error))
-        return -1;
-    }
+  runtime_metakey = flatpak_deploy_get_metadata (runtime_deploy);
+  runtime_files = flatpak_deploy_get_files (runtime_deploy);
 
-  return glnx_steal_fd (&ld_so_fd);
+  /* Nothing to do, see flatpak_run_app() */
+  if (!runtime_has_ldconfig (runtime_files))
+    return TRUE;
+
+  bwrap = flatpak_bwrap_new (NULL);
+  flatpak_bwrap_add_arg (bwrap, flatpak_get_bwrap ());
+
+  if (!add_app_and_runtime_args (bwrap, app_files, metakey, ref,
+                                 runtime_files, runtime_metakey, runtime_ref, TRUE, FALSE,
+                                 &app_extensions, &runtime_extensions,
+                                 cancellable, error))
+    return FALSE;
+
+  checksum = calculate_ld_cache_checksum (app_deploy_data, runtime_deploy_data,
+                                          app_extensions, runtime_extensions);
+  ld_cache_dir = flatpak_get_user_ld_cache_dir ();
+
+  ld_so_fd = open_ld_cache (ld_cache_dir, checksum);
+  if (ld_so_fd != -1)
+    return TRUE;
+
+  deps = calculate_ld_cache_deps (app_deploy_data, runtime_deploy_data,
+                                  app_extensions, runtime_extensions);
+  ld_so_fd = regenerate_ld_cache (bwrap->argv, bwrap->fds, ld_cache_dir,
+                                  checksum, deps, runtime_files,
+                                  runtime_needs_ld_so_conf (runtime_files),
+                                  cancellable, error);
+  if (ld_so_fd == -1)
+    return FALSE;
+
+  return TRUE;
 }
 
 /* Check that this user is actually allowed to run this app. When running
@@ -3288,6 +4029,76 @@ open_namespace_fd_if_needed (const char *path, const char *type)
   return -1;
 }
 
+static gpointer
+transient_unit_thread (gpointer user_data)
+{
+  g_autofree char *app_id = user_data;
+  GError *error = NULL;
+
+  g_debug ("Starting transient unit for %s", app_id);
+  flatpak_run_in_transient_unit (app_id, &error);
+
+  return error;
+}
+
+static LaunchTasks *
+launch_tasks_new (gboolean document_portal)
+{
+  LaunchTasks *tasks = g_new0 (LaunchTasks, 1);
+
+  tasks->proxy_sync_fd = -1;
+  if (document_portal)
+    tasks->document_portal = g_thread_new ("document-portal", get_document_portal_mount_path_thread, NULL);
+
+  current_launch_tasks = tasks;
+
+  return tasks;
+}
+
+static void
+launch_tasks_free (LaunchTasks *tasks)
+{
+  if (current_launch_tasks == tasks)
+    current_launch_tasks = NULL;
+
+  if (tasks->transient_unit)
+    {
+      GError *unit_error = g_thread_join (tasks->transient_unit);
+      g_clear_error (&unit_error);
+    }
+  if (tasks->document_portal)
+    g_free (g_thread_join (tasks->document_portal));
+  if (tasks->dconf)
+    dconf_data_free (g_thread_join (tasks->dconf));
+
+  g_free (tasks);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (LaunchTasks, launch_tasks_free)
+
+/* Moving the process into a new systemd scope can't be undone, so this
+ * must only be started once the launch is known to go ahead */
+static void
+launch_tasks_start_transient_unit (LaunchTasks *tasks,
+                                   const char  *app_id)
+{
+  tasks->transient_unit = g_thread_new ("transient-unit", transient_unit_thread, g_strdup (app_id));
+}
+
+/* Called right before exec, when nothing else is left to overlap with */
+static gboolean
+launch_tasks_finish (LaunchTasks *tasks,
+                     GError     **error)
+{
+  int sync_fd = tasks->proxy_sync_fd;
+
+  tasks->proxy_sync_fd = -1;
+  if (sync_fd != -1 && !sync_with_dbus_proxy (sync_fd, error))
+    return FALSE;
+
+  return TRUE;
+}
+
 gboolean
 flatpak_run_app (const char     *app_ref,
                  FlatpakDeploy  *app_deploy,
@@ -3310,7 +4121,6 @@ flatpak_run_app (const char     *app_ref,
   g_autoptr(GVariant) app_deploy_data = NULL;
   g_autoptr(GFile) app_files = NULL;
   g_autoptr(GFile) runtime_files = NULL;
-  g_autoptr(GFile) bin_ldconfig = NULL;
   g_autoptr(GFile) app_id_dir = NULL;
   g_autoptr(GFile) real_app_id_dir = NULL;
   g_autofree char *default_runtime = NULL;
@@ -3336,13 +4146,13 @@ flatpak_run_app (const char     *app_ref,
   g_autofree char *runtime_extensions = NULL;
   g_autofree char *checksum = NULL;
   int ld_so_fd = -1;
-  g_autoptr(GFile) runtime_ld_so_conf = NULL;
-  gboolean generate_ld_so_conf = TRUE;
+  gboolean generate_ld_so_conf;
   gboolean use_ld_so_cache = TRUE;
   gboolean sandboxed = (flags & FLATPAK_RUN_FLAG_SANDBOX) != 0;
   gboolean parent_expose_pids = (flags & FLATPAK_RUN_FLAG_PARENT_EXPOSE_PIDS) != 0;
-
-  struct stat s;
+  g_autoptr(LaunchTrace) trace = launch_trace_new (flags);
+  g_autoptr(LaunchTasks) tasks = NULL;
+  g_autoptr(DconfData) dconf_data = NULL;
 
   app_ref_parts = flatpak_decompose_ref (app_ref, error);
   if (app_ref_parts == NULL)
@@ -3352,6 +4162,10 @@ flatpak_run_app (const char     *app_ref,
   if (!check_parental_controls (app_ref, app_deploy, cancellable, error))
     return FALSE;
 
+  launch_trace_mark ("parental-controls");
+
+  tasks = launch_tasks_new (!sandboxed && !(flags & FLATPAK_RUN_FLAG_NO_DOCUMENTS_PORTAL));
+
   /* Construct the bwrap context. */
   bwrap = flatpak_bwrap_new (NULL);
   flatpak_bwrap_add_arg (bwrap, flatpak_get_bwrap ());
@@ -3385,6 +4199,8 @@ flatpak_run_app (const char     *app_ref,
         }
     }
 
+  tasks->dconf = g_thread_new ("dconf", load_dconf_data_thread, dconf_data_new (app_ref_parts[1], metakey));
+
   runtime_parts = g_strsplit (default_runtime, "/", 0);
   if (g_strv_length (runtime_parts) != 3)
     return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_REF, _("Wrong number of components in runtime %s"), default_runtime);
@@ -3444,10 +4260,13 @@ flatpak_run_app (const char     *app_ref,
     flatpak_context_merge (app_context, extra_context);
 
   runtime_files = flatpak_deploy_get_files (runtime_deploy);
-  bin_ldconfig = g_file_resolve_relative_path (runtime_files, "bin/ldconfig");
-  if (!g_file_query_exists (bin_ldconfig, NULL))
+  if (!runtime_has_ldconfig (runtime_files))
     use_ld_so_cache = FALSE;
 
+  launch_trace_mark ("deploys");
+
+  launch_tasks_start_transient_unit (tasks, app_ref_parts[1]);
+
   if (app_deploy != NULL)
     {
       g_autofree const char **previous_ids = NULL;
@@ -3535,6 +4354,8 @@ flatpak_run_app (const char     *app_ref,
 
       if (!sandboxed)
         app_id_dir = g_object_ref (real_app_id_dir);
+
+      launch_trace_mark ("data-dir");
     }
 
   flatpak_run_apply_env_default (bwrap, use_ld_so_cache);
@@ -3547,48 +4368,59 @@ flatpak_run_app (const char     *app_ref,
       flatpak_bwrap_set_env (bwrap, "FLATPAK_SANDBOX_DIR", flatpak_file_get_path_cached (sandbox_dir), TRUE);
     }
 
-  flatpak_bwrap_add_args (bwrap,
-                          "--ro-bind", flatpak_file_get_path_cached (runtime_files), "/usr",
-                          "--lock-file", "/usr/.ref",
-                          NULL);
-
-  if (app_files != NULL)
-    flatpak_bwrap_add_args (bwrap,
-                            "--ro-bind", flatpak_file_get_path_cached (app_files), "/app",
-                            "--lock-file", "/app/.ref",
-                            NULL);
-  else
-    flatpak_bwrap_add_args (bwrap,
-                            "--dir", "/app",
-                            NULL);
-
-  if (metakey != NULL &&
-      !flatpak_run_add_extension_args (bwrap, metakey, app_ref, use_ld_so_cache, &app_extensions, cancellable, error))
+  if (!add_app_and_runtime_args (bwrap, app_files, metakey, app_ref,
+                                 runtime_files, runtime_metakey, runtime_ref, use_ld_so_cache,
+                                 TRUE,
+                                 &app_extensions, &runtime_extensions,
+                                 cancellable, error))
     return FALSE;
 
-  if (!flatpak_run_add_extension_args (bwrap, runtime_metakey, runtime_ref, use_ld_so_cache, &runtime_extensions, cancellable, error))
-    return FALSE;
+  launch_trace_mark ("extensions");
 
-  runtime_ld_so_conf = g_file_resolve_relative_path (runtime_files, "etc/ld.so.conf");
-  if (lstat (flatpak_file_get_path_cached (runtime_ld_so_conf), &s) == 0)
-    generate_ld_so_conf = S_ISREG (s.st_mode) && s.st_size == 0;
+  generate_ld_so_conf = runtime_needs_ld_so_conf (runtime_files);
 
   /* At this point we have the minimal argv set up, with just the app, runtime and extensions.
      We can reuse this to generate the ld.so.cache (if needed) */
   if (use_ld_so_cache)
     {
+      g_autoptr(GFile) ld_cache_dir = flatpak_get_user_ld_cache_dir ();
+
       checksum = calculate_ld_cache_checksum (app_deploy_data, runtime_deploy_data,
                                               app_extensions, runtime_extensions);
-      ld_so_fd = regenerate_ld_cache (bwrap->argv,
-                                      bwrap->fds,
-                                      app_id_dir,
-                                      checksum,
-                                      runtime_files,
-                                      generate_ld_so_conf,
-                                      cancellable, error);
+
+      /* Normally this was generated when deploying */
+      ld_so_fd = open_ld_cache (ld_cache_dir, checksum);
       if (ld_so_fd == -1)
-        return FALSE;
+        {
+          g_autoptr(GError) local_error = NULL;
+          g_autofree char *deps = calculate_ld_cache_deps (app_deploy_data, runtime_deploy_data,
+                                                           app_extensions, runtime_extensions);
+
+          ld_so_fd = regenerate_ld_cache (bwrap->argv,
+                                          bwrap->fds,
+                                          ld_cache_dir,
+                                          checksum,
+                                          deps,
+                                          runtime_files,
+                                          generate_ld_so_conf,
+                                          cancellable, error);
+          if (ld_so_fd == -1)
+            return FALSE;
+
+          /* Older versions kept per-app caches in the app's data dir,
+             which are no longer used. Unused shared caches are removed
+             when uninstalling and pruning, see flatpak_dir_gc_ld_caches(). */
+          if (real_app_id_dir != NULL)
+            {
+              g_autoptr(GFile) old_ld_so_dir = g_file_get_child (real_app_id_dir, ".ld.so");
+
+              if (!flatpak_rm_rf (old_ld_so_dir, cancellable, &local_error))
+                g_debug ("Failed to remove %s: %s", flatpak_file_get_path_cached (old_ld_so_dir), local_error->message);
+            }
+        }
       flatpak_bwrap_add_fd (bwrap, ld_so_fd);
+
+      launch_trace_mark ("ld-so-cache");
     }
 
   flags |= flatpak_context_get_run_flags (app_context);
@@ -3610,6 +4442,8 @@ flatpak_run_app (const char     *app_ref,
       flatpak_bwrap_add_arg (bwrap, "/etc/ld.so.cache");
     }
 
+  launch_trace_mark ("base-argv");
+
   if (!flatpak_run_add_app_info_args (bwrap,
                                       app_files, app_deploy_data, app_extensions,
                                       runtime_files, runtime_deploy_data, runtime_extensions,
@@ -3619,11 +4453,20 @@ flatpak_run_app (const char     *app_ref,
                                       &app_info_path, &instance_id_host_dir, error))
     return FALSE;
 
-  if (!flatpak_run_add_dconf_args (bwrap, app_ref_parts[1], metakey, error))
+  launch_trace_mark ("app-info");
+
+  dconf_data = g_thread_join (g_steal_pointer (&tasks->dconf));
+  if (!flatpak_run_add_dconf_args (bwrap, dconf_data, error))
     return FALSE;
 
-  if (!sandboxed && !(flags & FLATPAK_RUN_FLAG_NO_DOCUMENTS_PORTAL))
-    add_document_portal_args (bwrap, app_ref_parts[1], &doc_mount_path);
+  launch_trace_mark ("dconf");
+
+  if (tasks->document_portal != NULL)
+    {
+      doc_mount_path = g_thread_join (g_steal_pointer (&tasks->document_portal));
+      add_document_portal_args (bwrap, app_ref_parts[1], doc_mount_path);
+      launch_trace_mark ("document-portal");
+    }
 
   if (!flatpak_run_add_environment_args (bwrap, app_info_path, flags,
                                          app_ref_parts[1], app_context, app_id_dir, previous_app_id_dirs,
@@ -3706,6 +4549,12 @@ flatpak_run_app (const char     *app_ref,
   commandline = flatpak_quote_argv ((const char **) bwrap->argv->pdata, -1);
   g_debug ("Running '%s'", commandline);
 
+  if (!launch_tasks_finish (tasks, error))
+    return FALSE;
+
+  launch_trace_mark ("finish");
+  launch_trace_emit (trace, app_ref);
+
   if ((flags & FLATPAK_RUN_FLAG_BACKGROUND) != 0)
     {
       GPid child_pid;
@@ -177,6 +177,7 @@ struct _FlatpakTransactionPrivate
   gboolean                     can_run;
   char                        *default_arch;
   guint                        max_op;
+  guint                        max_parallel_pulls;
 
   gboolean                     needs_resolve;
 };
@@ -1203,6 +1204,7 @@ flatpak_transaction_init (FlatpakTransaction *self)
   priv->added_origin_remotes = g_ptr_array_new_with_free_func (g_free);
   priv->extra_dependency_dirs = g_ptr_array_new_with_free_func (g_object_unref);
   priv->can_run = TRUE;
+  priv->max_parallel_pulls = 1;
 }
 
 
@@ -1499,6 +1501,54 @@ flatpak_transaction_set_default_arch (FlatpakTransaction *self,
   priv->default_arch = g_strdup (arch);
 }
 
+/**
+ * flatpak_transaction_set_max_parallel_pulls:
+ * @self: a #FlatpakTransaction
+ * @max_parallel_pulls: the maximum number of pulls to run at the same time
+ *
+ * Sets how many operations are allowed to download at the same time.
+ * If this is larger than 1, the pulls of the install and update
+ * operations are run in a pool of this many worker threads, at most
+ * this many operations ahead of the one that is being deployed, while
+ * the operations are still deployed one at a time in the normal order.
+ * Signals are still emitted for one operation at a time, so the
+ * progress of an operation may start at a later point than in the
+ * serial case.
+ *
+ * This is only supported for installations that don't need the
+ * system helper, and is silently ignored otherwise. The default is 1,
+ * which means that everything is done serially.
+ *
+ * Since: 1.5.2
+ */
+void
+flatpak_transaction_set_max_parallel_pulls (FlatpakTransaction *self,
+                                            guint               max_parallel_pulls)
+{
+  FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
+
+  priv->max_parallel_pulls = max_parallel_pulls;
+}
+
+/**
+ * flatpak_transaction_get_max_parallel_pulls:
+ * @self: a #FlatpakTransaction
+ *
+ * Gets the maximum number of operations that are downloading at the
+ * same time. See flatpak_transaction_set_max_parallel_pulls().
+ *
+ * Returns: the maximum number of parallel pulls
+ *
+ * Since: 1.5.2
+ */
+guint
+flatpak_transaction_get_max_parallel_pulls (FlatpakTransaction *self)
+{
+  FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
+
+  return priv->max_parallel_pulls;
+}
+
 static FlatpakTransactionOperation *
 flatpak_transaction_get_last_op_for_ref (FlatpakTransaction *self,
                                          const char         *ref)
@@ -3484,10 +3534,250 @@ flatpak_transaction_run (FlatpakTransaction *transaction,
   return FLATPAK_TRANSACTION_GET_CLASS (transaction)->run (transaction, cancellable, error);
 }
 
+/* In parallel mode the pulls of install and update operations are run
+ * ahead of time in a thread pool, and _run_op_kind() then waits for the
+ * pull of the op before deploying it with no_pull. This way the deploys
+ * still happen one at a time in the order given by run_operation_before(),
+ * but the network latency of the pulls overlaps. */
+typedef struct
+{
+  FlatpakDir                  *dir;
+  FlatpakTransactionOperation *op;
+  FlatpakRemoteState          *state;
+  char                       **subpaths;
+  gboolean                     disable_static_deltas;
+  gboolean                     allow_downgrade;
+  FlatpakTransactionProgress  *progress;
+  GCancellable                *cancellable;
+  GMainContext                *main_context; /* Woken up when done */
+  gint                         done;
+  GError                      *error;
+} ParallelPull;
+
+static void
+parallel_pull_free (ParallelPull *pull)
+{
+  /* Make sure we get no more progress callbacks if the op never ran */
+  if (!pull->progress->done)
+    flatpak_transaction_progress_done (pull->progress);
+
+  g_object_unref (pull->dir);
+  g_object_unref (pull->op);
+  flatpak_remote_state_unref (pull->state);
+  g_strfreev (pull->subpaths);
+  g_object_unref (pull->progress);
+  g_object_unref (pull->cancellable);
+  g_main_context_unref (pull->main_context);
+  g_clear_error (&pull->error);
+  g_free (pull);
+}
+
+static ParallelPull *
+parallel_pull_new (FlatpakTransaction          *self,
+                   FlatpakTransactionOperation *op,
+                   FlatpakRemoteState          *state,
+                   GCancellable                *cancellable)
+{
+  FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
+  ParallelPull *pull = g_new0 (ParallelPull, 1);
+
+  /* A FlatpakDir and its OstreeRepo can't be used from several threads */
+  pull->dir = flatpak_dir_clone (priv->dir);
+  pull->op = g_object_ref (op);
+  pull->state = flatpak_remote_state_ref (state);
+  pull->disable_static_deltas = priv->disable_static_deltas;
+  pull->progress = flatpak_transaction_progress_new ();
+  pull->cancellable = g_object_ref (cancellable);
+  pull->main_context = g_main_context_ref_thread_default ();
+
+  if (op->kind == FLATPAK_TRANSACTION_OPERATION_UPDATE)
+    {
+      /* Same as flatpak_dir_update(): keep the current subpaths if none are specified */
+      if (op->subpaths != NULL)
+        pull->subpaths = g_strdupv (op->subpaths);
+      else
+        {
+          g_autoptr(GVariant) deploy_data = flatpak_dir_get_deploy_data (priv->dir, op->ref, FLATPAK_DEPLOY_VERSION_ANY, NULL, NULL);
+          if (deploy_data != NULL)
+            {
+              g_autofree const char **old_subpaths = flatpak_deploy_data_get_subpaths (deploy_data);
+              pull->subpaths = g_strdupv ((char **) old_subpaths);
+            }
+        }
+
+      pull->allow_downgrade = op->commit != NULL; /* Allow downgrade if we specify commit */
+    }
+  else
+    pull->subpaths = g_strdupv (op->subpaths);
+
+  return pull;
+}
+
+static void
+parallel_pull_run (gpointer data,
+                   gpointer user_data)
+{
+  ParallelPull *pull = data;
+  g_autoptr(GMainContextPopDefault) context = NULL;
+
+  /* Each worker needs its own main context for the sync ostree calls */
+  context = flatpak_main_context_new_default ();
+
+  if (!g_cancellable_set_error_if_cancelled (pull->cancellable, &pull->error))
+    flatpak_dir_pull_for_deploy (pull->dir, pull->state, pull->op->ref, pull->op->resolved_commit,
+                                 (const char **) pull->subpaths, pull->op->resolved_token,
+                                 pull->disable_static_deltas, pull->allow_downgrade,
+                                 pull->progress->ostree_progress,
+                                 pull->cancellable, &pull->error);
+
+  g_atomic_int_set (&pull->done, TRUE);
+  g_main_context_wakeup (pull->main_context);
+}
+
+/* Called in the main thread, iterates the main context so that the
+ * progress of the pull is reported while we wait */
+static gboolean
+parallel_pull_wait (ParallelPull *pull,
+                    GError      **error)
+{
+  while (!g_atomic_int_get (&pull->done))
+    g_main_context_iteration (pull->main_context, TRUE);
+
+  if (pull->error != NULL)
+    {
+      g_propagate_error (error, g_steal_pointer (&pull->error));
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static void
+cancel_parallel_pulls (GCancellable *cancellable,
+                       GCancellable *pulls_cancellable)
+{
+  g_cancellable_cancel (pulls_cancellable);
+}
+
+/* The pulls are queued in the order of the ops, but only as the
+ * deploys catch up with them, so that at most max_parallel_pulls ops
+ * are pulled ahead of the one being deployed. */
+typedef struct
+{
+  GThreadPool  *pool;
+  GHashTable   *pulls; /* op -> ParallelPull */
+  GList        *next;  /* The next op to consider queueing */
+  guint         n_pending; /* Queued, and not yet passed by the deploys */
+  GCancellable *cancellable;
+} ParallelPulls;
+
+static void
+parallel_pulls_free (ParallelPulls *pulls)
+{
+  /* Stop pulls that are still queued or running, e.g. after an abort */
+  g_cancellable_cancel (pulls->cancellable);
+  g_thread_pool_free (pulls->pool, TRUE, TRUE);
+  g_hash_table_unref (pulls->pulls);
+  g_object_unref (pulls->cancellable);
+  g_free (pulls);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (ParallelPulls, parallel_pulls_free)
+
+/* Returns NULL if parallel pulls are not possible */
+static ParallelPulls *
+parallel_pulls_new (FlatpakTransaction *self)
+{
+  FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
+  g_autoptr(GError) local_error = NULL;
+  ParallelPulls *pulls;
+  GThreadPool *pool;
+
+  if (priv->max_parallel_pulls <= 1 || priv->no_pull)
+    return NULL;
+
+  if (flatpak_dir_use_system_helper (priv->dir, NULL))
+    {
+      g_debug ("Parallel pulls not supported with the system helper, pulling serially");
+      return NULL;
+    }
+
+  pool = g_thread_pool_new (parallel_pull_run, NULL, priv->max_parallel_pulls, FALSE, &local_error);
+  if (pool == NULL)
+    {
+      g_debug ("Failed to create pull thread pool, pulling serially: %s", local_error->message);
+      return NULL;
+    }
+
+  pulls = g_new0 (ParallelPulls, 1);
+  pulls->pool = pool;
+  pulls->pulls = g_hash_table_new_full (NULL, NULL, NULL, (GDestroyNotify) parallel_pull_free);
+  pulls->next = priv->ops;
+  pulls->cancellable = g_cancellable_new ();
+
+  return pulls;
+}
+
+/* Queues pulls for the ops after @current until the window is full, and
+ * returns the pull of @current, if any */
+static ParallelPull *
+parallel_pulls_advance (FlatpakTransaction *self,
+                        ParallelPulls      *pulls,
+                        GList              *current)
+{
+  FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
+  ParallelPull *current_pull;
+
+  while (pulls->next != NULL && pulls->n_pending < priv->max_parallel_pulls)
+    {
+      FlatpakTransactionOperation *op = pulls->next->data;
+      g_autoptr(FlatpakRemoteState) state = NULL;
+      ParallelPull *pull;
+
+      pulls->next = pulls->next->next;
+
+      if (op->skip || op->update_only_deploy || op->resolved_commit == NULL ||
+          (op->kind != FLATPAK_TRANSACTION_OPERATION_INSTALL &&
+           op->kind != FLATPAK_TRANSACTION_OPERATION_UPDATE))
+        continue;
+
+      if (op->fail_if_op_fails && op->fail_if_op_fails->failed)
+        continue;
+
+      /* Nothing to pull, _run_op_kind() skips these too */
+      if (op->kind == FLATPAK_TRANSACTION_OPERATION_UPDATE &&
+          !flatpak_dir_needs_update_for_commit_and_subpaths (priv->dir, op->remote, op->ref, op->resolved_commit,
+                                                             (const char **) op->subpaths))
+        continue;
+
+      /* Let the serial code report these errors */
+      if (op->resolved_metakey && !flatpak_check_required_version (op->ref, op->resolved_metakey, NULL))
+        continue;
+
+      state = flatpak_transaction_ensure_remote_state (self, op->kind, op->remote, NULL);
+      if (state == NULL)
+        continue;
+
+      g_debug ("Starting parallel pull of %s", op->ref);
+
+      pull = parallel_pull_new (self, op, state, pulls->cancellable);
+      g_hash_table_insert (pulls->pulls, op, pull);
+      g_thread_pool_push (pulls->pool, pull, NULL);
+      pulls->n_pending++;
+    }
+
+  current_pull = g_hash_table_lookup (pulls->pulls, current->data);
+  if (current_pull != NULL)
+    pulls->n_pending--;
+
+  return current_pull;
+}
+
 static gboolean
 _run_op_kind (FlatpakTransaction           *self,
               FlatpakTransactionOperation  *op,
               FlatpakRemoteState           *remote_state, /* nullable */
+              ParallelPull                 *pull, /* nullable */
               gboolean                     *out_needs_prune,
               gboolean                     *out_needs_triggers,
               GCancellable                 *cancellable,
@@ -3500,7 +3790,12 @@ _run_op_kind (FlatpakTransaction           *self,
 
   if (op->kind == FLATPAK_TRANSACTION_OPERATION_INSTALL)
     {
-      g_autoptr(FlatpakTransactionProgress) progress = flatpak_transaction_progress_new ();
+      g_autoptr(FlatpakTransactionProgress) progress = NULL;
+
+      if (pull)
+        progress = g_object_ref (pull->progress);
+      else
+        progress = flatpak_transaction_progress_new ();
 
       emit_new_op (self, op, progress);
 
@@ -3508,9 +3803,11 @@ _run_op_kind (FlatpakTransaction           *self,
 
       if (op->resolved_metakey && !flatpak_check_required_version (op->ref, op->resolved_metakey, error))
         res = FALSE;
+      else if (pull && !parallel_pull_wait (pull, error))
+        res = FALSE;
       else
         res = flatpak_dir_install (priv->dir,
-                                   priv->no_pull,
+                                   priv->no_pull || pull != NULL,
                                    priv->no_deploy,
                                    priv->disable_static_deltas,
                                    priv->reinstall,
@@ -3543,14 +3840,21 @@ _run_op_kind (FlatpakTransaction           *self,
       if (flatpak_dir_needs_update_for_commit_and_subpaths (priv->dir, op->remote, op->ref, op->resolved_commit,
                                                             (const char **) op->subpaths))
         {
-          g_autoptr(FlatpakTransactionProgress) progress = flatpak_transaction_progress_new ();
+          g_autoptr(FlatpakTransactionProgress) progress = NULL;
           FlatpakTransactionResult result_details = 0;
           g_autoptr(GError) local_error = NULL;
 
+          if (pull)
+            progress = g_object_ref (pull->progress);
+          else
+            progress = flatpak_transaction_progress_new ();
+
           emit_new_op (self, op, progress);
 
           if (op->resolved_metakey && !flatpak_check_required_version (op->ref, op->resolved_metakey, &local_error))
             res = FALSE;
+          else if (pull && !parallel_pull_wait (pull, &local_error))
+            res = FALSE;
           else if (op->update_only_deploy)
             res = flatpak_dir_deploy_update (priv->dir, op->ref, op->resolved_commit,
                                              (const char **) op->subpaths,
@@ -3558,7 +3862,7 @@ _run_op_kind (FlatpakTransaction           *self,
                                              cancellable, &local_error);
           else
             res = flatpak_dir_update (priv->dir,
-                                      priv->no_pull,
+                                      priv->no_pull || pull != NULL,
                                       priv->no_deploy,
                                       priv->disable_static_deltas,
                                       op->commit != NULL, /* Allow downgrade if we specify commit */
@@ -3664,6 +3968,8 @@ flatpak_transaction_real_run (FlatpakTransaction *self,
   gboolean needs_triggers = FALSE;
   g_autoptr(GMainContextPopDefault) main_context = NULL;
   gboolean ready_res = FALSE;
+  g_autoptr(ParallelPulls) parallel_pulls = NULL;
+  gulong cancelled_id = 0;
   int i;
 
   if (!priv->can_run)
@@ -3775,6 +4081,11 @@ flatpak_transaction_real_run (FlatpakTransaction *self,
   if (!ready_res)
     return flatpak_fail_error (error, FLATPAK_ERROR_ABORTED, _("Aborted by user"));
 
+  parallel_pulls = parallel_pulls_new (self);
+  if (parallel_pulls && cancellable)
+    cancelled_id = g_cancellable_connect (cancellable, G_CALLBACK (cancel_parallel_pulls),
+                                          parallel_pulls->cancellable, NULL);
+
   for (l = priv->ops; l != NULL; l = l->next)
     {
       FlatpakTransactionOperation *op = l->data;
@@ -3782,10 +4093,14 @@ flatpak_transaction_real_run (FlatpakTransaction *self,
       gboolean res = TRUE;
       const char *pref;
       g_autoptr(FlatpakRemoteState) state = NULL;
+      ParallelPull *pull = NULL;
 
       if (op->skip)
         continue;
 
+      if (parallel_pulls)
+        pull = parallel_pulls_advance (self, parallel_pulls, l);
+
       priv->current_op = op;
 
       pref = strchr (op->ref, '/') + 1;
@@ -3807,7 +4122,8 @@ flatpak_transaction_real_run (FlatpakTransaction *self,
         }
 
       /* Here we execute the operation in a helper function */
-      if (res && !_run_op_kind (self, op, state, &needs_prune, &needs_triggers, cancellable, &local_error))
+      if (res && !_run_op_kind (self, op, state, pull,
+                                &needs_prune, &needs_triggers, cancellable, &local_error))
         res = FALSE;
 
       if (res)
@@ -3856,6 +4172,10 @@ flatpak_transaction_real_run (FlatpakTransaction *self,
     }
   priv->current_op = NULL;
 
+  if (cancelled_id != 0)
+    g_cancellable_disconnect (cancellable, cancelled_id);
+  g_clear_pointer (&parallel_pulls, parallel_pulls_free);
+
   if (needs_triggers)
     flatpak_dir_run_triggers (priv->dir, cancellable, NULL);
 
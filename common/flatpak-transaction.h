@@ -215,6 +215,11 @@ FLATPAK_EXTERN
 void                flatpak_transaction_set_default_arch (FlatpakTransaction *self,
                                                           const char         *arch);
 FLATPAK_EXTERN
+void                flatpak_transaction_set_max_parallel_pulls (FlatpakTransaction *self,
+                                                                guint               max_parallel_pulls);
+FLATPAK_EXTERN
+guint               flatpak_transaction_get_max_parallel_pulls (FlatpakTransaction *self);
+FLATPAK_EXTERN
 void                flatpak_transaction_set_parent_window (FlatpakTransaction *self,
                                                            const char *parent_window);
 FLATPAK_EXTERN
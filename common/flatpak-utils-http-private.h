@@ -47,10 +47,35 @@ gboolean flatpak_download_http_uri (SoupSession           *soup_session,
                                     const char            *uri,
                                     FlatpakHTTPFlags       flags,
                                     GOutputStream         *out,
+                                    guint64                offset,
                                     FlatpakLoadUriProgress progress,
                                     gpointer               user_data,
                                     GCancellable          *cancellable,
                                     GError               **error);
+void     flatpak_load_http_uri_async (SoupSession           *soup_session,
+                                      const char            *uri,
+                                      FlatpakHTTPFlags       flags,
+                                      FlatpakLoadUriProgress progress,
+                                      gpointer               progress_data,
+                                      GCancellable          *cancellable,
+                                      GAsyncReadyCallback    callback,
+                                      gpointer               user_data);
+GBytes * flatpak_load_http_uri_finish (SoupSession  *soup_session,
+                                       GAsyncResult *result,
+                                       GError      **error);
+void     flatpak_download_http_uri_async (SoupSession           *soup_session,
+                                          const char            *uri,
+                                          FlatpakHTTPFlags       flags,
+                                          GOutputStream         *out,
+                                          guint64                offset,
+                                          FlatpakLoadUriProgress progress,
+                                          gpointer               progress_data,
+                                          GCancellable          *cancellable,
+                                          GAsyncReadyCallback    callback,
+                                          gpointer               user_data);
+gboolean flatpak_download_http_uri_finish (SoupSession  *soup_session,
+                                           GAsyncResult *result,
+                                           GError      **error);
 gboolean flatpak_cache_http_uri (SoupSession           *soup_session,
                                  const char            *uri,
                                  FlatpakHTTPFlags       flags,
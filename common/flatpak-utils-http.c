@@ -36,9 +36,16 @@ typedef struct
   gint64 expires;
 } CacheHttpData;
 
+/* Requests beyond these limits are queued by the session, so callers
+ * can start any number of async downloads at once */
+#define FLATPAK_HTTP_MAX_CONNS 16
+#define FLATPAK_HTTP_MAX_CONNS_PER_HOST 4
+
 typedef struct
 {
-  GMainLoop             *loop;
+  GMainLoop             *loop; /* flatpak_cache_http_uri() */
+  GTask                 *task; /* The async API */
+  SoupRequestHTTP       *request;
   GError                *error;
   gboolean               store_compressed;
 
@@ -48,6 +55,8 @@ typedef struct
   int                    out_tmpfile_parent_dfd;
 
   guint64                downloaded_bytes;
+  guint64                range_start;
+  guint64                skip_bytes;
   char                   buffer[16 * 1024];
   FlatpakLoadUriProgress progress;
   GCancellable          *cancellable;
@@ -323,6 +332,47 @@ save_cache_http_data_to_file (int           dfd,
   return TRUE;
 }
 
+static void
+load_uri_data_free (LoadUriData *data)
+{
+  g_clear_error (&data->error);
+  g_clear_object (&data->request);
+  g_clear_object (&data->out);
+  if (data->content)
+    g_string_free (data->content, TRUE);
+  g_clear_object (&data->cancellable);
+  g_free (data);
+}
+
+/* Called once the request is finished, successfully or not */
+static void
+load_uri_done (LoadUriData *data)
+{
+  g_autoptr(GTask) task = NULL;
+
+  if (data->task == NULL)
+    {
+      g_main_loop_quit (data->loop);
+      return;
+    }
+
+  task = g_steal_pointer (&data->task);
+
+  if (data->error)
+    g_task_return_error (task, g_steal_pointer (&data->error));
+  else
+    {
+      g_debug ("Received %" G_GUINT64_FORMAT " bytes", data->downloaded_bytes);
+
+      if (data->content)
+        g_task_return_pointer (task,
+                               g_string_free_to_bytes (g_steal_pointer (&data->content)),
+                               (GDestroyNotify) g_bytes_unref);
+      else
+        g_task_return_boolean (task, TRUE);
+    }
+}
+
 static void
 stream_closed (GObject *source, GAsyncResult *res, gpointer user_data)
 {
@@ -344,7 +394,7 @@ stream_closed (GObject *source, GAsyncResult *res, gpointer user_data)
       g_clear_pointer (&data->out, g_object_unref);
     }
 
-  g_main_loop_quit (data->loop);
+  load_uri_done (data);
 }
 
 static void
@@ -366,6 +416,16 @@ load_uri_read_cb (GObject *source, GAsyncResult *res, gpointer user_data)
       return;
     }
 
+  if (data->skip_bytes > 0)
+    {
+      gsize skip = MIN (nread, data->skip_bytes);
+
+      /* The server ignored the range request, so drop what we already have */
+      data->skip_bytes -= skip;
+      nread -= skip;
+      memmove (data->buffer, data->buffer + skip, nread);
+    }
+
   if (data->out != NULL)
     {
       gsize n_written;
@@ -412,7 +472,7 @@ load_uri_callback (GObject      *source_object,
   in = soup_request_send_finish (SOUP_REQUEST (request), res, &data->error);
   if (in == NULL)
     {
-      g_main_loop_quit (data->loop);
+      load_uri_done (data);
       return;
     }
 
@@ -445,13 +505,30 @@ load_uri_callback (GObject      *source_object,
                                  "Server returned status %u: %s",
                                  msg->status_code,
                                  soup_status_get_phrase (msg->status_code));
-      g_main_loop_quit (data->loop);
+      load_uri_done (data);
       return;
     }
 
   if (data->cache_data)
     set_cache_http_data_from_headers (data->cache_data, msg);
 
+  if (data->range_start > 0)
+    {
+      goffset start, end, total_length;
+
+      if (msg->status_code != SOUP_STATUS_PARTIAL_CONTENT)
+        data->skip_bytes = data->range_start;
+      else if (!soup_message_headers_get_content_range (msg->response_headers, &start, &end, &total_length) ||
+               start != (goffset) data->range_start)
+        {
+          data->error = g_error_new (G_IO_ERROR, G_IO_ERROR_FAILED,
+                                     "Server returned unexpected range for offset %" G_GUINT64_FORMAT,
+                                     data->range_start);
+          load_uri_done (data);
+          return;
+        }
+    }
+
   if (data->out_tmpfile)
     {
       g_autoptr(GOutputStream) out = NULL;
@@ -459,7 +536,10 @@ load_uri_callback (GObject      *source_object,
       if (!glnx_open_tmpfile_linkable_at (data->out_tmpfile_parent_dfd, ".",
                                           O_WRONLY, data->out_tmpfile,
                                           &data->error))
-        return;
+        {
+          load_uri_done (data);
+          return;
+        }
 
       g_assert (data->out == NULL);
 
@@ -492,6 +572,8 @@ flatpak_create_soup_session (const char *user_agent)
                                                 SOUP_SESSION_USE_THREAD_CONTEXT, TRUE,
                                                 SOUP_SESSION_TIMEOUT, 60,
                                                 SOUP_SESSION_IDLE_TIMEOUT, 60,
+                                                SOUP_SESSION_MAX_CONNS, FLATPAK_HTTP_MAX_CONNS,
+                                                SOUP_SESSION_MAX_CONNS_PER_HOST, FLATPAK_HTTP_MAX_CONNS_PER_HOST,
                                                 NULL);
   soup_session_remove_feature_by_type (soup_session, SOUP_TYPE_CONTENT_DECODER);
   http_proxy = g_getenv ("http_proxy");
@@ -510,62 +592,155 @@ flatpak_create_soup_session (const char *user_agent)
   return soup_session;
 }
 
-GBytes *
-flatpak_load_http_uri (SoupSession           *soup_session,
-                       const char            *uri,
-                       FlatpakHTTPFlags       flags,
-                       FlatpakLoadUriProgress progress,
-                       gpointer               user_data,
-                       GCancellable          *cancellable,
-                       GError               **error)
+static void
+load_uri_async (SoupSession           *soup_session,
+                const char            *uri,
+                FlatpakHTTPFlags       flags,
+                GOutputStream         *out,
+                guint64                offset,
+                FlatpakLoadUriProgress progress,
+                gpointer               progress_data,
+                GCancellable          *cancellable,
+                gpointer               source_tag,
+                GAsyncReadyCallback    callback,
+                gpointer               user_data)
 {
-  GBytes *bytes = NULL;
-  g_autoptr(GMainContext) context = NULL;
-  g_autoptr(SoupRequestHTTP) request = NULL;
-  g_autoptr(GMainLoop) loop = NULL;
-  g_autoptr(GString) content = g_string_new ("");
-  LoadUriData data = { NULL };
+  g_autoptr(GTask) task = NULL;
+  LoadUriData *data;
+  GError *error = NULL;
   SoupMessage *m;
 
   g_debug ("Loading %s using libsoup", uri);
 
-  context = g_main_context_ref_thread_default ();
+  task = g_task_new (soup_session, cancellable, callback, user_data);
+  g_task_set_source_tag (task, source_tag);
 
-  loop = g_main_loop_new (context, TRUE);
-  data.loop = loop;
-  data.content = content;
-  data.progress = progress;
-  data.cancellable = cancellable;
-  data.user_data = user_data;
-  data.last_progress_time = g_get_monotonic_time ();
+  data = g_new0 (LoadUriData, 1);
+  g_task_set_task_data (task, data, (GDestroyNotify) load_uri_data_free);
 
-  request = soup_session_request_http (soup_session, "GET",
-                                       uri, error);
-  if (request == NULL)
-    return NULL;
+  if (out)
+    data->out = g_object_ref (out);
+  else
+    data->content = g_string_new ("");
+  data->range_start = offset;
+  data->progress = progress;
+  data->user_data = progress_data;
+  data->cancellable = cancellable ? g_object_ref (cancellable) : NULL;
+  data->last_progress_time = g_get_monotonic_time ();
+
+  data->request = soup_session_request_http (soup_session, "GET", uri, &error);
+  if (data->request == NULL)
+    {
+      g_task_return_error (task, error);
+      return;
+    }
 
-  m = soup_request_http_get_message (request);
+  m = soup_request_http_get_message (data->request);
 
   if (flags & FLATPAK_HTTP_FLAGS_ACCEPT_OCI)
     soup_message_headers_replace (m->request_headers, "Accept",
                                   FLATPAK_OCI_MEDIA_TYPE_IMAGE_MANIFEST ", " FLATPAK_DOCKER_MEDIA_TYPE_IMAGE_MANIFEST2);
 
-  soup_request_send_async (SOUP_REQUEST (request),
+  if (offset > 0)
+    {
+      g_debug ("Resuming download at offset %" G_GUINT64_FORMAT, offset);
+      soup_message_headers_set_range (m->request_headers, offset, -1);
+    }
+
+  /* The task keeps itself alive until load_uri_done() */
+  data->task = g_steal_pointer (&task);
+
+  soup_request_send_async (SOUP_REQUEST (data->request),
                            cancellable,
-                           load_uri_callback, &data);
+                           load_uri_callback, data);
+}
 
-  g_main_loop_run (loop);
+/* Any number of requests can be started at once, the session limits
+ * how many run in parallel, per host and in total. @callback is called
+ * in the thread-default main context of the caller. */
+void
+flatpak_load_http_uri_async (SoupSession           *soup_session,
+                             const char            *uri,
+                             FlatpakHTTPFlags       flags,
+                             FlatpakLoadUriProgress progress,
+                             gpointer               progress_data,
+                             GCancellable          *cancellable,
+                             GAsyncReadyCallback    callback,
+                             gpointer               user_data)
+{
+  load_uri_async (soup_session, uri, flags, NULL, 0, progress, progress_data,
+                  cancellable, flatpak_load_http_uri_async, callback, user_data);
+}
 
-  if (data.error)
-    {
-      g_propagate_error (error, data.error);
-      return NULL;
-    }
+GBytes *
+flatpak_load_http_uri_finish (SoupSession  *soup_session,
+                              GAsyncResult *result,
+                              GError      **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, soup_session), NULL);
+  g_return_val_if_fail (g_task_get_source_tag (G_TASK (result)) == flatpak_load_http_uri_async, NULL);
 
-  bytes = g_string_free_to_bytes (g_steal_pointer (&content));
-  g_debug ("Received %" G_GUINT64_FORMAT " bytes", data.downloaded_bytes);
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
 
-  return bytes;
+/* If @offset is not 0 the download is resumed at that offset, @out is
+ * expected to already contain the data before it. */
+void
+flatpak_download_http_uri_async (SoupSession           *soup_session,
+                                 const char            *uri,
+                                 FlatpakHTTPFlags       flags,
+                                 GOutputStream         *out,
+                                 guint64                offset,
+                                 FlatpakLoadUriProgress progress,
+                                 gpointer               progress_data,
+                                 GCancellable          *cancellable,
+                                 GAsyncReadyCallback    callback,
+                                 gpointer               user_data)
+{
+  load_uri_async (soup_session, uri, flags, out, offset, progress, progress_data,
+                  cancellable, flatpak_download_http_uri_async, callback, user_data);
+}
+
+gboolean
+flatpak_download_http_uri_finish (SoupSession  *soup_session,
+                                  GAsyncResult *result,
+                                  GError      **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, soup_session), FALSE);
+  g_return_val_if_fail (g_task_get_source_tag (G_TASK (result)) == flatpak_download_http_uri_async, FALSE);
+
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
+
+static void
+load_uri_sync_cb (GObject      *source,
+                  GAsyncResult *result,
+                  gpointer      user_data)
+{
+  GAsyncResult **result_out = user_data;
+
+  *result_out = g_object_ref (result);
+}
+
+GBytes *
+flatpak_load_http_uri (SoupSession           *soup_session,
+                       const char            *uri,
+                       FlatpakHTTPFlags       flags,
+                       FlatpakLoadUriProgress progress,
+                       gpointer               user_data,
+                       GCancellable          *cancellable,
+                       GError               **error)
+{
+  g_autoptr(GMainContext) context = g_main_context_ref_thread_default ();
+  g_autoptr(GAsyncResult) result = NULL;
+
+  flatpak_load_http_uri_async (soup_session, uri, flags, progress, user_data,
+                               cancellable, load_uri_sync_cb, &result);
+
+  while (result == NULL)
+    g_main_context_iteration (context, TRUE);
+
+  return flatpak_load_http_uri_finish (soup_session, result, error);
 }
 
 gboolean
@@ -573,54 +748,22 @@ flatpak_download_http_uri (SoupSession           *soup_session,
                            const char            *uri,
                            FlatpakHTTPFlags       flags,
                            GOutputStream         *out,
+                           guint64                offset,
                            FlatpakLoadUriProgress progress,
                            gpointer               user_data,
                            GCancellable          *cancellable,
                            GError               **error)
 {
-  g_autoptr(SoupRequestHTTP) request = NULL;
-  g_autoptr(GMainLoop) loop = NULL;
-  g_autoptr(GMainContext) context = NULL;
-  LoadUriData data = { NULL };
-  SoupMessage *m;
+  g_autoptr(GMainContext) context = g_main_context_ref_thread_default ();
+  g_autoptr(GAsyncResult) result = NULL;
 
-  g_debug ("Loading %s using libsoup", uri);
+  flatpak_download_http_uri_async (soup_session, uri, flags, out, offset, progress, user_data,
+                                   cancellable, load_uri_sync_cb, &result);
 
-  context = g_main_context_ref_thread_default ();
+  while (result == NULL)
+    g_main_context_iteration (context, TRUE);
 
-  loop = g_main_loop_new (context, TRUE);
-  data.loop = loop;
-  data.out = out;
-  data.progress = progress;
-  data.cancellable = cancellable;
-  data.user_data = user_data;
-  data.last_progress_time = g_get_monotonic_time ();
-
-  request = soup_session_request_http (soup_session, "GET",
-                                       uri, error);
-  if (request == NULL)
-    return FALSE;
-
-  m = soup_request_http_get_message (request);
-  if (flags & FLATPAK_HTTP_FLAGS_ACCEPT_OCI)
-    soup_message_headers_replace (m->request_headers, "Accept",
-                                  FLATPAK_OCI_MEDIA_TYPE_IMAGE_MANIFEST ", " FLATPAK_DOCKER_MEDIA_TYPE_IMAGE_MANIFEST2);
-
-  soup_request_send_async (SOUP_REQUEST (request),
-                           cancellable,
-                           load_uri_callback, &data);
-
-  g_main_loop_run (loop);
-
-  if (data.error)
-    {
-      g_propagate_error (error, data.error);
-      return FALSE;
-    }
-
-  g_debug ("Received %" G_GUINT64_FORMAT " bytes", data.downloaded_bytes);
-
-  return TRUE;
+  return flatpak_download_http_uri_finish (soup_session, result, error);
 }
 
 static gboolean
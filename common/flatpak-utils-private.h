@@ -110,6 +110,7 @@ const char ** flatpak_get_gl_drivers (void);
 gboolean flatpak_extension_matches_reason (const char *extension_id,
                                            const char *reason,
                                            gboolean    default_value);
+char * flatpak_extension_reasons_state (void);
 
 const char * flatpak_get_bwrap (void);
 
@@ -160,6 +161,29 @@ gboolean flatpak_summary_lookup_ref (GVariant   *summary,
                                      char      **out_checksum,
                                      GVariant  **out_variant);
 
+FlatpakSummaryIndex *flatpak_summary_index_new (GVariant *summary,
+                                                GVariant *metadata);
+void     flatpak_summary_index_free (FlatpakSummaryIndex *index);
+gboolean flatpak_summary_index_lookup_ref (FlatpakSummaryIndex *index,
+                                           const char          *collection_id,
+                                           const char          *ref,
+                                           char               **out_checksum,
+                                           GVariant           **out_variant);
+char **  flatpak_summary_index_match_subrefs (FlatpakSummaryIndex *index,
+                                              const char          *collection_id,
+                                              const char          *ref);
+gboolean flatpak_summary_index_has_cache (FlatpakSummaryIndex *index);
+gboolean flatpak_summary_index_lookup_cache (FlatpakSummaryIndex *index,
+                                             const char          *ref,
+                                             guint64             *download_size,
+                                             guint64             *installed_size,
+                                             const char         **metadata,
+                                             GVariant           **maybe_commit);
+GVariant *flatpak_summary_index_lookup_sparse_cache (FlatpakSummaryIndex *index,
+                                                     const char          *ref);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (FlatpakSummaryIndex, flatpak_summary_index_free)
+
 gboolean flatpak_name_matches_one_wildcard_prefix (const char         *string,
                                                    const char * const *maybe_wildcard_prefixes,
                                                    gboolean            require_exact_match);
@@ -185,13 +209,25 @@ char **flatpak_decompose_ref (const char *ref,
                               GError    **error);
 
 char * flatpak_filter_glob_to_regexp (const char *glob, GError **error);
-gboolean flatpak_parse_filters (const char *data,
-                                GRegex **allow_refs_out,
-                                GRegex **deny_refs_out,
-                                GError **error);
-gboolean flatpak_filters_allow_ref (GRegex *allow_refs,
-                                    GRegex *deny_refs,
-                                    const char *ref);
+
+FlatpakFilter *flatpak_filter_new (void);
+FlatpakFilter *flatpak_filter_ref (FlatpakFilter *filter);
+void flatpak_filter_unref (FlatpakFilter *filter);
+gboolean flatpak_filter_add_glob (FlatpakFilter *filter,
+                                  const char    *glob,
+                                  GError       **error);
+gboolean flatpak_filter_match (FlatpakFilter *filter,
+                               const char    *ref);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (FlatpakFilter, flatpak_filter_unref)
+
+gboolean flatpak_parse_filters (const char     *data,
+                                FlatpakFilter **allow_refs_out,
+                                FlatpakFilter **deny_refs_out,
+                                GError        **error);
+gboolean flatpak_filters_allow_ref (FlatpakFilter *allow_refs,
+                                    FlatpakFilter *deny_refs,
+                                    const char    *ref);
 
 FlatpakKinds flatpak_kinds_from_bools (gboolean app,
                                        gboolean runtime);
@@ -444,12 +480,36 @@ gboolean flatpak_repo_update (OstreeRepo   *repo,
                               const char   *gpg_homedir,
                               GCancellable *cancellable,
                               GError      **error);
+
+typedef struct FlatpakSizeCache FlatpakSizeCache;
+
+/* The default limit of objects in the size cache of a repo */
+#define FLATPAK_SIZE_CACHE_MAX_ENTRIES 1000000
+
+FlatpakSizeCache *flatpak_size_cache_load (OstreeRepo *repo,
+                                           guint       max_entries);
+void     flatpak_size_cache_free (FlatpakSizeCache *cache);
+gboolean flatpak_size_cache_lookup (FlatpakSizeCache *cache,
+                                    const char       *checksum,
+                                    guint64          *file_size,
+                                    guint64          *storage_size);
+void     flatpak_size_cache_save (FlatpakSizeCache *cache);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (FlatpakSizeCache, flatpak_size_cache_free)
+
 gboolean flatpak_repo_collect_sizes (OstreeRepo   *repo,
                                      GFile        *root,
                                      guint64      *installed_size,
                                      guint64      *download_size,
                                      GCancellable *cancellable,
                                      GError      **error);
+gboolean flatpak_repo_collect_sizes_with_cache (OstreeRepo       *repo,
+                                                GFile            *root,
+                                                FlatpakSizeCache *cache,
+                                                guint64          *installed_size,
+                                                guint64          *download_size,
+                                                GCancellable     *cancellable,
+                                                GError          **error);
 GVariant *flatpak_commit_get_extra_data_sources (GVariant *commitv,
                                                  GError  **error);
 GVariant *flatpak_repo_get_extra_data_sources (OstreeRepo   *repo,
@@ -766,9 +826,31 @@ gboolean   flatpak_repo_generate_appstream (OstreeRepo   *repo,
                                             guint64       timestamp,
                                             GCancellable *cancellable,
                                             GError      **error);
-void flatpak_appstream_xml_filter (FlatpakXml *appstream,
-                                   GRegex *allow_refs,
-                                   GRegex *deny_refs);
+void flatpak_appstream_xml_filter (FlatpakXml    *appstream,
+                                   FlatpakFilter *allow_refs,
+                                   FlatpakFilter *deny_refs);
+
+#define FLATPAK_SEARCH_INDEX_FORMAT "(ua(sa{ss}a{ss}ss)a{sa(sa(uu))})"
+
+typedef struct
+{
+  guint app;
+  guint score;
+} FlatpakSearchIndexMatch;
+
+GVariant *flatpak_appstream_xml_build_search_index (FlatpakXml *appstream);
+GVariant *flatpak_search_index_load (GFile   *file,
+                                     GError **error);
+GArray   *flatpak_search_index_query (GVariant           *index,
+                                      const char         *text,
+                                      const char * const *languages);
+void      flatpak_search_index_get_app (GVariant    *index,
+                                        guint        app,
+                                        const char **id,
+                                        const char **name,
+                                        const char **summary,
+                                        const char **version,
+                                        const char **branch);
 
 
 gboolean flatpak_allocate_tmpdir (int           tmpdir_dfd,
@@ -848,6 +930,14 @@ gboolean flatpak_repo_resolve_rev (OstreeRepo    *repo,
                                    GCancellable  *cancellable,
                                    GError       **error);
 
+gboolean flatpak_repo_import_verified_objects (OstreeRepo   *repo,
+                                               OstreeRepo   *src_repo,
+                                               const char   *commit,
+                                               guint64      *out_linked_size,
+                                               guint64      *out_copied_size,
+                                               GCancellable *cancellable,
+                                               GError      **error);
+
 #define FLATPAK_MESSAGE_ID "c7b39b1e006b464599465e105b361485"
 
 #endif /* __FLATPAK_UTILS_H__ */
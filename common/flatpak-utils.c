@@ -1129,32 +1129,51 @@ line_get_word (char **line)
   return word;
 }
 
-char *
-flatpak_filter_glob_to_regexp (const char *glob, GError **error)
+/* A parsed filter glob. The kind is optional, and of the id, arch and
+ * branch segments only the id is required. Missing segments, and empty
+ * segments followed by a '/', match anything. */
+typedef struct
 {
-  g_autoptr(GString) regexp = g_string_new ("");
+  FlatpakKinds kinds;
+  char        *segments[3]; /* NULL matches anything */
+} FilterGlob;
+
+static void
+filter_glob_clear (FilterGlob *glob)
+{
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (glob->segments); i++)
+    g_clear_pointer (&glob->segments[i], g_free);
+}
+
+G_DEFINE_AUTO_CLEANUP_CLEAR_FUNC (FilterGlob, filter_glob_clear)
+
+static gboolean
+filter_glob_parse (const char *glob,
+                   FilterGlob *out,
+                   GError    **error)
+{
+  g_autoptr(GString) segment = g_string_new ("");
   int parts = 1;
   gboolean empty_part;
 
   if (g_str_has_prefix (glob, "app/"))
     {
       glob += strlen ("app/");
-      g_string_append (regexp, "app/");
+      out->kinds = FLATPAK_KINDS_APP;
     }
   else if (g_str_has_prefix (glob, "runtime/"))
     {
       glob += strlen ("runtime/");
-      g_string_append (regexp, "runtime/");
+      out->kinds = FLATPAK_KINDS_RUNTIME;
     }
   else
-    g_string_append (regexp, "(app|runtime)/");
+    out->kinds = FLATPAK_KINDS_APP | FLATPAK_KINDS_RUNTIME;
 
   /* We really need an id part, the rest is optional */
   if (*glob == 0)
-    {
-      flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Empty glob"));
-      return NULL;
-    }
+    return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Empty glob"));
 
   empty_part = TRUE;
   while (*glob != 0)
@@ -1164,62 +1183,415 @@ flatpak_filter_glob_to_regexp (const char *glob, GError **error)
 
       if (c == '/')
         {
-          if (empty_part)
-            g_string_append (regexp, "[.\\-_a-zA-Z0-9]*");
+          if (!empty_part)
+            out->segments[parts - 1] = g_strdup (segment->str);
+          g_string_truncate (segment, 0);
           empty_part = TRUE;
           parts++;
-          g_string_append (regexp, "/");
           if (parts > 3)
+            return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Too many segments in glob"));
+        }
+      else if (c == '*' || c == '.' || g_ascii_isalnum (c) || c == '-' || c == '_')
+        {
+          empty_part = FALSE;
+          g_string_append_c (segment, c);
+        }
+      else
+        return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Invalid glob character '%c'"), c);
+    }
+
+  /* Unlike the ones before it, an empty last segment only matches an
+   * empty segment, as it always has */
+  out->segments[parts - 1] = g_strdup (segment->str);
+
+  return TRUE;
+}
+
+#define FILTER_SEGMENT_REGEXP "[.\\-_a-zA-Z0-9]*"
+
+char *
+flatpak_filter_glob_to_regexp (const char *glob, GError **error)
+{
+  g_autoptr(GString) regexp = g_string_new ("");
+  g_auto(FilterGlob) parsed = { 0 };
+  guint i;
+
+  if (!filter_glob_parse (glob, &parsed, error))
+    return NULL;
+
+  if (parsed.kinds == FLATPAK_KINDS_APP)
+    g_string_append (regexp, "app/");
+  else if (parsed.kinds == FLATPAK_KINDS_RUNTIME)
+    g_string_append (regexp, "runtime/");
+  else
+    g_string_append (regexp, "(app|runtime)/");
+
+  for (i = 0; i < G_N_ELEMENTS (parsed.segments); i++)
+    {
+      const char *p;
+
+      if (i > 0)
+        g_string_append_c (regexp, '/');
+
+      if (parsed.segments[i] == NULL)
+        {
+          g_string_append (regexp, FILTER_SEGMENT_REGEXP);
+          continue;
+        }
+
+      for (p = parsed.segments[i]; *p != 0; p++)
+        {
+          if (*p == '*')
+            g_string_append (regexp, FILTER_SEGMENT_REGEXP);
+          else if (*p == '.')
+            g_string_append (regexp, "\\.");
+          else
+            g_string_append_c (regexp, *p);
+        }
+    }
+
+  return g_string_free (g_steal_pointer (&regexp), FALSE);
+}
+
+/* A FlatpakFilter is a set of globs compiled into a trie over the ref
+ * segments. Each node has a hash of literal edges and wildcard edges
+ * (globs with a '*', or NULL for anything), and a ref matches if any
+ * path through its id, arch and branch reaches the end. The wildcard
+ * edges are filed in a character trie by the literal prefix before
+ * their first '*', so only the globs whose prefix the segment starts
+ * with are tried, and only against the rest of the segment. It matches
+ * exactly the refs that the regexp built from the same globs with
+ * flatpak_filter_glob_to_regexp() would. */
+typedef struct FilterNode FilterNode;
+typedef struct FilterPrefix FilterPrefix;
+
+typedef struct
+{
+  char       *glob;       /* NULL matches anything */
+  gsize       prefix_len; /* Characters before the first '*' */
+  FilterNode *node;
+} FilterEdge;
+
+struct FilterPrefix
+{
+  GHashTable *children; /* character -> FilterPrefix, nullable */
+  GPtrArray  *edges;    /* (element-type FilterEdge) with this prefix, nullable */
+};
+
+struct FilterNode
+{
+  GHashTable   *literal;  /* segment -> FilterNode, nullable */
+  FilterPrefix *wildcard; /* nullable */
+};
+
+struct FlatpakFilter
+{
+  gint        ref_count;
+  FilterNode *kinds[2]; /* app, runtime; nullable */
+};
+
+static void
+filter_prefix_free (FilterPrefix *prefix)
+{
+  if (prefix == NULL)
+    return;
+
+  if (prefix->children)
+    g_hash_table_unref (prefix->children);
+  if (prefix->edges)
+    g_ptr_array_unref (prefix->edges);
+  g_free (prefix);
+}
+
+static void
+filter_node_free (FilterNode *node)
+{
+  if (node == NULL)
+    return;
+
+  if (node->literal)
+    g_hash_table_unref (node->literal);
+  filter_prefix_free (node->wildcard);
+  g_free (node);
+}
+
+static void
+filter_edge_free (FilterEdge *edge)
+{
+  g_free (edge->glob);
+  filter_node_free (edge->node);
+  g_free (edge);
+}
+
+static FilterNode *
+filter_node_add_edge (FilterNode *node,
+                      const char *glob)
+{
+  FilterPrefix *prefix;
+  FilterEdge *edge;
+  FilterNode *child;
+  gsize prefix_len = 0;
+  guint i;
+
+  if (glob != NULL && strchr (glob, '*') == NULL)
+    {
+      if (node->literal == NULL)
+        node->literal = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify) filter_node_free);
+
+      child = g_hash_table_lookup (node->literal, glob);
+      if (child == NULL)
+        {
+          child = g_new0 (FilterNode, 1);
+          g_hash_table_insert (node->literal, g_strdup (glob), child);
+        }
+
+      return child;
+    }
+
+  if (node->wildcard == NULL)
+    node->wildcard = g_new0 (FilterPrefix, 1);
+
+  prefix = node->wildcard;
+  if (glob != NULL)
+    {
+      for (; glob[prefix_len] != '*'; prefix_len++)
+        {
+          gpointer c = GUINT_TO_POINTER ((guchar) glob[prefix_len]);
+          FilterPrefix *next;
+
+          if (prefix->children == NULL)
+            prefix->children = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL,
+                                                      (GDestroyNotify) filter_prefix_free);
+
+          next = g_hash_table_lookup (prefix->children, c);
+          if (next == NULL)
             {
-              flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Too many segments in glob"));
-              return NULL;
+              next = g_new0 (FilterPrefix, 1);
+              g_hash_table_insert (prefix->children, c, next);
             }
+          prefix = next;
         }
-      else if (c == '*')
+    }
+
+  if (prefix->edges == NULL)
+    prefix->edges = g_ptr_array_new_with_free_func ((GDestroyNotify) filter_edge_free);
+
+  for (i = 0; i < prefix->edges->len; i++)
+    {
+      edge = g_ptr_array_index (prefix->edges, i);
+      if (g_strcmp0 (edge->glob, glob) == 0)
+        return edge->node;
+    }
+
+  edge = g_new0 (FilterEdge, 1);
+  edge->glob = g_strdup (glob);
+  edge->prefix_len = prefix_len;
+  edge->node = g_new0 (FilterNode, 1);
+  g_ptr_array_add (prefix->edges, edge);
+
+  return edge->node;
+}
+
+FlatpakFilter *
+flatpak_filter_new (void)
+{
+  FlatpakFilter *filter = g_new0 (FlatpakFilter, 1);
+
+  filter->ref_count = 1;
+  return filter;
+}
+
+FlatpakFilter *
+flatpak_filter_ref (FlatpakFilter *filter)
+{
+  g_atomic_int_inc (&filter->ref_count);
+  return filter;
+}
+
+void
+flatpak_filter_unref (FlatpakFilter *filter)
+{
+  guint i;
+
+  if (!g_atomic_int_dec_and_test (&filter->ref_count))
+    return;
+
+  for (i = 0; i < G_N_ELEMENTS (filter->kinds); i++)
+    filter_node_free (filter->kinds[i]);
+  g_free (filter);
+}
+
+gboolean
+flatpak_filter_add_glob (FlatpakFilter *filter,
+                         const char    *glob,
+                         GError       **error)
+{
+  g_auto(FilterGlob) parsed = { 0 };
+  FlatpakKinds kinds[2] = { FLATPAK_KINDS_APP, FLATPAK_KINDS_RUNTIME };
+  guint i, j;
+
+  if (!filter_glob_parse (glob, &parsed, error))
+    return FALSE;
+
+  for (i = 0; i < G_N_ELEMENTS (kinds); i++)
+    {
+      FilterNode *node;
+
+      if ((parsed.kinds & kinds[i]) == 0)
+        continue;
+
+      if (filter->kinds[i] == NULL)
+        filter->kinds[i] = g_new0 (FilterNode, 1);
+
+      node = filter->kinds[i];
+      for (j = 0; j < G_N_ELEMENTS (parsed.segments); j++)
+        node = filter_node_add_edge (node, parsed.segments[j]);
+    }
+
+  return TRUE;
+}
+
+/* Only '*' is special, and it never matches a '/' as segments don't
+ * have any */
+static gboolean
+filter_glob_match (const char *glob,
+                   const char *str)
+{
+  const char *star = NULL;
+  const char *star_str = NULL;
+
+  while (*str != 0)
+    {
+      if (*glob == '*')
         {
-          empty_part = FALSE;
-         g_string_append (regexp, "[.\\-_a-zA-Z0-9]*");
+          star = glob++;
+          star_str = str;
         }
-      else if (c == '.')
+      else if (*glob == *str)
         {
-          empty_part = FALSE;
-          g_string_append (regexp, "\\.");
+          glob++;
+          str++;
         }
-      else if (g_ascii_isalnum (c) || c == '-' || c == '_')
+      else if (star != NULL)
         {
-          empty_part = FALSE;
-          g_string_append_c (regexp, c);
+          glob = star + 1;
+          str = ++star_str;
         }
       else
+        return FALSE;
+    }
+
+  while (*glob == '*')
+    glob++;
+
+  return *glob == 0;
+}
+
+static gboolean
+filter_node_match (FilterNode  *node,
+                   char       **segments,
+                   int          depth)
+{
+  FilterNode *child;
+  FilterPrefix *prefix;
+  const char *p;
+  guint i;
+
+  if (depth == 3)
+    return TRUE;
+
+  if (node->literal != NULL &&
+      (child = g_hash_table_lookup (node->literal, segments[depth])) != NULL &&
+      filter_node_match (child, segments, depth + 1))
+    return TRUE;
+
+  /* Walk down the prefixes of the segment, trying the globs of each */
+  for (prefix = node->wildcard, p = segments[depth]; prefix != NULL; p++)
+    {
+      for (i = 0; prefix->edges != NULL && i < prefix->edges->len; i++)
         {
-          flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Invalid glob character '%c'"), c);
-          return NULL;
+          FilterEdge *edge = g_ptr_array_index (prefix->edges, i);
+
+          if ((edge->glob == NULL || filter_glob_match (edge->glob + edge->prefix_len, p)) &&
+              filter_node_match (edge->node, segments, depth + 1))
+            return TRUE;
         }
+
+      if (*p == 0 || prefix->children == NULL)
+        break;
+
+      prefix = g_hash_table_lookup (prefix->children, GUINT_TO_POINTER ((guchar) *p));
+    }
+
+  return FALSE;
+}
+
+gboolean
+flatpak_filter_match (FlatpakFilter *filter,
+                      const char    *ref)
+{
+  char buf[256];
+  g_autofree char *copy = NULL;
+  char *segments[3];
+  FilterNode *node;
+  char *p;
+  int n_segments;
+  gsize len;
+
+  if (g_str_has_prefix (ref, "app/"))
+    {
+      node = filter->kinds[0];
+      ref += strlen ("app/");
+    }
+  else if (g_str_has_prefix (ref, "runtime/"))
+    {
+      node = filter->kinds[1];
+      ref += strlen ("runtime/");
     }
+  else
+    return FALSE;
+
+  if (node == NULL)
+    return FALSE;
 
-  while (parts < 3)
+  len = strlen (ref);
+  if (len < sizeof (buf))
+    p = memcpy (buf, ref, len + 1);
+  else
+    p = copy = g_strdup (ref);
+
+  /* Split into exactly three segments, of the characters globs can match */
+  n_segments = 1;
+  segments[0] = p;
+  for (; *p != 0; p++)
     {
-      parts++;
-      g_string_append (regexp, "/[.\\-_a-zA-Z0-9]*");
+      if (*p == '/')
+        {
+          if (n_segments == 3)
+            return FALSE;
+          *p = 0;
+          segments[n_segments++] = p + 1;
+        }
+      else if (!(g_ascii_isalnum (*p) || *p == '.' || *p == '-' || *p == '_'))
+        return FALSE;
     }
 
-  return g_string_free (g_steal_pointer (&regexp), FALSE);
+  if (n_segments != 3)
+    return FALSE;
+
+  return filter_node_match (node, segments, 0);
 }
 
 gboolean
-flatpak_parse_filters (const char *data,
-                       GRegex **allow_refs_out,
-                       GRegex **deny_refs_out,
-                       GError **error)
+flatpak_parse_filters (const char     *data,
+                       FlatpakFilter **allow_refs_out,
+                       FlatpakFilter **deny_refs_out,
+                       GError        **error)
 {
   g_auto(GStrv) lines = NULL;
   int i;
-  g_autoptr(GString) allow_regexp = g_string_new ("^(");
-  g_autoptr(GString) deny_regexp = g_string_new ("^(");
-  gboolean has_allow = FALSE;
-  gboolean has_deny = FALSE;
-  g_autoptr(GRegex) allow_refs = NULL;
-  g_autoptr(GRegex) deny_refs = NULL;
+  g_autoptr(FlatpakFilter) allow_refs = flatpak_filter_new ();
+  g_autoptr(FlatpakFilter) deny_refs = flatpak_filter_new ();
 
   lines = g_strsplit (data, "\n", -1);
   for (i = 0; lines[i] != NULL; i++)
@@ -1239,9 +1611,8 @@ flatpak_parse_filters (const char *data,
 
       if (strcmp (command, "allow") == 0 || strcmp (command, "deny") == 0)
         {
-          char *glob, *next, *ref_regexp;
-          GString *command_regexp;
-          gboolean *has_type = NULL;
+          char *glob, *next;
+          FlatpakFilter *command_filter;
 
           glob = line_get_word (&line);
           if (glob == NULL)
@@ -1251,27 +1622,13 @@ flatpak_parse_filters (const char *data,
           if (next != NULL)
             return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Trailing text on line %d"), i + 1);
 
-          ref_regexp = flatpak_filter_glob_to_regexp (glob, error);
-          if (ref_regexp == NULL)
-            return glnx_prefix_error (error, _("on line %d"), i + 1);
-
           if (strcmp (command, "allow") == 0)
-            {
-              command_regexp = allow_regexp;
-              has_type = &has_allow;
-            }
-          else
-            {
-              command_regexp = deny_regexp;
-              has_type = &has_deny;
-            }
-
-          if (*has_type)
-            g_string_append (command_regexp, "|");
+            command_filter = allow_refs;
           else
-            *has_type = TRUE;
+            command_filter = deny_refs;
 
-          g_string_append (command_regexp, ref_regexp);
+          if (!flatpak_filter_add_glob (command_filter, glob, error))
+            return glnx_prefix_error (error, _("on line %d"), i + 1);
         }
       else
         {
@@ -1279,23 +1636,6 @@ flatpak_parse_filters (const char *data,
         }
     }
 
-  g_string_append (allow_regexp, ")$");
-  g_string_append (deny_regexp, ")$");
-
-  if (allow_regexp)
-    {
-      allow_refs = g_regex_new (allow_regexp->str, G_REGEX_DOLLAR_ENDONLY|G_REGEX_RAW|G_REGEX_OPTIMIZE, G_REGEX_MATCH_ANCHORED, error);
-      if (allow_refs == NULL)
-        return FALSE;
-    }
-
-  if (deny_regexp)
-    {
-      deny_refs = g_regex_new (deny_regexp->str, G_REGEX_DOLLAR_ENDONLY|G_REGEX_RAW|G_REGEX_OPTIMIZE, G_REGEX_MATCH_ANCHORED, error);
-      if (deny_refs == NULL)
-        return FALSE;
-    }
-
   *allow_refs_out = g_steal_pointer (&allow_refs);
   *deny_refs_out = g_steal_pointer (&deny_refs);
 
@@ -1303,17 +1643,17 @@ flatpak_parse_filters (const char *data,
 }
 
 gboolean
-flatpak_filters_allow_ref (GRegex *allow_refs,
-                           GRegex *deny_refs,
-                           const char *ref)
+flatpak_filters_allow_ref (FlatpakFilter *allow_refs,
+                           FlatpakFilter *deny_refs,
+                           const char    *ref)
 {
   if (deny_refs == NULL)
     return TRUE; /* All refs are allowed by default */
 
-  if (!g_regex_match (deny_refs, ref, G_REGEX_MATCH_ANCHORED, NULL))
+  if (!flatpak_filter_match (deny_refs, ref))
     return TRUE; /* Not denied */
 
-  if (allow_refs &&  g_regex_match (allow_refs, ref, G_REGEX_MATCH_ANCHORED, NULL))
+  if (allow_refs && flatpak_filter_match (allow_refs, ref))
     return TRUE; /* Explicitly allowed */
 
   return FALSE;
@@ -2736,49 +3076,416 @@ flatpak_summary_lookup_ref (GVariant   *summary,
   return TRUE;
 }
 
-GKeyFile *
-flatpak_parse_repofile (const char   *remote_name,
-                        gboolean      from_ref,
-                        GKeyFile     *keyfile,
-                        GBytes      **gpg_data_out,
-                        GCancellable *cancellable,
-                        GError      **error)
+/* The summary index is built once per remote state and makes lookups
+ * into the summary (and the xa.cache/xa.sparse-cache metadata) cheap.
+ * All the strings and checksums it stores point directly into the
+ * (typically mmapped) summary data, so the lookups themselves don't
+ * allocate anything except what is returned to the caller. Each part
+ * of the index is built lazily on first use. */
+
+typedef struct
 {
-  g_autoptr(GBytes) gpg_data = NULL;
-  g_autofree char *uri = NULL;
-  g_autofree char *title = NULL;
-  g_autofree char *gpg_key = NULL;
-  g_autofree char *collection_id = NULL;
-  g_autofree char *default_branch = NULL;
-  g_autofree char *comment = NULL;
-  g_autofree char *description = NULL;
-  g_autofree char *icon = NULL;
-  g_autofree char *homepage = NULL;
-  g_autofree char *filter = NULL;
-  gboolean nodeps;
-  const char *source_group;
-  g_autofree char *version = NULL;
+  const char   *ref;  /* Points into the summary data */
+  const guchar *csum; /* Points into the summary data, NULL if invalid */
+} FlatpakSummaryRefEntry;
 
-  if (from_ref)
-    source_group = FLATPAK_REF_GROUP;
-  else
-    source_group = FLATPAK_REPO_GROUP;
+typedef struct
+{
+  GVariant   *refs;      /* a(s(taya{sv})) */
+  GArray     *entries;   /* (element-type FlatpakSummaryRefEntry), sorted by ref */
+  GHashTable *positions; /* ref -> position + 1 */
+} FlatpakSummaryRefList;
 
-  GKeyFile *config = g_key_file_new ();
-  g_autofree char *group = g_strdup_printf ("remote \"%s\"", remote_name);
+typedef struct
+{
+  guint64     installed_size;
+  guint64     download_size;
+  const char *metadata; /* Points into the summary data */
+} FlatpakSummaryCacheEntry;
 
-  if (!g_key_file_has_group (keyfile, source_group))
-    {
-      flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Invalid %s: Missing group ‘%s’"),
-                          from_ref ? ".flatpakref" : ".flatpakrepo", source_group);
-      return NULL;
-    }
+struct FlatpakSummaryIndex
+{
+  GMutex      lock;
+  GVariant   *summary;  /* nullable */
+  GVariant   *metadata; /* nullable */
 
-  uri = g_key_file_get_string (keyfile, source_group,
-                               FLATPAK_REPO_URL_KEY, NULL);
-  if (uri == NULL)
-    {
-      flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Invalid %s: Missing key ‘%s’"),
+  GHashTable *ref_lists; /* collection id (or "") -> FlatpakSummaryRefList (nullable) */
+
+  gboolean    cache_loaded;
+  GVariant   *cache;           /* a{s(tts)} */
+  GVariant   *commits;         /* nullable */
+  GArray     *cache_entries;   /* (element-type FlatpakSummaryCacheEntry) */
+  GHashTable *cache_positions; /* ref -> position + 1 */
+
+  gboolean    sparse_cache_loaded;
+  GHashTable *sparse_cache; /* ref -> a{sv} */
+};
+
+static void
+flatpak_summary_ref_list_free (FlatpakSummaryRefList *list)
+{
+  if (list == NULL)
+    return;
+
+  g_variant_unref (list->refs);
+  g_array_unref (list->entries);
+  g_hash_table_unref (list->positions);
+  g_free (list);
+}
+
+static FlatpakSummaryRefList *
+flatpak_summary_ref_list_new (GVariant *refs)
+{
+  FlatpakSummaryRefList *list = g_new0 (FlatpakSummaryRefList, 1);
+  gsize n, i;
+
+  n = g_variant_n_children (refs);
+  list->refs = g_variant_ref (refs);
+  list->entries = g_array_sized_new (FALSE, TRUE, sizeof (FlatpakSummaryRefEntry), n);
+  list->positions = g_hash_table_new (g_str_hash, g_str_equal);
+
+  for (i = 0; i < n; i++)
+    {
+      g_autoptr(GVariant) child = g_variant_get_child_value (refs, i);
+      g_autoptr(GVariant) csum_v = NULL;
+      FlatpakSummaryRefEntry entry;
+
+      g_variant_get_child (child, 0, "&s", &entry.ref);
+      g_variant_get_child (child, 1, "(t@aya{sv})", NULL, &csum_v, NULL);
+      entry.csum = ostree_checksum_bytes_peek_validate (csum_v, NULL);
+
+      g_array_append_val (list->entries, entry);
+      g_hash_table_insert (list->positions, (char *) entry.ref, GSIZE_TO_POINTER (i + 1));
+    }
+
+  return list;
+}
+
+FlatpakSummaryIndex *
+flatpak_summary_index_new (GVariant *summary,
+                           GVariant *metadata)
+{
+  FlatpakSummaryIndex *index = g_new0 (FlatpakSummaryIndex, 1);
+
+  g_mutex_init (&index->lock);
+  if (summary)
+    index->summary = g_variant_ref (summary);
+  if (metadata)
+    index->metadata = g_variant_ref (metadata);
+
+  index->ref_lists = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                            (GDestroyNotify) flatpak_summary_ref_list_free);
+
+  return index;
+}
+
+void
+flatpak_summary_index_free (FlatpakSummaryIndex *index)
+{
+  g_clear_pointer (&index->summary, g_variant_unref);
+  g_clear_pointer (&index->metadata, g_variant_unref);
+  g_clear_pointer (&index->ref_lists, g_hash_table_unref);
+  g_clear_pointer (&index->cache, g_variant_unref);
+  g_clear_pointer (&index->commits, g_variant_unref);
+  g_clear_pointer (&index->cache_entries, g_array_unref);
+  g_clear_pointer (&index->cache_positions, g_hash_table_unref);
+  g_clear_pointer (&index->sparse_cache, g_hash_table_unref);
+  g_mutex_clear (&index->lock);
+  g_free (index);
+}
+
+/* Must be called with the lock held */
+static FlatpakSummaryRefList *
+summary_index_get_ref_list (FlatpakSummaryIndex *index,
+                            const char          *collection_id)
+{
+  const char *key = collection_id ? collection_id : "";
+  FlatpakSummaryRefList *list = NULL;
+  g_autoptr(GVariant) refs = NULL;
+
+  if (index->summary == NULL)
+    return NULL;
+
+  if (g_hash_table_lookup_extended (index->ref_lists, key, NULL, (gpointer *) &list))
+    return list;
+
+  refs = summary_find_refs_list (index->summary, collection_id);
+  if (refs != NULL)
+    list = flatpak_summary_ref_list_new (refs);
+
+  /* Also cache misses, as a NULL list */
+  g_hash_table_insert (index->ref_lists, g_strdup (key), list);
+
+  return list;
+}
+
+gboolean
+flatpak_summary_index_lookup_ref (FlatpakSummaryIndex *index,
+                                  const char          *collection_id,
+                                  const char          *ref,
+                                  char               **out_checksum,
+                                  GVariant           **out_variant)
+{
+  g_autoptr(GMutexLocker) locker = g_mutex_locker_new (&index->lock);
+  FlatpakSummaryRefList *list;
+  const FlatpakSummaryRefEntry *entry;
+  gsize pos;
+
+  list = summary_index_get_ref_list (index, collection_id);
+  if (list == NULL)
+    return FALSE;
+
+  pos = GPOINTER_TO_SIZE (g_hash_table_lookup (list->positions, ref));
+  if (pos == 0)
+    return FALSE;
+
+  entry = &g_array_index (list->entries, FlatpakSummaryRefEntry, pos - 1);
+  if (entry->csum == NULL)
+    return FALSE;
+
+  if (out_checksum)
+    *out_checksum = ostree_checksum_from_bytes (entry->csum);
+
+  if (out_variant)
+    {
+      g_autoptr(GVariant) refdata = g_variant_get_child_value (list->refs, pos - 1);
+      *out_variant = g_variant_get_child_value (refdata, 1);
+    }
+
+  return TRUE;
+}
+
+/* Same as flatpak_summary_match_subrefs(), but as the refs are sorted all
+ * the matches are in one range starting with "$kind/$id." which we can
+ * find with a binary search */
+char **
+flatpak_summary_index_match_subrefs (FlatpakSummaryIndex *index,
+                                     const char          *collection_id,
+                                     const char          *ref)
+{
+  g_autoptr(GMutexLocker) locker = g_mutex_locker_new (&index->lock);
+  GPtrArray *res = g_ptr_array_new ();
+  FlatpakSummaryRefList *list;
+
+  list = summary_index_get_ref_list (index, collection_id);
+  if (list != NULL)
+    {
+      g_auto(GStrv) parts = g_strsplit (ref, "/", 0);
+      g_autofree char *prefix = g_strconcat (parts[0], "/", parts[1], ".", NULL);
+      g_autofree char *suffix = g_strconcat ("/", parts[2], "/", parts[3], NULL);
+      guint lo = 0, hi = list->entries->len;
+
+      while (lo < hi)
+        {
+          guint mid = lo + (hi - lo) / 2;
+
+          if (strcmp (g_array_index (list->entries, FlatpakSummaryRefEntry, mid).ref, prefix) < 0)
+            lo = mid + 1;
+          else
+            hi = mid;
+        }
+
+      for (; lo < list->entries->len; lo++)
+        {
+          const char *cur = g_array_index (list->entries, FlatpakSummaryRefEntry, lo).ref;
+
+          if (!g_str_has_prefix (cur, prefix))
+            break;
+
+          /* Must match arch & branch */
+          if (!g_str_has_suffix (cur, suffix))
+            continue;
+
+          g_ptr_array_add (res, g_strdup (cur));
+        }
+    }
+
+  g_ptr_array_add (res, NULL);
+  return (char **) g_ptr_array_free (res, FALSE);
+}
+
+/* Must be called with the lock held */
+static void
+summary_index_ensure_cache (FlatpakSummaryIndex *index)
+{
+  g_autoptr(GVariant) cache_v = NULL;
+  gsize n, i;
+
+  if (index->cache_loaded)
+    return;
+
+  index->cache_loaded = TRUE;
+
+  if (index->metadata == NULL)
+    return;
+
+  cache_v = g_variant_lookup_value (index->metadata, "xa.cache", NULL);
+  if (cache_v == NULL)
+    return;
+
+  index->cache = g_variant_get_child_value (cache_v, 0);
+  index->commits = g_variant_lookup_value (index->metadata, "xa.commits", NULL);
+
+  n = g_variant_n_children (index->cache);
+  index->cache_entries = g_array_sized_new (FALSE, TRUE, sizeof (FlatpakSummaryCacheEntry), n);
+  index->cache_positions = g_hash_table_new (g_str_hash, g_str_equal);
+
+  for (i = 0; i < n; i++)
+    {
+      g_autoptr(GVariant) child = g_variant_get_child_value (index->cache, i);
+      FlatpakSummaryCacheEntry entry;
+      const char *ref;
+      guint64 installed_size, download_size;
+
+      g_variant_get (child, "{&s(tt&s)}", &ref, &installed_size, &download_size, &entry.metadata);
+      entry.installed_size = GUINT64_FROM_BE (installed_size);
+      entry.download_size = GUINT64_FROM_BE (download_size);
+
+      g_array_append_val (index->cache_entries, entry);
+      g_hash_table_insert (index->cache_positions, (char *) ref, GSIZE_TO_POINTER (i + 1));
+    }
+}
+
+gboolean
+flatpak_summary_index_has_cache (FlatpakSummaryIndex *index)
+{
+  g_autoptr(GMutexLocker) locker = g_mutex_locker_new (&index->lock);
+
+  summary_index_ensure_cache (index);
+  return index->cache != NULL;
+}
+
+gboolean
+flatpak_summary_index_lookup_cache (FlatpakSummaryIndex *index,
+                                    const char          *ref,
+                                    guint64             *download_size,
+                                    guint64             *installed_size,
+                                    const char         **metadata,
+                                    GVariant           **maybe_commit)
+{
+  g_autoptr(GMutexLocker) locker = g_mutex_locker_new (&index->lock);
+  const FlatpakSummaryCacheEntry *entry;
+  gsize pos;
+
+  summary_index_ensure_cache (index);
+  if (index->cache == NULL)
+    return FALSE;
+
+  pos = GPOINTER_TO_SIZE (g_hash_table_lookup (index->cache_positions, ref));
+  if (pos == 0)
+    return FALSE;
+
+  entry = &g_array_index (index->cache_entries, FlatpakSummaryCacheEntry, pos - 1);
+
+  if (installed_size)
+    *installed_size = entry->installed_size;
+
+  if (download_size)
+    *download_size = entry->download_size;
+
+  if (metadata)
+    *metadata = entry->metadata;
+
+  if (maybe_commit)
+    {
+      if (index->commits)
+        *maybe_commit = g_variant_get_child_value (index->commits, pos - 1);
+      else
+        *maybe_commit = NULL;
+    }
+
+  return TRUE;
+}
+
+GVariant *
+flatpak_summary_index_lookup_sparse_cache (FlatpakSummaryIndex *index,
+                                           const char          *ref)
+{
+  g_autoptr(GMutexLocker) locker = g_mutex_locker_new (&index->lock);
+  GVariant *sparse;
+
+  if (!index->sparse_cache_loaded)
+    {
+      g_autoptr(GVariant) cache = NULL;
+
+      index->sparse_cache_loaded = TRUE;
+
+      if (index->metadata)
+        cache = g_variant_lookup_value (index->metadata, "xa.sparse-cache", NULL);
+
+      if (cache != NULL)
+        {
+          gsize n, i;
+
+          index->sparse_cache = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                       NULL, (GDestroyNotify) g_variant_unref);
+
+          n = g_variant_n_children (cache);
+          for (i = 0; i < n; i++)
+            {
+              g_autoptr(GVariant) child = g_variant_get_child_value (cache, i);
+              const char *child_ref;
+              GVariant *value;
+
+              g_variant_get (child, "{&s@a{sv}}", &child_ref, &value);
+              g_hash_table_insert (index->sparse_cache, (char *) child_ref, value);
+            }
+        }
+    }
+
+  if (index->sparse_cache == NULL)
+    return NULL;
+
+  sparse = g_hash_table_lookup (index->sparse_cache, ref);
+  if (sparse == NULL)
+    return NULL;
+
+  return g_variant_ref (sparse);
+}
+
+GKeyFile *
+flatpak_parse_repofile (const char   *remote_name,
+                        gboolean      from_ref,
+                        GKeyFile     *keyfile,
+                        GBytes      **gpg_data_out,
+                        GCancellable *cancellable,
+                        GError      **error)
+{
+  g_autoptr(GBytes) gpg_data = NULL;
+  g_autofree char *uri = NULL;
+  g_autofree char *title = NULL;
+  g_autofree char *gpg_key = NULL;
+  g_autofree char *collection_id = NULL;
+  g_autofree char *default_branch = NULL;
+  g_autofree char *comment = NULL;
+  g_autofree char *description = NULL;
+  g_autofree char *icon = NULL;
+  g_autofree char *homepage = NULL;
+  g_autofree char *filter = NULL;
+  gboolean nodeps;
+  const char *source_group;
+  g_autofree char *version = NULL;
+
+  if (from_ref)
+    source_group = FLATPAK_REF_GROUP;
+  else
+    source_group = FLATPAK_REPO_GROUP;
+
+  GKeyFile *config = g_key_file_new ();
+  g_autofree char *group = g_strdup_printf ("remote \"%s\"", remote_name);
+
+  if (!g_key_file_has_group (keyfile, source_group))
+    {
+      flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Invalid %s: Missing group ‘%s’"),
+                          from_ref ? ".flatpakref" : ".flatpakrepo", source_group);
+      return NULL;
+    }
+
+  uri = g_key_file_get_string (keyfile, source_group,
+                               FLATPAK_REPO_URL_KEY, NULL);
+  if (uri == NULL)
+    {
+      flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Invalid %s: Missing key ‘%s’"),
                           from_ref ? ".flatpakref" : ".flatpakrepo", FLATPAK_REPO_URL_KEY);
       return NULL;
     }
@@ -3141,121 +3848,540 @@ flatpak_repo_parse_extra_data_sources (GVariant      *extra_data_sources,
     *sha256 = ostree_checksum_bytes_peek (sha256_v);
 }
 
-#define OSTREE_GIO_FAST_QUERYINFO ("standard::name,standard::type,standard::size,standard::is-symlink,standard::symlink-target," \
-                                   "unix::device,unix::inode,unix::mode,unix::uid,unix::gid,unix::rdev")
-
-static gboolean
-_flatpak_repo_collect_sizes (OstreeRepo   *repo,
-                             GFile        *file,
-                             GFileInfo    *file_info,
-                             guint64      *installed_size,
-                             guint64      *download_size,
-                             GCancellable *cancellable,
-                             GError      **error)
+/* OstreeRepo is not thread-safe, so worker threads read @repo through
+ * their own handles. Idle handles are kept in @thread_repos, to be reused
+ * by later work items of the same operation. */
+static OstreeRepo *
+get_thread_repo (OstreeRepo   *repo,
+                 GAsyncQueue  *thread_repos,
+                 GCancellable *cancellable,
+                 GError      **error)
 {
-  g_autoptr(GFileEnumerator) dir_enum = NULL;
-  GFileInfo *child_info_tmp;
-  g_autoptr(GError) temp_error = NULL;
+  g_autoptr(OstreeRepo) thread_repo = g_async_queue_try_pop (thread_repos);
 
-  if (file_info != NULL && g_file_info_get_file_type (file_info) == G_FILE_TYPE_REGULAR)
-    {
-      const char *checksum = ostree_repo_file_get_checksum (OSTREE_REPO_FILE (file));
-      guint64 obj_size;
-      guint64 file_size = g_file_info_get_size (file_info);
+  if (thread_repo != NULL)
+    return g_steal_pointer (&thread_repo);
 
-      if (installed_size)
-        *installed_size += ((file_size + 511) / 512) * 512;
+  thread_repo = ostree_repo_new (ostree_repo_get_path (repo));
+  if (!ostree_repo_open (thread_repo, cancellable, error))
+    return NULL;
 
-      if (download_size)
-        {
-          g_autoptr(GInputStream) input = NULL;
-          GInputStream *base_input;
-          g_autoptr(GError) local_error = NULL;
+  return g_steal_pointer (&thread_repo);
+}
+
+/* Sizes of file objects are cached in the repo, as computing them
+ * needs to open (and for archive repos, parse) each object. The
+ * cache is a(aytt): object checksum, file size, storage size, with the
+ * least recently used objects first. The file size is G_MAXUINT64 for
+ * objects that are not regular files. */
+#define FLATPAK_SIZE_CACHE_PATH "tmp/cache/flatpak-object-sizes"
+#define FLATPAK_SIZE_CACHE_FORMAT "a(aytt)"
+#define FLATPAK_SIZE_CACHE_NOT_REGULAR G_MAXUINT64
+
+/* Below this many uncached objects it is not worth starting threads */
+#define FLATPAK_COLLECT_SIZES_MIN_PARALLEL 64
+#define FLATPAK_COLLECT_SIZES_MAX_THREADS 8
+
+typedef struct {
+  guint64 file_size;
+  guint64 storage_size;
+  guint   count;
+} ObjectSizes;
+
+typedef struct {
+  guint64 file_size;
+  guint64 storage_size;
+  guint64 last_used;
+} CachedSizes;
+
+typedef struct {
+  const char  *checksum;
+  CachedSizes *sizes;
+} CachedSizesEntry;
+
+struct FlatpakSizeCache
+{
+  OstreeRepo *repo;
+  GHashTable *entries; /* checksum -> CachedSizes */
+  guint       max_entries;
+  guint64     clock;
+  gboolean    modified;
+};
 
-          if (!ostree_repo_query_object_storage_size (repo,
-                                                      OSTREE_OBJECT_TYPE_FILE, checksum,
-                                                      &obj_size, cancellable, &local_error))
-            {
-              int fd;
-              struct stat stbuf;
+typedef struct {
+  OstreeRepo   *repo;
+  GAsyncQueue  *thread_repos; /* Idle per-thread handles for @repo */
+  GCancellable *cancellable;
+  GMutex        mutex;
+  GPtrArray    *staged;       /* Items only @repo can see */
+  GError       *error;
+} CollectSizesData;
+
+/* Loads the object size cache of @repo. Missing or unreadable caches
+ * just give an empty one. When saved, it keeps at most @max_entries
+ * objects. */
+FlatpakSizeCache *
+flatpak_size_cache_load (OstreeRepo *repo,
+                         guint       max_entries)
+{
+  FlatpakSizeCache *cache = g_new0 (FlatpakSizeCache, 1);
+  g_autoptr(GError) local_error = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GVariant) v = NULL;
+  glnx_autofd int fd = -1;
+  gsize i, n;
 
-              /* Ostree does not look at the staging directory when querying storage
-                 size, so may return a NOT_FOUND error here. We work around this
-                 by loading the object and walking back until we find the original
-                 fd which we can fstat(). */
-              if (!g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
-                return FALSE;
+  cache->repo = g_object_ref (repo);
+  cache->entries = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  cache->max_entries = max_entries;
 
-              if (!ostree_repo_load_file (repo, checksum,  &input, NULL, NULL, NULL, error))
-                return FALSE;
+  if (!glnx_openat_rdonly (ostree_repo_get_dfd (repo), FLATPAK_SIZE_CACHE_PATH, TRUE, &fd, &local_error))
+    {
+      if (!g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        g_debug ("Failed to open size cache: %s", local_error->message);
+      return cache;
+    }
 
-              base_input = input;
-              while (G_IS_FILTER_INPUT_STREAM (base_input))
-                base_input = g_filter_input_stream_get_base_stream (G_FILTER_INPUT_STREAM (base_input));
+  bytes = glnx_fd_readall_bytes (fd, NULL, &local_error);
+  if (bytes == NULL)
+    {
+      g_debug ("Failed to read size cache: %s", local_error->message);
+      return cache;
+    }
 
-              if (!G_IS_UNIX_INPUT_STREAM (base_input))
-                return flatpak_fail (error, "Unable to find size of commit %s, not an unix stream", checksum);
+  v = g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE (FLATPAK_SIZE_CACHE_FORMAT), bytes, FALSE));
+  n = g_variant_n_children (v);
+  for (i = 0; i < n; i++)
+    {
+      g_autoptr(GVariant) csum_v = NULL;
+      CachedSizes *sizes = g_new0 (CachedSizes, 1);
 
-              fd = g_unix_input_stream_get_fd (G_UNIX_INPUT_STREAM (base_input));
+      g_variant_get_child (v, i, "(@aytt)", &csum_v, &sizes->file_size, &sizes->storage_size);
+      if (g_variant_n_children (csum_v) != OSTREE_SHA256_DIGEST_LEN)
+        {
+          g_free (sizes);
+          continue;
+        }
 
-              if (fstat (fd, &stbuf) != 0)
-                return glnx_throw_errno_prefix (error, "Can't find commit size: ");
+      /* The file is in the order of use */
+      sizes->last_used = ++cache->clock;
+      g_hash_table_replace (cache->entries, ostree_checksum_from_bytes_v (csum_v), sizes);
+    }
 
-              obj_size = stbuf.st_size;
-            }
+  return cache;
+}
 
-          *download_size += obj_size;
-        }
-    }
+void
+flatpak_size_cache_free (FlatpakSizeCache *cache)
+{
+  g_object_unref (cache->repo);
+  g_hash_table_unref (cache->entries);
+  g_free (cache);
+}
 
-  if (file_info == NULL || g_file_info_get_file_type (file_info) == G_FILE_TYPE_DIRECTORY)
-    {
-      dir_enum = g_file_enumerate_children (file, OSTREE_GIO_FAST_QUERYINFO,
-                                            G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
-                                            cancellable, error);
-      if (!dir_enum)
-        return FALSE;
+gboolean
+flatpak_size_cache_lookup (FlatpakSizeCache *cache,
+                           const char       *checksum,
+                           guint64          *file_size,
+                           guint64          *storage_size)
+{
+  CachedSizes *sizes = g_hash_table_lookup (cache->entries, checksum);
 
+  if (sizes == NULL)
+    return FALSE;
 
-      while ((child_info_tmp = g_file_enumerator_next_file (dir_enum, cancellable, &temp_error)))
-        {
-          g_autoptr(GFileInfo) child_info = child_info_tmp;
-          const char *name = g_file_info_get_name (child_info);
-          g_autoptr(GFile) child = g_file_get_child (file, name);
+  sizes->last_used = ++cache->clock;
 
-          if (!_flatpak_repo_collect_sizes (repo, child, child_info, installed_size, download_size, cancellable, error))
-            return FALSE;
-        }
-    }
+  if (file_size)
+    *file_size = sizes->file_size;
+  if (storage_size)
+    *storage_size = sizes->storage_size;
 
   return TRUE;
 }
 
-gboolean
-flatpak_repo_collect_sizes (OstreeRepo   *repo,
-                            GFile        *root,
-                            guint64      *installed_size,
-                            guint64      *download_size,
-                            GCancellable *cancellable,
-                            GError      **error)
+static void
+size_cache_add (FlatpakSizeCache  *cache,
+                const char        *checksum,
+                const ObjectSizes *object_sizes)
 {
-  return _flatpak_repo_collect_sizes (repo, root, NULL, installed_size, download_size, cancellable, error);
-}
+  CachedSizes *sizes = g_new0 (CachedSizes, 1);
 
+  sizes->file_size = object_sizes->file_size;
+  sizes->storage_size = object_sizes->storage_size;
+  sizes->last_used = ++cache->clock;
+  g_hash_table_replace (cache->entries, g_strdup (checksum), sizes);
+  cache->modified = TRUE;
+}
 
-static void
-flatpak_repo_collect_extra_data_sizes (OstreeRepo *repo,
-                                       const char *rev,
-                                       guint64    *installed_size,
-                                       guint64    *download_size)
+static int
+compare_cached_sizes_entry (gconstpointer a,
+                            gconstpointer b)
 {
-  g_autoptr(GVariant) extra_data_sources = NULL;
-  gsize n_extra_data;
-  int i;
+  const CachedSizesEntry *ea = a;
+  const CachedSizesEntry *eb = b;
 
-  extra_data_sources = flatpak_repo_get_extra_data_sources (repo, rev, NULL, NULL);
-  if (extra_data_sources == NULL)
-    return;
+  return (ea->sizes->last_used > eb->sizes->last_used) - (ea->sizes->last_used < eb->sizes->last_used);
+}
+
+/* Writes the cache back to the repo if anything was added to it. If it
+ * has grown past its limit, the least recently used objects are dropped,
+ * so the cache is trimmed a little at a time rather than starting over. */
+void
+flatpak_size_cache_save (FlatpakSizeCache *cache)
+{
+  g_auto(GVariantBuilder) builder = FLATPAK_VARIANT_BUILDER_INITIALIZER;
+  g_autoptr(GArray) entries = NULL;
+  g_autoptr(GVariant) v = NULL;
+  g_autoptr(GError) local_error = NULL;
+  GHashTableIter iter;
+  gpointer key, value;
+  int repo_dfd = ostree_repo_get_dfd (cache->repo);
+  guint first, i;
+
+  if (!cache->modified)
+    return;
+
+  entries = g_array_sized_new (FALSE, FALSE, sizeof (CachedSizesEntry), g_hash_table_size (cache->entries));
+  g_hash_table_iter_init (&iter, cache->entries);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      CachedSizesEntry entry = { key, value };
+      g_array_append_val (entries, entry);
+    }
+  g_array_sort (entries, compare_cached_sizes_entry);
+
+  first = entries->len > cache->max_entries ? entries->len - cache->max_entries : 0;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE (FLATPAK_SIZE_CACHE_FORMAT));
+  for (i = first; i < entries->len; i++)
+    {
+      CachedSizesEntry *entry = &g_array_index (entries, CachedSizesEntry, i);
+
+      g_variant_builder_add (&builder, "(@aytt)", ostree_checksum_to_bytes_v (entry->checksum),
+                             entry->sizes->file_size, entry->sizes->storage_size);
+    }
+
+  for (i = 0; i < first; i++)
+    g_hash_table_remove (cache->entries, g_array_index (entries, CachedSizesEntry, i).checksum);
+
+  v = g_variant_ref_sink (g_variant_builder_end (&builder));
+
+  if (!glnx_shutil_mkdir_p_at (repo_dfd, "tmp/cache", 0755, NULL, &local_error) ||
+      !glnx_file_replace_contents_at (repo_dfd, FLATPAK_SIZE_CACHE_PATH,
+                                      g_variant_get_data (v), g_variant_get_size (v),
+                                      GLNX_FILE_REPLACE_NODATASYNC, NULL, &local_error))
+    g_debug ("Failed to save size cache: %s", local_error->message);
+
+  cache->modified = FALSE;
+}
+
+static gboolean
+load_object_sizes (OstreeRepo   *repo,
+                   const char   *checksum,
+                   ObjectSizes  *sizes,
+                   GCancellable *cancellable,
+                   GError      **error)
+{
+  g_autoptr(GInputStream) input = NULL;
+  g_autoptr(GFileInfo) file_info = NULL;
+  g_autoptr(GError) local_error = NULL;
+  GInputStream *base_input;
+  struct stat stbuf;
+  int fd;
+
+  if (!ostree_repo_load_file (repo, checksum, &input, &file_info, NULL, cancellable, error))
+    return FALSE;
+
+  if (g_file_info_get_file_type (file_info) != G_FILE_TYPE_REGULAR)
+    {
+      sizes->file_size = FLATPAK_SIZE_CACHE_NOT_REGULAR;
+      sizes->storage_size = 0;
+      return TRUE;
+    }
+
+  sizes->file_size = g_file_info_get_size (file_info);
+
+  if (ostree_repo_query_object_storage_size (repo, OSTREE_OBJECT_TYPE_FILE, checksum,
+                                             &sizes->storage_size, cancellable, &local_error))
+    return TRUE;
+
+  /* Ostree does not look at the staging directory when querying storage
+     size, so may return a NOT_FOUND error here. We work around this
+     by walking back until we find the original fd which we can fstat(). */
+  if (!g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+    {
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return FALSE;
+    }
+
+  base_input = input;
+  while (G_IS_FILTER_INPUT_STREAM (base_input))
+    base_input = g_filter_input_stream_get_base_stream (G_FILTER_INPUT_STREAM (base_input));
+
+  if (!G_IS_UNIX_INPUT_STREAM (base_input))
+    return flatpak_fail (error, "Unable to find size of commit %s, not an unix stream", checksum);
+
+  fd = g_unix_input_stream_get_fd (G_UNIX_INPUT_STREAM (base_input));
+
+  if (fstat (fd, &stbuf) != 0)
+    return glnx_throw_errno_prefix (error, "Can't find commit size: ");
+
+  sizes->storage_size = stbuf.st_size;
+
+  return TRUE;
+}
+
+static void
+load_object_sizes_thread (gpointer data,
+                          gpointer user_data)
+{
+  gpointer *item = data;
+  CollectSizesData *collect = user_data;
+  g_autoptr(OstreeRepo) thread_repo = NULL;
+  g_autoptr(GError) local_error = NULL;
+  gboolean failed;
+  gboolean res;
+
+  g_mutex_lock (&collect->mutex);
+  failed = collect->error != NULL;
+  g_mutex_unlock (&collect->mutex);
+
+  if (failed)
+    return;
+
+  thread_repo = get_thread_repo (collect->repo, collect->thread_repos, collect->cancellable, &local_error);
+  if (thread_repo != NULL)
+    {
+      res = load_object_sizes (thread_repo, item[0], item[1], collect->cancellable, &local_error);
+      g_async_queue_push (collect->thread_repos, g_steal_pointer (&thread_repo));
+      if (res)
+        return;
+    }
+
+  g_mutex_lock (&collect->mutex);
+  /* Objects written in a transaction that is still open on @repo are
+     in its staging dir, which other handles don't look at */
+  if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+    g_ptr_array_add (collect->staged, item);
+  else if (collect->error == NULL)
+    collect->error = g_steal_pointer (&local_error);
+  g_mutex_unlock (&collect->mutex);
+}
+
+/* Counts how many times each file object appears in the tree, loading
+ * each dirtree object only once */
+static gboolean
+collect_dirtree_objects (OstreeRepo   *repo,
+                         const char   *dirtree_checksum,
+                         GHashTable   *dirtrees,
+                         GHashTable   *objects,
+                         GCancellable *cancellable,
+                         GError      **error)
+{
+  GVariant *dirtree;
+  g_autoptr(GVariant) files = NULL;
+  g_autoptr(GVariant) dirs = NULL;
+  gsize i, n;
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    return FALSE;
+
+  dirtree = g_hash_table_lookup (dirtrees, dirtree_checksum);
+  if (dirtree == NULL)
+    {
+      if (!ostree_repo_load_variant (repo, OSTREE_OBJECT_TYPE_DIR_TREE, dirtree_checksum,
+                                     &dirtree, error))
+        return FALSE;
+      g_hash_table_insert (dirtrees, g_strdup (dirtree_checksum), dirtree);
+    }
+
+  files = g_variant_get_child_value (dirtree, 0);
+  n = g_variant_n_children (files);
+  for (i = 0; i < n; i++)
+    {
+      g_autoptr(GVariant) csum_v = NULL;
+      g_autofree char *checksum = NULL;
+      ObjectSizes *sizes;
+
+      g_variant_get_child (files, i, "(&s@ay)", NULL, &csum_v);
+      checksum = ostree_checksum_from_bytes_v (csum_v);
+
+      sizes = g_hash_table_lookup (objects, checksum);
+      if (sizes == NULL)
+        {
+          sizes = g_new0 (ObjectSizes, 1);
+          g_hash_table_insert (objects, g_steal_pointer (&checksum), sizes);
+        }
+      sizes->count++;
+    }
+
+  dirs = g_variant_get_child_value (dirtree, 1);
+  n = g_variant_n_children (dirs);
+  for (i = 0; i < n; i++)
+    {
+      g_autoptr(GVariant) tree_csum_v = NULL;
+      g_autofree char *tree_checksum = NULL;
+
+      g_variant_get_child (dirs, i, "(&s@ay@ay)", NULL, &tree_csum_v, NULL);
+      tree_checksum = ostree_checksum_from_bytes_v (tree_csum_v);
+
+      if (!collect_dirtree_objects (repo, tree_checksum, dirtrees, objects, cancellable, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* The installed size is the sum of the sizes of all regular files,
+ * rounded up to 512 bytes, and the download size is the sum of their
+ * storage sizes. Each file object is only looked at once, even if it
+ * appears many times in the tree, and its sizes are looked up in and
+ * added to @cache, if not %NULL. */
+gboolean
+flatpak_repo_collect_sizes_with_cache (OstreeRepo       *repo,
+                                       GFile            *root,
+                                       FlatpakSizeCache *cache,
+                                       guint64          *installed_size,
+                                       guint64          *download_size,
+                                       GCancellable     *cancellable,
+                                       GError          **error)
+{
+  g_autoptr(GHashTable) dirtrees = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                                          (GDestroyNotify) g_variant_unref);
+  g_autoptr(GHashTable) objects = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  g_autoptr(GPtrArray) uncached = g_ptr_array_new_with_free_func (g_free);
+  GHashTableIter iter;
+  gpointer key, value;
+  guint i;
+
+  if (!ostree_repo_file_ensure_resolved (OSTREE_REPO_FILE (root), error))
+    return FALSE;
+
+  if (!collect_dirtree_objects (repo, ostree_repo_file_tree_get_contents_checksum (OSTREE_REPO_FILE (root)),
+                                dirtrees, objects, cancellable, error))
+    return FALSE;
+
+  g_hash_table_iter_init (&iter, objects);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      ObjectSizes *sizes = value;
+
+      if (cache == NULL ||
+          !flatpak_size_cache_lookup (cache, key, &sizes->file_size, &sizes->storage_size))
+        {
+          gpointer *item = g_new (gpointer, 2);
+          item[0] = key;
+          item[1] = sizes;
+          g_ptr_array_add (uncached, item);
+        }
+    }
+
+  if (uncached->len < FLATPAK_COLLECT_SIZES_MIN_PARALLEL)
+    {
+      for (i = 0; i < uncached->len; i++)
+        {
+          gpointer *item = g_ptr_array_index (uncached, i);
+
+          if (!load_object_sizes (repo, item[0], item[1], cancellable, error))
+            return FALSE;
+        }
+    }
+  else
+    {
+      g_autoptr(GAsyncQueue) thread_repos = g_async_queue_new_full (g_object_unref);
+      g_autoptr(GPtrArray) staged = g_ptr_array_new ();
+      CollectSizesData collect = { repo, thread_repos, cancellable };
+      GThreadPool *pool;
+
+      collect.staged = staged;
+      g_mutex_init (&collect.mutex);
+
+      pool = g_thread_pool_new (load_object_sizes_thread, &collect,
+                                MIN (g_get_num_processors (), FLATPAK_COLLECT_SIZES_MAX_THREADS),
+                                FALSE, NULL);
+      for (i = 0; i < uncached->len; i++)
+        g_thread_pool_push (pool, g_ptr_array_index (uncached, i), NULL);
+
+      /* Waits for all the queued items */
+      g_thread_pool_free (pool, FALSE, TRUE);
+      g_mutex_clear (&collect.mutex);
+
+      if (collect.error != NULL)
+        {
+          g_propagate_error (error, collect.error);
+          return FALSE;
+        }
+
+      for (i = 0; i < staged->len; i++)
+        {
+          gpointer *item = g_ptr_array_index (staged, i);
+
+          if (!load_object_sizes (repo, item[0], item[1], cancellable, error))
+            return FALSE;
+        }
+    }
+
+  g_hash_table_iter_init (&iter, objects);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      ObjectSizes *sizes = value;
+
+      if (sizes->file_size == FLATPAK_SIZE_CACHE_NOT_REGULAR)
+        continue;
+
+      if (installed_size)
+        *installed_size += ((sizes->file_size + 511) / 512) * 512 * sizes->count;
+
+      if (download_size)
+        *download_size += sizes->storage_size * sizes->count;
+    }
+
+  for (i = 0; cache != NULL && i < uncached->len; i++)
+    {
+      gpointer *item = g_ptr_array_index (uncached, i);
+
+      size_cache_add (cache, item[0], item[1]);
+    }
+
+  return TRUE;
+}
+
+/* Like flatpak_repo_collect_sizes_with_cache(), using the cache in @repo.
+ * To collect the sizes of several commits, load the cache once instead. */
+gboolean
+flatpak_repo_collect_sizes (OstreeRepo   *repo,
+                            GFile        *root,
+                            guint64      *installed_size,
+                            guint64      *download_size,
+                            GCancellable *cancellable,
+                            GError      **error)
+{
+  g_autoptr(FlatpakSizeCache) cache = flatpak_size_cache_load (repo, FLATPAK_SIZE_CACHE_MAX_ENTRIES);
+
+  if (!flatpak_repo_collect_sizes_with_cache (repo, root, cache, installed_size, download_size,
+                                              cancellable, error))
+    return FALSE;
+
+  flatpak_size_cache_save (cache);
+
+  return TRUE;
+}
+
+
+static void
+flatpak_repo_collect_extra_data_sizes (OstreeRepo *repo,
+                                       const char *rev,
+                                       guint64    *installed_size,
+                                       guint64    *download_size)
+{
+  g_autoptr(GVariant) extra_data_sources = NULL;
+  gsize n_extra_data;
+  int i;
+
+  extra_data_sources = flatpak_repo_get_extra_data_sources (repo, rev, NULL, NULL);
+  if (extra_data_sources == NULL)
+    return;
 
   n_extra_data = g_variant_n_children (extra_data_sources);
   if (n_extra_data == 0)
@@ -3322,6 +4448,98 @@ commit_data_free (gpointer data)
   g_free (rev_data);
 }
 
+/* The commit data of all the revs in the last generated summary is kept
+ * next to it, keyed by rev. As commits are immutable this lets
+ * flatpak_repo_update() reuse it directly for all unchanged refs. */
+#define FLATPAK_COMMIT_DATA_CACHE_PATH "tmp/cache/flatpak-commit-data"
+#define FLATPAK_COMMIT_DATA_CACHE_FORMAT "a{s(ttsa{sv})}"
+
+static guint
+load_commit_data_cache (OstreeRepo *repo,
+                        GHashTable *commit_data_cache /* (element-type utf8 CommitData) */)
+{
+  g_autoptr(GError) local_error = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GVariant) v = NULL;
+  glnx_autofd int fd = -1;
+  gsize i, n;
+
+  if (!glnx_openat_rdonly (ostree_repo_get_dfd (repo), FLATPAK_COMMIT_DATA_CACHE_PATH, TRUE, &fd, &local_error))
+    {
+      if (!g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        g_debug ("Failed to open commit data cache: %s", local_error->message);
+      return 0;
+    }
+
+  bytes = glnx_fd_readall_bytes (fd, NULL, &local_error);
+  if (bytes == NULL)
+    {
+      g_debug ("Failed to read commit data cache: %s", local_error->message);
+      return 0;
+    }
+
+  v = g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE (FLATPAK_COMMIT_DATA_CACHE_FORMAT), bytes, FALSE));
+  n = g_variant_n_children (v);
+  for (i = 0; i < n; i++)
+    {
+      const char *rev;
+      g_autoptr(GVariant) sparse_data = NULL;
+      CommitData *rev_data = g_new0 (CommitData, 1);
+
+      g_variant_get_child (v, i, "{&s(tts@a{sv})}", &rev,
+                           &rev_data->installed_size,
+                           &rev_data->download_size,
+                           &rev_data->metadata_contents,
+                           &sparse_data);
+      if (g_variant_n_children (sparse_data) > 0)
+        rev_data->sparse_data = g_steal_pointer (&sparse_data);
+
+      g_hash_table_replace (commit_data_cache, g_strdup (rev), rev_data);
+    }
+
+  return n;
+}
+
+static void
+save_commit_data_cache (OstreeRepo *repo,
+                        GList      *ordered_refs,
+                        GHashTable *refs,
+                        GHashTable *commit_data_cache)
+{
+  g_auto(GVariantBuilder) builder = FLATPAK_VARIANT_BUILDER_INITIALIZER;
+  g_autoptr(GHashTable) added = g_hash_table_new (g_str_hash, g_str_equal);
+  g_autoptr(GVariant) v = NULL;
+  g_autoptr(GError) local_error = NULL;
+  int repo_dfd = ostree_repo_get_dfd (repo);
+  GList *l;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE (FLATPAK_COMMIT_DATA_CACHE_FORMAT));
+
+  /* Only keep the revs that are still referenced */
+  for (l = ordered_refs; l; l = l->next)
+    {
+      const char *rev = g_hash_table_lookup (refs, l->data);
+      const CommitData *rev_data = g_hash_table_lookup (commit_data_cache, rev);
+
+      if (!g_hash_table_add (added, (char *) rev))
+        continue;
+
+      g_variant_builder_add (&builder, "{s(tts@a{sv})}", rev,
+                             rev_data->installed_size,
+                             rev_data->download_size,
+                             rev_data->metadata_contents,
+                             rev_data->sparse_data ? rev_data->sparse_data : g_variant_new_array (G_VARIANT_TYPE ("{sv}"), NULL, 0));
+    }
+
+  v = g_variant_ref_sink (g_variant_builder_end (&builder));
+
+  if (!glnx_shutil_mkdir_p_at (repo_dfd, "tmp/cache", 0755, NULL, &local_error) ||
+      !glnx_file_replace_contents_at (repo_dfd, FLATPAK_COMMIT_DATA_CACHE_PATH,
+                                      g_variant_get_data (v), g_variant_get_size (v),
+                                      GLNX_FILE_REPLACE_NODATASYNC, NULL, &local_error))
+    g_debug ("Failed to save commit data cache: %s", local_error->message);
+}
+
 /* For all the refs listed in @cache_v (an xa.cache value) which exist in the
  * @summary, insert their data into @commit_data_cache if it isn’t already there. */
 static void
@@ -3430,6 +4648,10 @@ flatpak_repo_update (OstreeRepo   *repo,
   g_autofree char *old_ostree_metadata_checksum = NULL;
   g_autoptr(GVariant) old_ostree_metadata_v = NULL;
   gboolean deploy_collection_id = FALSE;
+  gint64 start_time = g_get_monotonic_time ();
+  guint n_cached, n_reused = 0, n_computed = 0;
+  g_autoptr(GHashTable) revs = g_hash_table_new (g_str_hash, g_str_equal);
+  g_autoptr(FlatpakSizeCache) size_cache = NULL;
 
   g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
 
@@ -3527,6 +4749,8 @@ flatpak_repo_update (OstreeRepo   *repo,
   commit_data_cache = g_hash_table_new_full (g_str_hash, g_str_equal,
                                              g_free, commit_data_free);
 
+  n_cached = load_commit_data_cache (repo, commit_data_cache);
+
   old_summary = flatpak_repo_load_summary (repo, NULL);
 
   if (!flatpak_repo_resolve_rev (repo, collection_id, NULL, OSTREE_REPO_METADATA_REF,
@@ -3567,9 +4791,16 @@ flatpak_repo_update (OstreeRepo   *repo,
       const char *eol_rebase = NULL;
       int token_type = -1;
 
+      g_hash_table_add (revs, (char *) rev);
+
       /* See if we already have the info on this revision */
       if (g_hash_table_lookup (commit_data_cache, rev))
-        continue;
+        {
+          n_reused++;
+          continue;
+        }
+
+      n_computed++;
 
       if (!ostree_repo_read_commit (repo, rev, &root, &commit, NULL, error))
         return FALSE;
@@ -3593,7 +4824,13 @@ flatpak_repo_update (OstreeRepo   *repo,
         }
       else
         {
-          if (!flatpak_repo_collect_sizes (repo, root, &installed_size, &download_size, cancellable, error))
+          /* Loaded once and saved after the loop, not for every commit */
+          if (size_cache == NULL)
+            size_cache = flatpak_size_cache_load (repo, FLATPAK_SIZE_CACHE_MAX_ENTRIES);
+
+          if (!flatpak_repo_collect_sizes_with_cache (repo, root, size_cache,
+                                                      &installed_size, &download_size,
+                                                      cancellable, error))
             return FALSE;
         }
 
@@ -3642,6 +4879,18 @@ flatpak_repo_update (OstreeRepo   *repo,
       g_variant_builder_add (&commits_builder, "@ay", ostree_checksum_to_bytes_v (rev));
     }
 
+  g_debug ("Collected commit data for %u refs in %.2f seconds: %u reused, %u computed",
+           g_hash_table_size (refs),
+           (g_get_monotonic_time () - start_time) / (double) G_USEC_PER_SEC,
+           n_reused, n_computed);
+
+  /* Rewrite the cache if it had anything missing or stale */
+  if (n_computed > 0 || n_cached != g_hash_table_size (revs))
+    save_commit_data_cache (repo, ordered_keys, refs, commit_data_cache);
+
+  if (size_cache != NULL)
+    flatpak_size_cache_save (size_cache);
+
   /* Note: xa.cache doesn’t need to support collection IDs for the refs listed
    * in it, because the xa.cache metadata is stored on the ostree-metadata ref,
    * which is itself strongly bound to a collection ID — so that collection ID
@@ -4023,13 +5272,12 @@ flatpak_appstream_xml_migrate (FlatpakXml *source,
   return migrated;
 }
 
-static gboolean
-copy_icon (const char        *id,
-           GFile             *icons_dir,
-           OstreeRepo        *repo,
-           OstreeMutableTree *size_mtree,
-           const char        *size,
-           GError           **error)
+/* Adds the (size, name, checksum) of the icon to @icons */
+static void
+copy_icon (const char      *id,
+           GFile           *icons_dir,
+           GVariantBuilder *icons,
+           const char      *size)
 {
   g_autofree char *icon_name = g_strconcat (id, ".png", NULL);
   g_autoptr(GFile) size_dir = g_file_get_child (icons_dir, size);
@@ -4039,25 +5287,21 @@ copy_icon (const char        *id,
   if (!ostree_repo_file_ensure_resolved (OSTREE_REPO_FILE(icon_file), NULL))
     {
       g_debug ("No icon at size %s for %s", size, id);
-      return TRUE;
+      return;
     }
 
   checksum = ostree_repo_file_get_checksum (OSTREE_REPO_FILE(icon_file));
-  if (!ostree_mutable_tree_replace_file (size_mtree, icon_name, checksum, error))
-    return FALSE;
-
-  return TRUE;
+  g_variant_builder_add (icons, "(sss)", size, icon_name, checksum);
 }
 
 static gboolean
-extract_appstream (OstreeRepo   *repo,
-                   FlatpakXml   *appstream_root,
-                   const char   *ref,
-                   const char   *id,
-                   OstreeMutableTree *size1_mtree,
-                   OstreeMutableTree *size2_mtree,
-                   GCancellable *cancellable,
-                   GError      **error)
+extract_appstream (OstreeRepo      *repo,
+                   FlatpakXml      *appstream_root,
+                   const char      *ref,
+                   const char      *id,
+                   GVariantBuilder *icons,
+                   GCancellable    *cancellable,
+                   GError         **error)
 {
   g_autoptr(GFile) root = NULL;
   g_autoptr(GFile) app_info_dir = NULL;
@@ -4106,7 +5350,6 @@ extract_appstream (OstreeRepo   *repo,
   if (flatpak_appstream_xml_migrate (xml_root, appstream_root,
                                      ref, id, keyfile))
     {
-      g_autoptr(GError) my_error = NULL;
       FlatpakXml *components = appstream_root->first_child;
       FlatpakXml *component = components->first_child;
 
@@ -4143,17 +5386,8 @@ extract_appstream (OstreeRepo   *repo,
           if (g_str_has_suffix (component_id_suffix, ".desktop"))
             component_id_suffix[strlen (component_id_suffix) - strlen (".desktop")] = 0;
 
-          if (!copy_icon (component_id_text, icons_dir, repo, size1_mtree, "64x64", &my_error))
-            {
-              g_print (_("Error copying 64x64 icon for component %s: %s\n"), component_id_text, my_error->message);
-              g_clear_error (&my_error);
-            }
-
-          if (!copy_icon (component_id_text, icons_dir, repo, size2_mtree, "128x128", &my_error))
-             {
-               g_print (_("Error copying 128x128 icon for component %s: %s\n"), component_id_text, my_error->message);
-               g_clear_error (&my_error);
-             }
+          copy_icon (component_id_text, icons_dir, icons, "64x64");
+          copy_icon (component_id_text, icons_dir, icons, "128x128");
 
 
           /* We might match other prefixes, so keep on going */
@@ -4223,9 +5457,9 @@ flatpak_appstream_xml_root_to_data (FlatpakXml *appstream_root,
 }
 
 void
-flatpak_appstream_xml_filter (FlatpakXml *appstream,
-                              GRegex *allow_refs,
-                              GRegex *deny_refs)
+flatpak_appstream_xml_filter (FlatpakXml    *appstream,
+                              FlatpakFilter *allow_refs,
+                              FlatpakFilter *deny_refs)
 {
   FlatpakXml *components;
   FlatpakXml *component;
@@ -4253,26 +5487,815 @@ flatpak_appstream_xml_filter (FlatpakXml *appstream,
                 allow = flatpak_filters_allow_ref (allow_refs, deny_refs, bundle->first_child->text);
             }
 
-          if (allow)
-            {
-              prev_component = component;
-              component = component->next_sibling;
-            }
-          else
-            {
-              old = component;
+          if (allow)
+            {
+              prev_component = component;
+              component = component->next_sibling;
+            }
+          else
+            {
+              old = component;
+
+              /* prev_component is same as before */
+              component = component->next_sibling;
+
+              flatpak_xml_unlink (old, prev_component);
+              flatpak_xml_free (old);
+            }
+        }
+    }
+}
+
+
+/* The search index is stored next to appstream.xml in the deployed appstream
+ * checkout, so that flatpak search doesn't have to parse all of it. It has:
+ *
+ *  u: The format version
+ *  a(sa{ss}a{ss}ss): The apps: id, name and summary by locale ("C" being
+ *                    the untranslated one), version and branch
+ *  a{sa(sa(uu))}: The tokens of each locale, sorted, with the index and
+ *                 match flags of each app that has them
+ *
+ * The tokens, the match flags and the way they are combined into a score
+ * are the same as for as_app_search_matches() in appstream-glib, which
+ * searches the text of all the user's languages. The exception is that
+ * appstream-glib can be built to stem the tokens, which we don't do.
+ */
+#define FLATPAK_SEARCH_INDEX_VERSION 2
+
+typedef enum {
+  FLATPAK_SEARCH_MATCH_MIMETYPE    = 1 << 0,
+  FLATPAK_SEARCH_MATCH_DESCRIPTION = 1 << 2,
+  FLATPAK_SEARCH_MATCH_COMMENT     = 1 << 3,
+  FLATPAK_SEARCH_MATCH_NAME        = 1 << 4,
+  FLATPAK_SEARCH_MATCH_KEYWORD     = 1 << 5,
+  FLATPAK_SEARCH_MATCH_ID          = 1 << 6,
+} FlatpakSearchMatch;
+
+/* Same score as flatpak search gives to substring matches of the id */
+#define FLATPAK_SEARCH_ID_SUBSTRING_SCORE 50
+
+static const char *
+xml_get_attribute (FlatpakXml *node,
+                   const char *name)
+{
+  int i;
+
+  for (i = 0; node->attribute_names != NULL && node->attribute_names[i] != NULL; i++)
+    {
+      if (strcmp (node->attribute_names[i], name) == 0)
+        return node->attribute_values[i];
+    }
+
+  return NULL;
+}
+
+static const char *
+xml_get_text (FlatpakXml *node)
+{
+  if (node->first_child != NULL)
+    return node->first_child->text;
+
+  return NULL;
+}
+
+static void
+string_free (gpointer data)
+{
+  g_string_free (data, TRUE);
+}
+
+/* Collects the text below @node in @texts, by locale. The text is in
+ * @lang unless an element below says otherwise. */
+static void
+xml_collect_text (FlatpakXml *node,
+                  const char *lang,
+                  GHashTable *texts)
+{
+  FlatpakXml *child;
+
+  for (child = node->first_child; child != NULL; child = child->next_sibling)
+    {
+      if (child->text != NULL)
+        {
+          GString *str = g_hash_table_lookup (texts, lang);
+
+          if (str == NULL)
+            {
+              str = g_string_new ("");
+              g_hash_table_insert (texts, g_strdup (lang), str);
+            }
+
+          g_string_append (str, child->text);
+          g_string_append_c (str, ' ');
+        }
+      else
+        {
+          const char *child_lang = xml_get_attribute (child, "xml:lang");
+
+          xml_collect_text (child, child_lang ? child_lang : lang, texts);
+        }
+    }
+}
+
+static void
+search_index_add_words (GHashTable *tokens,
+                        char      **words,
+                        guint       app,
+                        guint       flags)
+{
+  int i;
+
+  for (i = 0; words != NULL && words[i] != NULL; i++)
+    {
+      GHashTable *apps;
+      guint old_flags;
+
+      /* Like appstream-glib, ignore very short tokens */
+      if (strlen (words[i]) < 3)
+        continue;
+
+      apps = g_hash_table_lookup (tokens, words[i]);
+      if (apps == NULL)
+        {
+          apps = g_hash_table_new (NULL, NULL);
+          g_hash_table_insert (tokens, g_strdup (words[i]), apps);
+        }
+
+      old_flags = GPOINTER_TO_UINT (g_hash_table_lookup (apps, GUINT_TO_POINTER (app)));
+      g_hash_table_insert (apps, GUINT_TO_POINTER (app), GUINT_TO_POINTER (old_flags | flags));
+    }
+}
+
+/* Adds the tokens of @text, which is in @lang, to the tokens of that
+ * locale in @locales */
+static void
+search_index_add_tokens (GHashTable *locales,
+                         const char *lang,
+                         const char *text,
+                         guint       app,
+                         guint       flags)
+{
+  GHashTable *tokens;
+  g_auto(GStrv) words = NULL;
+  g_auto(GStrv) ascii_words = NULL;
+
+  if (text == NULL)
+    return;
+
+  tokens = g_hash_table_lookup (locales, lang);
+  if (tokens == NULL)
+    {
+      tokens = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                      (GDestroyNotify) g_hash_table_unref);
+      g_hash_table_insert (locales, g_strdup (lang), tokens);
+    }
+
+  /* Like appstream-glib, also add the ASCII versions, so that e.g.
+     "gruss" finds "Gruß" */
+  words = g_str_tokenize_and_fold (text, strcmp (lang, "C") != 0 ? lang : NULL, &ascii_words);
+  search_index_add_words (tokens, words, app, flags);
+  search_index_add_words (tokens, ascii_words, app, flags);
+}
+
+static int
+compare_uint (gconstpointer a,
+              gconstpointer b)
+{
+  guint ua = *(const guint *) a;
+  guint ub = *(const guint *) b;
+
+  return (ua > ub) - (ua < ub);
+}
+
+static int
+compare_str_ptr (gconstpointer a,
+                 gconstpointer b)
+{
+  return strcmp (*(const char * const *) a, *(const char * const *) b);
+}
+
+static GVariant *
+search_index_build_tokens (GHashTable *tokens)
+{
+  g_autofree gpointer *sorted_tokens = NULL;
+  g_auto(GVariantBuilder) tokens_builder = FLATPAK_VARIANT_BUILDER_INITIALIZER;
+  guint n_tokens, i;
+
+  g_variant_builder_init (&tokens_builder, G_VARIANT_TYPE ("a(sa(uu))"));
+
+  sorted_tokens = g_hash_table_get_keys_as_array (tokens, &n_tokens);
+  qsort (sorted_tokens, n_tokens, sizeof (gpointer), compare_str_ptr);
+
+  for (i = 0; i < n_tokens; i++)
+    {
+      GHashTable *apps = g_hash_table_lookup (tokens, sorted_tokens[i]);
+      g_autofree gpointer *app_keys = NULL;
+      g_autoptr(GArray) app_indexes = g_array_new (FALSE, FALSE, sizeof (guint));
+      g_auto(GVariantBuilder) matches_builder = FLATPAK_VARIANT_BUILDER_INITIALIZER;
+      guint n_app_keys, j;
+
+      app_keys = g_hash_table_get_keys_as_array (apps, &n_app_keys);
+      for (j = 0; j < n_app_keys; j++)
+        {
+          guint app = GPOINTER_TO_UINT (app_keys[j]);
+          g_array_append_val (app_indexes, app);
+        }
+      g_array_sort (app_indexes, compare_uint);
+
+      g_variant_builder_init (&matches_builder, G_VARIANT_TYPE ("a(uu)"));
+      for (j = 0; j < app_indexes->len; j++)
+        {
+          guint app = g_array_index (app_indexes, guint, j);
+          g_variant_builder_add (&matches_builder, "(uu)", app,
+                                 GPOINTER_TO_UINT (g_hash_table_lookup (apps, GUINT_TO_POINTER (app))));
+        }
+
+      g_variant_builder_add (&tokens_builder, "(s@a(uu))",
+                             (const char *) sorted_tokens[i],
+                             g_variant_builder_end (&matches_builder));
+    }
+
+  return g_variant_builder_end (&tokens_builder);
+}
+
+GVariant *
+flatpak_appstream_xml_build_search_index (FlatpakXml *appstream)
+{
+  g_autoptr(GHashTable) locales = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                                         (GDestroyNotify) g_hash_table_unref);
+  g_autofree gpointer *sorted_locales = NULL;
+  g_auto(GVariantBuilder) apps_builder = FLATPAK_VARIANT_BUILDER_INITIALIZER;
+  g_auto(GVariantBuilder) locales_builder = FLATPAK_VARIANT_BUILDER_INITIALIZER;
+  FlatpakXml *components;
+  FlatpakXml *component;
+  guint n_apps = 0;
+  guint n_locales, i;
+
+  g_variant_builder_init (&apps_builder, G_VARIANT_TYPE ("a(sa{ss}a{ss}ss)"));
+  g_variant_builder_init (&locales_builder, G_VARIANT_TYPE ("a{sa(sa(uu))}"));
+
+  for (components = appstream->first_child;
+       components != NULL;
+       components = components->next_sibling)
+    {
+      if (g_strcmp0 (components->element_name, "components") != 0)
+        continue;
+
+      for (component = components->first_child;
+           component != NULL;
+           component = component->next_sibling)
+        {
+          g_auto(GVariantBuilder) names_builder = FLATPAK_VARIANT_BUILDER_INITIALIZER;
+          g_auto(GVariantBuilder) summaries_builder = FLATPAK_VARIANT_BUILDER_INITIALIZER;
+          g_autoptr(GHashTable) descriptions = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, string_free);
+          g_autofree char *id = NULL;
+          g_auto(GStrv) ref_parts = NULL;
+          const char *version = NULL;
+          FlatpakXml *id_node, *bundle, *releases, *child;
+          GHashTableIter iter;
+          gpointer key, value;
+
+          if (g_strcmp0 (component->element_name, "component") != 0)
+            continue;
+
+          id_node = flatpak_xml_find (component, "id", NULL);
+          if (id_node == NULL || xml_get_text (id_node) == NULL)
+            continue;
+
+          id = g_strdup (xml_get_text (id_node));
+          if (g_str_has_suffix (id, ".desktop"))
+            id[strlen (id) - strlen (".desktop")] = 0;
+
+          bundle = flatpak_xml_find (component, "bundle", NULL);
+          if (bundle != NULL && xml_get_text (bundle) != NULL)
+            ref_parts = flatpak_decompose_ref (xml_get_text (bundle), NULL);
+
+          releases = flatpak_xml_find (component, "releases", NULL);
+          if (releases != NULL)
+            {
+              FlatpakXml *release = flatpak_xml_find (releases, "release", NULL);
+              if (release != NULL)
+                version = xml_get_attribute (release, "version");
+            }
+
+          g_variant_builder_init (&names_builder, G_VARIANT_TYPE ("a{ss}"));
+          g_variant_builder_init (&summaries_builder, G_VARIANT_TYPE ("a{ss}"));
+
+          search_index_add_tokens (locales, "C", id, n_apps, FLATPAK_SEARCH_MATCH_ID);
+
+          for (child = component->first_child; child != NULL; child = child->next_sibling)
+            {
+              const char *lang = xml_get_attribute (child, "xml:lang");
+              const char *text = xml_get_text (child);
+
+              if (lang == NULL)
+                lang = "C";
+
+              if (g_strcmp0 (child->element_name, "name") == 0 && text != NULL)
+                {
+                  g_variant_builder_add (&names_builder, "{ss}", lang, text);
+                  search_index_add_tokens (locales, lang, text, n_apps, FLATPAK_SEARCH_MATCH_NAME);
+                }
+              else if (g_strcmp0 (child->element_name, "summary") == 0 && text != NULL)
+                {
+                  g_variant_builder_add (&summaries_builder, "{ss}", lang, text);
+                  search_index_add_tokens (locales, lang, text, n_apps, FLATPAK_SEARCH_MATCH_COMMENT);
+                }
+              else if (g_strcmp0 (child->element_name, "description") == 0)
+                xml_collect_text (child, lang, descriptions);
+              else if (g_strcmp0 (child->element_name, "keywords") == 0 ||
+                       g_strcmp0 (child->element_name, "mimetypes") == 0)
+                {
+                  guint flags = child->element_name[0] == 'k' ? FLATPAK_SEARCH_MATCH_KEYWORD : FLATPAK_SEARCH_MATCH_MIMETYPE;
+                  FlatpakXml *item;
+
+                  for (item = child->first_child; item != NULL; item = item->next_sibling)
+                    {
+                      const char *item_lang;
+
+                      if (item->element_name == NULL)
+                        continue;
+
+                      item_lang = xml_get_attribute (item, "xml:lang");
+                      search_index_add_tokens (locales, item_lang ? item_lang : lang,
+                                               xml_get_text (item), n_apps, flags);
+                    }
+                }
+            }
+
+          g_hash_table_iter_init (&iter, descriptions);
+          while (g_hash_table_iter_next (&iter, &key, &value))
+            search_index_add_tokens (locales, key, ((GString *) value)->str, n_apps, FLATPAK_SEARCH_MATCH_DESCRIPTION);
+
+          g_variant_builder_add (&apps_builder, "(s@a{ss}@a{ss}ss)",
+                                 id,
+                                 g_variant_builder_end (&names_builder),
+                                 g_variant_builder_end (&summaries_builder),
+                                 version ? version : "",
+                                 ref_parts ? ref_parts[3] : "");
+          n_apps++;
+        }
+    }
+
+  sorted_locales = g_hash_table_get_keys_as_array (locales, &n_locales);
+  qsort (sorted_locales, n_locales, sizeof (gpointer), compare_str_ptr);
+
+  for (i = 0; i < n_locales; i++)
+    g_variant_builder_add (&locales_builder, "{s@a(sa(uu))}",
+                           (const char *) sorted_locales[i],
+                           search_index_build_tokens (g_hash_table_lookup (locales, sorted_locales[i])));
+
+  return g_variant_ref_sink (g_variant_new ("(u@a(sa{ss}a{ss}ss)@a{sa(sa(uu))})",
+                                            FLATPAK_SEARCH_INDEX_VERSION,
+                                            g_variant_builder_end (&apps_builder),
+                                            g_variant_builder_end (&locales_builder)));
+}
+
+GVariant *
+flatpak_search_index_load (GFile   *file,
+                           GError **error)
+{
+  g_autoptr(GMappedFile) mfile = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GVariant) index = NULL;
+  guint32 version;
+
+  mfile = g_mapped_file_new (flatpak_file_get_path_cached (file), FALSE, error);
+  if (mfile == NULL)
+    return NULL;
+
+  bytes = g_mapped_file_get_bytes (mfile);
+  index = g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE (FLATPAK_SEARCH_INDEX_FORMAT),
+                                                        bytes, FALSE));
+
+  g_variant_get_child (index, 0, "u", &version);
+  if (version != FLATPAK_SEARCH_INDEX_VERSION)
+    {
+      flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA,
+                          _("Unsupported search index version %u"), version);
+      return NULL;
+    }
+
+  return g_steal_pointer (&index);
+}
+
+static const char *
+search_index_get_token (GVariant *tokens,
+                        gsize     pos,
+                        GVariant **matches_out)
+{
+  g_autoptr(GVariant) child = g_variant_get_child_value (tokens, pos);
+  const char *token;
+
+  if (matches_out)
+    g_variant_get (child, "(&s@a(uu))", &token, matches_out);
+  else
+    g_variant_get_child (child, 0, "&s", &token);
+
+  return token;
+}
+
+/* Looks up @folded in the sorted @tokens of one locale. As in appstream-glib,
+ * an app that has the text as a token scores its match flags shifted up,
+ * otherwise it gets the combined flags of all its tokens that start with
+ * the text. The flags of all the locales searched are combined. */
+static void
+search_index_query_tokens (GVariant   *tokens,
+                           const char *folded,
+                           gsize       n_apps,
+                           guint      *scores,
+                           guint      *exact_scores)
+{
+  gsize n_tokens, lo, hi, i, j;
+
+  n_tokens = g_variant_n_children (tokens);
+
+  /* Find the first token that is not less than the text */
+  lo = 0;
+  hi = n_tokens;
+  while (lo < hi)
+    {
+      gsize mid = lo + (hi - lo) / 2;
+
+      if (strcmp (search_index_get_token (tokens, mid, NULL), folded) < 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+
+  for (i = lo; i < n_tokens; i++)
+    {
+      g_autoptr(GVariant) matches = NULL;
+      const char *token = search_index_get_token (tokens, i, &matches);
+      gboolean exact = strcmp (token, folded) == 0;
+
+      if (!g_str_has_prefix (token, folded))
+        break;
+
+      for (j = 0; j < g_variant_n_children (matches); j++)
+        {
+          guint32 app, flags;
+
+          g_variant_get_child (matches, j, "(uu)", &app, &flags);
+          if (app >= n_apps)
+            continue;
+
+          if (exact)
+            exact_scores[app] |= flags << 2;
+          scores[app] |= flags;
+        }
+    }
+}
+
+/* Returns the apps in @index that match @text in any of @languages, with
+ * their score, in the order they appear in the index. */
+GArray *
+flatpak_search_index_query (GVariant           *index,
+                            const char         *text,
+                            const char * const *languages)
+{
+  g_autoptr(GVariant) apps = g_variant_get_child_value (index, 1);
+  g_autoptr(GVariant) locales = g_variant_get_child_value (index, 2);
+  g_autofree char *folded = g_utf8_casefold (text, -1);
+  g_autofree guint *scores = NULL;
+  g_autofree guint *exact_scores = NULL;
+  GArray *res = g_array_new (FALSE, FALSE, sizeof (FlatpakSearchIndexMatch));
+  gsize n_apps, i;
+
+  n_apps = g_variant_n_children (apps);
+  scores = g_new0 (guint, n_apps);
+  exact_scores = g_new0 (guint, n_apps);
+
+  for (i = 0; languages[i] != NULL; i++)
+    {
+      g_autoptr(GVariant) tokens = NULL;
+
+      /* appstream-glib skips these, they are the same as the ones without */
+      if (g_str_has_suffix (languages[i], ".UTF-8"))
+        continue;
+
+      tokens = g_variant_lookup_value (locales, languages[i], G_VARIANT_TYPE ("a(sa(uu))"));
+      if (tokens != NULL)
+        search_index_query_tokens (tokens, folded, n_apps, scores, exact_scores);
+    }
+
+  for (i = 0; i < n_apps; i++)
+    {
+      FlatpakSearchIndexMatch match = { i, exact_scores[i] ? exact_scores[i] : scores[i] };
+
+      if (match.score == 0)
+        {
+          const char *id;
+
+          g_variant_get_child (apps, i, "(&s@a{ss}@a{ss}&s&s)", &id, NULL, NULL, NULL, NULL);
+          if (strcasestr (id, text) == NULL)
+            continue;
+
+          match.score = FLATPAK_SEARCH_ID_SUBSTRING_SCORE;
+        }
+
+      g_array_append_val (res, match);
+    }
+
+  return res;
+}
+
+static const char *
+search_index_lookup_localized (GVariant *strings)
+{
+  const char * const *languages = g_get_language_names ();
+  const char *value;
+  int i;
+
+  for (i = 0; languages[i] != NULL; i++)
+    {
+      if (g_variant_lookup (strings, languages[i], "&s", &value))
+        return value;
+    }
+
+  return NULL;
+}
+
+/* The returned strings point into @index, and are valid as long as it is */
+void
+flatpak_search_index_get_app (GVariant    *index,
+                              guint        app,
+                              const char **id,
+                              const char **name,
+                              const char **summary,
+                              const char **version,
+                              const char **branch)
+{
+  g_autoptr(GVariant) apps = g_variant_get_child_value (index, 1);
+  g_autoptr(GVariant) names = NULL;
+  g_autoptr(GVariant) summaries = NULL;
+
+  g_variant_get_child (apps, app, "(&s@a{ss}@a{ss}&s&s)",
+                       id, &names, &summaries, version, branch);
+
+  *name = search_index_lookup_localized (names);
+  *summary = search_index_lookup_localized (summaries);
+}
+
+/* The appstream extracted from each ref is cached in the repo, keyed
+ * by the ref and commit, so unchanged refs don't have to be extracted
+ * again on the next run. Bump the version when the extraction changes. */
+#define FLATPAK_APPSTREAM_CACHE_DIR "tmp/cache/flatpak-appstream"
+#define FLATPAK_APPSTREAM_CACHE_VERSION 1
+#define FLATPAK_APPSTREAM_CACHE_FORMAT "(sa(sss))"
+
+typedef struct
+{
+  const char *ref;
+  const char *commit;
+  char       *cache_key;
+  char       *xml;    /* The migrated components, or NULL */
+  GVariant   *icons;  /* a(sss): size, name, checksum */
+  GError     *error;
+} AppstreamExtraction;
+
+static void
+appstream_extraction_free (AppstreamExtraction *extraction)
+{
+  g_free (extraction->cache_key);
+  g_free (extraction->xml);
+  if (extraction->icons)
+    g_variant_unref (extraction->icons);
+  g_clear_error (&extraction->error);
+  g_free (extraction);
+}
+
+typedef struct
+{
+  OstreeRepo   *repo;
+  GAsyncQueue  *thread_repos; /* Idle per-thread handles for @repo */
+  GCancellable *cancellable;
+} AppstreamExtractionData;
+
+static gboolean
+load_cached_appstream (OstreeRepo          *repo,
+                       AppstreamExtraction *extraction)
+{
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GVariant) v = NULL;
+  g_autofree char *path = g_build_filename (FLATPAK_APPSTREAM_CACHE_DIR, extraction->cache_key, NULL);
+  glnx_autofd int fd = -1;
+  const char *xml;
+
+  if (!glnx_openat_rdonly (ostree_repo_get_dfd (repo), path, TRUE, &fd, NULL))
+    return FALSE;
+
+  bytes = glnx_fd_readall_bytes (fd, NULL, NULL);
+  if (bytes == NULL)
+    return FALSE;
+
+  v = g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE (FLATPAK_APPSTREAM_CACHE_FORMAT), bytes, FALSE));
+  g_variant_get (v, "(&s@a(sss))", &xml, &extraction->icons);
+  extraction->xml = g_strdup (xml);
+
+  return TRUE;
+}
+
+static void
+save_cached_appstream (OstreeRepo          *repo,
+                       AppstreamExtraction *extraction)
+{
+  g_autoptr(GVariant) v = NULL;
+  g_autoptr(GError) local_error = NULL;
+  g_autofree char *path = g_build_filename (FLATPAK_APPSTREAM_CACHE_DIR, extraction->cache_key, NULL);
+  int repo_dfd = ostree_repo_get_dfd (repo);
+
+  v = g_variant_ref_sink (g_variant_new ("(s@a(sss))", extraction->xml, extraction->icons));
+
+  if (!glnx_shutil_mkdir_p_at (repo_dfd, FLATPAK_APPSTREAM_CACHE_DIR, 0755, NULL, &local_error) ||
+      !glnx_file_replace_contents_at (repo_dfd, path,
+                                      g_variant_get_data (v), g_variant_get_size (v),
+                                      GLNX_FILE_REPLACE_NODATASYNC, NULL, &local_error))
+    g_debug ("Failed to cache appstream for %s: %s", extraction->ref, local_error->message);
+}
+
+static void
+extract_appstream_thread (gpointer data,
+                          gpointer user_data)
+{
+  AppstreamExtraction *extraction = data;
+  AppstreamExtractionData *extraction_data = user_data;
+  g_autoptr(FlatpakXml) appstream_root = NULL;
+  g_autoptr(GString) xml = NULL;
+  g_auto(GVariantBuilder) icons = FLATPAK_VARIANT_BUILDER_INITIALIZER;
+  g_auto(GStrv) split = NULL;
+  g_autoptr(OstreeRepo) thread_repo = NULL;
+  gboolean res;
+
+  if (load_cached_appstream (extraction_data->repo, extraction))
+    return;
+
+  split = flatpak_decompose_ref (extraction->ref, NULL);
+  g_assert (split != NULL);
+
+  thread_repo = get_thread_repo (extraction_data->repo, extraction_data->thread_repos,
+                                 extraction_data->cancellable, &extraction->error);
+  if (thread_repo == NULL)
+    return;
+
+  appstream_root = flatpak_appstream_xml_new ();
+  g_variant_builder_init (&icons, G_VARIANT_TYPE ("a(sss)"));
+
+  res = extract_appstream (thread_repo, appstream_root,
+                           extraction->ref, split[1], &icons,
+                           extraction_data->cancellable, &extraction->error);
+  g_async_queue_push (extraction_data->thread_repos, g_steal_pointer (&thread_repo));
+  if (!res)
+    return;
+
+  xml = g_string_new ("");
+  flatpak_xml_to_string (appstream_root, xml);
+  extraction->xml = g_string_free (g_steal_pointer (&xml), FALSE);
+  extraction->icons = g_variant_ref_sink (g_variant_builder_end (&icons));
+
+  save_cached_appstream (extraction_data->repo, extraction);
+}
+
+/* Moves the components extracted for a ref into @appstream_root */
+static gboolean
+merge_extracted_appstream (FlatpakXml          *appstream_root,
+                           AppstreamExtraction *extraction,
+                           GError             **error)
+{
+  g_autoptr(GInputStream) in = NULL;
+  g_autoptr(FlatpakXml) xml_root = NULL;
+  FlatpakXml *dest_components = appstream_root->first_child;
+  FlatpakXml *components, *component, *prev_component;
+
+  in = g_memory_input_stream_new_from_data (extraction->xml, -1, NULL);
+  xml_root = flatpak_xml_parse (in, FALSE, NULL, error);
+  if (xml_root == NULL)
+    return FALSE;
+
+  components = flatpak_xml_find (xml_root, "components", NULL);
+  if (components == NULL)
+    return flatpak_fail (error, "No components in appstream for %s", extraction->ref);
+
+  component = components->first_child;
+  prev_component = NULL;
+  while (component != NULL)
+    {
+      FlatpakXml *next = component->next_sibling;
+
+      if (component->element_name != NULL)
+        flatpak_xml_add (dest_components, flatpak_xml_unlink (component, prev_component));
+      else
+        prev_component = component;
+
+      component = next;
+    }
+
+  return TRUE;
+}
+
+typedef struct
+{
+  const char *arch;
+  GPtrArray  *extractions; /* The refs included for this arch, in order */
+  GBytes     *xml_data;
+  GBytes     *xml_gz_data;
+  GError     *error;
+} AppstreamArch;
+
+static void
+appstream_arch_free (AppstreamArch *arch)
+{
+  g_ptr_array_unref (arch->extractions);
+  if (arch->xml_data)
+    g_bytes_unref (arch->xml_data);
+  if (arch->xml_gz_data)
+    g_bytes_unref (arch->xml_gz_data);
+  g_clear_error (&arch->error);
+  g_free (arch);
+}
+
+static void
+generate_arch_appstream_thread (gpointer data,
+                                gpointer user_data)
+{
+  AppstreamArch *arch = data;
+  g_autoptr(FlatpakXml) appstream_root = flatpak_appstream_xml_new ();
+  guint i;
+
+  for (i = 0; i < arch->extractions->len; i++)
+    {
+      AppstreamExtraction *extraction = g_ptr_array_index (arch->extractions, i);
+      g_autoptr(GError) local_error = NULL;
+
+      if (extraction->xml == NULL)
+        continue;
+
+      if (!merge_extracted_appstream (appstream_root, extraction, &local_error))
+        g_warning ("Failed to merge appstream for %s: %s", extraction->ref, local_error->message);
+    }
+
+  flatpak_appstream_xml_root_to_data (appstream_root, &arch->xml_data, &arch->xml_gz_data, &arch->error);
+}
+
+/* Runs @func on all the @items, using a thread pool if possible */
+static void
+run_in_thread_pool (GFunc      func,
+                    gpointer   user_data,
+                    GPtrArray *items)
+{
+  GThreadPool *pool = NULL;
+  guint i;
+
+  if (items->len > 1)
+    pool = g_thread_pool_new (func, user_data, g_get_num_processors (), FALSE, NULL);
+
+  for (i = 0; i < items->len; i++)
+    {
+      if (pool)
+        g_thread_pool_push (pool, g_ptr_array_index (items, i), NULL);
+      else
+        func (g_ptr_array_index (items, i), user_data);
+    }
+
+  if (pool)
+    g_thread_pool_free (pool, FALSE, TRUE);
+}
+
+/* Removes cached appstream of refs that were not used in this run */
+static void
+prune_appstream_cache (OstreeRepo *repo,
+                       GHashTable *extractions)
+{
+  g_auto(GLnxDirFdIterator) iter = { 0, };
+  g_autoptr(GHashTable) used = g_hash_table_new (g_str_hash, g_str_equal);
+  g_autoptr(GError) local_error = NULL;
+  GHashTableIter hash_iter;
+  gpointer value;
+
+  g_hash_table_iter_init (&hash_iter, extractions);
+  while (g_hash_table_iter_next (&hash_iter, NULL, &value))
+    {
+      AppstreamExtraction *extraction = value;
+      g_hash_table_add (used, extraction->cache_key);
+    }
 
-              /* prev_component is same as before */
-              component = component->next_sibling;
+  if (!glnx_dirfd_iterator_init_at (ostree_repo_get_dfd (repo), FLATPAK_APPSTREAM_CACHE_DIR,
+                                    FALSE, &iter, &local_error))
+    return;
 
-              flatpak_xml_unlink (old, prev_component);
-              flatpak_xml_free (old);
-            }
-        }
+  while (TRUE)
+    {
+      struct dirent *dent;
+
+      if (!glnx_dirfd_iterator_next_dent (&iter, &dent, NULL, &local_error) || dent == NULL)
+        break;
+
+      if (!g_hash_table_contains (used, dent->d_name))
+        (void) unlinkat (iter.fd, dent->d_name, 0);
     }
 }
 
-
 gboolean
 flatpak_repo_generate_appstream (OstreeRepo   *repo,
                                  const char  **gpg_key_ids,
@@ -4286,9 +6309,17 @@ flatpak_repo_generate_appstream (OstreeRepo   *repo,
   guint n_keys;
   gsize i;
   g_autoptr(GHashTable) arches = NULL;  /* (element-type utf8 utf8) */
+  g_autoptr(GHashTable) extractions = NULL; /* (element-type utf8 AppstreamExtraction) */
+  g_autoptr(GPtrArray) extractions_to_run = g_ptr_array_new ();
+  g_autoptr(GPtrArray) arch_data = g_ptr_array_new_with_free_func ((GDestroyNotify) appstream_arch_free);
+  g_autoptr(GAsyncQueue) thread_repos = g_async_queue_new_full (g_object_unref);
+  AppstreamExtractionData extraction_data = { repo, thread_repos, cancellable };
   const char *collection_id;
+  guint j;
 
   arches = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  extractions = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+                                       (GDestroyNotify) appstream_extraction_free);
 
   collection_id = ostree_repo_get_collection_id (repo);
 
@@ -4327,48 +6358,16 @@ flatpak_repo_generate_appstream (OstreeRepo   *repo,
         }
     }
 
+  /* Find the refs to include for each arch. Each of them is only extracted
+     once, even if it is used for several arches. */
   GLNX_HASH_TABLE_FOREACH (arches, const char *, arch)
   {
-    OstreeRepoTransactionStats stats;
-    g_autoptr(FlatpakXml) appstream_root = NULL;
-    g_autoptr(GBytes) xml_data = NULL;
-    g_autoptr(GBytes) xml_gz_data = NULL;
-    g_autoptr(OstreeMutableTree) mtree = ostree_mutable_tree_new ();
-    g_autoptr(OstreeMutableTree) icons_mtree = NULL;
-    g_autoptr(OstreeMutableTree) icons_flatpak_mtree = NULL;
-    g_autoptr(OstreeMutableTree) size1_mtree = NULL;
-    g_autoptr(OstreeMutableTree) size2_mtree = NULL;
-    const char *compat_arch;
-    g_autoptr(FlatpakRepoTransaction) transaction = NULL;
-    compat_arch = flatpak_get_compat_arch (arch);
-    const char *branch_names[] = { "appstream", "appstream2" };
-
-    if (!flatpak_mtree_ensure_dir_metadata (repo, mtree, cancellable, error))
-      return FALSE;
-
-    if (!flatpak_mtree_create_dir (repo, mtree, "icons", &icons_mtree, error))
-      return FALSE;
-
-    if (!flatpak_mtree_create_dir (repo, icons_mtree, "64x64", &size1_mtree, error))
-      return FALSE;
-
-    if (!flatpak_mtree_create_dir (repo, icons_mtree, "128x128", &size2_mtree, error))
-      return FALSE;
-
-    /* For compatibility with libappstream we create a $origin ("flatpak") subdirectory with symlinks
-     * to the size directories thus matching the standard merged appstream layout if we assume the
-     * appstream has origin=flatpak, which flatpak-builder creates.
-     *
-     * See https://github.com/ximion/appstream/pull/224 for details.
-     */
-    if (!flatpak_mtree_create_dir (repo, icons_mtree, "flatpak", &icons_flatpak_mtree, error))
-      return FALSE;
-    if (!flatpak_mtree_create_symlink (repo, icons_flatpak_mtree, "64x64", "../64x64", error))
-      return FALSE;
-    if (!flatpak_mtree_create_symlink (repo, icons_flatpak_mtree, "128x128", "../128x128", error))
-      return FALSE;
+    const char *compat_arch = flatpak_get_compat_arch (arch);
+    AppstreamArch *arch_appstream = g_new0 (AppstreamArch, 1);
 
-    appstream_root = flatpak_appstream_xml_new ();
+    arch_appstream->arch = arch;
+    arch_appstream->extractions = g_ptr_array_new ();
+    g_ptr_array_add (arch_data, arch_appstream);
 
     for (i = 0; i < n_keys; i++)
       {
@@ -4377,9 +6376,9 @@ flatpak_repo_generate_appstream (OstreeRepo   *repo,
         g_autoptr(GVariant) commit_v = NULL;
         g_autoptr(GVariant) commit_metadata = NULL;
         g_auto(GStrv) split = NULL;
-        g_autoptr(GError) my_error = NULL;
         const char *eol = NULL;
         const char *eol_rebase = NULL;
+        AppstreamExtraction *extraction;
 
         split = flatpak_decompose_ref (ref, NULL);
         if (!split)
@@ -4398,6 +6397,13 @@ flatpak_repo_generate_appstream (OstreeRepo   *repo,
               continue;
           }
 
+        extraction = g_hash_table_lookup (extractions, ref);
+        if (extraction != NULL)
+          {
+            g_ptr_array_add (arch_appstream->extractions, extraction);
+            continue;
+          }
+
         commit = g_hash_table_lookup (all_refs, ref);
 
         if (!ostree_repo_load_variant (repo, OSTREE_OBJECT_TYPE_COMMIT, commit,
@@ -4416,19 +6422,110 @@ flatpak_repo_generate_appstream (OstreeRepo   *repo,
             continue;
           }
 
-        if (!extract_appstream (repo, appstream_root,
-                                ref, split[1], size1_mtree, size2_mtree,
-                                cancellable, &my_error))
-          {
-            if (g_str_has_prefix (ref, "app/"))
-              g_print (_("No appstream data for %s: %s\n"), ref, my_error->message);
-            continue;
-          }
+        extraction = g_new0 (AppstreamExtraction, 1);
+        extraction->ref = ref;
+        extraction->commit = commit;
+        {
+          g_autofree char *key = g_strdup_printf ("%d\n%s\n%s", FLATPAK_APPSTREAM_CACHE_VERSION, ref, commit);
+          extraction->cache_key = g_compute_checksum_for_string (G_CHECKSUM_SHA256, key, -1);
+        }
+        g_hash_table_insert (extractions, (char *) ref, extraction);
+        g_ptr_array_add (extractions_to_run, extraction);
+        g_ptr_array_add (arch_appstream->extractions, extraction);
+      }
+  }
+
+  run_in_thread_pool (extract_appstream_thread, &extraction_data, extractions_to_run);
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    return FALSE;
+
+  for (i = 0; i < extractions_to_run->len; i++)
+    {
+      AppstreamExtraction *extraction = g_ptr_array_index (extractions_to_run, i);
+
+      if (extraction->error != NULL && g_str_has_prefix (extraction->ref, "app/"))
+        g_print (_("No appstream data for %s: %s\n"), extraction->ref, extraction->error->message);
+    }
+
+  prune_appstream_cache (repo, extractions);
+
+  run_in_thread_pool (generate_arch_appstream_thread, NULL, arch_data);
+
+  for (j = 0; j < arch_data->len; j++)
+  {
+    AppstreamArch *arch_appstream = g_ptr_array_index (arch_data, j);
+    const char *arch = arch_appstream->arch;
+    OstreeRepoTransactionStats stats;
+    GBytes *xml_data = arch_appstream->xml_data;
+    GBytes *xml_gz_data = arch_appstream->xml_gz_data;
+    g_autoptr(OstreeMutableTree) mtree = ostree_mutable_tree_new ();
+    g_autoptr(OstreeMutableTree) icons_mtree = NULL;
+    g_autoptr(OstreeMutableTree) icons_flatpak_mtree = NULL;
+    g_autoptr(OstreeMutableTree) size1_mtree = NULL;
+    g_autoptr(OstreeMutableTree) size2_mtree = NULL;
+    g_autoptr(FlatpakRepoTransaction) transaction = NULL;
+    const char *branch_names[] = { "appstream", "appstream2" };
+
+    if (arch_appstream->error != NULL)
+      {
+        g_propagate_error (error, g_steal_pointer (&arch_appstream->error));
+        return FALSE;
       }
 
-    if (!flatpak_appstream_xml_root_to_data (appstream_root, &xml_data, &xml_gz_data, error))
+    if (!flatpak_mtree_ensure_dir_metadata (repo, mtree, cancellable, error))
+      return FALSE;
+
+    if (!flatpak_mtree_create_dir (repo, mtree, "icons", &icons_mtree, error))
+      return FALSE;
+
+    if (!flatpak_mtree_create_dir (repo, icons_mtree, "64x64", &size1_mtree, error))
+      return FALSE;
+
+    if (!flatpak_mtree_create_dir (repo, icons_mtree, "128x128", &size2_mtree, error))
+      return FALSE;
+
+    /* For compatibility with libappstream we create a $origin ("flatpak") subdirectory with symlinks
+     * to the size directories thus matching the standard merged appstream layout if we assume the
+     * appstream has origin=flatpak, which flatpak-builder creates.
+     *
+     * See https://github.com/ximion/appstream/pull/224 for details.
+     */
+    if (!flatpak_mtree_create_dir (repo, icons_mtree, "flatpak", &icons_flatpak_mtree, error))
+      return FALSE;
+    if (!flatpak_mtree_create_symlink (repo, icons_flatpak_mtree, "64x64", "../64x64", error))
+      return FALSE;
+    if (!flatpak_mtree_create_symlink (repo, icons_flatpak_mtree, "128x128", "../128x128", error))
       return FALSE;
 
+    for (i = 0; i < arch_appstream->extractions->len; i++)
+      {
+        AppstreamExtraction *extraction = g_ptr_array_index (arch_appstream->extractions, i);
+        gsize k;
+
+        if (extraction->icons == NULL)
+          continue;
+
+        for (k = 0; k < g_variant_n_children (extraction->icons); k++)
+          {
+            const char *size, *icon_name, *checksum;
+            g_autoptr(GError) my_error = NULL;
+            gboolean is_size1;
+
+            g_variant_get_child (extraction->icons, k, "(&s&s&s)", &size, &icon_name, &checksum);
+            is_size1 = strcmp (size, "64x64") == 0;
+
+            if (!ostree_mutable_tree_replace_file (is_size1 ? size1_mtree : size2_mtree,
+                                                   icon_name, checksum, &my_error))
+              {
+                if (is_size1)
+                  g_print (_("Error copying 64x64 icon for component %s: %s\n"), icon_name, my_error->message);
+                else
+                  g_print (_("Error copying 128x128 icon for component %s: %s\n"), icon_name, my_error->message);
+              }
+          }
+      }
+
     transaction = flatpak_repo_transaction_start (repo, cancellable, error);
     if (transaction == NULL)
       return FALSE;
@@ -4691,6 +6788,21 @@ flatpak_extension_matches_reason (const char *extension_id,
   return FALSE;
 }
 
+/* Describes the host state that flatpak_extension_matches_reason()
+ * depends on, for use in cache keys */
+char *
+flatpak_extension_reasons_state (void)
+{
+  g_autofree char *gl_drivers = g_strjoinv (";", (char **) flatpak_get_gl_drivers ());
+  const char *current_desktop = g_getenv ("XDG_CURRENT_DESKTOP");
+
+  return g_strdup_printf ("%s\n%s\n%d\n%s",
+                          gl_drivers,
+                          flatpak_get_gtk_theme (),
+                          flatpak_get_have_intel_gpu (),
+                          current_desktop ? current_desktop : "");
+}
+
 static GList *
 add_extension (GKeyFile   *metakey,
                const char *group,
@@ -5440,6 +7552,19 @@ oci_layer_progress (guint64  downloaded_bytes,
                                 progress_data->progress_user_data);
 }
 
+/* The layer fetcher reports the total downloaded for all layers */
+static void
+oci_fetch_progress (guint64  downloaded_bytes,
+                    gpointer user_data)
+{
+  FlatpakOciPullProgressData *progress_data = user_data;
+
+  if (progress_data->progress_cb)
+    progress_data->progress_cb (progress_data->total_size, downloaded_bytes,
+                                progress_data->n_layers, progress_data->pulled_layers,
+                                progress_data->progress_user_data);
+}
+
 gboolean
 flatpak_mirror_image_from_oci (FlatpakOciRegistry    *dst_registry,
                                FlatpakOciRegistry    *registry,
@@ -5520,6 +7645,21 @@ flatpak_mirror_image_from_oci (FlatpakOciRegistry    *dst_registry,
 }
 
 
+/* How many layers of an image we download at the same time, by default */
+#define FLATPAK_OCI_PARALLEL_LAYER_DOWNLOADS 4
+
+static int
+get_oci_parallel_layer_downloads (void)
+{
+  const char *env = g_getenv ("FLATPAK_OCI_PARALLEL_DOWNLOADS");
+  guint64 n;
+
+  if (env != NULL && flatpak_utils_ascii_string_to_unsigned (env, 10, 1, 64, &n, NULL))
+    return (int) n;
+
+  return FLATPAK_OCI_PARALLEL_LAYER_DOWNLOADS;
+}
+
 char *
 flatpak_pull_from_oci (OstreeRepo            *repo,
                        FlatpakOciRegistry    *registry,
@@ -5546,6 +7686,7 @@ flatpak_pull_from_oci (OstreeRepo            *repo,
   FlatpakOciPullProgressData progress_data = { progress_cb, progress_user_data };
   g_autoptr(GVariantBuilder) metadata_builder = g_variant_builder_new (G_VARIANT_TYPE ("a{sv}"));
   g_autoptr(GVariant) metadata = NULL;
+  g_autoptr(FlatpakOciLayerFetcher) fetcher = NULL;
   GHashTable *annotations, *labels;
   int i;
 
@@ -5593,6 +7734,16 @@ flatpak_pull_from_oci (OstreeRepo            *repo,
   for (i = 0; manifest->layers[i] != NULL; i++)
     {
       FlatpakOciDescriptor *layer = manifest->layers[i];
+
+#ifndef HAVE_ARCHIVE_READ_SUPPORT_FILTER_ZSTD
+      /* Fail before downloading anything we can't unpack */
+      if (flatpak_oci_layer_is_zstd (layer))
+        {
+          flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("zstd-compressed OCI layer %s is not supported"), layer->digest);
+          goto error;
+        }
+#endif
+
       progress_data.total_size += layer->size;
       progress_data.n_layers++;
     }
@@ -5602,25 +7753,23 @@ flatpak_pull_from_oci (OstreeRepo            *repo,
                  progress_data.n_layers, progress_data.pulled_layers,
                  progress_user_data);
 
+  /* Layers are downloaded and verified in parallel in the background,
+   * but they have to be imported in order, since later layers override
+   * earlier ones. Each import starts once its layer is verified. */
+  fetcher = flatpak_oci_layer_fetcher_new (registry, oci_repository, manifest->layers,
+                                           get_oci_parallel_layer_downloads (),
+                                           cancellable);
+
   for (i = 0; manifest->layers[i] != NULL; i++)
     {
       FlatpakOciDescriptor *layer = manifest->layers[i];
       OstreeRepoImportArchiveOptions opts = { 0, };
       g_autoptr(FlatpakAutoArchiveRead) a = NULL;
       glnx_autofd int layer_fd = -1;
-      g_autoptr(GChecksum) checksum = g_checksum_new (G_CHECKSUM_SHA256);
-      const char *layer_checksum;
 
       opts.autocreate_parents = TRUE;
       opts.ignore_unsupported_content = TRUE;
 
-      layer_fd = flatpak_oci_registry_download_blob (registry, oci_repository, FALSE,
-                                                     layer->digest,
-                                                     oci_layer_progress, &progress_data,
-                                                     cancellable, error);
-      if (layer_fd == -1)
-        goto error;
-
       a = archive_read_new ();
 #ifdef HAVE_ARCHIVE_READ_SUPPORT_FILTER_ALL
       archive_read_support_filter_all (a);
@@ -5629,23 +7778,22 @@ flatpak_pull_from_oci (OstreeRepo            *repo,
 #endif
       archive_read_support_format_all (a);
 
-      if (!flatpak_archive_read_open_fd_with_checksum (a, layer_fd, checksum, error))
-        goto error;
-
-      if (!ostree_repo_import_archive_to_mtree (repo, &opts, a, archive_mtree, NULL, cancellable, error))
+      layer_fd = flatpak_oci_layer_fetcher_wait (fetcher, i, oci_fetch_progress, &progress_data, error);
+      if (layer_fd == -1)
         goto error;
 
-      if (archive_read_close (a) != ARCHIVE_OK)
+      if (archive_read_open_fd (a, layer_fd, 8192) != ARCHIVE_OK)
         {
           propagate_libarchive_error (error, a);
           goto error;
         }
 
-      layer_checksum = g_checksum_get_string (checksum);
-      if (!g_str_has_prefix (layer->digest, "sha256:") ||
-          strcmp (layer->digest + strlen ("sha256:"), layer_checksum) != 0)
+      if (!ostree_repo_import_archive_to_mtree (repo, &opts, a, archive_mtree, NULL, cancellable, error))
+        goto error;
+
+      if (archive_read_close (a) != ARCHIVE_OK)
         {
-          flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Wrong layer checksum, expected %s, was %s"), layer->digest, layer_checksum);
+          propagate_libarchive_error (error, a);
           goto error;
         }
 
@@ -6913,6 +9061,236 @@ flatpak_repo_resolve_rev (OstreeRepo    *repo,
   return TRUE;
 }
 
+/* Loads a metadata object of @src_repo and checks that it matches its
+ * checksum, as nothing in @src_repo is trusted */
+static GVariant *
+load_verified_variant (OstreeRepo      *src_repo,
+                       OstreeObjectType objtype,
+                       const char      *checksum,
+                       GError         **error)
+{
+  g_autoptr(GVariant) variant = NULL;
+  g_autofree char *actual = NULL;
+
+  if (!ostree_repo_load_variant (src_repo, objtype, checksum, &variant, error))
+    return NULL;
+
+  actual = g_compute_checksum_for_data (G_CHECKSUM_SHA256,
+                                        g_variant_get_data (variant),
+                                        g_variant_get_size (variant));
+  if (strcmp (actual, checksum) != 0)
+    {
+      flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA,
+                          _("Corrupted %s object %s"),
+                          ostree_object_type_to_string (objtype), checksum);
+      return NULL;
+    }
+
+  return g_steal_pointer (&variant);
+}
+
+static gboolean
+collect_verified_file_objects (OstreeRepo   *src_repo,
+                               const char   *dirtree_checksum,
+                               GHashTable   *dirtrees,
+                               GHashTable   *files,
+                               GCancellable *cancellable,
+                               GError      **error)
+{
+  g_autoptr(GVariant) dirtree = NULL;
+  g_autoptr(GVariant) files_v = NULL;
+  g_autoptr(GVariant) dirs_v = NULL;
+  gsize i, n;
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    return FALSE;
+
+  if (!g_hash_table_add (dirtrees, g_strdup (dirtree_checksum)))
+    return TRUE;
+
+  dirtree = load_verified_variant (src_repo, OSTREE_OBJECT_TYPE_DIR_TREE, dirtree_checksum, error);
+  if (dirtree == NULL)
+    return FALSE;
+
+  files_v = g_variant_get_child_value (dirtree, 0);
+  n = g_variant_n_children (files_v);
+  for (i = 0; i < n; i++)
+    {
+      g_autoptr(GVariant) csum_v = NULL;
+
+      g_variant_get_child (files_v, i, "(&s@ay)", NULL, &csum_v);
+      if (!ostree_validate_structureof_csum_v (csum_v, error))
+        return FALSE;
+      g_hash_table_add (files, ostree_checksum_from_bytes_v (csum_v));
+    }
+
+  dirs_v = g_variant_get_child_value (dirtree, 1);
+  n = g_variant_n_children (dirs_v);
+  for (i = 0; i < n; i++)
+    {
+      g_autoptr(GVariant) tree_csum_v = NULL;
+      g_autofree char *tree_checksum = NULL;
+
+      g_variant_get_child (dirs_v, i, "(&s@ay@ay)", NULL, &tree_csum_v, NULL);
+      if (!ostree_validate_structureof_csum_v (tree_csum_v, error))
+        return FALSE;
+      tree_checksum = ostree_checksum_from_bytes_v (tree_csum_v);
+
+      if (!collect_verified_file_objects (src_repo, tree_checksum, dirtrees, files, cancellable, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Checks that the regular file object @checksum in @src_repo is what
+ * the checksum says, and that it is fine to have in @repo: owned by us,
+ * and without setuid, setgid, sticky or world-writable bits, which
+ * bare-user-only repos can't have. Returns its size, or -1 if it should
+ * be left to the regular pull, which verifies it in its own way. */
+static gint64
+verify_file_object_in_place (OstreeRepo   *src_repo,
+                             const char   *checksum,
+                             struct stat  *out_stbuf,
+                             GCancellable *cancellable)
+{
+  g_autofree char *path = ostree_get_relative_object_path (checksum, OSTREE_OBJECT_TYPE_FILE, FALSE);
+  g_autoptr(GFileInfo) file_info = NULL;
+  g_autoptr(GInputStream) input = NULL;
+  g_autofree guchar *csum = NULL;
+  g_autofree char *actual = NULL;
+  g_autoptr(GError) local_error = NULL;
+  glnx_autofd int fd = -1;
+
+  /* Symlinks, and anything else that isn't a regular file, fail here */
+  fd = openat (ostree_repo_get_dfd (src_repo), path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd == -1 || fstat (fd, out_stbuf) != 0 || !S_ISREG (out_stbuf->st_mode))
+    return -1;
+
+  if (out_stbuf->st_uid != getuid () ||
+      (out_stbuf->st_mode & ~(S_IFMT | 0775)) != 0)
+    {
+      g_debug ("Not importing object %s with owner %d and mode 0%o", checksum,
+               (int) out_stbuf->st_uid, (guint) out_stbuf->st_mode);
+      return -1;
+    }
+
+  /* bare-user-only objects have no xattrs, and their uid and gid are 0 */
+  file_info = g_file_info_new ();
+  g_file_info_set_file_type (file_info, G_FILE_TYPE_REGULAR);
+  g_file_info_set_size (file_info, out_stbuf->st_size);
+  g_file_info_set_attribute_uint32 (file_info, "unix::mode", out_stbuf->st_mode);
+  g_file_info_set_attribute_uint32 (file_info, "unix::uid", 0);
+  g_file_info_set_attribute_uint32 (file_info, "unix::gid", 0);
+
+  input = g_unix_input_stream_new (fd, FALSE);
+  if (!ostree_checksum_file_from_input (file_info, NULL, input, OSTREE_OBJECT_TYPE_FILE,
+                                        &csum, cancellable, &local_error))
+    {
+      g_debug ("Not importing object %s: %s", checksum, local_error->message);
+      return -1;
+    }
+
+  actual = ostree_checksum_from_bytes (csum);
+  if (strcmp (actual, checksum) != 0)
+    {
+      g_debug ("Not importing corrupted object %s", checksum);
+      return -1;
+    }
+
+  return out_stbuf->st_size;
+}
+
+/* Imports the file objects of @commit from @src_repo into the transaction
+ * that is open on @repo, without reading and writing them again where
+ * possible. This is for the system helper, after it took ownership of the
+ * repo the user pulled into, so that nobody else can change it anymore.
+ *
+ * The commit and the dirtrees are only used after checking that they
+ * match their checksums, starting from @commit, which the caller must
+ * have verified. Each file object is then verified in place, and
+ * imported as trusted, which hardlinks it on the same filesystem and
+ * otherwise copies it, with a reflink where the filesystem can. The
+ * pull that follows does everything else, and can skip the objects that
+ * are already here. Objects that fail verification are not imported, so
+ * that pull fails on them as before.
+ *
+ * @out_linked_size and @out_copied_size are set to the sizes of the
+ * objects that were hardlinked and copied. */
+gboolean
+flatpak_repo_import_verified_objects (OstreeRepo   *repo,
+                                      OstreeRepo   *src_repo,
+                                      const char   *commit,
+                                      guint64      *out_linked_size,
+                                      guint64      *out_copied_size,
+                                      GCancellable *cancellable,
+                                      GError      **error)
+{
+  g_autoptr(GHashTable) dirtrees = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  g_autoptr(GHashTable) files = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  g_autoptr(GVariant) commit_v = NULL;
+  g_autoptr(GVariant) tree_csum_v = NULL;
+  g_autofree char *tree_checksum = NULL;
+  guint64 linked_size = 0, copied_size = 0;
+  GHashTableIter iter;
+  gpointer key;
+
+  if (ostree_repo_get_mode (repo) != OSTREE_REPO_MODE_BARE_USER_ONLY ||
+      ostree_repo_get_mode (src_repo) != OSTREE_REPO_MODE_BARE_USER_ONLY)
+    return flatpak_fail (error, "Can only import objects between bare-user-only repos");
+
+  commit_v = load_verified_variant (src_repo, OSTREE_OBJECT_TYPE_COMMIT, commit, error);
+  if (commit_v == NULL)
+    return FALSE;
+
+  g_variant_get_child (commit_v, 6, "@ay", &tree_csum_v);
+  if (!ostree_validate_structureof_csum_v (tree_csum_v, error))
+    return FALSE;
+  tree_checksum = ostree_checksum_from_bytes_v (tree_csum_v);
+
+  if (!collect_verified_file_objects (src_repo, tree_checksum, dirtrees, files, cancellable, error))
+    return FALSE;
+
+  g_hash_table_iter_init (&iter, files);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    {
+      const char *checksum = key;
+      g_autofree char *path = NULL;
+      struct stat stbuf, after_stbuf;
+      gboolean have_object;
+      gint64 size;
+
+      if (!ostree_repo_has_object (repo, OSTREE_OBJECT_TYPE_FILE, checksum, &have_object,
+                                   cancellable, error))
+        return FALSE;
+      if (have_object)
+        continue;
+
+      size = verify_file_object_in_place (src_repo, checksum, &stbuf, cancellable);
+      if (size < 0)
+        continue;
+
+      if (!ostree_repo_import_object_from_with_trust (repo, src_repo, OSTREE_OBJECT_TYPE_FILE,
+                                                      checksum, TRUE, cancellable, error))
+        return FALSE;
+
+      /* A hardlink shows up in the link count of the source */
+      path = ostree_get_relative_object_path (checksum, OSTREE_OBJECT_TYPE_FILE, FALSE);
+      if (fstatat (ostree_repo_get_dfd (src_repo), path, &after_stbuf, AT_SYMLINK_NOFOLLOW) == 0 &&
+          after_stbuf.st_ino == stbuf.st_ino && after_stbuf.st_nlink > stbuf.st_nlink)
+        linked_size += size;
+      else
+        copied_size += size;
+    }
+
+  if (out_linked_size)
+    *out_linked_size = linked_size;
+  if (out_copied_size)
+    *out_copied_size = copied_size;
+
+  return TRUE;
+}
+
 
 #if !GLIB_CHECK_VERSION (2, 56, 0)
 /* All this code is backported directly from glib */
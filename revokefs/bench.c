@@ -0,0 +1,224 @@
+/*
+ * SPDX-License-Identifier: LGPL-2.0+
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* Measures the throughput of the writer protocol, without fuse in
+ * between, by writing files from several threads at once. With --verify
+ * it also reads the files back and checks their contents, which makes
+ * it a test of the pipelined requests. */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#include "writer.h"
+#include "libglnx.h"
+
+static int opt_threads = 4;
+static int opt_files = 16;
+static int opt_file_size = 8; /* MiB */
+static int opt_chunk_size = MAX_DATA_SIZE;
+static gboolean opt_verify;
+
+static GOptionEntry options[] = {
+  { "threads", 0, 0, G_OPTION_ARG_INT, &opt_threads, "Number of writing threads", "N" },
+  { "files", 0, 0, G_OPTION_ARG_INT, &opt_files, "Number of files to write", "N" },
+  { "file-size", 0, 0, G_OPTION_ARG_INT, &opt_file_size, "Size of each file in MiB", "SIZE" },
+  { "chunk-size", 0, 0, G_OPTION_ARG_INT, &opt_chunk_size, "Size of each write in bytes", "SIZE" },
+  { "verify", 0, 0, G_OPTION_ARG_NONE, &opt_verify, "Read back and check what was written", NULL },
+  { NULL }
+};
+
+static int writer_socket = -1;
+static gint next_file;
+
+/* Every chunk of every file is different, so that responses that end
+ * up with the wrong request are noticed */
+static void
+fill_chunk (char *buf, gsize size, int file_nr, gsize offset)
+{
+  gsize i;
+
+  for (i = 0; i < size; i++)
+    buf[i] = (char) (file_nr * 7 + (offset + i) / 4096);
+}
+
+static void
+verify_file (const char *path, int file_nr, gsize file_size)
+{
+  g_autofree char *expected = g_malloc (opt_chunk_size);
+  g_autofree char *buf = g_malloc (opt_chunk_size);
+  gsize offset = 0;
+  int fd, r;
+
+  fd = request_open (writer_socket, path, 0, O_RDONLY);
+  if (fd < 0)
+    g_error ("Failed to open %s: %s", path, g_strerror (-fd));
+
+  while (offset < file_size)
+    {
+      gsize size = MIN (opt_chunk_size, file_size - offset);
+
+      r = request_read (writer_socket, fd, buf, size, offset);
+      if (r <= 0)
+        g_error ("Failed to read %s: %s", path, r < 0 ? g_strerror (-r) : "Unexpected end of file");
+
+      fill_chunk (expected, r, file_nr, offset);
+      if (memcmp (buf, expected, r) != 0)
+        g_error ("Wrong data in %s at offset %" G_GSIZE_FORMAT, path, offset);
+      offset += r;
+    }
+
+  r = request_close (writer_socket, fd);
+  if (r < 0)
+    g_error ("Failed to close %s: %s", path, g_strerror (-r));
+}
+
+static gpointer
+bench_thread (gpointer user_data)
+{
+  g_autofree char *buf = g_malloc (opt_chunk_size);
+  gsize file_size = (gsize) opt_file_size * 1024 * 1024;
+  int file_nr;
+
+  memset (buf, 'x', opt_chunk_size);
+
+  while ((file_nr = g_atomic_int_add (&next_file, 1)) < opt_files)
+    {
+      g_autofree char *path = g_strdup_printf ("revokefs-bench-%d", file_nr);
+      gsize offset = 0;
+      int fd, r;
+
+      fd = request_open (writer_socket, path, 0644, O_CREAT | O_WRONLY | O_TRUNC);
+      if (fd < 0)
+        g_error ("Failed to open %s: %s", path, g_strerror (-fd));
+
+      while (offset < file_size)
+        {
+          gsize size = MIN (opt_chunk_size, file_size - offset);
+
+          if (opt_verify)
+            fill_chunk (buf, size, file_nr, offset);
+
+          r = request_write (writer_socket, fd, buf, size, offset);
+          if (r <= 0)
+            g_error ("Failed to write %s: %s", path, g_strerror (-r));
+          offset += r;
+        }
+
+      r = request_close (writer_socket, fd);
+      if (r < 0)
+        g_error ("Failed to close %s: %s", path, g_strerror (-r));
+
+      if (opt_verify)
+        verify_file (path, file_nr, file_size);
+
+      r = request_unlink (writer_socket, path);
+      if (r < 0)
+        g_error ("Failed to unlink %s: %s", path, g_strerror (-r));
+    }
+
+  return NULL;
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_autoptr(GOptionContext) context = g_option_context_new ("DIR - Benchmark the revokefs writer");
+  g_autoptr(GPtrArray) threads = g_ptr_array_new ();
+  g_autoptr(GError) error = NULL;
+  int sockets[2];
+  int basefd;
+  pid_t pid;
+  gint64 start, elapsed;
+  double mib;
+  int i;
+
+  g_option_context_add_main_entries (context, options, NULL);
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      exit (EXIT_FAILURE);
+    }
+
+  if (argc != 2 || opt_threads < 1 || opt_chunk_size < 1)
+    {
+      g_printerr ("Usage: revokefs-bench [OPTION…] DIR\n");
+      exit (EXIT_FAILURE);
+    }
+
+  basefd = openat (AT_FDCWD, argv[1], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (basefd == -1)
+    {
+      perror ("opening basepath: ");
+      exit (EXIT_FAILURE);
+    }
+
+  if (socketpair (AF_UNIX, SOCK_SEQPACKET, 0, sockets))
+    {
+      perror ("Failed to create socket pair");
+      exit (EXIT_FAILURE);
+    }
+
+  pid = fork ();
+  if (pid == -1)
+    {
+      perror ("Failed to fork writer");
+      exit (EXIT_FAILURE);
+    }
+
+  if (pid == 0)
+    {
+      close (sockets[0]);
+      do_writer (basefd, sockets[1], -1);
+      exit (0);
+    }
+
+  close (sockets[1]);
+  writer_socket = sockets[0];
+  setup_socket (writer_socket);
+
+  start = g_get_monotonic_time ();
+
+  for (i = 0; i < opt_threads; i++)
+    g_ptr_array_add (threads, g_thread_new ("bench", bench_thread, NULL));
+  for (i = 0; i < opt_threads; i++)
+    g_thread_join (g_ptr_array_index (threads, i));
+
+  elapsed = g_get_monotonic_time () - start;
+
+  /* The writer exits when the socket is closed */
+  close (writer_socket);
+  waitpid (pid, NULL, 0);
+
+  mib = (double) opt_files * opt_file_size;
+  g_print ("Wrote %.0f MiB in %.3f s with %d threads and %d byte chunks: %.1f MiB/s\n",
+           mib, elapsed / (double) G_USEC_PER_SEC, opt_threads, opt_chunk_size,
+           mib * G_USEC_PER_SEC / elapsed);
+
+  return 0;
+}
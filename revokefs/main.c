@@ -501,6 +501,7 @@ main (int argc, char *argv[])
   struct fuse_args args = FUSE_ARGS_INIT (argc, argv);
   int res;
   struct revokefs_config conf = { -1, -1 };
+  g_autofree char *max_write_arg = NULL;
 
   res = fuse_opt_parse (&args, &conf, revokefs_opts, revokefs_opt_proc);
   if (res != 0)
@@ -571,6 +572,17 @@ main (int argc, char *argv[])
       writer_socket = sockets[0];
     }
 
+  setup_socket (writer_socket);
+
+  /* Let the kernel send us large writes, which we pass on to the writer
+     in one request, rather than splitting them in pages */
+  max_write_arg = g_strdup_printf ("-obig_writes,max_write=%d", MAX_DATA_SIZE);
+  if (fuse_opt_add_arg (&args, max_write_arg) != 0)
+    {
+      fprintf (stderr, "Failed to add fuse arguments\n");
+      exit (EXIT_FAILURE);
+    }
+
   fuse_main (args.argc, args.argv, &callback_oper, NULL);
 
   return 0;
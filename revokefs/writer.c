@@ -43,8 +43,107 @@
 static int basefd = -1;
 
 static GHashTable *outstanding_fds;
-
+static GMutex outstanding_fds_mutex;
+
+/* Number of threads handling requests in the writer */
+#define WRITER_THREADS 4
+
+typedef struct {
+  guint32 id;
+  gboolean done;
+  gboolean failed;
+  ssize_t response_size;
+  RevokefsResponse *response;
+  void *response_data;
+  size_t response_data_size;
+} PendingRequest;
+
+/* Protects all the below. Any thread waiting for a response can become
+ * the one reading from the socket, and it then dispatches each response
+ * to whatever request it belongs to. */
 static GMutex mutex;
+static GCond cond;
+static GHashTable *pending_requests;
+static guint32 next_request_id;
+static gboolean reading_responses;
+
+void
+setup_socket (int socket)
+{
+  int buf_size = 4 * MAX_REQUEST_SIZE;
+
+  /* Make room for a few large requests at a time, this is capped
+     by the system max, so ignore errors */
+  (void) setsockopt (socket, SOL_SOCKET, SO_SNDBUF, &buf_size, sizeof (buf_size));
+  (void) setsockopt (socket, SOL_SOCKET, SO_RCVBUF, &buf_size, sizeof (buf_size));
+}
+
+/* Called without the lock held, but only by one thread at a time */
+static gboolean
+read_one_response (int writer_socket)
+{
+  RevokefsResponse header;
+  PendingRequest *pending;
+  struct iovec read_vecs[2] = {};
+  int n_read_vecs = 0;
+  ssize_t read_size;
+
+  read_size = TEMP_FAILURE_RETRY (recv (writer_socket, &header, sizeof (header), MSG_PEEK));
+  if (read_size == -1)
+    {
+      g_printerr ("Read from socket returned error %d\n", errno);
+      return FALSE;
+    }
+
+  if (read_size < sizeof (RevokefsResponse))
+    {
+      g_printerr ("Invalid read size %zd\n", read_size);
+      /* Drop the message, so the next read doesn't see it again */
+      (void) TEMP_FAILURE_RETRY (recv (writer_socket, &header, sizeof (header), 0));
+      return FALSE;
+    }
+
+  g_mutex_lock (&mutex);
+  pending = g_hash_table_lookup (pending_requests, GUINT_TO_POINTER (header.id));
+  g_mutex_unlock (&mutex);
+
+  /* This can be a late response to a request that already failed, drop it */
+  if (pending == NULL)
+    {
+      g_printerr ("Response for unknown request %u\n", header.id);
+      (void) TEMP_FAILURE_RETRY (recv (writer_socket, &header, sizeof (header), 0));
+      return TRUE;
+    }
+
+  read_vecs[n_read_vecs].iov_base = (char *)pending->response;
+  read_vecs[n_read_vecs++].iov_len = sizeof (RevokefsResponse);
+
+  if (pending->response_data)
+    {
+      read_vecs[n_read_vecs].iov_base = pending->response_data;
+      read_vecs[n_read_vecs++].iov_len = pending->response_data_size;
+    }
+
+  read_size = TEMP_FAILURE_RETRY (readv (writer_socket, read_vecs, n_read_vecs));
+  if (read_size == -1)
+    {
+      g_printerr ("Read from socket returned error %d\n", errno);
+      return FALSE;
+    }
+
+  if (read_size < sizeof (RevokefsResponse))
+    {
+      g_printerr ("Invalid read size %zd\n", read_size);
+      return FALSE;
+    }
+
+  g_mutex_lock (&mutex);
+  pending->response_size = read_size;
+  pending->done = TRUE;
+  g_mutex_unlock (&mutex);
+
+  return TRUE;
+}
 
 static ssize_t
 do_request (int writer_socket,
@@ -58,13 +157,10 @@ do_request (int writer_socket,
             size_t response_data_size)
 {
   size_t request_size;
-  size_t response_max_size;
-  ssize_t written_size, read_size;
+  ssize_t written_size;
   struct iovec write_vecs[3] = {};
   int n_write_vecs = 0;
-  struct iovec read_vecs[2] = {};
-  int n_read_vecs = 0;
-  g_autoptr(GMutexLocker) locker = NULL;
+  PendingRequest pending = { 0, };
 
   request_size = sizeof (RevokefsRequest);
   write_vecs[n_write_vecs].iov_base = (char *)request;
@@ -84,44 +180,69 @@ do_request (int writer_socket,
       request_size += data2_size;
     }
 
-  locker = g_mutex_locker_new (&mutex);
+  pending.response = response;
+  pending.response_data = response_data;
+  pending.response_data_size = response_data_size;
+
+  g_mutex_lock (&mutex);
+  if (pending_requests == NULL)
+    pending_requests = g_hash_table_new (g_direct_hash, g_direct_equal);
+  request->id = pending.id = ++next_request_id;
+  g_hash_table_insert (pending_requests, GUINT_TO_POINTER (pending.id), &pending);
+  g_mutex_unlock (&mutex);
+
+  /* The socket is SOCK_SEQPACKET, so each request is written atomically
+     even with other threads writing at the same time */
   written_size = TEMP_FAILURE_RETRY (writev (writer_socket, write_vecs, n_write_vecs));
   if (written_size == -1)
-    {
-      g_printerr ("Write to socket returned error %d\n", errno);
-      return -1;
-    }
-  if (written_size != request_size)
-    {
-      g_printerr ("Partial Write to socket\n");
-      return -1;
-    }
+    g_printerr ("Write to socket returned error %d\n", errno);
+  else if (written_size != request_size)
+    g_printerr ("Partial Write to socket\n");
 
-  response_max_size = sizeof (RevokefsResponse);
-  read_vecs[n_read_vecs].iov_base = (char *)response;
-  read_vecs[n_read_vecs++].iov_len = response_max_size;
+  g_mutex_lock (&mutex);
 
-  if (response_data)
+  if (written_size == request_size)
     {
-      read_vecs[n_read_vecs].iov_base = response_data;
-      read_vecs[n_read_vecs++].iov_len = response_data_size;
-      response_max_size += response_data_size;
+      while (!pending.done && !pending.failed)
+        {
+          gboolean ok;
+
+          if (reading_responses)
+            {
+              g_cond_wait (&cond, &mutex);
+              continue;
+            }
+
+          reading_responses = TRUE;
+          g_mutex_unlock (&mutex);
+
+          ok = read_one_response (writer_socket);
+
+          g_mutex_lock (&mutex);
+          reading_responses = FALSE;
+          if (!ok)
+            {
+              GHashTableIter iter;
+              gpointer value;
+
+              /* We don't know whose response went missing, so fail all
+                 the requests that are waiting. Later requests can still
+                 succeed, unless the socket is really gone. */
+              g_hash_table_iter_init (&iter, pending_requests);
+              while (g_hash_table_iter_next (&iter, NULL, &value))
+                ((PendingRequest *) value)->failed = TRUE;
+            }
+          g_cond_broadcast (&cond);
+        }
     }
 
-  read_size = TEMP_FAILURE_RETRY (readv (writer_socket, read_vecs, n_read_vecs));
-  if (read_size == -1)
-    {
-      g_printerr ("Read from socket returned error %d\n", errno);
-      return -1;
-    }
+  g_hash_table_remove (pending_requests, GUINT_TO_POINTER (pending.id));
+  g_mutex_unlock (&mutex);
 
-  if (read_size < sizeof (RevokefsResponse))
-    {
-      g_printerr ("Invalid read size %zd\n", read_size);
-      return -1;
-    }
+  if (!pending.done)
+    return -1;
 
-  return read_size - sizeof (RevokefsResponse);
+  return pending.response_size - sizeof (RevokefsResponse);
 }
 
 static int
@@ -272,6 +393,22 @@ get_valid_2path (RevokefsRequest *request,
   *path2 = get_valid_path (request->data + request->arg1, data_size - request->arg1);
 }
 
+static gboolean
+has_outstanding_fd (int fd)
+{
+  g_autoptr(GMutexLocker) locker = g_mutex_locker_new (&outstanding_fds_mutex);
+
+  return g_hash_table_lookup (outstanding_fds, GUINT_TO_POINTER(fd)) != NULL;
+}
+
+static gboolean
+remove_outstanding_fd (int fd)
+{
+  g_autoptr(GMutexLocker) locker = g_mutex_locker_new (&outstanding_fds_mutex);
+
+  return g_hash_table_remove (outstanding_fds, GUINT_TO_POINTER(fd));
+}
+
 static ssize_t
 handle_mkdir (RevokefsRequest *request,
               gsize data_size,
@@ -546,7 +683,9 @@ handle_open (RevokefsRequest *request,
 
       if (response->result == 0)
         {
+          g_mutex_lock (&outstanding_fds_mutex);
           g_hash_table_insert (outstanding_fds, GUINT_TO_POINTER(fd), GUINT_TO_POINTER(1));
+          g_mutex_unlock (&outstanding_fds_mutex);
           response->result = fd;
         }
       else
@@ -575,7 +714,7 @@ handle_read (RevokefsRequest *request,
   if (size > MAX_DATA_SIZE)
     size = MAX_DATA_SIZE;
 
-  if (g_hash_table_lookup (outstanding_fds, GUINT_TO_POINTER(fd)) == NULL)
+  if (!has_outstanding_fd (fd))
     {
       response->result = -EBADFD;
       return 0;
@@ -597,20 +736,34 @@ handle_read (RevokefsRequest *request,
 int
 request_read (int writer_socket, int fd, char *buf, size_t size, off_t offset)
 {
-  RevokefsRequest request = { REVOKE_FS_READ };
-  RevokefsResponse response;
-  ssize_t response_data_len;
+  size_t total = 0;
 
-  request.arg1 = fd;
-  request.arg2 = size;
-  request.arg3 = offset;
-
-  response_data_len = do_request (writer_socket, &request, NULL, 0, NULL, 0,
-                                  &response, buf, size);
-  if (response_data_len < 0)
-    return -EIO;
+  /* Split reads larger than what fits in a response */
+  while (total < size)
+    {
+      RevokefsRequest request = { REVOKE_FS_READ };
+      RevokefsResponse response;
+      ssize_t response_data_len;
+      size_t chunk = MIN (size - total, MAX_DATA_SIZE);
+
+      request.arg1 = fd;
+      request.arg2 = chunk;
+      request.arg3 = offset + total;
+
+      response_data_len = do_request (writer_socket, &request, NULL, 0, NULL, 0,
+                                      &response, buf + total, chunk);
+      if (response_data_len < 0)
+        return total > 0 ? (int) total : -EIO;
+
+      if (response.result < 0)
+        return total > 0 ? (int) total : response.result;
+
+      total += response.result;
+      if ((size_t) response.result < chunk)
+        break;
+    }
 
-  return response.result;
+  return total;
 }
 
 static ssize_t
@@ -622,7 +775,7 @@ handle_write (RevokefsRequest *request,
   int fd = request->arg1;
   off_t offset = request->arg2;
 
-  if (g_hash_table_lookup (outstanding_fds, GUINT_TO_POINTER(fd)) == NULL)
+  if (!has_outstanding_fd (fd))
     {
       response->result = -EBADFD;
       return 0;
@@ -640,22 +793,33 @@ handle_write (RevokefsRequest *request,
 int
 request_write (int writer_socket, int fd, const char *buf, size_t size, off_t offset)
 {
-  RevokefsRequest request = { REVOKE_FS_WRITE };
-  RevokefsResponse response;
-  ssize_t response_data_len;
+  size_t total = 0;
 
-  if (size > MAX_DATA_SIZE)
-    size = MAX_DATA_SIZE;
+  /* Split writes larger than what fits in a request */
+  while (total < size)
+    {
+      RevokefsRequest request = { REVOKE_FS_WRITE };
+      RevokefsResponse response;
+      ssize_t response_data_len;
+      size_t chunk = MIN (size - total, MAX_DATA_SIZE);
 
-  request.arg1 = fd;
-  request.arg2 = offset;
+      request.arg1 = fd;
+      request.arg2 = offset + total;
 
-  response_data_len = do_request (writer_socket, &request, buf, size, NULL, 0,
-                                  &response, NULL, 0);
-  if (response_data_len < 0)
-    return -EIO;
+      response_data_len = do_request (writer_socket, &request, buf + total, chunk, NULL, 0,
+                                      &response, NULL, 0);
+      if (response_data_len < 0)
+        return total > 0 ? (int) total : -EIO;
 
-  return response.result;
+      if (response.result < 0)
+        return total > 0 ? (int) total : response.result;
+
+      total += response.result;
+      if ((size_t) response.result < chunk)
+        break;
+    }
+
+  return total;
 }
 
 static ssize_t
@@ -666,7 +830,7 @@ handle_fsync (RevokefsRequest *request,
   int r;
   int fd = request->arg1;
 
-  if (g_hash_table_lookup (outstanding_fds, GUINT_TO_POINTER(fd)) == NULL)
+  if (!has_outstanding_fd (fd))
     {
       response->result = -EBADFD;
       return 0;
@@ -705,7 +869,7 @@ handle_close (RevokefsRequest *request,
 {
   int fd = request->arg1;
 
-  if (!g_hash_table_remove (outstanding_fds, GUINT_TO_POINTER(fd)))
+  if (!remove_outstanding_fd (fd))
     {
       response->result = -EBADFD;
       return 0;
@@ -758,23 +922,116 @@ request_access (int writer_socket, const char *path, int mode)
   return request_path_int (writer_socket, REVOKE_FS_ACCESS, path, mode);
 }
 
+typedef struct {
+  int fuse_socket;
+  ssize_t data_size;
+  RevokefsRequest request;
+} WriterRequest;
+
+static ssize_t
+handle_request (RevokefsRequest *request,
+                gsize data_size,
+                RevokefsResponse *response)
+{
+  switch (request->op)
+    {
+    case REVOKE_FS_MKDIR:
+      return handle_mkdir (request, data_size, response);
+    case REVOKE_FS_RMDIR:
+      return handle_rmdir (request, data_size, response);
+    case REVOKE_FS_UNLINK:
+      return handle_unlink (request, data_size, response);
+    case REVOKE_FS_SYMLINK:
+      return handle_symlink (request, data_size, response);
+    case REVOKE_FS_LINK:
+      return handle_link (request, data_size, response);
+    case REVOKE_FS_RENAME:
+      return handle_rename (request, data_size, response);
+    case REVOKE_FS_CHMOD:
+      return handle_chmod (request, data_size, response);
+    case REVOKE_FS_CHOWN:
+      return handle_chown (request, data_size, response);
+    case REVOKE_FS_TRUNCATE:
+      return handle_truncate (request, data_size, response);
+    case REVOKE_FS_UTIMENS:
+      return handle_utimens (request, data_size, response);
+    case REVOKE_FS_OPEN:
+      return handle_open (request, data_size, response);
+    case REVOKE_FS_READ:
+      return handle_read (request, data_size, response);
+    case REVOKE_FS_WRITE:
+      return handle_write (request, data_size, response);
+    case REVOKE_FS_FSYNC:
+      return handle_fsync (request, data_size, response);
+    case REVOKE_FS_CLOSE:
+      return handle_close (request, data_size, response);
+    case REVOKE_FS_ACCESS:
+      return handle_access (request, data_size, response);
+    default:
+      g_printerr ("Invalid request op %d", (guint) request->op);
+      exit (1);
+    }
+}
+
+static void
+writer_thread (gpointer data,
+               gpointer user_data)
+{
+  WriterRequest *wrequest = data;
+  RevokefsRequest *request = &wrequest->request;
+  g_autofree guchar *response_buffer = g_malloc0 (MAX_RESPONSE_SIZE);
+  RevokefsResponse *response = (RevokefsResponse *)response_buffer;
+  ssize_t response_data_size, response_size, written_size;
+
+  response->id = request->id;
+  response_data_size = handle_request (request, wrequest->data_size, response);
+
+  if (response_data_size < 0 || response_data_size > MAX_DATA_SIZE)
+    {
+      g_printerr ("Invalid response size %zd", response_data_size);
+      exit (1);
+    }
+
+  response_size = RESPONSE_SIZE(response_data_size);
+
+  /* Responses are single SOCK_SEQPACKET messages, so the threads
+     can write them without further locking */
+  written_size = TEMP_FAILURE_RETRY (write (wrequest->fuse_socket, response_buffer, response_size));
+  if (written_size == -1)
+    {
+      perror ("Got error writing to fuse socket: ");
+      exit (1);
+    }
+
+  if (written_size != response_size)
+    {
+      g_printerr ("Got partial write to fuse socket");
+      exit (1);
+    }
+
+  g_free (wrequest);
+}
+
 void
 do_writer (int basefd_arg,
            int fuse_socket,
            int exit_with_fd)
 {
-  guchar request_buffer[MAX_REQUEST_SIZE];
-  RevokefsRequest *request = (RevokefsRequest *)&request_buffer;
-  guchar response_buffer[MAX_RESPONSE_SIZE];
-  RevokefsResponse *response = (RevokefsResponse *)&response_buffer;
+  GThreadPool *pool;
 
   basefd = basefd_arg;
   outstanding_fds = g_hash_table_new (g_direct_hash, g_direct_equal);
 
+  setup_socket (fuse_socket);
+
+  /* The requests are independent, as the fuse side only sends a
+     request once all the ones it depends on got a response */
+  pool = g_thread_pool_new (writer_thread, NULL, WRITER_THREADS, FALSE, NULL);
+
   while (1)
     {
-      ssize_t data_size, size;
-      ssize_t response_data_size, response_size, written_size;
+      WriterRequest *wrequest;
+      ssize_t size;
       int res;
       struct pollfd pollfds[2] =  {
          {fuse_socket, POLLIN, 0 },
@@ -797,7 +1054,10 @@ do_writer (int basefd_arg,
       if ((pollfds[0].revents & POLLIN) == 0)
         continue;
 
-      size = TEMP_FAILURE_RETRY (read (fuse_socket, request_buffer, sizeof (request_buffer)));
+      wrequest = g_malloc (G_STRUCT_OFFSET (WriterRequest, request) + MAX_REQUEST_SIZE);
+      wrequest->fuse_socket = fuse_socket;
+
+      size = TEMP_FAILURE_RETRY (read (fuse_socket, &wrequest->request, MAX_REQUEST_SIZE));
       if (size == -1)
         {
           perror ("Got error reading from fuse socket: ");
@@ -816,83 +1076,7 @@ do_writer (int basefd_arg,
           exit (1);
         }
 
-      data_size = size - sizeof (RevokefsRequest);
-      memset (response_buffer, 0, sizeof(RevokefsResponse));
-
-      switch (request->op)
-        {
-        case REVOKE_FS_MKDIR:
-          response_data_size = handle_mkdir (request, data_size, response);
-          break;
-        case REVOKE_FS_RMDIR:
-          response_data_size = handle_rmdir (request, data_size, response);
-          break;
-        case REVOKE_FS_UNLINK:
-          response_data_size = handle_unlink (request, data_size, response);
-          break;
-        case REVOKE_FS_SYMLINK:
-          response_data_size = handle_symlink (request, data_size, response);
-          break;
-        case REVOKE_FS_LINK:
-          response_data_size = handle_link (request, data_size, response);
-          break;
-        case REVOKE_FS_RENAME:
-          response_data_size = handle_rename (request, data_size, response);
-          break;
-        case REVOKE_FS_CHMOD:
-          response_data_size = handle_chmod (request, data_size, response);
-          break;
-        case REVOKE_FS_CHOWN:
-          response_data_size = handle_chown (request, data_size, response);
-          break;
-        case REVOKE_FS_TRUNCATE:
-          response_data_size = handle_truncate (request, data_size, response);
-          break;
-        case REVOKE_FS_UTIMENS:
-          response_data_size = handle_utimens (request, data_size, response);
-          break;
-        case REVOKE_FS_OPEN:
-          response_data_size = handle_open (request, data_size, response);
-          break;
-        case REVOKE_FS_READ:
-          response_data_size = handle_read (request, data_size, response);
-          break;
-        case REVOKE_FS_WRITE:
-          response_data_size = handle_write (request, data_size, response);
-          break;
-        case REVOKE_FS_FSYNC:
-          response_data_size = handle_fsync (request, data_size, response);
-          break;
-        case REVOKE_FS_CLOSE:
-          response_data_size = handle_close (request, data_size, response);
-          break;
-        case REVOKE_FS_ACCESS:
-          response_data_size = handle_access (request, data_size, response);
-          break;
-        default:
-          g_printerr ("Invalid request op %d", (guint) request->op);
-          exit (1);
-        }
-
-      if (response_data_size < 0 || response_data_size > MAX_DATA_SIZE)
-        {
-          g_printerr ("Invalid response size %ld", response_size);
-          exit (1);
-        }
-
-      response_size = RESPONSE_SIZE(response_data_size);
-
-      written_size = TEMP_FAILURE_RETRY (write (fuse_socket, response_buffer, response_size));
-      if (written_size == -1)
-        {
-          perror ("Got error writing to fuse socket: ");
-          exit (1);
-        }
-
-      if (written_size != response_size)
-        {
-          g_printerr ("Got partial write to fuse socket");
-          exit (1);
-        }
+      wrequest->data_size = size - sizeof (RevokefsRequest);
+      g_thread_pool_push (pool, wrequest, NULL);
     }
 }
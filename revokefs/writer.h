@@ -39,6 +39,7 @@ int request_fsync (int writer_socket, int fd);
 int request_close (int writer_socket, int fd);
 int request_access (int writer_socket, const char *path, int mode);
 
+void  setup_socket (int socket);
 void  do_writer (int basefd, int socket, int exit_with_fd);
 
 
@@ -61,8 +62,12 @@ typedef enum {
   REVOKE_FS_ACCESS,
 } RevokefsOps;
 
+/* Each request carries an id that is echoed in the response, so that
+ * multiple requests can be in flight on the socket at the same time,
+ * and the responses can come back in any order. */
 typedef struct {
   guint32 op;
+  guint32 id;
   guint64 arg1;
   guint64 arg2;
   guint64 arg3;
@@ -71,6 +76,7 @@ typedef struct {
 
 typedef struct {
   gint32 result;
+  guint32 id;
 
   guchar data[];
 } RevokefsResponse;
@@ -78,7 +84,8 @@ typedef struct {
 #define REQUEST_SIZE(__data_size) (sizeof(RevokefsRequest) + (__data_size))
 #define RESPONSE_SIZE(__data_size) (sizeof(RevokefsResponse) + (__data_size))
 
-#define MAX_DATA_SIZE 16384
+/* Matches the largest write fuse does with big_writes */
+#define MAX_DATA_SIZE (128 * 1024)
 #define MAX_REQUEST_SIZE REQUEST_SIZE(MAX_DATA_SIZE)
 #define MAX_RESPONSE_SIZE RESPONSE_SIZE(MAX_DATA_SIZE)
 
@@ -632,6 +632,7 @@ handle_deploy (FlatpakSystemHelper   *object,
                                              arg_origin,
                                              arg_ref,
                                              (const char **) arg_subpaths,
+                                             ongoing_pull != NULL,
                                              ostree_progress,
                                              NULL, &error))
         {
@@ -859,6 +860,7 @@ handle_deploy_appstream (FlatpakSystemHelper   *object,
                                              arg_origin,
                                              new_branch,
                                              NULL,
+                                             FALSE,
                                              ostree_progress,
                                              NULL, &first_error))
         {
@@ -866,6 +868,7 @@ handle_deploy_appstream (FlatpakSystemHelper   *object,
                                                  arg_origin,
                                                  old_branch,
                                                  NULL,
+                                                 FALSE,
                                                  ostree_progress,
                                                  NULL, &second_error))
             {
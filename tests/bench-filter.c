@@ -0,0 +1,159 @@
+/*
+ * SPDX-License-Identifier: LGPL-2.0+
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* Compares matching refs against a remote filter compiled to a
+ * FlatpakFilter with the single anchored regexp that was used before. */
+
+#include "config.h"
+
+#include <stdlib.h>
+
+#include <glib.h>
+
+#include "flatpak-utils-private.h"
+
+static int opt_globs = 200;
+static int opt_refs = 20000;
+static int opt_rounds = 10;
+
+static GOptionEntry options[] = {
+  { "globs", 0, 0, G_OPTION_ARG_INT, &opt_globs, "Number of globs in the filter", "N" },
+  { "refs", 0, 0, G_OPTION_ARG_INT, &opt_refs, "Number of refs to match", "N" },
+  { "rounds", 0, 0, G_OPTION_ARG_INT, &opt_rounds, "Number of times to match each ref", "N" },
+  { NULL }
+};
+
+static const char *arches[] = { "x86_64", "aarch64", "arm", "i386" };
+static const char *branches[] = { "stable", "beta", "master", "1.0", "20.08" };
+
+static char *
+make_glob (GRand *rand, int i)
+{
+  switch (g_rand_int_range (rand, 0, 4))
+    {
+    case 0:
+      return g_strdup_printf ("org.vendor%d.App%d", i % 50, i);
+    case 1:
+      return g_strdup_printf ("app/org.vendor%d.*", i % 50);
+    case 2:
+      return g_strdup_printf ("runtime/org.vendor%d.Platform*/%s", i % 50,
+                              arches[g_rand_int_range (rand, 0, G_N_ELEMENTS (arches))]);
+    default:
+      return g_strdup_printf ("org.vendor%d.App%d//%s", i % 50, i,
+                              branches[g_rand_int_range (rand, 0, G_N_ELEMENTS (branches))]);
+    }
+}
+
+static char *
+make_ref (GRand *rand)
+{
+  int vendor = g_rand_int_range (rand, 0, 100);
+
+  return g_strdup_printf ("%s/org.vendor%d.%s%d/%s/%s",
+                          g_rand_boolean (rand) ? "app" : "runtime",
+                          vendor,
+                          g_rand_boolean (rand) ? "App" : "Platform",
+                          g_rand_int_range (rand, 0, opt_globs),
+                          arches[g_rand_int_range (rand, 0, G_N_ELEMENTS (arches))],
+                          branches[g_rand_int_range (rand, 0, G_N_ELEMENTS (branches))]);
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_autoptr(GOptionContext) context = g_option_context_new ("- Benchmark remote filter matching");
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GRand) rand = g_rand_new_with_seed (42);
+  g_autoptr(GPtrArray) refs = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr(GString) regexp = g_string_new ("^(");
+  g_autoptr(FlatpakFilter) filter = flatpak_filter_new ();
+  g_autoptr(GRegex) regex = NULL;
+  gint64 start, regex_time, filter_time;
+  int regex_matches = 0, filter_matches = 0;
+  int i, round;
+  guint j;
+
+  g_option_context_add_main_entries (context, options, NULL);
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      exit (EXIT_FAILURE);
+    }
+
+  if (opt_globs < 1 || opt_refs < 1 || opt_rounds < 1)
+    {
+      g_printerr ("Usage: bench-filter [OPTION…]\n");
+      exit (EXIT_FAILURE);
+    }
+
+  for (i = 0; i < opt_globs; i++)
+    {
+      g_autofree char *glob = make_glob (rand, i);
+      g_autofree char *glob_regexp = flatpak_filter_glob_to_regexp (glob, &error);
+
+      if (glob_regexp == NULL || !flatpak_filter_add_glob (filter, glob, &error))
+        g_error ("Invalid glob %s: %s", glob, error->message);
+
+      if (i != 0)
+        g_string_append_c (regexp, '|');
+      g_string_append (regexp, glob_regexp);
+    }
+  g_string_append (regexp, ")$");
+
+  regex = g_regex_new (regexp->str, G_REGEX_DOLLAR_ENDONLY | G_REGEX_RAW | G_REGEX_OPTIMIZE, G_REGEX_MATCH_ANCHORED, &error);
+  if (regex == NULL)
+    g_error ("Invalid regexp: %s", error->message);
+
+  for (i = 0; i < opt_refs; i++)
+    g_ptr_array_add (refs, make_ref (rand));
+
+  start = g_get_monotonic_time ();
+  for (round = 0; round < opt_rounds; round++)
+    for (j = 0; j < refs->len; j++)
+      regex_matches += g_regex_match (regex, g_ptr_array_index (refs, j), 0, NULL);
+  regex_time = g_get_monotonic_time () - start;
+
+  start = g_get_monotonic_time ();
+  for (round = 0; round < opt_rounds; round++)
+    for (j = 0; j < refs->len; j++)
+      filter_matches += flatpak_filter_match (filter, g_ptr_array_index (refs, j));
+  filter_time = g_get_monotonic_time () - start;
+
+  for (j = 0; j < refs->len; j++)
+    {
+      const char *ref = g_ptr_array_index (refs, j);
+      gboolean regex_match = g_regex_match (regex, ref, 0, NULL);
+      gboolean filter_match = flatpak_filter_match (filter, ref);
+
+      if (regex_match != filter_match)
+        g_error ("Mismatch for %s: regexp %s, filter %s", ref,
+                 regex_match ? "matched" : "didn't match",
+                 filter_match ? "matched" : "didn't match");
+    }
+  g_assert_cmpint (regex_matches, ==, filter_matches);
+
+  g_print ("%d globs, %d refs x %d rounds, %d matches\n",
+           opt_globs, opt_refs, opt_rounds, filter_matches / opt_rounds);
+  g_print ("regexp: %.3f s (%.0f ns/ref)\n",
+           regex_time / (double) G_USEC_PER_SEC, regex_time * 1000.0 / ((double) opt_refs * opt_rounds));
+  g_print ("filter: %.3f s (%.0f ns/ref)\n",
+           filter_time / (double) G_USEC_PER_SEC, filter_time * 1000.0 / ((double) opt_refs * opt_rounds));
+
+  return 0;
+}
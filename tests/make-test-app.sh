@@ -101,6 +101,8 @@ gzip -c > ${DIR}/files/share/app-info/xmls/${APP_ID}.xml.gz <<EOF
     <id>$APP_ID.desktop</id>
     <name>Hello world test app: $APP_ID</name>
     <summary>Print a greeting</summary>
+    <name xml:lang="de">Hallo Welt Testanwendung: $APP_ID</name>
+    <summary xml:lang="de">Einen Gruß ausgeben</summary>
     <description><p>This is a test app.</p></description>
     <categories>
       <category>Utility</category>
@@ -27,7 +27,7 @@ set -euo pipefail
 skip_without_bwrap
 skip_revokefs_without_fuse
 
-echo "1..5"
+echo "1..8"
 
 # Configure a repository, then set a collection ID on it and check that the ID
 # is saved in the config file.
@@ -67,3 +67,53 @@ ${FLATPAK} build-update-repo --default-branch=no-such-branch repos/test
 assert_file_has_content repos/test/config '^default-branch=no-such-branch$'
 
 echo "ok can update default branch"
+
+# Dropping the summary leaves only the on-disk commit data cache to reuse
+${FLATPAK} build-update-repo repos/test
+assert_has_file repos/test/tmp/cache/flatpak-commit-data
+ostree --repo=repos/test summary --view | grep -v last-modified > summary-before
+
+rm -f repos/test/summary repos/test/summary.sig
+${FLATPAK} build-update-repo -v repos/test 2> build-update-repo-log
+assert_file_has_content build-update-repo-log 'Collected commit data for [0-9]* refs in .* seconds: [1-9][0-9]* reused, 0 computed'
+ostree --repo=repos/test summary --view | grep -v last-modified > summary-after
+diff -u summary-before summary-after
+
+echo "ok summary update reuses commit data cache"
+
+# A corrupt cache is ignored and regenerated
+echo "garbage" > repos/test/tmp/cache/flatpak-commit-data
+rm -f repos/test/summary repos/test/summary.sig
+${FLATPAK} build-update-repo -v repos/test 2> build-update-repo-log
+assert_file_has_content build-update-repo-log 'Collected commit data for [0-9]* refs in .* seconds: 0 reused, [1-9][0-9]* computed'
+ostree --repo=repos/test summary --view | grep -v last-modified > summary-after
+diff -u summary-before summary-after
+
+${FLATPAK} build-update-repo -v repos/test 2> build-update-repo-log
+assert_file_has_content build-update-repo-log 'seconds: [1-9][0-9]* reused, 0 computed'
+
+echo "ok summary update recovers from corrupt commit data cache"
+
+# Extracting the appstream of several apps in parallel gives the same
+# result as reusing the extracted data
+for i in 1 2 3 4 5 6; do
+    $(dirname $0)/make-test-app.sh repos/test org.test.Parallel$i master "" > /dev/null
+done
+
+rm -rf repos/test/tmp/cache/flatpak-appstream
+${FLATPAK} build-update-repo repos/test
+ostree --repo=repos/test cat appstream2/$ARCH /appstream.xml > appstream-extracted
+ostree --repo=repos/test ls -R appstream2/$ARCH /icons > icons-extracted
+for i in 1 2 3 4 5 6; do
+    assert_file_has_content appstream-extracted "<id>org\.test\.Parallel$i\.desktop</id>"
+    assert_file_has_content icons-extracted "/64x64/org\.test\.Parallel$i\.png$"
+done
+assert_file_has_content appstream-extracted '<id>org\.test\.Hello\.desktop</id>'
+
+${FLATPAK} build-update-repo repos/test
+ostree --repo=repos/test cat appstream2/$ARCH /appstream.xml > appstream-cached
+ostree --repo=repos/test ls -R appstream2/$ARCH /icons > icons-cached
+diff -u appstream-extracted appstream-cached
+diff -u icons-extracted icons-cached
+
+echo "ok appstream extracted in parallel"
@@ -0,0 +1,103 @@
+#!/bin/bash
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 02111-1307, USA.
+
+set -euo pipefail
+
+. $(dirname $0)/libtest.sh
+
+skip_without_bwrap
+skip_revokefs_without_fuse
+
+echo "1..5"
+
+setup_repo
+install_repo
+
+# The extra data is served next to the repo
+seq 1 20000 > repos/extra-payload
+EXTRA_SHA256=$(sha256sum repos/extra-payload | cut -d ' ' -f 1)
+EXTRA_SIZE=$(stat -c %s repos/extra-payload)
+EXTRA_CACHE=$FL_DIR/repo/tmp/cache/extra-data
+port=$(cat httpd-port)
+
+BUILD_FINISH_ARGS="--extra-data=payload:${EXTRA_SHA256}:${EXTRA_SIZE}:${EXTRA_SIZE}:http://127.0.0.1:${port}/extra-payload" \
+    GPGARGS="${FL_GPGARGS}" $(dirname $0)/make-test-app.sh repos/test org.test.Extra master "${COLLECTION_ID}" > /dev/null
+update_repo
+
+${FLATPAK} ${U} install -y test-repo org.test.Extra
+cmp repos/extra-payload $FL_DIR/app/org.test.Extra/$ARCH/master/active/files/extra/payload
+
+echo "ok install extra-data app"
+
+# Deploying the commit again needs the extra data that was downloaded
+# for it, without pulling
+${FLATPAK} ${U} uninstall -y --keep-ref org.test.Extra
+assert_not_has_dir $FL_DIR/app/org.test.Extra/$ARCH/master/active
+if [ x${U} == x--user ]; then
+    assert_has_file $EXTRA_CACHE/$EXTRA_SHA256
+fi
+
+${FLATPAK} ${U} install -y --no-pull test-repo org.test.Extra
+cmp repos/extra-payload $FL_DIR/app/org.test.Extra/$ARCH/master/active/files/extra/payload
+
+echo "ok redeploy extra-data app without pulling"
+
+# Unused and partial downloads are dropped when pruning
+mkdir -p $EXTRA_CACHE
+LEAKED_SHA256=$(echo leaked | sha256sum | cut -d ' ' -f 1)
+echo leaked > $EXTRA_CACHE/$LEAKED_SHA256.partial
+
+${FLATPAK} ${U} uninstall -y org.test.Extra
+assert_not_has_file $EXTRA_CACHE/$LEAKED_SHA256.partial
+assert_not_has_file $EXTRA_CACHE/$EXTRA_SHA256
+
+echo "ok prune extra-data cache"
+
+# Several extra-data files are fetched at the same time
+seq 20001 40000 > repos/extra-payload2
+EXTRA2_SHA256=$(sha256sum repos/extra-payload2 | cut -d ' ' -f 1)
+EXTRA2_SIZE=$(stat -c %s repos/extra-payload2)
+
+BUILD_FINISH_ARGS="--extra-data=payload:${EXTRA_SHA256}:${EXTRA_SIZE}:${EXTRA_SIZE}:http://127.0.0.1:${port}/extra-payload --extra-data=payload2:${EXTRA2_SHA256}:${EXTRA2_SIZE}:${EXTRA2_SIZE}:http://127.0.0.1:${port}/extra-payload2" \
+    GPGARGS="${FL_GPGARGS}" $(dirname $0)/make-test-app.sh repos/test org.test.Extra master "${COLLECTION_ID}" > /dev/null
+update_repo
+
+${FLATPAK} ${U} install -y test-repo org.test.Extra
+cmp repos/extra-payload $FL_DIR/app/org.test.Extra/$ARCH/master/active/files/extra/payload
+cmp repos/extra-payload2 $FL_DIR/app/org.test.Extra/$ARCH/master/active/files/extra/payload2
+
+echo "ok install app with several extra-data files"
+
+# Entries with the same checksum share one download, and a partial
+# download that another process holds the lock on is left alone
+${FLATPAK} ${U} uninstall -y org.test.Extra
+
+BUILD_FINISH_ARGS="--extra-data=payload:${EXTRA_SHA256}:${EXTRA_SIZE}:${EXTRA_SIZE}:http://127.0.0.1:${port}/extra-payload --extra-data=payload-copy:${EXTRA_SHA256}:${EXTRA_SIZE}:${EXTRA_SIZE}:http://127.0.0.1:${port}/extra-payload" \
+    GPGARGS="${FL_GPGARGS}" $(dirname $0)/make-test-app.sh repos/test org.test.Extra master "${COLLECTION_ID}" > /dev/null
+update_repo
+
+${FLATPAK} ${U} install -y test-repo org.test.Extra
+cmp repos/extra-payload $FL_DIR/app/org.test.Extra/$ARCH/master/active/files/extra/payload
+cmp repos/extra-payload $FL_DIR/app/org.test.Extra/$ARCH/master/active/files/extra/payload-copy
+
+mkdir -p $EXTRA_CACHE
+LOCKED_SHA256=$(echo locked | sha256sum | cut -d ' ' -f 1)
+echo locked > $EXTRA_CACHE/$LOCKED_SHA256.partial
+flock $EXTRA_CACHE/$LOCKED_SHA256.partial ${FLATPAK} ${U} uninstall -y org.test.Extra
+assert_has_file $EXTRA_CACHE/$LOCKED_SHA256.partial
+
+echo "ok share downloads of the same extra-data"
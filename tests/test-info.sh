@@ -6,7 +6,7 @@ set -euo pipefail
 
 skip_revokefs_without_fuse
 
-echo "1..7"
+echo "1..8"
 
 setup_repo
 install_repo
@@ -54,3 +54,32 @@ ${FLATPAK} info --file-access=home org.test.Hello > info
 assert_file_has_content info "^hidden$"
 
 echo "ok info --file-access"
+
+# The deploy index is rebuilt from all deploys when it is missing, and
+# gives the same results as the deploy files
+assert_has_file $FL_DIR/.deploy-index
+rm $FL_DIR/.deploy-index
+${FLATPAK} ${U} list -v --columns=ref,origin,commit > list-rebuilt 2> list-log
+assert_file_has_content list-log "Rebuilt deploy index"
+assert_file_has_content list-rebuilt "^app/org\.test\.Hello/"
+assert_file_has_content list-rebuilt "^runtime/org\.test\.Platform/"
+assert_has_file $FL_DIR/.deploy-index
+
+${FLATPAK} ${U} list -v --columns=ref,origin,commit > list-indexed 2> list-log
+assert_not_file_has_content list-log "Rebuilt deploy index"
+diff -u list-rebuilt list-indexed
+
+# Entries for a changed active deploy are not used
+ACTIVE=$FL_DIR/app/org.test.Hello/$ARCH/master/active
+ln -sfn $(readlink $ACTIVE) $ACTIVE
+${FLATPAK} ${U} list --columns=ref,origin,commit > list-changed
+diff -u list-rebuilt list-changed
+
+# Uninstalling updates the index
+${FLATPAK} ${U} uninstall -y org.test.Hello
+${FLATPAK} ${U} list -v --columns=ref > list-uninstalled 2> list-log
+assert_not_file_has_content list-log "Rebuilt deploy index"
+assert_not_file_has_content list-uninstalled "org\.test\.Hello/"
+assert_file_has_content list-uninstalled "^runtime/org\.test\.Platform/"
+
+echo "ok deploy index"
@@ -23,7 +23,7 @@ set -euo pipefail
 
 skip_without_bwrap
 
-echo "1..14"
+echo "1..16"
 
 if [ x${USE_OCI_LABELS-} == xyes ] ; then
     URI_SUFFIX="?index=labels"
@@ -249,3 +249,51 @@ assert_file_has_content remotes-list "^hello-origin.*[ 	]http://127\.0\.0\.1:${p
 assert_not_has_file $base/oci/hello-origin.index.gz
 
 echo "ok change remote origin via bundle"
+
+# Push an app image with a zstd-compressed layer and install it
+
+${FLATPAK} ${U} -y uninstall org.test.Hello
+
+if ${FLATPAK} build-bundle ${BUILD_BUNDLE_FLAGS} --oci --oci-compression=zstd $FL_GPGARGS repos/oci oci/app-image-zstd org.test.Hello 2> zstd-error; then
+    grep -l 'tar+zstd' oci/app-image-zstd/blobs/sha256/* > /dev/null
+
+    $client add hello latest $(pwd)/oci/app-image-zstd
+    ${FLATPAK} remote-add ${U} oci-registry "oci+http://127.0.0.1:${port}${URI_SUFFIX}"
+    ${FLATPAK} ${U} install -y oci-registry org.test.Hello
+
+    run org.test.Hello > hello_out
+    assert_file_has_content hello_out '^Hello world, from a sandbox'
+
+    echo "ok install zstd layer"
+else
+    assert_file_has_content zstd-error "not supported"
+    echo "ok install zstd layer # skip zstd not supported"
+fi
+
+# Serve an app image with a corrupted layer, which must be rejected on
+# its digest before anything from it is imported
+
+if ${FLATPAK} ${U} info org.test.Hello > /dev/null 2>&1; then
+    ${FLATPAK} ${U} -y uninstall org.test.Hello
+fi
+
+rm -rf oci/app-image-bad
+cp -r oci/app-image oci/app-image-bad
+for blob in oci/app-image-bad/blobs/sha256/*; do
+    if gzip -t $blob 2>/dev/null; then
+        printf 'XXXX' | dd of=$blob bs=1 seek=64 conv=notrunc 2> /dev/null
+    fi
+done
+
+$client add hello latest $(pwd)/oci/app-image-bad
+${FLATPAK} remote-add ${U} --if-not-exists oci-registry "oci+http://127.0.0.1:${port}${URI_SUFFIX}"
+
+if FLATPAK_OCI_PARALLEL_DOWNLOADS=2 ${FLATPAK} ${U} install -y oci-registry org.test.Hello 2> install-error; then
+    assert_not_reached "Installed an image with a corrupted layer"
+fi
+assert_file_has_content install-error "Wrong layer checksum"
+
+${FLATPAK} ${U} list --columns=application > list-log
+assert_not_file_has_content list-log "org\.test\.Hello"
+
+echo "ok reject corrupted layer"
@@ -23,7 +23,7 @@ set -euo pipefail
 
 skip_without_bwrap
 
-echo "1..2"
+echo "1..3"
 
 setup_repo_no_add oci
 
@@ -46,6 +46,17 @@ assert_has_file $manifest
 assert_file_has_content $manifest "org\.freedesktop\.appstream\.appdata.*<summary>Print a greeting</summary>"
 assert_file_has_content $manifest "org\.freedesktop\.appstream\.icon-64"
 
+# Layers are valid gzip streams and byte-reproducible
+${FLATPAK} build-bundle --oci $FL_GPGARGS repos/oci oci/image2 org.test.Hello
+n_layers=0
+for i in oci/image/blobs/sha256/*; do
+    if gzip -t $i 2>/dev/null; then
+        assert_has_file oci/image2/blobs/sha256/$(basename $i)
+        n_layers=$((n_layers + 1))
+    fi
+done
+test $n_layers -gt 0
+
 echo "ok export oci"
 
 ostree --repo=repo2 init --mode=archive-z2
@@ -59,3 +70,32 @@ assert_has_file checked-out/files/bin/hello.sh
 assert_has_file checked-out/metadata
 
 echo "ok import oci"
+
+# Layers much larger than a compression block round-trip through
+# several blocks, each primed with the tail of the previous one
+rm -rf app
+${FLATPAK} build-init app org.test.Large org.test.Platform org.test.Platform master
+mkdir -p app/files
+head -c 3M /dev/urandom > app/files/large
+seq 1 1000000 >> app/files/large
+${FLATPAK} build-finish --command=large app
+${FLATPAK} build-export ${FL_GPGARGS} repos/oci app master
+
+${FLATPAK} build-bundle --oci $FL_GPGARGS repos/oci oci/large org.test.Large
+
+config=$(grep -l diff_ids oci/large/blobs/sha256/*)
+n_layers=0
+for i in oci/large/blobs/sha256/*; do
+    if gzip -t $i 2>/dev/null; then
+        diff_id=$(gzip -dc $i | sha256sum | cut -d ' ' -f 1)
+        assert_file_has_content $config "sha256:$diff_id"
+        n_layers=$((n_layers + 1))
+    fi
+done
+test $n_layers -gt 0
+
+$FLATPAK build-import-bundle --oci repo2 oci/large
+ostree checkout -U --repo=repo2 app/org.test.Large/$ARCH/master checked-out-large
+cmp app/files/large checked-out-large/files/large
+
+echo "ok export and import large oci layer"
@@ -0,0 +1,51 @@
+#!/bin/bash
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 02111-1307, USA.
+
+set -euo pipefail
+
+. $(dirname $0)/libtest.sh
+
+skip_revokefs_without_fuse
+
+echo "1..2"
+
+setup_repo
+install_repo
+
+# Only the timing can differ between runs, and the parallel mode
+# reports problems in the order it finds them
+repair_output () {
+    ${FLATPAK} ${U} repair --dry-run "$@" 2>&1 | sed 's/ in [0-9.]* s,.*$//' | sort
+}
+
+repair_output > repair-serial
+repair_output --jobs=4 > repair-parallel
+assert_file_has_content repair-serial "^Verified [0-9]* objects"
+diff -u repair-serial repair-parallel
+
+echo "ok repair --jobs matches serial repair"
+
+OBJECT=$(find $FL_DIR/repo/objects -name '*.file' -type f -size +0 | head -n 1)
+chmod u+w $OBJECT
+echo corrupt >> $OBJECT
+
+repair_output > repair-serial
+repair_output --jobs=4 > repair-parallel
+assert_file_has_content repair-serial "^Object invalid: "
+diff -u repair-serial repair-parallel
+
+echo "ok repair --jobs finds the same invalid objects"
@@ -24,7 +24,7 @@ set -euo pipefail
 skip_without_bwrap
 skip_revokefs_without_fuse
 
-echo "1..37"
+echo "1..40"
 
 #Regular repo
 setup_repo
@@ -102,9 +102,34 @@ assert_has_file $FL_DIR/appstream/test-repo/$ARCH/.timestamp
 assert_has_symlink $FL_DIR/appstream/test-repo/$ARCH/active
 assert_has_file $FL_DIR/appstream/test-repo/$ARCH/active/appstream.xml
 assert_has_file $FL_DIR/appstream/test-repo/$ARCH/active/appstream.xml.gz
+assert_has_file $FL_DIR/appstream/test-repo/$ARCH/active/search-index
 
 echo "ok update appstream"
 
+# The search index must find the same as parsing the appstream, also
+# in translations. These words are their own stems, so the results don't
+# depend on whether appstream-glib was built with stemming.
+SEARCHES="hello hel print greet hallo welt test.hel nomatch"
+for language in C de; do
+    for text in $SEARCHES; do
+        LANGUAGE=$language flatpak search $text > search-index-$language-$text
+    done
+done
+assert_file_has_content search-index-C-print "org\.test\.Hello"
+assert_not_file_has_content search-index-C-welt "org\.test\.Hello"
+assert_file_has_content search-index-de-welt "org\.test\.Hello"
+
+mv $FL_DIR/appstream/test-repo/$ARCH/active/search-index search-index.saved
+for language in C de; do
+    for text in $SEARCHES; do
+        LANGUAGE=$language flatpak search $text > search-store-$language-$text
+        diff -u search-store-$language-$text search-index-$language-$text
+    done
+done
+mv search-index.saved $FL_DIR/appstream/test-repo/$ARCH/active/search-index
+
+echo "ok search index matches appstream"
+
 if [ x${USE_COLLECTIONS_IN_CLIENT-} != xyes ] ; then
     install_repo test-no-gpg
     echo "ok install without gpg key"
@@ -588,6 +613,24 @@ assert_not_file_has_content list-log "org\.test\.Platform"
 
 echo "ok uninstall --unused"
 
+${FLATPAK} ${U} install -y --parallel-pulls=4 test-repo org.test.Hello
+
+${FLATPAK} ${U} list -a --columns=application > list-log
+assert_file_has_content list-log "org\.test\.Hello"
+assert_file_has_content list-log "org\.test\.Hello\.Locale"
+assert_file_has_content list-log "org\.test\.Platform"
+
+${FLATPAK} ${U} run org.test.Hello > hello_out
+assert_file_has_content hello_out '^Hello world, from a sandbox$'
+
+# Nothing to update, so nothing is pulled
+${FLATPAK} ${U} update -y --parallel-pulls=4 > update-log
+assert_file_has_content update-log "Nothing to do"
+
+${FLATPAK} ${U} uninstall -y --all
+
+echo "ok install and update with --parallel-pulls"
+
 # Test that remote-ls works in all of the following cases:
 # * system remote, and --system is used
 # * system remote, and --system is omitted
@@ -879,3 +922,33 @@ ${FLATPAK} ${U} remote-add --if-not-exists new-repo test.flatpakrepo
 assert_remote_has_no_config new-repo xa.filter
 
 echo "ok flatpakrepo"
+
+if [ x${USE_COLLECTIONS_IN_CLIENT-} == xyes ] ; then
+    echo "ok shared summary cache # skip summaries are not signed with collections"
+else
+    rm -rf ${XDG_RUNTIME_DIR}/.flatpak-summaries
+
+    ${FLATPAK} ${U} remote-ls -v test-repo > /dev/null 2> remote-ls-log
+    assert_not_file_has_content remote-ls-log "Using shared cached summary"
+    ${FLATPAK} ${U} remote-ls -v test-repo > /dev/null 2> remote-ls-log
+    assert_file_has_content remote-ls-log "Using shared cached summary for remote test-repo"
+
+    # After a publish, only the summary itself is fetched after summary.sig
+    make_updated_app
+    ${FLATPAK} ${U} remote-ls -v test-repo > /dev/null 2> remote-ls-log
+    assert_file_has_content remote-ls-log "Fetched summary for remote test-repo matching its summary.sig"
+    assert_not_file_has_content remote-ls-log "Using shared cached summary"
+    ${FLATPAK} ${U} remote-ls -v test-repo > /dev/null 2> remote-ls-log
+    assert_file_has_content remote-ls-log "Using shared cached summary for remote test-repo"
+
+    # A summary that doesn't match the new signature is rejected
+    update_repo
+    echo -n x >> repos/test/summary
+    if ${FLATPAK} ${U} remote-ls -v test-repo > /dev/null 2> remote-ls-log; then
+        assert_not_reached "remote-ls should fail with a tampered summary"
+    fi
+    assert_not_file_has_content remote-ls-log "Fetched summary for remote test-repo matching"
+    update_repo
+
+    echo "ok shared summary cache"
+fi
@@ -0,0 +1,43 @@
+#!/bin/bash
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 02111-1307, USA.
+
+set -euo pipefail
+
+. $(dirname $0)/libtest.sh
+
+# This is only built, not installed
+if ! command -v revokefs-bench > /dev/null; then
+    skip "no revokefs-bench"
+fi
+
+echo "1..2"
+
+mkdir revokefs-dir
+
+revokefs-bench --verify --threads=1 --files=4 --file-size=1 revokefs-dir > bench-out
+assert_file_has_content bench-out "^Wrote 4 MiB"
+assert_not_has_file revokefs-dir/revokefs-bench-0
+
+echo "ok revokefs serial requests"
+
+# Many threads with requests in flight at once, and writes and reads
+# that don't fit in a single request
+revokefs-bench --verify --threads=8 --files=32 --file-size=2 --chunk-size=300000 revokefs-dir > bench-out
+assert_file_has_content bench-out "^Wrote 64 MiB"
+assert_not_has_file revokefs-dir/revokefs-bench-31
+
+echo "ok revokefs pipelined requests"
@@ -24,7 +24,7 @@ set -euo pipefail
 skip_without_bwrap
 skip_revokefs_without_fuse
 
-echo "1..16"
+echo "1..20"
 
 # Use stable rather than master as the branch so we can test that the run
 # command automatically finds the branch correctly
@@ -57,6 +57,8 @@ assert_has_file $FL_DIR/exports/share/applications/mimeinfo.cache
 assert_file_has_content $FL_DIR/exports/share/applications/mimeinfo.cache x-test/Hello
 assert_has_file $FL_DIR/exports/share/icons/hicolor/icon-theme.cache
 assert_has_file $FL_DIR/exports/share/icons/hicolor/index.theme
+assert_file_has_content $FL_DIR/.trigger-state '^\[desktop-database\.trigger\]$'
+assert_file_has_content $FL_DIR/.trigger-state '^\[gtk-icon-cache\.trigger\]$'
 
 $FLATPAK list ${U} | grep org.test.Hello > /dev/null
 $FLATPAK list ${U} -d | grep org.test.Hello | grep test-repo > /dev/null
@@ -67,13 +69,68 @@ $FLATPAK info ${U} org.test.Hello > /dev/null
 $FLATPAK info ${U} org.test.Hello | grep test-repo > /dev/null
 $FLATPAK info ${U} org.test.Hello | grep $ID > /dev/null
 
+# The ld.so.cache is generated when deploying, in the per-user store
+# that is hidden from sandboxes
+grep -q "^$ID$" ${USERDIR}/ld-so-cache/*.deps
+assert_not_has_dir ${XDG_CACHE_HOME}/flatpak/ld.so
+
 echo "ok install"
 
 run org.test.Hello > hello_out
 assert_file_has_content hello_out '^Hello world, from a sandbox$'
 
+assert_not_has_dir $HOME/.var/app/org.test.Hello/.ld.so
+
 echo "ok hello"
 
+run --trace-launch org.test.Hello > hello_out 2> trace_out
+assert_file_has_content hello_out '^Hello world, from a sandbox$'
+assert_file_has_content trace_out '^{"ref": "app/org\.test\.Hello/'"$ARCH"'/[a-z]*", "total_us": [0-9]*, "phases": \[.*{"name": "dbus-proxy", "us": [0-9]*}'
+
+FLATPAK_TRACE_LAUNCH=stderr run org.test.Hello > hello_out 2> trace_out
+assert_file_has_content trace_out '"name": "parental-controls"'
+
+echo "ok launch tracing"
+
+PLANS=${USERDIR}/launch-plans
+ls ${PLANS}/app_org.test.Hello_${ARCH}_* > /dev/null
+assert_not_has_dir ${XDG_CACHE_HOME}/flatpak/launch-plans
+run -v org.test.Hello > hello_out 2> run-log
+assert_file_has_content hello_out '^Hello world, from a sandbox$'
+assert_file_has_content run-log "Using cached launch plan for app/org\.test\.Hello/"
+
+# A corrupt plan is ignored and replaced
+for f in ${PLANS}/app_org.test.Hello_${ARCH}_*; do
+    echo garbage > $f
+done
+run org.test.Hello > hello_out
+assert_file_has_content hello_out '^Hello world, from a sandbox$'
+assert_not_file_has_content ${PLANS}/app_org.test.Hello_${ARCH}_* '^garbage$'
+
+# A plan that others could have written is never replayed
+for f in ${PLANS}/app_org.test.Hello_${ARCH}_*; do
+    chmod 0666 $f
+done
+run -v org.test.Hello > hello_out 2> run-log
+assert_file_has_content hello_out '^Hello world, from a sandbox$'
+assert_file_has_content run-log "Ignoring launch plan .* with unexpected owner or mode"
+assert_not_file_has_content run-log "Using cached launch plan"
+
+echo "ok launch plan cache"
+
+# The app is only moved into a transient unit once the runtime was found
+if run -v --runtime=org.test.Missing org.test.Hello > hello_out 2> run-log; then
+    assert_not_reached "Running with a missing runtime should fail"
+fi
+assert_file_has_content run-log "org\.test\.Missing.* not installed"
+assert_not_file_has_content run-log "Starting transient unit"
+
+run -v org.test.Hello > hello_out 2> run-log
+assert_file_has_content hello_out '^Hello world, from a sandbox$'
+assert_file_has_content run-log "Starting transient unit for org\.test\.Hello"
+
+echo "ok transient unit after validation"
+
 run_sh org.test.Platform cat /.flatpak-info >runtime-fpi
 assert_file_has_content runtime-fpi "[Runtime]"
 assert_file_has_content runtime-fpi "^runtime=runtime/org\.test\.Platform/$ARCH/stable$"
@@ -222,6 +279,9 @@ echo "ok null update"
 
 make_updated_app "" "" stable
 
+# Export links that went missing are put back even if nothing changed
+rm $FL_DIR/exports/share/applications/org.test.Hello.desktop
+
 ${FLATPAK} ${U} update -y org.test.Hello
 
 NEW_COMMIT=`${FLATPAK} ${U} info --show-commit org.test.Hello`
@@ -231,6 +291,12 @@ assert_not_streq "$OLD_COMMIT" "$NEW_COMMIT"
 run org.test.Hello > hello_out
 assert_file_has_content hello_out '^Hello world, from a sandboxUPDATED$'
 
+# The exports didn't change, so the rewritten files are reused
+assert_symlink_has_content $FL_DIR/exports/share/applications/org.test.Hello.desktop "active/export/share/applications/org\.test\.Hello\.desktop$"
+assert_file_has_content $FL_DIR/exports/share/applications/org.test.Hello.desktop "^Exec=.*/flatpak run --branch=stable --arch=$ARCH --command=hello\.sh org\.test\.Hello$"
+assert_file_has_content $FL_DIR/app/org.test.Hello/$ARCH/stable/active/export/share/applications/org.test.Hello.desktop "^X-Flatpak=org\.test\.Hello$"
+assert_file_has_content $FL_DIR/exports/share/gnome-shell/search-providers/org.test.Hello.search-provider.ini "^DefaultDisabled=true$"
+
 echo "ok update"
 
 ostree --repo=repos/test reset app/org.test.Hello/$ARCH/stable "$OLD_COMMIT"
@@ -459,3 +525,46 @@ ${FLATPAK} ${U} info -m org.test.App > out
 assert_file_has_content out "^sdk=org\.test\.Sdk/$(flatpak --default-arch)/stable$"
 
 echo "ok --sdk option"
+
+# The system helper doesn't see FLATPAK_TRIGGERSDIR
+if [ x${USE_SYSTEMDIR-} != xyes ] ; then
+    BASEDIR=$(realpath $FL_DIR)
+    mkdir -p triggers
+    cat > triggers/declared.trigger <<TRIGGER
+#!/bin/sh
+# flatpak-trigger-input: exports/share/applications
+# flatpak-trigger-output: exports/share/applications/test-output
+echo declared >> \$1/test-trigger-runs
+touch \$1/exports/share/applications/test-output
+TRIGGER
+    cat > triggers/undeclared.trigger <<TRIGGER
+#!/bin/sh
+echo undeclared >> \$1/test-trigger-runs
+TRIGGER
+    chmod a+x triggers/*.trigger
+
+    FLATPAK_TRIGGERSDIR=$(pwd)/triggers ${FLATPAK} ${U} uninstall -y org.test.App
+    assert_file_has_content $BASEDIR/test-trigger-runs "^declared$"
+    assert_file_has_content $BASEDIR/test-trigger-runs "^undeclared$"
+    assert_has_file $BASEDIR/exports/share/applications/test-output
+
+    # Nothing the declared trigger uses changed
+    rm $BASEDIR/test-trigger-runs
+    FLATPAK_TRIGGERSDIR=$(pwd)/triggers ${FLATPAK} ${U} install -y test-repo org.test.App
+    assert_not_file_has_content $BASEDIR/test-trigger-runs "^declared$"
+    assert_file_has_content $BASEDIR/test-trigger-runs "^undeclared$"
+
+    # Its output went missing
+    rm $BASEDIR/test-trigger-runs $BASEDIR/exports/share/applications/test-output
+    FLATPAK_TRIGGERSDIR=$(pwd)/triggers ${FLATPAK} ${U} uninstall -y org.test.App
+    assert_file_has_content $BASEDIR/test-trigger-runs "^declared$"
+    assert_has_file $BASEDIR/exports/share/applications/test-output
+
+    # Its input changed
+    rm $BASEDIR/test-trigger-runs
+    FLATPAK_TRIGGERSDIR=$(pwd)/triggers ${FLATPAK} ${U} uninstall -y org.test.Hello
+    assert_file_has_content $BASEDIR/test-trigger-runs "^declared$"
+    assert_file_has_content $BASEDIR/test-trigger-runs "^undeclared$"
+fi
+
+echo "ok skip triggers with unchanged state"
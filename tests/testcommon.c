@@ -1,12 +1,14 @@
 #include "config.h"
 
 #include <string.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 
 #include <glib.h>
 #include "flatpak.h"
 #include "flatpak-utils-private.h"
+#include "flatpak-dir-private.h"
 #include "flatpak-appdata-private.h"
 #include "flatpak-builtins-utils.h"
 #include "flatpak-table-printer.h"
@@ -1014,8 +1016,8 @@ test_filter_parser (void)
   for (i = 0; i < G_N_ELEMENTS(filters); i++)
     {
       g_autoptr(GError) error = NULL;
-      g_autoptr(GRegex) allow_refs = NULL;
-      g_autoptr(GRegex) deny_refs = NULL;
+      g_autoptr(FlatpakFilter) allow_refs = NULL;
+      g_autoptr(FlatpakFilter) deny_refs = NULL;
 
       ret = flatpak_parse_filters (filters[i].filter, &allow_refs, &deny_refs, &error);
       g_assert_error (error, FLATPAK_ERROR, filters[i].expected_error);
@@ -1029,8 +1031,8 @@ static void
 test_filter (void)
 {
   GError *error = NULL;
-  g_autoptr(GRegex) allow_refs = NULL;
-  g_autoptr(GRegex) deny_refs = NULL;
+  g_autoptr(FlatpakFilter) allow_refs = NULL;
+  g_autoptr(FlatpakFilter) deny_refs = NULL;
   gboolean ret;
   int i;
   char *filter =
@@ -1110,6 +1112,767 @@ test_filter (void)
     g_assert_cmpint (flatpak_filters_allow_ref (allow_refs, deny_refs, filter_refs[i].ref), ==, filter_refs[i].expected_result);
 }
 
+/* The compiled filter must match exactly what the regexp built from
+ * the same globs matches */
+static void
+test_filter_regexp (void)
+{
+  const char *globs[] = {
+    "org.foo",
+    "org.foo.*",
+    "*",
+    "app/*",
+    "runtime/org.*.Platform*",
+    "org.foo/",
+    "org.foo//stable",
+    "org.foo/arm",
+    "org.foo/arm/",
+    "/x86_64",
+    "app/com.bar.foo*/*/stable",
+    "*.*.*a*",
+    "org.f*o*o/*_64/1.*",
+    "a**b",
+  };
+  const char *refs[] = {
+    "app/org.foo/x86_64/stable",
+    "app/org.foo/arm/stable",
+    "app/org.foo//stable",
+    "app/org.foo/arm/",
+    "app/org.foo.Locale/x86_64/stable",
+    "app/org.fooo/x86_64/1.0",
+    "runtime/org.foo/x86_64/1.0",
+    "runtime/org.test.Platform/x86_64/1.0",
+    "runtime/org.test.Platform.Locale/x86_64/1.0",
+    "runtime/org.Platform/x86_64/1.0",
+    "app/com.bar.foo/arm/stable",
+    "app/com.bar.foobar/arm/unstable",
+    "app/ab/x86_64/stable",
+    "app/a_b/x86_64/stable",
+    "app/org.foo/x86_64",
+    "app/org.foo/x86_64/stable/extra",
+    "app/org.f+o/x86_64/stable",
+    "app//x86_64/stable",
+    "other/org.foo/x86_64/stable",
+    "org.foo/x86_64/stable",
+    "",
+  };
+  const char *prefix_globs[] = {
+    "org.fooo*/*/1.*",
+    "org.foo*/arm",
+    "org.f*/x86_64/stable",
+    "org.foo.L*",
+    "com.bar.foo*/*/un*",
+    "runtime/org.test.Platform*",
+  };
+  int i, j;
+
+  for (i = 0; i < G_N_ELEMENTS (globs); i++)
+    {
+      g_autoptr(GError) error = NULL;
+      g_autoptr(FlatpakFilter) filter = flatpak_filter_new ();
+      g_autoptr(GRegex) regex = NULL;
+      g_autofree char *regexp = NULL;
+      g_autofree char *anchored = NULL;
+
+      regexp = flatpak_filter_glob_to_regexp (globs[i], &error);
+      g_assert_no_error (error);
+      anchored = g_strdup_printf ("^(%s)$", regexp);
+      regex = g_regex_new (anchored, G_REGEX_DOLLAR_ENDONLY | G_REGEX_RAW, G_REGEX_MATCH_ANCHORED, &error);
+      g_assert_no_error (error);
+
+      g_assert (flatpak_filter_add_glob (filter, globs[i], &error));
+      g_assert_no_error (error);
+
+      for (j = 0; j < G_N_ELEMENTS (refs); j++)
+        {
+          g_test_message ("%s vs %s", globs[i], refs[j]);
+          g_assert_cmpint (flatpak_filter_match (filter, refs[j]), ==,
+                           g_regex_match (regex, refs[j], 0, NULL));
+        }
+    }
+
+  /* Globs sharing literal prefixes end up in the same part of the trie */
+  for (i = 0; i < G_N_ELEMENTS (prefix_globs); i++)
+    {
+      g_autoptr(GError) error = NULL;
+      g_autoptr(FlatpakFilter) filter = flatpak_filter_new ();
+      g_autoptr(GString) anchored = g_string_new ("^(");
+      g_autoptr(GRegex) regex = NULL;
+
+      for (j = 0; j <= i; j++)
+        {
+          g_autofree char *regexp = flatpak_filter_glob_to_regexp (prefix_globs[j], &error);
+
+          g_assert_no_error (error);
+          if (j > 0)
+            g_string_append_c (anchored, '|');
+          g_string_append (anchored, regexp);
+
+          g_assert (flatpak_filter_add_glob (filter, prefix_globs[j], &error));
+          g_assert_no_error (error);
+        }
+      g_string_append (anchored, ")$");
+
+      regex = g_regex_new (anchored->str, G_REGEX_DOLLAR_ENDONLY | G_REGEX_RAW, G_REGEX_MATCH_ANCHORED, &error);
+      g_assert_no_error (error);
+
+      for (j = 0; j < G_N_ELEMENTS (refs); j++)
+        {
+          g_test_message ("%s vs %s", anchored->str, refs[j]);
+          g_assert_cmpint (flatpak_filter_match (filter, refs[j]), ==,
+                           g_regex_match (regex, refs[j], 0, NULL));
+        }
+    }
+}
+
+static GVariant *
+make_test_summary (void)
+{
+  const char *refs[] = {
+    "app/org.test.Hello/x86_64/master",
+    "runtime/org.test.Platform.Locale/x86_64/master",
+    "runtime/org.test.Platform.Locale/x86_64/stable",
+    "runtime/org.test.Platform/x86_64/master",
+    "runtime/org.test.PlatformX/x86_64/master",
+  };
+  g_autoptr(GVariant) summary = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+  GVariantBuilder refs_builder;
+  GVariantBuilder metadata_builder;
+  GVariantBuilder cache_builder;
+  GVariantBuilder sparse_builder;
+  int i;
+
+  g_variant_builder_init (&refs_builder, G_VARIANT_TYPE ("a(s(taya{sv}))"));
+  g_variant_builder_init (&cache_builder, G_VARIANT_TYPE ("a{s(tts)}"));
+  g_variant_builder_init (&sparse_builder, G_VARIANT_TYPE ("a{sa{sv}}"));
+
+  for (i = 0; i < G_N_ELEMENTS (refs); i++)
+    {
+      g_autoptr(GVariant) csum_v = ostree_checksum_to_bytes_v ("0000000000000000000000000000000000000000000000000000000000000000");
+      GVariantBuilder sparse_data_builder;
+
+      g_variant_builder_add (&refs_builder, "(s(t@aya{sv}))", refs[i], (guint64) 0, csum_v, NULL);
+      g_variant_builder_add (&cache_builder, "{s(tts)}", refs[i],
+                             GUINT64_TO_BE ((guint64) i * 10),
+                             GUINT64_TO_BE ((guint64) i),
+                             "[Application]\n");
+
+      if (i == 0)
+        {
+          g_variant_builder_init (&sparse_data_builder, G_VARIANT_TYPE_VARDICT);
+          g_variant_builder_add (&sparse_data_builder, "{sv}", "eol", g_variant_new_string ("dead"));
+          g_variant_builder_add (&sparse_builder, "{s@a{sv}}", refs[i],
+                                 g_variant_builder_end (&sparse_data_builder));
+        }
+    }
+
+  g_variant_builder_init (&metadata_builder, G_VARIANT_TYPE_VARDICT);
+  g_variant_builder_add (&metadata_builder, "{sv}", "xa.cache",
+                         g_variant_new_variant (g_variant_builder_end (&cache_builder)));
+  g_variant_builder_add (&metadata_builder, "{sv}", "xa.sparse-cache",
+                         g_variant_builder_end (&sparse_builder));
+
+  summary = g_variant_ref_sink (g_variant_new ("(@a(s(taya{sv}))@a{sv})",
+                                               g_variant_builder_end (&refs_builder),
+                                               g_variant_builder_end (&metadata_builder)));
+
+  /* Make sure we test the serialized form, as we would get from disk */
+  bytes = g_variant_get_data_as_bytes (summary);
+  return g_variant_ref_sink (g_variant_new_from_bytes (OSTREE_SUMMARY_GVARIANT_FORMAT, bytes, FALSE));
+}
+
+static void
+test_summary_index (void)
+{
+  g_autoptr(GVariant) summary = make_test_summary ();
+  g_autoptr(GVariant) metadata = g_variant_get_child_value (summary, 1);
+  g_autoptr(FlatpakSummaryIndex) index = flatpak_summary_index_new (summary, metadata);
+  g_autoptr(GVariant) sparse = NULL;
+  g_autofree char *checksum = NULL;
+  g_auto(GStrv) subrefs = NULL;
+  g_auto(GStrv) old_subrefs = NULL;
+  guint64 download_size, installed_size;
+  const char *metadata_str;
+  const char *eol;
+
+  g_assert_true (flatpak_summary_index_lookup_ref (index, NULL, "runtime/org.test.Platform/x86_64/master", &checksum, NULL));
+  g_assert_cmpstr (checksum, ==, "0000000000000000000000000000000000000000000000000000000000000000");
+  g_assert_false (flatpak_summary_index_lookup_ref (index, NULL, "runtime/org.test.Platform/x86_64/stable", NULL, NULL));
+  g_assert_false (flatpak_summary_index_lookup_ref (index, "org.test.Collection", "runtime/org.test.Platform/x86_64/master", NULL, NULL));
+
+  subrefs = flatpak_summary_index_match_subrefs (index, NULL, "runtime/org.test.Platform/x86_64/master");
+  g_assert_cmpuint (g_strv_length (subrefs), ==, 1);
+  g_assert_cmpstr (subrefs[0], ==, "runtime/org.test.Platform.Locale/x86_64/master");
+
+  old_subrefs = flatpak_summary_match_subrefs (summary, NULL, "runtime/org.test.Platform/x86_64/master");
+  g_assert_cmpuint (g_strv_length (old_subrefs), ==, 1);
+  g_assert_cmpstr (subrefs[0], ==, old_subrefs[0]);
+
+  g_assert_true (flatpak_summary_index_has_cache (index));
+  g_assert_true (flatpak_summary_index_lookup_cache (index, "runtime/org.test.Platform/x86_64/master",
+                                                     &download_size, &installed_size, &metadata_str, NULL));
+  g_assert_cmpuint (download_size, ==, 3);
+  g_assert_cmpuint (installed_size, ==, 30);
+  g_assert_cmpstr (metadata_str, ==, "[Application]\n");
+  g_assert_false (flatpak_summary_index_lookup_cache (index, "app/org.test.Missing/x86_64/master",
+                                                      NULL, NULL, NULL, NULL));
+
+  sparse = flatpak_summary_index_lookup_sparse_cache (index, "app/org.test.Hello/x86_64/master");
+  g_assert_nonnull (sparse);
+  g_assert_true (g_variant_lookup (sparse, "eol", "&s", &eol));
+  g_assert_cmpstr (eol, ==, "dead");
+  g_assert_null (flatpak_summary_index_lookup_sparse_cache (index, "runtime/org.test.Platform/x86_64/master"));
+}
+
+static void
+test_search_index (void)
+{
+  const char *xml =
+    "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+    "<components version=\"0.8\">\n"
+    "  <component type=\"desktop\">\n"
+    "    <id>org.test.Hello.desktop</id>\n"
+    "    <name>Hello world</name>\n"
+    "    <name xml:lang=\"de\">Hallo Welt</name>\n"
+    "    <summary>Print a greeting</summary>\n"
+    "    <description><p>Says hello to the whole planet</p><p xml:lang=\"de\">Ein Gruß an alle Planeten</p></description>\n"
+    "    <releases><release version=\"1.2\"/><release version=\"1.1\"/></releases>\n"
+    "    <bundle type=\"flatpak\">app/org.test.Hello/x86_64/stable</bundle>\n"
+    "  </component>\n"
+    "  <component type=\"desktop\">\n"
+    "    <id>org.test.Planets</id>\n"
+    "    <name>Planets</name>\n"
+    "    <summary>Show the planets</summary>\n"
+    "  </component>\n"
+    "</components>";
+  g_autoptr(GInputStream) in = g_memory_input_stream_new_from_data (xml, -1, NULL);
+  g_autoptr(GError) error = NULL;
+  g_autoptr(FlatpakXml) appstream = NULL;
+  g_autoptr(GVariant) index = NULL;
+  g_autoptr(GArray) res = NULL;
+  const char *c_locale[] = { "C", NULL };
+  const char *de_locale[] = { "de_DE.UTF-8", "de_DE", "de.UTF-8", "de", "C", NULL };
+  const char *id, *name, *summary, *version, *branch;
+
+  appstream = flatpak_xml_parse (in, FALSE, NULL, &error);
+  g_assert_no_error (error);
+
+  index = flatpak_appstream_xml_build_search_index (appstream);
+  g_assert_true (g_variant_is_of_type (index, G_VARIANT_TYPE (FLATPAK_SEARCH_INDEX_FORMAT)));
+
+  flatpak_search_index_get_app (index, 0, &id, &name, &summary, &version, &branch);
+  g_assert_cmpstr (id, ==, "org.test.Hello");
+  g_assert_cmpstr (summary, ==, "Print a greeting");
+  g_assert_cmpstr (version, ==, "1.2");
+  g_assert_cmpstr (branch, ==, "stable");
+
+  /* Name match beats description match, and prefixes match */
+  res = flatpak_search_index_query (index, "Planet", c_locale);
+  g_assert_cmpint (res->len, ==, 2);
+  g_assert_cmpint (g_array_index (res, FlatpakSearchIndexMatch, 0).app, ==, 0);
+  g_assert_cmpint (g_array_index (res, FlatpakSearchIndexMatch, 1).app, ==, 1);
+  g_assert_cmpint (g_array_index (res, FlatpakSearchIndexMatch, 1).score, >,
+                   g_array_index (res, FlatpakSearchIndexMatch, 0).score);
+  g_clear_pointer (&res, g_array_unref);
+
+  /* Translations are only searched in the user's languages */
+  res = flatpak_search_index_query (index, "welt", c_locale);
+  g_assert_cmpint (res->len, ==, 0);
+  g_clear_pointer (&res, g_array_unref);
+
+  res = flatpak_search_index_query (index, "welt", de_locale);
+  g_assert_cmpint (res->len, ==, 1);
+  g_assert_cmpint (g_array_index (res, FlatpakSearchIndexMatch, 0).app, ==, 0);
+  g_assert_cmpint (g_array_index (res, FlatpakSearchIndexMatch, 0).score, ==, 1 << (4 + 2));
+  g_clear_pointer (&res, g_array_unref);
+
+  /* Also in translated descriptions, and with ASCII alternatives */
+  res = flatpak_search_index_query (index, "gruss", de_locale);
+  g_assert_cmpint (res->len, ==, 1);
+  g_assert_cmpint (g_array_index (res, FlatpakSearchIndexMatch, 0).app, ==, 0);
+  g_clear_pointer (&res, g_array_unref);
+
+  /* Falls back to substrings of the id */
+  res = flatpak_search_index_query (index, "test.hel", c_locale);
+  g_assert_cmpint (res->len, ==, 1);
+  g_assert_cmpint (g_array_index (res, FlatpakSearchIndexMatch, 0).score, ==, 50);
+}
+
+static void
+test_ref_index (void)
+{
+  const char *refs[] = {
+    "remote:app/org.test.Hello/x86_64/master",
+    "remote:app/org.test.Hello/x86_64/stable",
+    "remote:app/org.test.Hello/i386/master",
+    "remote:app/org.test.Hellp/x86_64/master",
+    "remote:app/org.test.Goodbye/x86_64/master",
+    "remote:runtime/org.test.Hello.Locale/x86_64/master",
+    "remote:runtime/org.test.Platform/x86_64/master",
+    "remote:ostree-metadata",
+    "remote:app/not-valid/x86_64/master",
+  };
+  g_autoptr(GHashTable) table = NULL;
+  g_autoptr(FlatpakRefIndex) index = NULL;
+  g_autoptr(GPtrArray) res = NULL;
+  const FlatpakRefIndexEntry *entry;
+  FlatpakCollectionRef key;
+  int i;
+
+  table = g_hash_table_new_full (flatpak_collection_ref_hash,
+                                 flatpak_collection_ref_equal,
+                                 (GDestroyNotify) flatpak_collection_ref_free,
+                                 NULL);
+  for (i = 0; i < G_N_ELEMENTS (refs); i++)
+    g_hash_table_add (table, flatpak_collection_ref_new (i == 0 ? "org.test.Collection" : NULL, refs[i]));
+
+  index = flatpak_ref_index_new (table);
+
+  /* Everything that decomposes, apps first */
+  res = flatpak_ref_index_lookup (index, FLATPAK_KINDS_APP | FLATPAK_KINDS_RUNTIME, NULL, FLATPAK_REF_INDEX_MATCH_EXACT);
+  g_assert_cmpint (res->len, ==, 7);
+  entry = g_ptr_array_index (res, 0);
+  g_assert_cmpstr (entry->refspec, ==, "remote:app/org.test.Goodbye/x86_64/master");
+  g_assert_cmpstr (entry->ref, ==, "app/org.test.Goodbye/x86_64/master");
+  g_assert_cmpint (entry->kind, ==, FLATPAK_KINDS_APP);
+  entry = g_ptr_array_index (res, 6);
+  g_assert_cmpstr (entry->id, ==, "org.test.Platform");
+  g_assert_cmpint (entry->kind, ==, FLATPAK_KINDS_RUNTIME);
+  g_clear_pointer (&res, g_ptr_array_unref);
+
+  res = flatpak_ref_index_lookup (index, FLATPAK_KINDS_APP, "org.test.Hello", FLATPAK_REF_INDEX_MATCH_EXACT);
+  g_assert_cmpint (res->len, ==, 3);
+  entry = g_ptr_array_index (res, 0);
+  g_assert_cmpstr (entry->arch, ==, "i386");
+  entry = g_ptr_array_index (res, 1);
+  g_assert_cmpstr (entry->branch, ==, "master");
+  g_assert_cmpstr (entry->collection_id, ==, "org.test.Collection");
+  entry = g_ptr_array_index (res, 2);
+  g_assert_cmpstr (entry->branch, ==, "stable");
+  g_assert_null (entry->collection_id);
+  g_clear_pointer (&res, g_ptr_array_unref);
+
+  res = flatpak_ref_index_lookup (index, FLATPAK_KINDS_RUNTIME, "org.test.Hello", FLATPAK_REF_INDEX_MATCH_EXACT);
+  g_assert_cmpint (res->len, ==, 0);
+  g_clear_pointer (&res, g_ptr_array_unref);
+
+  res = flatpak_ref_index_lookup (index, FLATPAK_KINDS_APP | FLATPAK_KINDS_RUNTIME, "org.test.Hel", FLATPAK_REF_INDEX_MATCH_PREFIX);
+  g_assert_cmpint (res->len, ==, 5);
+  entry = g_ptr_array_index (res, 4);
+  g_assert_cmpstr (entry->id, ==, "org.test.Hello.Locale");
+  g_clear_pointer (&res, g_ptr_array_unref);
+
+  /* Fuzzy matches never include subrefs of a different id */
+  res = flatpak_ref_index_lookup (index, FLATPAK_KINDS_APP | FLATPAK_KINDS_RUNTIME, "org.test.Helo", FLATPAK_REF_INDEX_MATCH_FUZZY);
+  g_assert_cmpint (res->len, ==, 4);
+  entry = g_ptr_array_index (res, 3);
+  g_assert_cmpstr (entry->id, ==, "org.test.Hellp");
+  g_clear_pointer (&res, g_ptr_array_unref);
+
+  res = flatpak_ref_index_lookup (index, FLATPAK_KINDS_APP, "Goodbye", FLATPAK_REF_INDEX_MATCH_FUZZY);
+  g_assert_cmpint (res->len, ==, 1);
+
+  /* A cached index is only reused for the exact same refs, including
+   * the ones that don't decompose and the collection ids */
+  g_assert_true (flatpak_ref_index_has_refs (index, table));
+
+  key.collection_id = (char *) "org.test.Collection";
+  key.ref_name = (char *) refs[0];
+  g_hash_table_remove (table, &key);
+  g_assert_false (flatpak_ref_index_has_refs (index, table));
+  g_hash_table_add (table, flatpak_collection_ref_new (NULL, refs[0]));
+  g_assert_false (flatpak_ref_index_has_refs (index, table));
+
+  key.collection_id = NULL;
+  g_hash_table_remove (table, &key);
+  g_hash_table_add (table, flatpak_collection_ref_new ("org.test.Collection", refs[0]));
+  g_assert_true (flatpak_ref_index_has_refs (index, table));
+
+  key.ref_name = (char *) refs[7];
+  g_hash_table_remove (table, &key);
+  g_hash_table_add (table, flatpak_collection_ref_new (NULL, "remote:appstream/x86_64"));
+  g_assert_false (flatpak_ref_index_has_refs (index, table));
+}
+
+/* Commits files with the given sizes to @repo, named @prefix followed by
+ * their index, and returns the root of the commit */
+static GFile *
+commit_test_files (OstreeRepo   *repo,
+                   const char   *dir,
+                   const char   *prefix,
+                   const gsize  *sizes,
+                   gsize         n_sizes)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GFile) dir_file = g_file_new_for_path (dir);
+  g_autoptr(OstreeMutableTree) mtree = ostree_mutable_tree_new ();
+  g_autoptr(GFile) root = NULL;
+  g_autoptr(GFile) commit_root = NULL;
+  g_autofree char *commit = NULL;
+  gsize i;
+
+  g_assert_cmpint (g_mkdir_with_parents (dir, 0755), ==, 0);
+
+  for (i = 0; i < n_sizes; i++)
+    {
+      g_autofree char *name = g_strdup_printf ("%s%" G_GSIZE_FORMAT, prefix, i);
+      g_autofree char *path = g_build_filename (dir, name, NULL);
+      g_autofree char *contents = g_strnfill (sizes[i], 'x');
+
+      /* Make every file a different object */
+      memcpy (contents, name, MIN (strlen (name), sizes[i]));
+      g_file_set_contents (path, contents, sizes[i], &error);
+      g_assert_no_error (error);
+    }
+
+  ostree_repo_prepare_transaction (repo, NULL, NULL, &error);
+  g_assert_no_error (error);
+  ostree_repo_write_directory_to_mtree (repo, dir_file, mtree, NULL, NULL, &error);
+  g_assert_no_error (error);
+  ostree_repo_write_mtree (repo, mtree, &root, NULL, &error);
+  g_assert_no_error (error);
+  ostree_repo_write_commit (repo, NULL, "Test", NULL, NULL, OSTREE_REPO_FILE (root), &commit, NULL, &error);
+  g_assert_no_error (error);
+  ostree_repo_commit_transaction (repo, NULL, NULL, &error);
+  g_assert_no_error (error);
+
+  ostree_repo_read_commit (repo, commit, &commit_root, NULL, NULL, &error);
+  g_assert_no_error (error);
+
+  return g_steal_pointer (&commit_root);
+}
+
+static const char *
+get_test_file_checksum (GFile      *root,
+                        const char *name)
+{
+  g_autoptr(GFile) child = g_file_get_child (root, name);
+  g_autoptr(GError) error = NULL;
+
+  ostree_repo_file_ensure_resolved (OSTREE_REPO_FILE (child), &error);
+  g_assert_no_error (error);
+
+  /* The checksum is owned by @root's cached dirtree */
+  return ostree_repo_file_get_checksum (OSTREE_REPO_FILE (child));
+}
+
+static void
+test_size_cache (void)
+{
+  g_autoptr(GError) error = NULL;
+  g_autofree char *tmpdir = g_dir_make_tmp ("test-size-cache-XXXXXX", NULL);
+  g_autofree char *repo_path = g_build_filename (tmpdir, "repo", NULL);
+  g_autofree char *a_path = g_build_filename (tmpdir, "a", NULL);
+  g_autofree char *b_path = g_build_filename (tmpdir, "b", NULL);
+  g_autofree char *cache_path = g_build_filename (repo_path, "tmp/cache/flatpak-object-sizes", NULL);
+  g_autoptr(GFile) tmpdir_file = g_file_new_for_path (tmpdir);
+  g_autoptr(GFile) repo_file = g_file_new_for_path (repo_path);
+  g_autoptr(OstreeRepo) repo = ostree_repo_new (repo_file);
+  g_autoptr(FlatpakSizeCache) cache = NULL;
+  g_autoptr(GFile) a_root = NULL;
+  g_autoptr(GFile) b_root = NULL;
+  const gsize sizes[] = { 100, 1000, 5000 };
+  guint64 installed_size = 0, download_size = 0;
+  guint64 cached_installed_size = 0, cached_download_size = 0;
+  guint64 file_size;
+  gsize i;
+
+  ostree_repo_create (repo, OSTREE_REPO_MODE_ARCHIVE_Z2, NULL, &error);
+  g_assert_no_error (error);
+
+  a_root = commit_test_files (repo, a_path, "a", sizes, G_N_ELEMENTS (sizes));
+  b_root = commit_test_files (repo, b_path, "b", sizes, G_N_ELEMENTS (sizes));
+
+  /* File sizes are rounded up to 512 bytes */
+  flatpak_repo_collect_sizes (repo, a_root, &installed_size, &download_size, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (installed_size, ==, 512 + 1024 + 5120);
+  g_assert_cmpuint (download_size, >, 0);
+  g_assert_true (g_file_test (cache_path, G_FILE_TEST_IS_REGULAR));
+
+  /* The second time the sizes come from the cache, and are the same */
+  cache = flatpak_size_cache_load (repo, G_N_ELEMENTS (sizes));
+  g_assert_true (flatpak_size_cache_lookup (cache, get_test_file_checksum (a_root, "a1"), &file_size, NULL));
+  g_assert_cmpuint (file_size, ==, 1000);
+
+  flatpak_repo_collect_sizes_with_cache (repo, a_root, cache,
+                                         &cached_installed_size, &cached_download_size,
+                                         NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (cached_installed_size, ==, installed_size);
+  g_assert_cmpuint (cached_download_size, ==, download_size);
+
+  /* When the cache grows too big the least recently used objects go */
+  flatpak_repo_collect_sizes_with_cache (repo, b_root, cache, NULL, NULL, NULL, &error);
+  g_assert_no_error (error);
+  flatpak_size_cache_save (cache);
+  g_clear_pointer (&cache, flatpak_size_cache_free);
+
+  cache = flatpak_size_cache_load (repo, G_N_ELEMENTS (sizes));
+  for (i = 0; i < G_N_ELEMENTS (sizes); i++)
+    {
+      g_autofree char *a_name = g_strdup_printf ("a%" G_GSIZE_FORMAT, i);
+      g_autofree char *b_name = g_strdup_printf ("b%" G_GSIZE_FORMAT, i);
+
+      g_assert_false (flatpak_size_cache_lookup (cache, get_test_file_checksum (a_root, a_name), NULL, NULL));
+      g_assert_true (flatpak_size_cache_lookup (cache, get_test_file_checksum (b_root, b_name), &file_size, NULL));
+      g_assert_cmpuint (file_size, ==, sizes[i]);
+    }
+
+  flatpak_rm_rf (tmpdir_file, NULL, &error);
+  g_assert_no_error (error);
+}
+
+/* Enough objects to be loaded by the thread pool */
+#define N_PARALLEL_TEST_FILES 100
+
+/* The sizes of regular files computed one by one, like the serial path */
+static void
+get_serial_sizes (OstreeRepo  *repo,
+                  GFile       *root,
+                  const char  *prefix,
+                  const gsize *sizes,
+                  gsize        n_sizes,
+                  guint64     *installed_size,
+                  guint64     *download_size)
+{
+  g_autoptr(GError) error = NULL;
+  gsize i;
+
+  *installed_size = 0;
+  *download_size = 0;
+
+  for (i = 0; i < n_sizes; i++)
+    {
+      g_autofree char *name = g_strdup_printf ("%s%" G_GSIZE_FORMAT, prefix, i);
+      guint64 storage_size;
+
+      ostree_repo_query_object_storage_size (repo, OSTREE_OBJECT_TYPE_FILE,
+                                             get_test_file_checksum (root, name),
+                                             &storage_size, NULL, &error);
+      g_assert_no_error (error);
+
+      *installed_size += ((sizes[i] + 511) / 512) * 512;
+      *download_size += storage_size;
+    }
+}
+
+static void
+test_size_cache_parallel (void)
+{
+  g_autoptr(GError) error = NULL;
+  g_autofree char *tmpdir = g_dir_make_tmp ("test-size-cache-XXXXXX", NULL);
+  g_autofree char *repo_path = g_build_filename (tmpdir, "repo", NULL);
+  g_autofree char *files_path = g_build_filename (tmpdir, "files", NULL);
+  g_autofree char *staged_path = g_build_filename (tmpdir, "staged", NULL);
+  g_autofree char *cache_path = g_build_filename (repo_path, "tmp/cache/flatpak-object-sizes", NULL);
+  g_autoptr(GFile) tmpdir_file = g_file_new_for_path (tmpdir);
+  g_autoptr(GFile) repo_file = g_file_new_for_path (repo_path);
+  g_autoptr(GFile) staged_file = g_file_new_for_path (staged_path);
+  g_autoptr(OstreeRepo) repo = ostree_repo_new (repo_file);
+  g_autoptr(OstreeMutableTree) mtree = ostree_mutable_tree_new ();
+  g_autoptr(FlatpakSizeCache) cache = NULL;
+  g_autoptr(GFile) root = NULL;
+  g_autoptr(GFile) staged_root = NULL;
+  gsize sizes[N_PARALLEL_TEST_FILES];
+  guint64 installed_size = 0, download_size = 0;
+  guint64 serial_installed_size, serial_download_size;
+  gsize i;
+
+  for (i = 0; i < G_N_ELEMENTS (sizes); i++)
+    sizes[i] = 100 + i * 97;
+
+  ostree_repo_create (repo, OSTREE_REPO_MODE_ARCHIVE_Z2, NULL, &error);
+  g_assert_no_error (error);
+
+  root = commit_test_files (repo, files_path, "p", sizes, G_N_ELEMENTS (sizes));
+  get_serial_sizes (repo, root, "p", sizes, G_N_ELEMENTS (sizes),
+                    &serial_installed_size, &serial_download_size);
+
+  /* Without a cache all the objects are loaded, in parallel */
+  flatpak_repo_collect_sizes_with_cache (repo, root, NULL, &installed_size, &download_size, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (installed_size, ==, serial_installed_size);
+  g_assert_cmpuint (download_size, ==, serial_download_size);
+  g_assert_false (g_file_test (cache_path, G_FILE_TEST_EXISTS));
+
+  /* The sizes loaded in parallel are the ones that get cached */
+  cache = flatpak_size_cache_load (repo, FLATPAK_SIZE_CACHE_MAX_ENTRIES);
+  installed_size = download_size = 0;
+  flatpak_repo_collect_sizes_with_cache (repo, root, cache, &installed_size, &download_size, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (installed_size, ==, serial_installed_size);
+  g_assert_cmpuint (download_size, ==, serial_download_size);
+  for (i = 0; i < G_N_ELEMENTS (sizes); i++)
+    {
+      g_autofree char *name = g_strdup_printf ("p%" G_GSIZE_FORMAT, i);
+      guint64 file_size;
+
+      g_assert_true (flatpak_size_cache_lookup (cache, get_test_file_checksum (root, name), &file_size, NULL));
+      g_assert_cmpuint (file_size, ==, sizes[i]);
+    }
+
+  /* Objects of a transaction that is still open are only visible to
+     @repo itself, not to the handles of the threads */
+  g_assert_cmpint (g_mkdir_with_parents (staged_path, 0755), ==, 0);
+  for (i = 0; i < G_N_ELEMENTS (sizes); i++)
+    {
+      g_autofree char *name = g_strdup_printf ("s%" G_GSIZE_FORMAT, i);
+      g_autofree char *path = g_build_filename (staged_path, name, NULL);
+      g_autofree char *contents = g_strnfill (sizes[i], 'y');
+
+      memcpy (contents, name, strlen (name));
+      g_file_set_contents (path, contents, sizes[i], &error);
+      g_assert_no_error (error);
+    }
+
+  ostree_repo_prepare_transaction (repo, NULL, NULL, &error);
+  g_assert_no_error (error);
+  ostree_repo_write_directory_to_mtree (repo, staged_file, mtree, NULL, NULL, &error);
+  g_assert_no_error (error);
+  ostree_repo_write_mtree (repo, mtree, &staged_root, NULL, &error);
+  g_assert_no_error (error);
+
+  installed_size = download_size = 0;
+  flatpak_repo_collect_sizes_with_cache (repo, staged_root, NULL, &installed_size, NULL, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (installed_size, ==, serial_installed_size);
+
+  ostree_repo_abort_transaction (repo, NULL, &error);
+  g_assert_no_error (error);
+
+  flatpak_rm_rf (tmpdir_file, NULL, &error);
+  g_assert_no_error (error);
+}
+
+static char *
+get_only_commit (OstreeRepo *repo)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GHashTable) commits = NULL;
+  g_autoptr(GList) keys = NULL;
+  const char *checksum;
+
+  ostree_repo_list_commit_objects_starting_with (repo, "", &commits, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (g_hash_table_size (commits), ==, 1);
+
+  keys = g_hash_table_get_keys (commits);
+  g_variant_get (keys->data, "(&si)", &checksum, NULL);
+
+  return g_strdup (checksum);
+}
+
+static void
+test_import_verified_objects (void)
+{
+  g_autoptr(GError) error = NULL;
+  g_autofree char *tmpdir = g_dir_make_tmp ("test-import-XXXXXX", NULL);
+  g_autofree char *src_path = g_build_filename (tmpdir, "src", NULL);
+  g_autofree char *repo_path = g_build_filename (tmpdir, "repo", NULL);
+  g_autofree char *files_path = g_build_filename (tmpdir, "files", NULL);
+  g_autoptr(GFile) tmpdir_file = g_file_new_for_path (tmpdir);
+  g_autoptr(GFile) src_file = g_file_new_for_path (src_path);
+  g_autoptr(GFile) repo_file = g_file_new_for_path (repo_path);
+  g_autoptr(OstreeRepo) src_repo = ostree_repo_new (src_file);
+  g_autoptr(OstreeRepo) repo = ostree_repo_new (repo_file);
+  g_autoptr(GFile) root = NULL;
+  g_autofree char *commit = NULL;
+  g_autofree char *url = g_file_get_uri (src_file);
+  g_autofree char *corrupted_object = NULL;
+  g_autofree char *corrupted_path = NULL;
+  g_autofree char *setuid_object = NULL;
+  g_autofree char *setuid_path = NULL;
+  g_autoptr(GVariant) options = NULL;
+  GVariantBuilder builder;
+  const char *refs[] = { "test", NULL };
+  const gsize sizes[] = { 100, 1000, 5000, 20000 };
+  const char *corrupted, *setuid;
+  guint64 linked_size = 0, copied_size = 0;
+  gboolean have_object;
+  gsize i;
+
+  ostree_repo_create (src_repo, OSTREE_REPO_MODE_BARE_USER_ONLY, NULL, &error);
+  g_assert_no_error (error);
+  ostree_repo_create (repo, OSTREE_REPO_MODE_BARE_USER_ONLY, NULL, &error);
+  g_assert_no_error (error);
+
+  root = commit_test_files (src_repo, files_path, "i", sizes, G_N_ELEMENTS (sizes));
+  commit = get_only_commit (src_repo);
+  ostree_repo_set_ref_immediate (src_repo, NULL, "test", commit, NULL, &error);
+  g_assert_no_error (error);
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sv}"));
+  g_variant_builder_add (&builder, "{s@v}", "flags",
+                         g_variant_new_variant (g_variant_new_int32 (OSTREE_REPO_PULL_FLAGS_UNTRUSTED)));
+  g_variant_builder_add (&builder, "{s@v}", "refs",
+                         g_variant_new_variant (g_variant_new_strv (refs, -1)));
+  g_variant_builder_add (&builder, "{s@v}", "inherit-transaction",
+                         g_variant_new_variant (g_variant_new_boolean (TRUE)));
+  options = g_variant_ref_sink (g_variant_builder_end (&builder));
+
+  /* Objects that match their checksum are all imported */
+  ostree_repo_prepare_transaction (repo, NULL, NULL, &error);
+  g_assert_no_error (error);
+  flatpak_repo_import_verified_objects (repo, src_repo, commit, &linked_size, &copied_size, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (linked_size + copied_size, ==, 100 + 1000 + 5000 + 20000);
+
+  for (i = 0; i < G_N_ELEMENTS (sizes); i++)
+    {
+      g_autofree char *name = g_strdup_printf ("i%" G_GSIZE_FORMAT, i);
+
+      ostree_repo_has_object (repo, OSTREE_OBJECT_TYPE_FILE, get_test_file_checksum (root, name),
+                              &have_object, NULL, &error);
+      g_assert_no_error (error);
+      g_assert_true (have_object);
+    }
+
+  /* The pull verifies everything else, and finds these objects */
+  ostree_repo_pull_with_options (repo, url, options, NULL, NULL, &error);
+  g_assert_no_error (error);
+
+  ostree_repo_abort_transaction (repo, NULL, &error);
+  g_assert_no_error (error);
+
+  /* Change one object after the fact, and make another one setuid */
+  corrupted = get_test_file_checksum (root, "i1");
+  corrupted_object = ostree_get_relative_object_path (corrupted, OSTREE_OBJECT_TYPE_FILE, FALSE);
+  corrupted_path = g_build_filename (src_path, corrupted_object, NULL);
+  g_file_set_contents (corrupted_path, "changed", -1, &error);
+  g_assert_no_error (error);
+
+  setuid = get_test_file_checksum (root, "i2");
+  setuid_object = ostree_get_relative_object_path (setuid, OSTREE_OBJECT_TYPE_FILE, FALSE);
+  setuid_path = g_build_filename (src_path, setuid_object, NULL);
+  g_assert_cmpint (chmod (setuid_path, 04755), ==, 0);
+
+  /* Those stay behind, and the untrusted pull that follows still fails */
+  ostree_repo_prepare_transaction (repo, NULL, NULL, &error);
+  g_assert_no_error (error);
+  flatpak_repo_import_verified_objects (repo, src_repo, commit, &linked_size, &copied_size, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (linked_size + copied_size, ==, 100 + 20000);
+
+  ostree_repo_has_object (repo, OSTREE_OBJECT_TYPE_FILE, corrupted, &have_object, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_false (have_object);
+  ostree_repo_has_object (repo, OSTREE_OBJECT_TYPE_FILE, setuid, &have_object, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_false (have_object);
+
+  g_assert_false (ostree_repo_pull_with_options (repo, url, options, NULL, NULL, &error));
+  g_assert_nonnull (error);
+  g_clear_error (&error);
+
+  ostree_repo_abort_transaction (repo, NULL, &error);
+  g_assert_no_error (error);
+
+  flatpak_rm_rf (tmpdir_file, NULL, &error);
+  g_assert_no_error (error);
+}
+
 static void
 test_dconf_app_id (void)
 {
@@ -1181,6 +1944,13 @@ main (int argc, char *argv[])
   g_test_add_func ("/common/name-matching", test_name_matching);
   g_test_add_func ("/common/filter_parser", test_filter_parser);
   g_test_add_func ("/common/filter", test_filter);
+  g_test_add_func ("/common/filter-regexp", test_filter_regexp);
+  g_test_add_func ("/common/summary-index", test_summary_index);
+  g_test_add_func ("/common/search-index", test_search_index);
+  g_test_add_func ("/common/ref-index", test_ref_index);
+  g_test_add_func ("/common/size-cache", test_size_cache);
+  g_test_add_func ("/common/size-cache-parallel", test_size_cache_parallel);
+  g_test_add_func ("/common/import-verified-objects", test_import_verified_objects);
   g_test_add_func ("/common/dconf-app-id", test_dconf_app_id);
   g_test_add_func ("/common/dconf-paths", test_dconf_paths);
 
@@ -1913,6 +1913,120 @@ test_list_updates_offline (void)
   g_assert_true (res);
 }
 
+static gboolean
+refs_contain_name (GPtrArray  *refs,
+                   const char *name)
+{
+  guint i;
+
+  for (i = 0; i < refs->len; i++)
+    {
+      if (strcmp (flatpak_ref_get_name (g_ptr_array_index (refs, i)), name) == 0)
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+/* Remotes without a collection ID are checked by fetching their
+ * states concurrently; one of them failing must not hide the updates
+ * from the others. */
+static void
+test_list_updates_parallel (void)
+{
+  g_autoptr(FlatpakInstallation) inst = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GPtrArray) refs = NULL;
+  g_autoptr(FlatpakInstalledRef) runtime_ref = NULL;
+  g_autoptr(FlatpakInstalledRef) app_ref = NULL;
+  g_autoptr(FlatpakRemote) remote = NULL;
+  g_autoptr(FlatpakRemote) copy_remote = NULL;
+  g_autoptr(GBytes) gpg_key = NULL;
+  g_autofree char *pubring = NULL;
+  g_autofree char *gpg_data = NULL;
+  g_autofree char *url = NULL;
+  g_autofree char *wrong_url = NULL;
+  gsize gpg_data_len;
+  gboolean res;
+
+  inst = flatpak_installation_new_user (NULL, &error);
+  g_assert_no_error (error);
+
+  empty_installation (inst);
+
+  remote = flatpak_installation_get_remote_by_name (inst, repo_name, NULL, &error);
+  g_assert_no_error (error);
+  url = flatpak_remote_get_url (remote);
+  flatpak_remote_set_collection_id (remote, NULL);
+  res = flatpak_installation_modify_remote (inst, remote, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_true (res);
+
+  pubring = g_build_filename (gpg_homedir, "pubring.gpg", NULL);
+  g_file_get_contents (pubring, &gpg_data, &gpg_data_len, &error);
+  g_assert_no_error (error);
+  gpg_key = g_bytes_new (gpg_data, gpg_data_len);
+
+  copy_remote = flatpak_remote_new ("test-copy-repo");
+  flatpak_remote_set_url (copy_remote, url);
+  flatpak_remote_set_gpg_verify (copy_remote, TRUE);
+  flatpak_remote_set_gpg_key (copy_remote, gpg_key);
+  res = flatpak_installation_add_remote (inst, copy_remote, FALSE, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_true (res);
+
+  /* Install the runtime and the app from different remotes */
+  runtime_ref = flatpak_installation_install (inst, "test-copy-repo",
+                                              FLATPAK_REF_KIND_RUNTIME, "org.test.Platform",
+                                              NULL, NULL, NULL, NULL, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_true (FLATPAK_IS_INSTALLED_REF (runtime_ref));
+
+  app_ref = flatpak_installation_install (inst, repo_name,
+                                          FLATPAK_REF_KIND_APP, "org.test.Hello",
+                                          NULL, NULL, NULL, NULL, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_true (FLATPAK_IS_INSTALLED_REF (app_ref));
+
+  update_test_app ();
+  update_repo ("test");
+
+  flatpak_installation_drop_caches (inst, NULL, &error);
+  g_assert_no_error (error);
+
+  refs = flatpak_installation_list_installed_refs_for_update (inst, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_true (refs_contain_name (refs, "org.test.Hello"));
+  g_assert_false (refs_contain_name (refs, "org.test.Platform"));
+  g_clear_pointer (&refs, g_ptr_array_unref);
+
+  /* Make the runtime's remote unreachable */
+  wrong_url = g_strdup_printf ("http://127.0.0.1:%s/nonexistent", httpd_port);
+  flatpak_remote_set_url (copy_remote, wrong_url);
+  res = flatpak_installation_modify_remote (inst, copy_remote, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_true (res);
+
+  flatpak_installation_drop_caches (inst, NULL, &error);
+  g_assert_no_error (error);
+
+  refs = flatpak_installation_list_installed_refs_for_update (inst, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_true (refs_contain_name (refs, "org.test.Hello"));
+  g_assert_false (refs_contain_name (refs, "org.test.Platform"));
+
+  empty_installation (inst);
+
+  res = flatpak_installation_remove_remote (inst, "test-copy-repo", NULL, &error);
+  g_assert_no_error (error);
+  g_assert_true (res);
+
+  flatpak_remote_set_collection_id (remote, repo_collection_id);
+  res = flatpak_installation_modify_remote (inst, remote, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_true (res);
+}
+
 static void
 run_test_subprocess (char                 **argv,
                      RunTestSubprocessFlags flags)
@@ -2425,6 +2539,10 @@ test_misc_transaction (void)
   flatpak_transaction_set_no_pull (transaction, TRUE);
   g_assert (flatpak_transaction_get_no_pull (transaction) == TRUE);
 
+  g_assert_cmpuint (flatpak_transaction_get_max_parallel_pulls (transaction), ==, 1);
+  flatpak_transaction_set_max_parallel_pulls (transaction, 4);
+  g_assert_cmpuint (flatpak_transaction_get_max_parallel_pulls (transaction), ==, 4);
+
   g_assert (flatpak_transaction_is_empty (transaction));
 }
 
@@ -2721,6 +2839,25 @@ test_transaction_install_uninstall (void)
   g_assert_no_error (error);
   g_assert_nonnull (refs);
   g_assert_cmpint (refs->len, ==, 3);
+
+  /* Listing looks things up for all refs at once, with the same results */
+  for (guint i = 0; i < refs->len; i++)
+    {
+      FlatpakInstalledRef *listed = g_ptr_array_index (refs, i);
+      g_autoptr(FlatpakInstalledRef) single = NULL;
+
+      single = flatpak_installation_get_installed_ref (inst,
+                                                       flatpak_ref_get_kind (FLATPAK_REF (listed)),
+                                                       flatpak_ref_get_name (FLATPAK_REF (listed)),
+                                                       flatpak_ref_get_arch (FLATPAK_REF (listed)),
+                                                       flatpak_ref_get_branch (FLATPAK_REF (listed)),
+                                                       NULL, &error);
+      g_assert_no_error (error);
+      g_assert_nonnull (flatpak_installed_ref_get_latest_commit (listed));
+      g_assert_cmpstr (flatpak_installed_ref_get_latest_commit (listed), ==, flatpak_installed_ref_get_latest_commit (single));
+      g_assert_cmpstr (flatpak_ref_get_collection_id (FLATPAK_REF (listed)), ==, flatpak_ref_get_collection_id (FLATPAK_REF (single)));
+      g_assert_cmpint (flatpak_installed_ref_get_is_current (listed), ==, flatpak_installed_ref_get_is_current (single));
+    }
   g_clear_pointer (&refs, g_ptr_array_unref);
 
   ref = flatpak_installation_get_current_installed_app (inst, "org.test.Hello", NULL, &error);
@@ -3260,6 +3397,91 @@ test_transaction_deps (void)
   g_assert_error (error, FLATPAK_ERROR, FLATPAK_ERROR_ABORTED);
 }
 
+/* The pulls may already have made progress when the op starts */
+static void
+new_op_parallel (FlatpakTransaction          *transaction,
+                 FlatpakTransactionOperation *op,
+                 FlatpakTransactionProgress  *progress)
+{
+  g_autoptr(FlatpakTransactionOperation) current = NULL;
+
+  new_op_count++;
+
+  current = flatpak_transaction_get_current_operation (transaction);
+  g_assert (op == current);
+  g_assert_cmpint (flatpak_transaction_operation_get_operation_type (op), ==, FLATPAK_TRANSACTION_OPERATION_INSTALL);
+}
+
+/* install an app with its runtime and locale pulled in parallel, which
+ * must give the same result as the serial install */
+static void
+test_transaction_parallel_pulls (void)
+{
+  g_autoptr(FlatpakInstallation) inst = NULL;
+  g_autoptr(FlatpakTransaction) transaction = NULL;
+  g_autoptr(FlatpakInstalledRef) ref = NULL;
+  g_autoptr(GPtrArray) refs = NULL;
+  g_autoptr(GError) error = NULL;
+  gboolean res;
+  g_autofree char *app = NULL;
+
+  app = g_strdup_printf ("app/org.test.Hello/%s/master",
+                         flatpak_get_default_arch ());
+
+  inst = flatpak_installation_new_user (NULL, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (inst);
+
+  empty_installation (inst);
+
+  transaction = flatpak_transaction_new_for_installation (inst, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (transaction);
+
+  flatpak_transaction_set_max_parallel_pulls (transaction, 3);
+
+  res = flatpak_transaction_add_install (transaction, repo_name, app, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_true (res);
+
+  new_op_count = 0;
+  op_done_count = 0;
+  g_signal_connect (transaction, "new-operation", G_CALLBACK (new_op_parallel), NULL);
+  g_signal_connect (transaction, "operation-done", G_CALLBACK (op_done), NULL);
+
+  res = flatpak_transaction_run (transaction, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_true (res);
+
+  g_assert_cmpint (new_op_count, ==, 3);
+  g_assert_cmpint (op_done_count, ==, 3);
+
+  refs = flatpak_installation_list_installed_refs (inst, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (refs->len, ==, 3);
+
+  ref = flatpak_installation_get_current_installed_app (inst, "org.test.Hello", NULL, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (ref);
+  g_assert_nonnull (flatpak_installed_ref_get_latest_commit (ref));
+  g_clear_object (&transaction);
+
+  /* Everything is up to date, so this pulls nothing */
+  transaction = flatpak_transaction_new_for_installation (inst, NULL, &error);
+  g_assert_no_error (error);
+  flatpak_transaction_set_max_parallel_pulls (transaction, 3);
+
+  res = flatpak_transaction_add_update (transaction, app, NULL, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_true (res);
+
+  res = flatpak_transaction_run (transaction, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_true (res);
+
+  empty_installation (inst);
+}
+
 /* install from a local repository */
 static void
 test_transaction_install_local (void)
@@ -4073,11 +4295,13 @@ main (int argc, char *argv[])
   g_test_add_func ("/library/list-refs-in-remote", test_list_refs_in_remotes);
   g_test_add_func ("/library/list-updates", test_list_updates);
   g_test_add_func ("/library/list-updates-offline", test_list_updates_offline);
+  g_test_add_func ("/library/list-updates-parallel", test_list_updates_parallel);
   g_test_add_func ("/library/transaction", test_misc_transaction);
   g_test_add_func ("/library/transaction-install-uninstall", test_transaction_install_uninstall);
   g_test_add_func ("/library/transaction-install-flatpakref", test_transaction_install_flatpakref);
   g_test_add_func ("/library/transaction-flatpakref-remote-creation", test_transaction_flatpakref_remote_creation);
   g_test_add_func ("/library/transaction-deps", test_transaction_deps);
+  g_test_add_func ("/library/transaction-parallel-pulls", test_transaction_parallel_pulls);
   g_test_add_func ("/library/transaction-install-local", test_transaction_install_local);
   g_test_add_func ("/library/instance", test_instance);
   g_test_add_func ("/library/update-subpaths", test_update_subpaths);